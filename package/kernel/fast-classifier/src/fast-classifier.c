@@ -34,6 +34,7 @@
 #include <linux/spinlock.h>
 #include <linux/if_bridge.h>
 #include <linux/hashtable.h>
+#include <linux/workqueue.h>
 #include <linux/version.h>
 
 #include <sfe_backport.h>
@@ -118,6 +119,14 @@ static struct nla_policy fast_classifier_genl_policy[FAST_CLASSIFIER_A_MAX + 1]
 		.type = NLA_UNSPEC,
 		.len = sizeof(struct fast_classifier_tuple)
 	},
+	[FAST_CLASSIFIER_A_POLICY] = {
+		.type = NLA_UNSPEC,
+		.len = sizeof(struct fast_classifier_policy)
+	},
+	[FAST_CLASSIFIER_A_DEFAULT_POLICY] = {
+		.type = NLA_UNSPEC,
+		.len = sizeof(struct fast_classifier_policy)
+	},
 };
 #endif /*KERNEL_VERSION(5, 2, 0)*/
 
@@ -129,6 +138,10 @@ static struct genl_multicast_group fast_classifier_genl_mcgrp[] = {
 
 static int fast_classifier_offload_genl_msg(struct sk_buff *skb, struct genl_info *info);
 static int fast_classifier_nl_genl_msg_DUMP(struct sk_buff *skb, struct netlink_callback *cb);
+static int fast_classifier_policy_add_genl_msg(struct sk_buff *skb, struct genl_info *info);
+static int fast_classifier_policy_flush_genl_msg(struct sk_buff *skb, struct genl_info *info);
+static int fast_classifier_policy_default_genl_msg(struct sk_buff *skb, struct genl_info *info);
+static int fast_classifier_policy_get_genl_msg(struct sk_buff *skb, struct genl_info *info);
 
 static struct genl_ops fast_classifier_gnl_ops[] = {
 	{
@@ -158,6 +171,42 @@ static struct genl_ops fast_classifier_gnl_ops[] = {
 		.doit = NULL,
 		.dumpit = fast_classifier_nl_genl_msg_DUMP,
 	},
+	{
+		.cmd = FAST_CLASSIFIER_C_POLICY_ADD,
+		.flags = GENL_ADMIN_PERM,
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 2, 0))
+		.policy = fast_classifier_genl_policy,
+#endif /*KERNEL_VERSION(5, 2, 0)*/
+		.doit = fast_classifier_policy_add_genl_msg,
+		.dumpit = NULL,
+	},
+	{
+		.cmd = FAST_CLASSIFIER_C_POLICY_FLUSH,
+		.flags = GENL_ADMIN_PERM,
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 2, 0))
+		.policy = fast_classifier_genl_policy,
+#endif /*KERNEL_VERSION(5, 2, 0)*/
+		.doit = fast_classifier_policy_flush_genl_msg,
+		.dumpit = NULL,
+	},
+	{
+		.cmd = FAST_CLASSIFIER_C_POLICY_DEFAULT,
+		.flags = GENL_ADMIN_PERM,
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 2, 0))
+		.policy = fast_classifier_genl_policy,
+#endif /*KERNEL_VERSION(5, 2, 0)*/
+		.doit = fast_classifier_policy_default_genl_msg,
+		.dumpit = NULL,
+	},
+	{
+		.cmd = FAST_CLASSIFIER_C_POLICY_GET,
+		.flags = 0,
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 2, 0))
+		.policy = fast_classifier_genl_policy,
+#endif /*KERNEL_VERSION(5, 2, 0)*/
+		.doit = fast_classifier_policy_get_genl_msg,
+		.dumpit = NULL,
+	},
 };
 
 static struct genl_family fast_classifier_gnl_family = {
@@ -422,6 +471,10 @@ struct sfe_connection {
 	bool is_v4;
 	unsigned char smac[ETH_ALEN];
 	unsigned char dmac[ETH_ALEN];
+	struct fast_classifier_policy policy;	/* Offload policy picked when the connection was first seen */
+	u64 bytes;				/* Bytes seen since first_jiffies */
+	unsigned long first_jiffies;		/* When we started counting hits and bytes */
+	unsigned long last_jiffies;		/* When the offloaded connection last passed traffic */
 };
 
 static int sfe_connections_size;
@@ -442,6 +495,29 @@ static u32 fc_conn_hash(sfe_ip_addr_t *saddr, sfe_ip_addr_t *daddr,
 	return hash ^ (sport | (dport << 16));
 }
 
+/*
+ * fast_classifier_fill_tuple()
+ *	Fill in the message that tells user space about a connection.
+ */
+static void fast_classifier_fill_tuple(struct sfe_connection *conn, struct fast_classifier_tuple *fc_msg)
+{
+	if (conn->is_v4) {
+		fc_msg->ethertype = AF_INET;
+		fc_msg->src_saddr.in = *((struct in_addr *)&conn->sic->src_ip);
+		fc_msg->dst_saddr.in = *((struct in_addr *)&conn->sic->dest_ip_xlate);
+	} else {
+		fc_msg->ethertype = AF_INET6;
+		fc_msg->src_saddr.in6 = *((struct in6_addr *)&conn->sic->src_ip);
+		fc_msg->dst_saddr.in6 = *((struct in6_addr *)&conn->sic->dest_ip_xlate);
+	}
+
+	fc_msg->proto = conn->sic->protocol;
+	fc_msg->sport = conn->sic->src_port;
+	fc_msg->dport = conn->sic->dest_port_xlate;
+	memcpy(fc_msg->smac, conn->smac, ETH_ALEN);
+	memcpy(fc_msg->dmac, conn->dmac, ETH_ALEN);
+}
+
 /*
  * fast_classifier_update_protocol()
  * 	Update sfe_ipv4_create struct with new protocol information before we offload
@@ -799,13 +875,458 @@ static int fast_classifier_nl_genl_msg_DUMP(struct sk_buff *skb,
 /* auto offload connection once we have this many packets*/
 static int offload_at_pkts = 128;
 
+/*
+ * Byte rates are measured over at least this long so that the first few
+ * packets of a flow don't look like a huge rate.
+ */
+#define FAST_CLASSIFIER_RATE_MIN_JIFFIES (HZ / 10)
+
+/*
+ * How often we look for idle offloaded connections and how many we demote
+ * per pass over the connection table.
+ */
+#define FAST_CLASSIFIER_IDLE_SCAN_INTERVAL HZ
+#define FAST_CLASSIFIER_IDLE_BATCH 8
+
+/*
+ * Offload policy table.  The packet path reads it under RCU.  Updates are
+ * serialised by fc_policy_mutex and replace the whole table.
+ */
+struct fast_classifier_policy_table {
+	struct rcu_head rcu;
+	struct fast_classifier_policy default_policy;
+					/* Policy for connections that match no rule */
+	int num_rules;			/* Number of rules in use */
+	struct fast_classifier_policy rules[FAST_CLASSIFIER_POLICY_RULES_MAX];
+					/* Rules, in match order */
+};
+
+static struct fast_classifier_policy_table __rcu *fc_policy_table;
+static DEFINE_MUTEX(fc_policy_mutex);
+
+/*
+ * Policy used until user space configures one: offload after offload_at_pkts.
+ */
+static const struct fast_classifier_policy fc_policy_builtin_default = {
+	.action = FAST_CLASSIFIER_POLICY_PACKETS,
+};
+
+/*
+ * fast_classifier_policy_match()
+ *	Check whether a policy rule covers a connection.
+ */
+static inline bool fast_classifier_policy_match(const struct fast_classifier_policy *rule,
+						 u8 proto, u16 sport, u16 dport)
+{
+	if (rule->proto && rule->proto != proto) {
+		return false;
+	}
+
+	if (!rule->port_max) {
+		return true;
+	}
+
+	return (sport >= rule->port_min && sport <= rule->port_max) ||
+	       (dport >= rule->port_min && dport <= rule->port_max);
+}
+
+/*
+ * fast_classifier_policy_lookup()
+ *	Find the offload policy for a new connection.
+ */
+static void fast_classifier_policy_lookup(struct fast_classifier_policy *policy,
+					  u8 proto, __be16 sport, __be16 dport)
+{
+	struct fast_classifier_policy_table *table;
+	u16 hsport = ntohs(sport);
+	u16 hdport = ntohs(dport);
+	int i;
+
+	rcu_read_lock();
+	table = rcu_dereference(fc_policy_table);
+	if (!table) {
+		rcu_read_unlock();
+		*policy = fc_policy_builtin_default;
+		return;
+	}
+
+	*policy = table->default_policy;
+	for (i = 0; i < table->num_rules; i++) {
+		if (fast_classifier_policy_match(&table->rules[i], proto, hsport, hdport)) {
+			*policy = table->rules[i];
+			break;
+		}
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * fast_classifier_should_offload()
+ *	Check whether a connection has met its offload policy.
+ *
+ * Called with sfe_connections_lock held.
+ */
+static bool fast_classifier_should_offload(struct sfe_connection *conn)
+{
+	unsigned long elapsed;
+	u32 threshold = conn->policy.threshold;
+
+	/*
+	 * An explicit request from user space overrides the policy.
+	 */
+	if (conn->offload_permit) {
+		return true;
+	}
+
+	switch (conn->policy.action) {
+	case FAST_CLASSIFIER_POLICY_FIRST_PACKET:
+		return true;
+
+	case FAST_CLASSIFIER_POLICY_PACKETS:
+		if (!threshold) {
+			threshold = offload_at_pkts;
+		}
+		return conn->hits >= threshold;
+
+	case FAST_CLASSIFIER_POLICY_BYTE_RATE:
+		elapsed = max(jiffies - conn->first_jiffies, (unsigned long)FAST_CLASSIFIER_RATE_MIN_JIFFIES);
+		return conn->bytes * HZ >= (u64)threshold * elapsed;
+	}
+
+	return false;
+}
+
+/*
+ * fast_classifier_offload_conn()
+ *	Create the SFE rule for a connection and tell user space about it.
+ *
+ * Called with sfe_connections_lock held, which is released before returning.
+ */
+static void fast_classifier_offload_conn(struct sfe_connection *conn)
+{
+	int ret;
+
+	if (fast_classifier_update_protocol(conn->sic, conn->ct) == 0) {
+		spin_unlock_bh(&sfe_connections_lock);
+		fast_classifier_incr_exceptions(FAST_CL_EXCEPTION_UPDATE_PROTOCOL_FAIL);
+		DEBUG_TRACE("UNKNOWN PROTOCOL OR CONNECTION CLOSING, SKIPPING\n");
+		return;
+	}
+
+	DEBUG_TRACE("INFO: calling sfe rule creation!\n");
+	spin_unlock_bh(&sfe_connections_lock);
+
+	ret = conn->is_v4 ? sfe_ipv4_create_rule(conn->sic) : sfe_ipv6_create_rule(conn->sic);
+	if ((ret == 0) || (ret == -EADDRINUSE)) {
+		struct fast_classifier_tuple fc_msg;
+
+		fast_classifier_fill_tuple(conn, &fc_msg);
+		fast_classifier_send_genl_msg(FAST_CLASSIFIER_C_OFFLOADED, &fc_msg);
+		conn->last_jiffies = jiffies;
+		conn->offloaded = 1;
+	}
+}
+
+/*
+ * fast_classifier_policy_valid()
+ *	Sanity check a policy from user space.
+ */
+static bool fast_classifier_policy_valid(const struct fast_classifier_policy *policy)
+{
+	if (policy->action > FAST_CLASSIFIER_POLICY_MAX) {
+		return false;
+	}
+
+	if (policy->port_max && policy->port_min > policy->port_max) {
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * fast_classifier_policy_table_dup()
+ *	Return a copy of the policy table for the caller to modify.
+ *
+ * Called with fc_policy_mutex held.
+ */
+static struct fast_classifier_policy_table *fast_classifier_policy_table_dup(void)
+{
+	struct fast_classifier_policy_table *old;
+	struct fast_classifier_policy_table *table;
+
+	old = rcu_dereference_protected(fc_policy_table, lockdep_is_held(&fc_policy_mutex));
+	if (old) {
+		return kmemdup(old, sizeof(*old), GFP_KERNEL);
+	}
+
+	table = kzalloc(sizeof(*table), GFP_KERNEL);
+	if (table) {
+		table->default_policy = fc_policy_builtin_default;
+	}
+
+	return table;
+}
+
+/*
+ * fast_classifier_policy_table_replace()
+ *	Publish a new policy table and free the old one once readers are done.
+ *
+ * Called with fc_policy_mutex held.
+ */
+static void fast_classifier_policy_table_replace(struct fast_classifier_policy_table *table)
+{
+	struct fast_classifier_policy_table *old;
+
+	old = rcu_dereference_protected(fc_policy_table, lockdep_is_held(&fc_policy_mutex));
+	rcu_assign_pointer(fc_policy_table, table);
+	if (old) {
+		kfree_rcu(old, rcu);
+	}
+}
+
+/*
+ * fast_classifier_policy_from_attr()
+ *	Get a policy from a netlink attribute.
+ */
+static struct fast_classifier_policy *fast_classifier_policy_from_attr(struct nlattr *na)
+{
+	struct fast_classifier_policy *policy;
+
+	if (!na || nla_len(na) < sizeof(*policy)) {
+		return NULL;
+	}
+
+	policy = nla_data(na);
+	if (!fast_classifier_policy_valid(policy)) {
+		return NULL;
+	}
+
+	return policy;
+}
+
+/*
+ * fast_classifier_policy_add_genl_msg()
+ *	Called from user space to append an offload policy rule.
+ */
+static int fast_classifier_policy_add_genl_msg(struct sk_buff *skb, struct genl_info *info)
+{
+	struct fast_classifier_policy *policy;
+	struct fast_classifier_policy_table *table;
+	int index;
+
+	policy = fast_classifier_policy_from_attr(info->attrs[FAST_CLASSIFIER_A_POLICY]);
+	if (!policy) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&fc_policy_mutex);
+	table = fast_classifier_policy_table_dup();
+	if (!table) {
+		mutex_unlock(&fc_policy_mutex);
+		return -ENOMEM;
+	}
+
+	if (table->num_rules >= FAST_CLASSIFIER_POLICY_RULES_MAX) {
+		mutex_unlock(&fc_policy_mutex);
+		kfree(table);
+		return -ENOSPC;
+	}
+
+	index = table->num_rules++;
+	table->rules[index] = *policy;
+	fast_classifier_policy_table_replace(table);
+	mutex_unlock(&fc_policy_mutex);
+
+	DEBUG_INFO("policy rule %d: proto %u ports %u-%u action %u threshold %u idle %u\n",
+		   index, policy->proto, policy->port_min, policy->port_max,
+		   policy->action, policy->threshold, policy->idle_timeout);
+	return 0;
+}
+
+/*
+ * fast_classifier_policy_flush_genl_msg()
+ *	Called from user space to remove all offload policy rules.
+ *
+ * Connections that already picked a policy keep it.
+ */
+static int fast_classifier_policy_flush_genl_msg(struct sk_buff *skb, struct genl_info *info)
+{
+	struct fast_classifier_policy_table *table;
+
+	mutex_lock(&fc_policy_mutex);
+	table = fast_classifier_policy_table_dup();
+	if (!table) {
+		mutex_unlock(&fc_policy_mutex);
+		return -ENOMEM;
+	}
+
+	table->num_rules = 0;
+	fast_classifier_policy_table_replace(table);
+	mutex_unlock(&fc_policy_mutex);
+	return 0;
+}
+
+/*
+ * fast_classifier_policy_default_genl_msg()
+ *	Called from user space to set the policy for connections that match no rule.
+ */
+static int fast_classifier_policy_default_genl_msg(struct sk_buff *skb, struct genl_info *info)
+{
+	struct fast_classifier_policy *policy;
+	struct fast_classifier_policy_table *table;
+
+	policy = fast_classifier_policy_from_attr(info->attrs[FAST_CLASSIFIER_A_DEFAULT_POLICY]);
+	if (!policy) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&fc_policy_mutex);
+	table = fast_classifier_policy_table_dup();
+	if (!table) {
+		mutex_unlock(&fc_policy_mutex);
+		return -ENOMEM;
+	}
+
+	table->default_policy = *policy;
+	fast_classifier_policy_table_replace(table);
+	mutex_unlock(&fc_policy_mutex);
+	return 0;
+}
+
+/*
+ * fast_classifier_policy_get_genl_msg()
+ *	Called from user space to read back the default policy and the rules.
+ */
+static int fast_classifier_policy_get_genl_msg(struct sk_buff *skb, struct genl_info *info)
+{
+	struct fast_classifier_policy_table *table;
+	struct sk_buff *msg;
+	void *msg_head;
+	int i;
+
+	msg = genlmsg_new(fast_classifier_gnl_family.hdrsize +
+			  nla_total_size(sizeof(struct fast_classifier_policy)) * (FAST_CLASSIFIER_POLICY_RULES_MAX + 1),
+			  GFP_KERNEL);
+	if (!msg) {
+		return -ENOMEM;
+	}
+
+	msg_head = genlmsg_put_reply(msg, info, &fast_classifier_gnl_family, 0, FAST_CLASSIFIER_C_POLICY_GET);
+	if (!msg_head) {
+		nlmsg_free(msg);
+		return -EMSGSIZE;
+	}
+
+	mutex_lock(&fc_policy_mutex);
+	table = rcu_dereference_protected(fc_policy_table, lockdep_is_held(&fc_policy_mutex));
+	if (nla_put(msg, FAST_CLASSIFIER_A_DEFAULT_POLICY, sizeof(struct fast_classifier_policy),
+		    table ? &table->default_policy : &fc_policy_builtin_default)) {
+		goto nla_put_failure;
+	}
+
+	for (i = 0; table && i < table->num_rules; i++) {
+		if (nla_put(msg, FAST_CLASSIFIER_A_POLICY, sizeof(struct fast_classifier_policy), &table->rules[i])) {
+			goto nla_put_failure;
+		}
+	}
+	mutex_unlock(&fc_policy_mutex);
+
+	genlmsg_end(msg, msg_head);
+	return genlmsg_reply(msg, info);
+
+nla_put_failure:
+	mutex_unlock(&fc_policy_mutex);
+	genlmsg_cancel(msg, msg_head);
+	nlmsg_free(msg);
+	return -EMSGSIZE;
+}
+
+/*
+ * Record of a connection demoted by the idle scan.
+ */
+struct fast_classifier_demotion {
+	struct sfe_connection_destroy sid;	/* Rule to destroy */
+	struct fast_classifier_tuple fc_msg;	/* Message for user space */
+	bool is_v4;				/* IPv4 or IPv6 rule */
+};
+
+static void fast_classifier_idle_scan(struct work_struct *work);
+static DECLARE_DELAYED_WORK(fc_idle_work, fast_classifier_idle_scan);
+
+/*
+ * fast_classifier_idle_scan()
+ *	Demote offloaded connections that have been idle for longer than their policy allows.
+ *
+ * The SFE rule is destroyed and the connection starts waiting for its policy
+ * to be met again, so that it gets offloaded again if it becomes busy.
+ */
+static void fast_classifier_idle_scan(struct work_struct *work)
+{
+	struct fast_classifier_demotion demotions[FAST_CLASSIFIER_IDLE_BATCH];
+	struct sfe_connection *conn;
+	int num;
+	int i;
+	u32 bkt;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 9, 0))
+	struct hlist_node *node;
+#endif
+
+another_round:
+	num = 0;
+	spin_lock_bh(&sfe_connections_lock);
+	sfe_hash_for_each(fc_conn_ht, bkt, node, conn, hl) {
+		struct fast_classifier_demotion *d;
+
+		if (!conn->offloaded || !conn->policy.idle_timeout) {
+			continue;
+		}
+
+		if (time_before(jiffies, conn->last_jiffies + conn->policy.idle_timeout * HZ)) {
+			continue;
+		}
+
+		d = &demotions[num];
+		d->sid.protocol = conn->sic->protocol;
+		d->sid.src_ip = conn->sic->src_ip;
+		d->sid.dest_ip = conn->sic->dest_ip;
+		d->sid.src_port = conn->sic->src_port;
+		d->sid.dest_port = conn->sic->dest_port;
+		d->is_v4 = conn->is_v4;
+		fast_classifier_fill_tuple(conn, &d->fc_msg);
+
+		conn->offloaded = 0;
+		conn->offload_permit = 0;
+		conn->hits = 0;
+		conn->bytes = 0;
+		conn->first_jiffies = jiffies;
+
+		if (++num == FAST_CLASSIFIER_IDLE_BATCH) {
+			break;
+		}
+	}
+	spin_unlock_bh(&sfe_connections_lock);
+
+	for (i = 0; i < num; i++) {
+		DEBUG_TRACE("demoting idle connection, proto: %d sport: %d dport: %d\n",
+			    demotions[i].sid.protocol, ntohs(demotions[i].sid.src_port), ntohs(demotions[i].sid.dest_port));
+		demotions[i].is_v4 ? sfe_ipv4_destroy_rule(&demotions[i].sid) : sfe_ipv6_destroy_rule(&demotions[i].sid);
+		fast_classifier_send_genl_msg(FAST_CLASSIFIER_C_DONE, &demotions[i].fc_msg);
+	}
+
+	if (num == FAST_CLASSIFIER_IDLE_BATCH) {
+		goto another_round;
+	}
+
+	schedule_delayed_work(&fc_idle_work, FAST_CLASSIFIER_IDLE_SCAN_INTERVAL);
+}
+
 /*
  * fast_classifier_post_routing()
  *	Called for packets about to leave the box - either locally generated or forwarded from another interface
  */
 static unsigned int fast_classifier_post_routing(struct sk_buff *skb, bool is_v4)
 {
-	int ret;
 	struct sfe_connection_create sic;
 	struct sfe_connection_create *p_sic;
 	struct net_device *in;
@@ -1036,46 +1557,12 @@ static unsigned int fast_classifier_post_routing(struct sk_buff *skb, bool is_v4
 	conn = fast_classifier_find_conn(&sic.src_ip, &sic.dest_ip, sic.src_port, sic.dest_port, sic.protocol, is_v4);
 	if (conn) {
 		conn->hits++;
+		conn->bytes += skb->len;
 
-		if (!conn->offloaded) {
-			if (conn->offload_permit || conn->hits >= offload_at_pkts) {
-				DEBUG_TRACE("OFFLOADING CONNECTION, TOO MANY HITS\n");
-
-				if (fast_classifier_update_protocol(conn->sic, conn->ct) == 0) {
-					spin_unlock_bh(&sfe_connections_lock);
-					fast_classifier_incr_exceptions(FAST_CL_EXCEPTION_UPDATE_PROTOCOL_FAIL);
-					DEBUG_TRACE("UNKNOWN PROTOCOL OR CONNECTION CLOSING, SKIPPING\n");
-					return NF_ACCEPT;
-				}
-
-				DEBUG_TRACE("INFO: calling sfe rule creation!\n");
-				spin_unlock_bh(&sfe_connections_lock);
-
-				ret = is_v4 ? sfe_ipv4_create_rule(conn->sic) : sfe_ipv6_create_rule(conn->sic);
-				if ((ret == 0) || (ret == -EADDRINUSE)) {
-					struct fast_classifier_tuple fc_msg;
-
-					if (is_v4) {
-						fc_msg.ethertype = AF_INET;
-						fc_msg.src_saddr.in = *((struct in_addr *)&sic.src_ip);
-						fc_msg.dst_saddr.in = *((struct in_addr *)&sic.dest_ip_xlate);
-					} else {
-						fc_msg.ethertype = AF_INET6;
-						fc_msg.src_saddr.in6 = *((struct in6_addr *)&sic.src_ip);
-						fc_msg.dst_saddr.in6 = *((struct in6_addr *)&sic.dest_ip_xlate);
-					}
-
-					fc_msg.proto = sic.protocol;
-					fc_msg.sport = sic.src_port;
-					fc_msg.dport = sic.dest_port_xlate;
-					memcpy(fc_msg.smac, conn->smac, ETH_ALEN);
-					memcpy(fc_msg.dmac, conn->dmac, ETH_ALEN);
-					fast_classifier_send_genl_msg(FAST_CLASSIFIER_C_OFFLOADED, &fc_msg);
-					conn->offloaded = 1;
-				}
-
-				return NF_ACCEPT;
-			}
+		if (!conn->offloaded && fast_classifier_should_offload(conn)) {
+			DEBUG_TRACE("OFFLOADING CONNECTION, POLICY MET\n");
+			fast_classifier_offload_conn(conn);
+			return NF_ACCEPT;
 		}
 
 		spin_unlock_bh(&sfe_connections_lock);
@@ -1165,6 +1652,10 @@ static unsigned int fast_classifier_post_routing(struct sk_buff *skb, bool is_v4
 	conn->offload_permit = 0;
 	conn->offloaded = 0;
 	conn->is_v4 = is_v4;
+	conn->bytes = skb->len;
+	conn->first_jiffies = jiffies;
+	conn->last_jiffies = jiffies;
+	fast_classifier_policy_lookup(&conn->policy, sic.protocol, sic.src_port, sic.dest_port);
 	DEBUG_TRACE("Source MAC=%pM\n", sic.src_mac);
 	memcpy(conn->smac, sic.src_mac, ETH_ALEN);
 	memcpy(conn->dmac, sic.dest_mac_xlate, ETH_ALEN);
@@ -1183,6 +1674,20 @@ static unsigned int fast_classifier_post_routing(struct sk_buff *skb, bool is_v4
 	if (!fast_classifier_add_conn(conn)) {
 		kfree(conn->sic);
 		kfree(conn);
+		goto done4;
+	}
+
+	/*
+	 * Some policies want the connection offloaded straight away.  The
+	 * conntrack entry is held by this packet so the connection can't go
+	 * away while we look at it.
+	 */
+	spin_lock_bh(&sfe_connections_lock);
+	if (!conn->offloaded && fast_classifier_should_offload(conn)) {
+		DEBUG_TRACE("OFFLOADING CONNECTION, POLICY MET ON FIRST PACKET\n");
+		fast_classifier_offload_conn(conn);
+	} else {
+		spin_unlock_bh(&sfe_connections_lock);
 	}
 
 	/*
@@ -1430,9 +1935,23 @@ static void fast_classifier_sync_rule(struct sfe_connection_sync *sis)
 {
 	struct nf_conntrack_tuple_hash *h;
 	struct nf_conntrack_tuple tuple;
+	struct sfe_connection *conn;
 	struct nf_conn *ct;
 	SFE_NF_CONN_ACCT(acct);
 
+	/*
+	 * Note that the connection is still busy so that it isn't demoted.
+	 */
+	if (sis->src_new_packet_count || sis->dest_new_packet_count) {
+		spin_lock_bh(&sfe_connections_lock);
+		conn = fast_classifier_find_conn(&sis->src_ip, &sis->dest_ip, sis->src_port,
+						 sis->dest_port, sis->protocol, !sis->is_v6);
+		if (conn) {
+			conn->last_jiffies = jiffies;
+		}
+		spin_unlock_bh(&sfe_connections_lock);
+	}
+
 	/*
 	 * Create a tuple so as to be able to look up a connection
 	 */
@@ -1556,6 +2075,19 @@ static void fast_classifier_sync_rule(struct sfe_connection_sync *sis)
 	nf_ct_put(ct);
 }
 
+/*
+ * fast_classifier_sync_rules()
+ *	Synchronize a batch of connections' state.
+ */
+static void fast_classifier_sync_rules(struct sfe_connection_sync *sis, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		fast_classifier_sync_rule(&sis[i]);
+	}
+}
+
 /*
  * fast_classifier_device_event()
  */
@@ -1868,8 +2400,13 @@ static int __init fast_classifier_init(void)
 	/*
 	 * Hook the shortcut sync callback.
 	 */
-	sfe_ipv4_register_sync_rule_callback(fast_classifier_sync_rule);
-	sfe_ipv6_register_sync_rule_callback(fast_classifier_sync_rule);
+	sfe_ipv4_register_sync_rule_callback(fast_classifier_sync_rules);
+	sfe_ipv6_register_sync_rule_callback(fast_classifier_sync_rules);
+
+	/*
+	 * Start looking for idle connections to demote.
+	 */
+	schedule_delayed_work(&fc_idle_work, FAST_CLASSIFIER_IDLE_SCAN_INTERVAL);
 	return 0;
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0))
@@ -1916,6 +2453,11 @@ static void __exit fast_classifier_exit(void)
 	DEBUG_INFO("SFE CM exit\n");
 	printk(KERN_ALERT "fast-classifier: shutting down\n");
 
+	/*
+	 * Stop demoting idle connections.
+	 */
+	cancel_delayed_work_sync(&fc_idle_work);
+
 	/*
 	 * Unregister our sync callback.
 	 */
@@ -1964,6 +2506,13 @@ static void __exit fast_classifier_exit(void)
 	unregister_netdevice_notifier(&sc->dev_notifier);
 
 	kobject_put(sc->sys_fast_classifier);
+
+	/*
+	 * Free the offload policy.  User space can no longer change it but we
+	 * must wait for any tables it replaced to be freed.
+	 */
+	kfree(rcu_dereference_protected(fc_policy_table, 1));
+	rcu_barrier();
 }
 
 module_init(fast_classifier_init)
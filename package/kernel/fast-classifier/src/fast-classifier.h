@@ -24,6 +24,8 @@
 enum {
 	FAST_CLASSIFIER_A_UNSPEC,
 	FAST_CLASSIFIER_A_TUPLE,
+	FAST_CLASSIFIER_A_POLICY,		/* struct fast_classifier_policy */
+	FAST_CLASSIFIER_A_DEFAULT_POLICY,	/* struct fast_classifier_policy */
 	__FAST_CLASSIFIER_A_MAX,
 };
 
@@ -34,6 +36,10 @@ enum {
 	FAST_CLASSIFIER_C_OFFLOAD,
 	FAST_CLASSIFIER_C_OFFLOADED,
 	FAST_CLASSIFIER_C_DONE,
+	FAST_CLASSIFIER_C_POLICY_ADD,		/* Append an A_POLICY rule */
+	FAST_CLASSIFIER_C_POLICY_FLUSH,		/* Remove all rules */
+	FAST_CLASSIFIER_C_POLICY_DEFAULT,	/* Set the A_DEFAULT_POLICY */
+	FAST_CLASSIFIER_C_POLICY_GET,		/* Reply with the default policy and all rules */
 	__FAST_CLASSIFIER_C_MAX,
 };
 
@@ -55,3 +61,38 @@ struct fast_classifier_tuple {
 	unsigned char smac[ETH_ALEN];
 	unsigned char dmac[ETH_ALEN];
 };
+
+/*
+ * Offload policy actions.
+ */
+enum {
+	FAST_CLASSIFIER_POLICY_NEVER,		/* Leave the flow on the slow path */
+	FAST_CLASSIFIER_POLICY_FIRST_PACKET,	/* Offload as soon as the flow is seen */
+	FAST_CLASSIFIER_POLICY_PACKETS,		/* Offload after threshold packets, 0 uses offload_at_pkts */
+	FAST_CLASSIFIER_POLICY_BYTE_RATE,	/* Offload once the flow reaches threshold bytes per second */
+	__FAST_CLASSIFIER_POLICY_MAX,
+};
+
+#define FAST_CLASSIFIER_POLICY_MAX (__FAST_CLASSIFIER_POLICY_MAX - 1)
+
+/*
+ * Maximum number of policy rules.
+ */
+#define FAST_CLASSIFIER_POLICY_RULES_MAX 32
+
+/*
+ * An offload policy rule.  Rules are matched in the order they were added and
+ * the first match wins; flows that match no rule use the default policy.  A
+ * flow matches if either of its ports is in [port_min, port_max].  Setting
+ * the default action to FAST_CLASSIFIER_POLICY_NEVER turns the rules into an
+ * allowlist.
+ */
+struct fast_classifier_policy {
+	unsigned char proto;		/* IP protocol, 0 matches any */
+	unsigned char action;		/* FAST_CLASSIFIER_POLICY_* */
+	unsigned short port_min;	/* Lowest port, host byte order */
+	unsigned short port_max;	/* Highest port, 0 matches any port */
+	unsigned short reserved;
+	unsigned int threshold;		/* Packets or bytes per second, depending on action */
+	unsigned int idle_timeout;	/* Seconds without traffic before an offloaded flow is demoted, 0 for never */
+};
@@ -31,6 +31,12 @@
 #include <net/netfilter/nf_conntrack_core.h>
 #include <linux/netfilter/xt_dscp.h>
 #include <linux/if_bridge.h>
+#include <linux/if_vlan.h>
+#include <linux/if_pppox.h>
+#include <linux/ppp_defs.h>
+#include <linux/if_arp.h>
+#include <linux/etherdevice.h>
+#include <linux/seqlock.h>
 #include <linux/version.h>
 
 #include "sfe.h"
@@ -56,6 +62,8 @@ typedef enum sfe_cm_exception {
 	SFE_CM_EXCEPTION_NO_DEST_XLATE_DEV,
 	SFE_CM_EXCEPTION_NO_BRIDGE,
 	SFE_CM_EXCEPTION_LOCAL_OUT,
+	SFE_CM_EXCEPTION_PPPOE_BAD_HEADER,
+	SFE_CM_EXCEPTION_PPPOE_NO_SESSION,
 	SFE_CM_EXCEPTION_MAX
 } sfe_cm_exception_t;
 
@@ -77,7 +85,25 @@ static char *sfe_cm_exception_events_string[SFE_CM_EXCEPTION_MAX] = {
 	"NO_DEST_DEV",
 	"NO_DEST_XLATE_DEV",
 	"NO_BRIDGE",
-	"LOCAL_OUT"
+	"LOCAL_OUT",
+	"PPPOE_BAD_HEADER",
+	"PPPOE_NO_SESSION"
+};
+
+/*
+ * The number of PPPoE sessions we'll decapsulate in the receive path.  A router
+ * normally only has one or two.
+ */
+#define SFE_CM_PPPOE_SESSIONS_MAX 8
+
+/*
+ * A PPPoE session whose connections we've offloaded.
+ */
+struct sfe_cm_pppoe_session {
+	int ifindex;			/* Device the session runs over, 0 if the slot is free */
+	int ppp_ifindex;		/* PPP device of the session */
+	__be16 session_id;		/* PPPoE session ID */
+	u8 remote_mac[ETH_ALEN];	/* MAC address of the access concentrator */
 };
 
 /*
@@ -98,6 +124,14 @@ struct sfe_cm {
 	struct notifier_block inet_notifier;	/* IPv4 notifier */
 	struct notifier_block inet6_notifier;	/* IPv6 notifier */
 	u32 exceptions[SFE_CM_EXCEPTION_MAX];
+
+	/*
+	 * PPPoE sessions.  Written under the lock, read locklessly in the receive path.
+	 */
+	seqcount_t pppoe_seq;		/* Sequence count protecting the session table */
+	int pppoe_num_sessions;		/* Number of sessions in use */
+	int pppoe_next_session;		/* Slot to recycle when the table is full */
+	struct sfe_cm_pppoe_session pppoe_sessions[SFE_CM_PPPOE_SESSIONS_MAX];
 };
 
 static struct sfe_cm __sc;
@@ -116,24 +150,130 @@ static inline void sfe_cm_incr_exceptions(sfe_cm_exception_t except)
 }
 
 /*
- * sfe_cm_recv()
- *	Handle packet receives.
+ * sfe_cm_find_pppoe_session()
+ *	Find the PPP device of a PPPoE session that we've offloaded.
  *
- * Returns 1 if the packet is forwarded or 0 if it isn't.
+ * Must be called under rcu_read_lock().
  */
-int sfe_cm_recv(struct sk_buff *skb)
+static struct net_device *sfe_cm_find_pppoe_session(struct net_device *dev, __be16 session_id, const u8 *remote_mac)
 {
-	struct net_device *dev;
+	struct sfe_cm *sc = &__sc;
+	unsigned int seq;
+	int ppp_ifindex;
+	int i;
+
+	do {
+		seq = read_seqcount_begin(&sc->pppoe_seq);
+		ppp_ifindex = 0;
+		for (i = 0; i < SFE_CM_PPPOE_SESSIONS_MAX; i++) {
+			struct sfe_cm_pppoe_session *ps = &sc->pppoe_sessions[i];
+
+			if ((ps->ifindex == dev->ifindex) && (ps->session_id == session_id) &&
+			    ether_addr_equal(ps->remote_mac, remote_mac)) {
+				ppp_ifindex = ps->ppp_ifindex;
+				break;
+			}
+		}
+	} while (read_seqcount_retry(&sc->pppoe_seq, seq));
+
+	if (!ppp_ifindex) {
+		return NULL;
+	}
+
+	return dev_get_by_index_rcu(dev_net(dev), ppp_ifindex);
+}
+
+/*
+ * sfe_cm_add_pppoe_session()
+ *	Record a PPPoE session so that the receive path can decapsulate its packets.
+ */
+static void sfe_cm_add_pppoe_session(struct net_device *dev, __be16 session_id, const u8 *remote_mac,
+				     struct net_device *ppp_dev)
+{
+	struct sfe_cm *sc = &__sc;
+	struct sfe_cm_pppoe_session *ps;
+	int free = -1;
+	int i;
+
+	spin_lock_bh(&sc->lock);
+	for (i = 0; i < SFE_CM_PPPOE_SESSIONS_MAX; i++) {
+		ps = &sc->pppoe_sessions[i];
+		if (!ps->ifindex) {
+			if (free < 0) {
+				free = i;
+			}
+			continue;
+		}
+
+		if ((ps->ifindex == dev->ifindex) && (ps->session_id == session_id) &&
+		    ether_addr_equal(ps->remote_mac, remote_mac)) {
+			if (ps->ppp_ifindex == ppp_dev->ifindex) {
+				spin_unlock_bh(&sc->lock);
+				return;
+			}
+
+			free = i;
+			break;
+		}
+	}
 
 	/*
-	 * We know that for the vast majority of packets we need the transport
-	 * layer header so we may as well start to fetch it now!
+	 * If the table's full then recycle the slots in turn.
 	 */
-	prefetch(skb->data + 32);
-	barrier();
+	if (free < 0) {
+		free = sc->pppoe_next_session;
+		sc->pppoe_next_session = (free + 1) % SFE_CM_PPPOE_SESSIONS_MAX;
+	} else if (!sc->pppoe_sessions[free].ifindex) {
+		sc->pppoe_num_sessions++;
+	}
+
+	ps = &sc->pppoe_sessions[free];
+	write_seqcount_begin(&sc->pppoe_seq);
+	ps->ifindex = dev->ifindex;
+	ps->ppp_ifindex = ppp_dev->ifindex;
+	ps->session_id = session_id;
+	ether_addr_copy(ps->remote_mac, remote_mac);
+	write_seqcount_end(&sc->pppoe_seq);
+	spin_unlock_bh(&sc->lock);
+
+	DEBUG_INFO("PPPoE session %u on %s is %s\n", ntohs(session_id), dev->name, ppp_dev->name);
+}
 
-	dev = skb->dev;
+/*
+ * sfe_cm_remove_pppoe_sessions()
+ *	Forget any PPPoE sessions that run over, or terminate on, a device.
+ */
+static void sfe_cm_remove_pppoe_sessions(struct net_device *dev)
+{
+	struct sfe_cm *sc = &__sc;
+	int i;
+
+	spin_lock_bh(&sc->lock);
+	write_seqcount_begin(&sc->pppoe_seq);
+	for (i = 0; i < SFE_CM_PPPOE_SESSIONS_MAX; i++) {
+		struct sfe_cm_pppoe_session *ps = &sc->pppoe_sessions[i];
+
+		if (!ps->ifindex) {
+			continue;
+		}
+
+		if ((ps->ifindex == dev->ifindex) || (ps->ppp_ifindex == dev->ifindex)) {
+			memset(ps, 0, sizeof(*ps));
+			sc->pppoe_num_sessions--;
+		}
+	}
+	write_seqcount_end(&sc->pppoe_seq);
+	spin_unlock_bh(&sc->lock);
+}
 
+/*
+ * sfe_cm_recv_ip()
+ *	Hand an IPv4 or IPv6 packet to the forwarding engine as though it arrived on dev.
+ *
+ * Returns 1 if the packet is forwarded or 0 if it isn't.
+ */
+static int sfe_cm_recv_ip(struct net_device *dev, struct sk_buff *skb)
+{
 	/*
 	 * We're only interested in IPv4 and IPv6 packets.
 	 */
@@ -189,6 +329,149 @@ int sfe_cm_recv(struct sk_buff *skb)
 	return 0;
 }
 
+/*
+ * sfe_cm_recv_pppoe()
+ *	Decapsulate a PPPoE session packet and hand it on as though it arrived on the PPP device.
+ *
+ * Returns 1 if the packet is forwarded or 0 if it isn't, in which case the
+ * PPPoE header is put back for the stack to deal with.
+ */
+static int sfe_cm_recv_pppoe(struct net_device *dev, struct sk_buff *skb)
+{
+	struct sfe_cm *sc = &__sc;
+	struct net_device *ppp_dev;
+	struct pppoe_hdr *ph;
+	unsigned int len;
+	__be16 proto;
+	int ret;
+
+	/*
+	 * Don't bother unless we've offloaded a PPPoE session.
+	 */
+	if (likely(!READ_ONCE(sc->pppoe_num_sessions))) {
+		return 0;
+	}
+
+	if (unlikely(!pskb_may_pull(skb, PPPOE_SES_HLEN))) {
+		sfe_cm_incr_exceptions(SFE_CM_EXCEPTION_PPPOE_BAD_HEADER);
+		DEBUG_TRACE("packet too short for PPPoE header\n");
+		return 0;
+	}
+
+	ph = (struct pppoe_hdr *)skb->data;
+	len = ntohs(ph->length);
+	if (unlikely((ph->ver != 1) || (ph->type != 1) || ph->code ||
+		     (len < sizeof(__be16)) || ((len + sizeof(struct pppoe_hdr)) > skb->len))) {
+		sfe_cm_incr_exceptions(SFE_CM_EXCEPTION_PPPOE_BAD_HEADER);
+		DEBUG_TRACE("bad PPPoE header\n");
+		return 0;
+	}
+
+	/*
+	 * Anything other than IP, such as LCP, is for pppd.
+	 */
+	switch (*(__be16 *)(ph + 1)) {
+	case htons(PPP_IP):
+		proto = htons(ETH_P_IP);
+		break;
+
+	case htons(PPP_IPV6):
+		proto = htons(ETH_P_IPV6);
+		break;
+
+	default:
+		return 0;
+	}
+
+	ppp_dev = sfe_cm_find_pppoe_session(dev, ph->sid, eth_hdr(skb)->h_source);
+	if (unlikely(!ppp_dev)) {
+		sfe_cm_incr_exceptions(SFE_CM_EXCEPTION_PPPOE_NO_SESSION);
+		DEBUG_TRACE("no PPPoE session %u on %s\n", ntohs(ph->sid), dev->name);
+		return 0;
+	}
+
+	/*
+	 * Drop any Ethernet padding along with the PPPoE header.
+	 */
+	if (unlikely(pskb_trim_rcsum(skb, len + sizeof(struct pppoe_hdr)))) {
+		return 0;
+	}
+
+	skb_pull_rcsum(skb, PPPOE_SES_HLEN);
+	skb_reset_network_header(skb);
+	skb->protocol = proto;
+
+	ret = sfe_cm_recv_ip(ppp_dev, skb);
+	if (!ret) {
+		skb_push_rcsum(skb, PPPOE_SES_HLEN);
+		skb_reset_network_header(skb);
+		skb->protocol = htons(ETH_P_PPP_SES);
+	}
+
+	return ret;
+}
+
+/*
+ * sfe_cm_recv_vlan()
+ *	Handle a packet whose 802.1Q tag was stripped by the hardware.
+ *
+ * The packet is treated as though it arrived on the VLAN device, just as the
+ * stack would, and the tag is put back if we don't forward it.
+ */
+static int sfe_cm_recv_vlan(struct sk_buff *skb)
+{
+	struct net_device *vlan_dev;
+	__be16 vlan_proto = skb->vlan_proto;
+	u16 vlan_tci = skb_vlan_tag_get(skb);
+	int ret;
+
+	vlan_dev = __vlan_find_dev_deep_rcu(skb->dev, vlan_proto, vlan_tci & VLAN_VID_MASK);
+	if (!vlan_dev || !(vlan_dev->flags & IFF_UP)) {
+		DEBUG_TRACE("no VLAN device for tag %u on %s\n", vlan_tci & VLAN_VID_MASK, skb->dev->name);
+		return 0;
+	}
+
+	__vlan_hwaccel_clear_tag(skb);
+
+	if (htons(ETH_P_PPP_SES) == skb->protocol) {
+		ret = sfe_cm_recv_pppoe(vlan_dev, skb);
+	} else {
+		ret = sfe_cm_recv_ip(vlan_dev, skb);
+	}
+
+	if (!ret) {
+		__vlan_hwaccel_put_tag(skb, vlan_proto, vlan_tci);
+	}
+
+	return ret;
+}
+
+/*
+ * sfe_cm_recv()
+ *	Handle packet receives.
+ *
+ * Returns 1 if the packet is forwarded or 0 if it isn't.
+ */
+int sfe_cm_recv(struct sk_buff *skb)
+{
+	/*
+	 * We know that for the vast majority of packets we need the transport
+	 * layer header so we may as well start to fetch it now!
+	 */
+	prefetch(skb->data + 32);
+	barrier();
+
+	if (skb_vlan_tag_present(skb)) {
+		return sfe_cm_recv_vlan(skb);
+	}
+
+	if (unlikely(htons(ETH_P_PPP_SES) == skb->protocol)) {
+		return sfe_cm_recv_pppoe(skb->dev, skb);
+	}
+
+	return sfe_cm_recv_ip(skb->dev, skb);
+}
+
 /*
  * sfe_cm_find_dev_and_mac_addr()
  *	Find the device and MAC address for a given IPv4/IPv6 address.
@@ -276,6 +559,80 @@ ret_fail:
 	return false;
 }
 
+/*
+ * sfe_cm_find_encap()
+ *	Work out any VLAN and PPPoE encapsulation between a device and the
+ *	Ethernet device underneath it.
+ *
+ * If we find some then encap->dev is set, otherwise packets just go to dev.
+ */
+static void sfe_cm_find_encap(struct net_device *dev, const u8 *mac_addr, struct sfe_connection_encap *encap)
+{
+	struct net_device *l2_dev = dev;
+	struct net_device *real_dev;
+	const u8 *dest_mac = mac_addr;
+	__be16 session_id = 0;
+	u16 vlan_tag = 0;
+
+	memset(encap, 0, sizeof(*encap));
+
+	if (dev->type == ARPHRD_PPP) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0))
+		struct net_device_path_stack stack;
+		static const u8 zero_mac[ETH_ALEN];
+
+		/*
+		 * pppoe knows its session and the device it runs over.  A PPP
+		 * device of any other kind fails here and we leave it alone.
+		 */
+		if (dev_fill_forward_path(dev, zero_mac, &stack) < 0 ||
+		    (stack.num_paths < 2) || (stack.path[0].type != DEV_PATH_PPPOE)) {
+			return;
+		}
+
+		session_id = htons(stack.path[0].encap.id);
+		dest_mac = stack.path[0].encap.h_dest;
+		l2_dev = stack.path[1].dev;
+#else
+		return;
+#endif /*KERNEL_VERSION(5, 10, 0)*/
+	}
+
+	real_dev = l2_dev;
+	if (is_vlan_dev(l2_dev)) {
+		if ((vlan_dev_vlan_proto(l2_dev) != htons(ETH_P_8021Q)) || !vlan_dev_vlan_id(l2_dev)) {
+			return;
+		}
+
+		vlan_tag = vlan_dev_vlan_id(l2_dev);
+		real_dev = vlan_dev_real_dev(l2_dev);
+	}
+
+	if (!vlan_tag && !session_id) {
+		return;
+	}
+
+	/*
+	 * We can only write the headers ourselves when they go straight onto an
+	 * Ethernet device.  Stacked VLANs or bridges below us take the slow path.
+	 */
+	if (is_vlan_dev(real_dev) || (real_dev->priv_flags & IFF_EBRIDGE) ||
+	    !real_dev->header_ops || (real_dev->header_ops->create != eth_header)) {
+		DEBUG_TRACE("can't encapsulate %s over %s\n", dev->name, real_dev->name);
+		return;
+	}
+
+	encap->dev = real_dev;
+	ether_addr_copy(encap->src_mac, l2_dev->dev_addr);
+	ether_addr_copy(encap->dest_mac, dest_mac);
+	encap->vlan_tag = vlan_tag;
+	encap->pppoe_session_id = session_id;
+
+	if (session_id) {
+		sfe_cm_add_pppoe_session(l2_dev, session_id, dest_mac, dev);
+	}
+}
+
 /*
  * sfe_cm_post_routing()
  *	Called for packets about to leave the box - either locally generated or forwarded from another interface
@@ -615,9 +972,22 @@ static unsigned int sfe_cm_post_routing(struct sk_buff *skb, int is_v4)
 	sic.src_dev = src_dev;
 	sic.dest_dev = dest_dev;
 
+	/*
+	 * If either side is a VLAN or PPPoE device then find the Ethernet device
+	 * underneath so that the engine can add the encapsulation itself.
+	 */
+	sfe_cm_find_encap(src_dev, sic.src_mac, &sic.src_encap);
+	sfe_cm_find_encap(dest_dev, sic.dest_mac_xlate, &sic.dest_encap);
+
 	sic.src_mtu = src_dev->mtu;
 	sic.dest_mtu = dest_dev->mtu;
 
+	/*
+	 * Let the engines hold our conntrack entry so that syncs don't need to
+	 * look it up again.
+	 */
+	sic.ct = &ct->ct_general;
+
 	if (likely(is_v4)) {
 		sfe_ipv4_create_rule(&sic);
 	} else {
@@ -774,85 +1144,41 @@ static struct nf_hook_ops sfe_cm_ops_post_routing[] __read_mostly = {
 };
 
 /*
- * sfe_cm_sync_rule()
- *	Synchronize a connection's state.
+ * sfe_cm_update_conntrack()
+ *	Update a conntrack entry from a connection's sync message.
+ *
+ * Bottom halves must be disabled.
  */
-static void sfe_cm_sync_rule(struct sfe_connection_sync *sis)
+static void sfe_cm_update_conntrack(struct nf_conn *ct, struct sfe_connection_sync *sis)
 {
-	struct nf_conntrack_tuple_hash *h;
-	struct nf_conntrack_tuple tuple;
-	struct nf_conn *ct;
 	SFE_NF_CONN_ACCT(acct);
 
-	/*
-	 * Create a tuple so as to be able to look up a connection
-	 */
-	memset(&tuple, 0, sizeof(tuple));
-	tuple.src.u.all = (__be16)sis->src_port;
-	tuple.dst.dir = IP_CT_DIR_ORIGINAL;
-	tuple.dst.protonum = (u8)sis->protocol;
-	tuple.dst.u.all = (__be16)sis->dest_port;
-
-	if (sis->is_v6) {
-		tuple.src.u3.in6 = *((struct in6_addr *)sis->src_ip.ip6);
-		tuple.dst.u3.in6 = *((struct in6_addr *)sis->dest_ip.ip6);
-		tuple.src.l3num = AF_INET6;
-
-		DEBUG_TRACE("update connection - p: %d, s: %pI6:%u, d: %pI6:%u\n",
-			    (int)tuple.dst.protonum,
-			    &tuple.src.u3.in6, (unsigned int)ntohs(tuple.src.u.all),
-			    &tuple.dst.u3.in6, (unsigned int)ntohs(tuple.dst.u.all));
-	} else {
-		tuple.src.u3.ip = sis->src_ip.ip;
-		tuple.dst.u3.ip = sis->dest_ip.ip;
-		tuple.src.l3num = AF_INET;
-
-		DEBUG_TRACE("update connection - p: %d, s: %pI4:%u, d: %pI4:%u\n",
-			    (int)tuple.dst.protonum,
-			    &tuple.src.u3.ip, (unsigned int)ntohs(tuple.src.u.all),
-			    &tuple.dst.u3.ip, (unsigned int)ntohs(tuple.dst.u.all));
-	}
+	acct = nf_conn_acct_find(ct);
 
 	/*
-	 * Look up conntrack connection
+	 * Do everything that needs the lock in one go.
 	 */
-	h = nf_conntrack_find_get(&init_net, SFE_NF_CT_DEFAULT_ZONE, &tuple);
-	if (unlikely(!h)) {
-		DEBUG_TRACE("no connection found\n");
-		return;
-	}
-
-	ct = nf_ct_tuplehash_to_ctrack(h);
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0))
-	NF_CT_ASSERT(ct->timeout.data == (unsigned long)ct);
-#endif /*KERNEL_VERSION(4, 9, 0)*/
+	spin_lock(&ct->lock);
 
 	/*
 	 * Only update if this is not a fixed timeout
 	 */
 	if (!test_bit(IPS_FIXED_TIMEOUT_BIT, &ct->status)) {
-		spin_lock_bh(&ct->lock);
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0))
 		ct->timeout += sis->delta_jiffies;
 #else
 		ct->timeout.expires += sis->delta_jiffies;
 #endif /*KERNEL_VERSION(4, 9, 0)*/
-		spin_unlock_bh(&ct->lock);
 	}
 
-	acct = nf_conn_acct_find(ct);
 	if (acct) {
-		spin_lock_bh(&ct->lock);
 		atomic64_add(sis->src_new_packet_count, &SFE_ACCT_COUNTER(acct)[IP_CT_DIR_ORIGINAL].packets);
 		atomic64_add(sis->src_new_byte_count, &SFE_ACCT_COUNTER(acct)[IP_CT_DIR_ORIGINAL].bytes);
 		atomic64_add(sis->dest_new_packet_count, &SFE_ACCT_COUNTER(acct)[IP_CT_DIR_REPLY].packets);
 		atomic64_add(sis->dest_new_byte_count, &SFE_ACCT_COUNTER(acct)[IP_CT_DIR_REPLY].bytes);
-		spin_unlock_bh(&ct->lock);
 	}
 
-	switch (sis->protocol) {
-	case IPPROTO_TCP:
-		spin_lock_bh(&ct->lock);
+	if (sis->protocol == IPPROTO_TCP) {
 		if (ct->proto.tcp.seen[0].td_maxwin < sis->src_td_max_window) {
 			ct->proto.tcp.seen[0].td_maxwin = sis->src_td_max_window;
 		}
@@ -871,58 +1197,149 @@ static void sfe_cm_sync_rule(struct sfe_connection_sync *sis)
 		if ((s32)(ct->proto.tcp.seen[1].td_maxend - sis->dest_td_max_end) < 0) {
 			ct->proto.tcp.seen[1].td_maxend = sis->dest_td_max_end;
 		}
-		spin_unlock_bh(&ct->lock);
-		break;
+	}
+
+	spin_unlock(&ct->lock);
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 4, 0))
-	case IPPROTO_UDP:
-		/*
-		 * In Linux connection track, UDP flow has two timeout values:
-		 * /proc/sys/net/netfilter/nf_conntrack_udp_timeout:
-		 * 	this is for uni-direction UDP flow, normally its value is 60 seconds
-		 * /proc/sys/net/netfilter/nf_conntrack_udp_timeout_stream:
-		 * 	this is for bi-direction UDP flow, normally its value is 180 seconds
-		 *
-		 * Linux will update timer of UDP flow to stream timeout once it seen packets
-		 * in reply direction. But if flow is accelerated by NSS or SFE, Linux won't
-		 * see any packets. So we have to do the same thing in our stats sync message.
-		 */
-		if (!test_bit(IPS_ASSURED_BIT, &ct->status) && acct) {
-			u_int64_t reply_pkts = atomic64_read(&SFE_ACCT_COUNTER(acct)[IP_CT_DIR_REPLY].packets);
+	/*
+	 * In Linux connection track, UDP flow has two timeout values:
+	 * /proc/sys/net/netfilter/nf_conntrack_udp_timeout:
+	 * 	this is for uni-direction UDP flow, normally its value is 60 seconds
+	 * /proc/sys/net/netfilter/nf_conntrack_udp_timeout_stream:
+	 * 	this is for bi-direction UDP flow, normally its value is 180 seconds
+	 *
+	 * Linux will update timer of UDP flow to stream timeout once it seen packets
+	 * in reply direction. But if flow is accelerated by NSS or SFE, Linux won't
+	 * see any packets. So we have to do the same thing in our stats sync message.
+	 */
+	if ((sis->protocol == IPPROTO_UDP) && !test_bit(IPS_ASSURED_BIT, &ct->status) && acct) {
+		u_int64_t reply_pkts = atomic64_read(&SFE_ACCT_COUNTER(acct)[IP_CT_DIR_REPLY].packets);
 
-			if (reply_pkts != 0) {
-				unsigned int *timeouts;
+		if (reply_pkts != 0) {
+			unsigned int *timeouts;
 
-				set_bit(IPS_SEEN_REPLY_BIT, &ct->status);
-				set_bit(IPS_ASSURED_BIT, &ct->status);
+			set_bit(IPS_SEEN_REPLY_BIT, &ct->status);
+			set_bit(IPS_ASSURED_BIT, &ct->status);
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
-				timeouts = nf_ct_timeout_lookup(ct);
+			timeouts = nf_ct_timeout_lookup(ct);
 #else
-				struct nf_conntrack_l4proto *l4proto;
+			struct nf_conntrack_l4proto *l4proto;
 
-				l4proto = __nf_ct_l4proto_find((sis->is_v6 ? AF_INET6 : AF_INET), IPPROTO_UDP);
-				timeouts = nf_ct_timeout_lookup(&init_net, ct, l4proto);
+			l4proto = __nf_ct_l4proto_find((sis->is_v6 ? AF_INET6 : AF_INET), IPPROTO_UDP);
+			timeouts = nf_ct_timeout_lookup(&init_net, ct, l4proto);
 #endif /*KERNEL_VERSION(4, 19, 0)*/
 
-				spin_lock_bh(&ct->lock);
+			spin_lock(&ct->lock);
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0))
-				ct->timeout = jiffies + timeouts[UDP_CT_REPLIED];
+			ct->timeout = jiffies + timeouts[UDP_CT_REPLIED];
 #else
-				ct->timeout.expires = jiffies + timeouts[UDP_CT_REPLIED];
+			ct->timeout.expires = jiffies + timeouts[UDP_CT_REPLIED];
 #endif /*KERNEL_VERSION(4, 9, 0)*/
-				spin_unlock_bh(&ct->lock);
-			}
+			spin_unlock(&ct->lock);
 		}
-		break;
+	}
 #endif /*KERNEL_VERSION(3, 4, 0)*/
+}
+
+/*
+ * sfe_cm_sync_rule()
+ *	Synchronize a connection's state.
+ *
+ * Bottom halves must be disabled.
+ */
+static void sfe_cm_sync_rule(struct sfe_connection_sync *sis)
+{
+	struct nf_conntrack_tuple_hash *h;
+	struct nf_conntrack_tuple tuple;
+	struct nf_conn *ct;
+
+	/*
+	 * We give the engines a reference to the conntrack entry when we create
+	 * a connection, so we can normally go straight to it.  Once it's dying
+	 * there's nothing worth updating.
+	 */
+	if (likely(sis->ct)) {
+		ct = container_of(sis->ct, struct nf_conn, ct_general);
+		if (unlikely(nf_ct_is_dying(ct))) {
+			DEBUG_TRACE("%p: connection is dying\n", ct);
+			return;
+		}
+
+		sfe_cm_update_conntrack(ct, sis);
+		return;
+	}
+
+	/*
+	 * Create a tuple so as to be able to look up a connection
+	 */
+	memset(&tuple, 0, sizeof(tuple));
+	tuple.src.u.all = (__be16)sis->src_port;
+	tuple.dst.dir = IP_CT_DIR_ORIGINAL;
+	tuple.dst.protonum = (u8)sis->protocol;
+	tuple.dst.u.all = (__be16)sis->dest_port;
+
+	if (sis->is_v6) {
+		tuple.src.u3.in6 = *((struct in6_addr *)sis->src_ip.ip6);
+		tuple.dst.u3.in6 = *((struct in6_addr *)sis->dest_ip.ip6);
+		tuple.src.l3num = AF_INET6;
+
+		DEBUG_TRACE("update connection - p: %d, s: %pI6:%u, d: %pI6:%u\n",
+			    (int)tuple.dst.protonum,
+			    &tuple.src.u3.in6, (unsigned int)ntohs(tuple.src.u.all),
+			    &tuple.dst.u3.in6, (unsigned int)ntohs(tuple.dst.u.all));
+	} else {
+		tuple.src.u3.ip = sis->src_ip.ip;
+		tuple.dst.u3.ip = sis->dest_ip.ip;
+		tuple.src.l3num = AF_INET;
+
+		DEBUG_TRACE("update connection - p: %d, s: %pI4:%u, d: %pI4:%u\n",
+			    (int)tuple.dst.protonum,
+			    &tuple.src.u3.ip, (unsigned int)ntohs(tuple.src.u.all),
+			    &tuple.dst.u3.ip, (unsigned int)ntohs(tuple.dst.u.all));
+	}
+
+	/*
+	 * Look up conntrack connection
+	 */
+	h = nf_conntrack_find_get(&init_net, SFE_NF_CT_DEFAULT_ZONE, &tuple);
+	if (unlikely(!h)) {
+		DEBUG_TRACE("no connection found\n");
+		return;
 	}
 
+	ct = nf_ct_tuplehash_to_ctrack(h);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0))
+	NF_CT_ASSERT(ct->timeout.data == (unsigned long)ct);
+#endif /*KERNEL_VERSION(4, 9, 0)*/
+
+	sfe_cm_update_conntrack(ct, sis);
+
 	/*
 	 * Release connection
 	 */
 	nf_ct_put(ct);
 }
 
+/*
+ * sfe_cm_sync_rules()
+ *	Synchronize a batch of connections' state.
+ *
+ * The engines hand us a timer tick's worth of connections at a time, so we
+ * only disable bottom halves once for the whole batch.
+ */
+static void sfe_cm_sync_rules(struct sfe_connection_sync *sis, int num)
+{
+	int i;
+
+	local_bh_disable();
+	for (i = 0; i < num; i++) {
+		sfe_cm_sync_rule(&sis[i]);
+	}
+	local_bh_enable();
+}
+
 /*
  * sfe_cm_device_event()
  */
@@ -931,6 +1348,7 @@ int sfe_cm_device_event(struct notifier_block *this, unsigned long event, void *
 	struct net_device *dev = SFE_DEV_EVENT_PTR(ptr);
 
 	if (dev && (event == NETDEV_DOWN)) {
+		sfe_cm_remove_pppoe_sessions(dev);
 		sfe_ipv4_destroy_all_rules_for_dev(dev);
 		sfe_ipv6_destroy_all_rules_for_dev(dev);
 	}
@@ -1060,6 +1478,7 @@ static int __init sfe_cm_init(void)
 #endif
 
 	spin_lock_init(&sc->lock);
+	seqcount_init(&sc->pppoe_seq);
 
 	/*
 	 * Hook the receive path in the network stack.
@@ -1070,8 +1489,8 @@ static int __init sfe_cm_init(void)
 	/*
 	 * Hook the shortcut sync callback.
 	 */
-	sfe_ipv4_register_sync_rule_callback(sfe_cm_sync_rule);
-	sfe_ipv6_register_sync_rule_callback(sfe_cm_sync_rule);
+	sfe_ipv4_register_sync_rule_callback(sfe_cm_sync_rules);
+	sfe_ipv6_register_sync_rule_callback(sfe_cm_sync_rules);
 	return 0;
 
 #ifdef CONFIG_NF_CONNTRACK_EVENTS
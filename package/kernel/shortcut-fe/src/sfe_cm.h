@@ -37,6 +37,19 @@ typedef union {
 	struct sfe_ipv6_addr	ip6[1];
 } sfe_ip_addr_t;
 
+/*
+ * VLAN and PPPoE encapsulation between a connection's device and the Ethernet
+ * device that actually carries its packets.  When dev is set the engine adds
+ * the encapsulation itself and transmits on dev.
+ */
+struct sfe_connection_encap {
+	struct net_device *dev;		/* Ethernet device to transmit on, NULL if none */
+	u8 src_mac[ETH_ALEN];		/* Our MAC address on the encapsulated link */
+	u8 dest_mac[ETH_ALEN];		/* Next hop (or PPPoE peer) MAC address */
+	u16 vlan_tag;			/* 802.1Q VLAN ID to push, 0 if untagged */
+	__be16 pppoe_session_id;	/* PPPoE session ID, 0 if not PPPoE */
+};
+
 /*
  * connection creation structure.
  */
@@ -76,6 +89,9 @@ struct sfe_connection_create {
 	u32 dest_priority;
 	u32 src_dscp;
 	u32 dest_dscp;
+	struct sfe_connection_encap src_encap;
+	struct sfe_connection_encap dest_encap;
+	struct nf_conntrack *ct;	/* Conntrack entry to hand back in syncs, or NULL */
 };
 
 /*
@@ -130,6 +146,43 @@ struct sfe_connection_sync {
 	u32 dest_new_byte_count;
 	u32 reason;		/* reason for stats sync message, i.e. destroy, flush, period sync */
 	u64 delta_jiffies;		/* Time to be added to the current timeout to keep the connection alive */
+	struct nf_conntrack *ct;	/* Conntrack entry given when the connection was created, or NULL */
+};
+
+/*
+ * wildcard rule flags.
+ */
+#define SFE_WILDCARD_FLAG_MATCH_SRC BIT(0)
+					/* Match the source rather than the destination address and ports */
+#define SFE_WILDCARD_FLAG_REMARK_PRIORITY BIT(1)
+					/* Indicates that we should remark priority of skb */
+#define SFE_WILDCARD_FLAG_REMARK_DSCP BIT(2)
+					/* Indicates that we should remark DSCP of packet */
+
+/*
+ * wildcard rule structure.
+ *
+ * Forwards every packet of a protocol received on match_dev whose destination
+ * (or source) address is ip and whose port is within [port_lo, port_hi] to
+ * xmit_dev, without creating a connection for each flow.  The matched address
+ * and port can be translated; translated ports keep their offset in the range.
+ */
+struct sfe_wildcard_rule {
+	int protocol;
+	struct net_device *match_dev;
+	struct net_device *xmit_dev;
+	u32 flags;
+	u32 xmit_mtu;			/* MTU of xmit_dev, 0 to use the device's own */
+	sfe_ip_addr_t ip;		/* Address to match, 0 to match any */
+	sfe_ip_addr_t ip_xlate;		/* Translated address, 0 to leave it unchanged */
+	__be16 port_lo;			/* First port to match */
+	__be16 port_hi;			/* Last port to match */
+	__be16 port_xlate;		/* Port that port_lo translates to, 0 to leave ports unchanged */
+	u8 xmit_src_mac[ETH_ALEN];
+	u8 xmit_dest_mac[ETH_ALEN];
+	u32 mark;
+	u32 priority;
+	u32 dscp;
 };
 
 /*
@@ -157,12 +210,13 @@ extern int nf_ct_tcp_no_window_check;
 /*
  * This callback will be called in a timer
  * at 100 times per second to sync stats back to
- * Linux connection track.
+ * Linux connection track.  Each call passes an
+ * array of num sync messages.
  *
  * A RCU lock is taken to prevent this callback
  * from unregistering.
  */
-typedef void (*sfe_sync_rule_callback_t)(struct sfe_connection_sync *);
+typedef void (*sfe_sync_rule_callback_t)(struct sfe_connection_sync *sis, int num);
 
 /*
  * IPv4 APIs used by connection manager
@@ -174,6 +228,8 @@ void sfe_ipv4_destroy_all_rules_for_dev(struct net_device *dev);
 void sfe_ipv4_register_sync_rule_callback(sfe_sync_rule_callback_t callback);
 void sfe_ipv4_update_rule(struct sfe_connection_create *sic);
 void sfe_ipv4_mark_rule(struct sfe_connection_mark *mark);
+int sfe_ipv4_create_wildcard_rule(struct sfe_wildcard_rule *swr);
+int sfe_ipv4_destroy_wildcard_rule(struct sfe_wildcard_rule *swr);
 
 #ifdef SFE_SUPPORT_IPV6
 /*
@@ -0,0 +1,617 @@
+/*
+ * sfe_dump.c
+ *	Dump the shortcut forwarding engine connections and counters.
+ *
+ * Copyright (c) 2016 The Linux Foundation. All rights reserved.
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all copies.
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <netlink/genl/genl.h>
+#include <netlink/genl/ctrl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sfe_dump.h"
+
+/*
+ * How many times we restart a connection dump that raced with a hash resize.
+ */
+#define SFE_DUMP_RETRIES 3
+
+/*
+ * State for one engine being dumped.
+ */
+struct sfe_dump_engine {
+	const char *name;		/* Name used in the output */
+	const char *genl_name;		/* Generic netlink family name */
+	int af;				/* Address family */
+	struct sfe_dump_connection *conns;
+					/* Connections received so far */
+	size_t num_conns;		/* Number of entries in conns */
+	size_t max_conns;		/* Allocated size of conns */
+	struct sfe_dump_stats stats;	/* Global counters */
+	struct sfe_dump_cpu_stats *cpus;
+					/* Per-CPU counters */
+	size_t num_cpus;		/* Number of entries in cpus */
+	size_t max_cpus;		/* Allocated size of cpus */
+	struct sfe_dump_exception *exceptions;
+					/* Non-zero exception counters */
+	size_t num_exceptions;		/* Number of entries in exceptions */
+	size_t max_exceptions;		/* Allocated size of exceptions */
+	struct sfe_dump_sync_latency sync_latency;
+					/* Sync latency histogram */
+	struct sfe_dump_wildcard_rule *rules;
+					/* Wildcard rules */
+	size_t num_rules;		/* Number of entries in rules */
+	size_t max_rules;		/* Allocated size of rules */
+};
+
+static int json;
+
+/*
+ * sfe_dump_attr_copy()
+ *	Copy an attribute payload into a record.
+ *
+ * Attribute payloads are only 4 byte aligned and may be shorter or longer than
+ * the record we know about, so copy what we can and zero the rest.
+ */
+static void sfe_dump_attr_copy(void *rec, size_t size, struct nlattr *nla)
+{
+	size_t len = nla_len(nla);
+
+	memset(rec, 0, size);
+	memcpy(rec, nla_data(nla), len < size ? len : size);
+}
+
+/*
+ * sfe_dump_append()
+ *	Grow an array by one element and return the new element.
+ */
+static void *sfe_dump_append(void **array, size_t *num, size_t *max, size_t size)
+{
+	if (*num == *max) {
+		size_t new_max = *max ? *max * 2 : 64;
+		void *p = realloc(*array, new_max * size);
+
+		if (!p) {
+			return NULL;
+		}
+
+		*array = p;
+		*max = new_max;
+	}
+
+	return (char *)*array + (*num)++ * size;
+}
+
+/*
+ * sfe_dump_msg_recv()
+ *	Handle one message of a connection dump or a stats reply.
+ */
+static int sfe_dump_msg_recv(struct nl_msg *msg, void *arg)
+{
+	struct sfe_dump_engine *e = (struct sfe_dump_engine *)arg;
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+	struct nlattr *nla;
+	int rem;
+
+	nla_for_each_attr(nla, genlmsg_attrdata(nlmsg_data(nlh), SFE_DUMP_GENL_HDRSIZE),
+			  genlmsg_attrlen(nlmsg_data(nlh), SFE_DUMP_GENL_HDRSIZE), rem) {
+		void *rec;
+
+		switch (nla_type(nla)) {
+		case SFE_DUMP_A_CONNECTION:
+			rec = sfe_dump_append((void **)&e->conns, &e->num_conns, &e->max_conns,
+					      sizeof(struct sfe_dump_connection));
+			if (!rec) {
+				return NL_STOP;
+			}
+
+			sfe_dump_attr_copy(rec, sizeof(struct sfe_dump_connection), nla);
+			break;
+
+		case SFE_DUMP_A_STATS:
+			sfe_dump_attr_copy(&e->stats, sizeof(e->stats), nla);
+			break;
+
+		case SFE_DUMP_A_CPU_STATS:
+			rec = sfe_dump_append((void **)&e->cpus, &e->num_cpus, &e->max_cpus,
+					      sizeof(struct sfe_dump_cpu_stats));
+			if (!rec) {
+				return NL_STOP;
+			}
+
+			sfe_dump_attr_copy(rec, sizeof(struct sfe_dump_cpu_stats), nla);
+			break;
+
+		case SFE_DUMP_A_EXCEPTION:
+			rec = sfe_dump_append((void **)&e->exceptions, &e->num_exceptions, &e->max_exceptions,
+					      sizeof(struct sfe_dump_exception));
+			if (!rec) {
+				return NL_STOP;
+			}
+
+			sfe_dump_attr_copy(rec, sizeof(struct sfe_dump_exception), nla);
+			((struct sfe_dump_exception *)rec)->name[SFE_DUMP_EXCEPTION_NAME_LEN - 1] = '\0';
+			break;
+
+		case SFE_DUMP_A_SYNC_LATENCY:
+			sfe_dump_attr_copy(&e->sync_latency, sizeof(e->sync_latency), nla);
+			break;
+
+		case SFE_DUMP_A_WILDCARD_RULE:
+			rec = sfe_dump_append((void **)&e->rules, &e->num_rules, &e->max_rules,
+					      sizeof(struct sfe_dump_wildcard_rule));
+			if (!rec) {
+				return NL_STOP;
+			}
+
+			sfe_dump_attr_copy(rec, sizeof(struct sfe_dump_wildcard_rule), nla);
+			break;
+		}
+	}
+
+	return NL_OK;
+}
+
+/*
+ * sfe_dump_request()
+ *	Send a request to an engine and collect everything it sends back.
+ */
+static int sfe_dump_request(struct nl_sock *sock, int family_id, int cmd, int flags)
+{
+	struct nl_msg *msg;
+	int ret;
+
+	msg = nlmsg_alloc();
+	if (!msg) {
+		return -NLE_NOMEM;
+	}
+
+	if (!genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, family_id, SFE_DUMP_GENL_HDRSIZE,
+			 flags, cmd, SFE_DUMP_GENL_VERSION)) {
+		nlmsg_free(msg);
+		return -NLE_NOMEM;
+	}
+
+	ret = nl_send_auto(sock, msg);
+	nlmsg_free(msg);
+	if (ret < 0) {
+		return ret;
+	}
+
+	return nl_recvmsgs_default(sock);
+}
+
+/*
+ * sfe_dump_collect()
+ *	Fetch the connections and counters of one engine.
+ */
+static int sfe_dump_collect(struct nl_sock *sock, struct sfe_dump_engine *e)
+{
+	int family_id;
+	int tries;
+	int ret;
+
+	family_id = genl_ctrl_resolve(sock, e->genl_name);
+	if (family_id < 0) {
+		fprintf(stderr, "%s: unable to resolve family %s, is the module loaded?\n",
+			e->name, e->genl_name);
+		return family_id;
+	}
+
+	nl_socket_modify_cb(sock, NL_CB_VALID, NL_CB_CUSTOM, sfe_dump_msg_recv, e);
+
+	/*
+	 * The kernel walks its hash table a batch at a time and tells us if the
+	 * table was resized in the middle, in which case we start again.
+	 */
+	for (tries = 0; tries < SFE_DUMP_RETRIES; tries++) {
+		e->num_conns = 0;
+		ret = sfe_dump_request(sock, family_id, SFE_DUMP_C_CONNECTIONS, NLM_F_DUMP);
+		if (ret != -NLE_DUMP_INTR) {
+			break;
+		}
+	}
+
+	if (ret < 0 && ret != -NLE_DUMP_INTR) {
+		fprintf(stderr, "%s: connection dump failed: %s\n", e->name, nl_geterror(ret));
+		return ret;
+	}
+
+	ret = sfe_dump_request(sock, family_id, SFE_DUMP_C_STATS, NLM_F_REQUEST);
+	if (ret < 0) {
+		fprintf(stderr, "%s: stats request failed: %s\n", e->name, nl_geterror(ret));
+		return ret;
+	}
+
+	/*
+	 * Only the IPv4 engine has wildcard rules.
+	 */
+	if (e->af == AF_INET) {
+		ret = sfe_dump_request(sock, family_id, SFE_DUMP_C_WILDCARD_RULES, NLM_F_DUMP);
+		if (ret < 0) {
+			fprintf(stderr, "%s: wildcard rule dump failed: %s\n", e->name, nl_geterror(ret));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * sfe_dump_ifname()
+ *	Turn an interface index into a name.
+ */
+static const char *sfe_dump_ifname(unsigned int ifindex, char *buf)
+{
+	if (!if_indextoname(ifindex, buf)) {
+		snprintf(buf, IF_NAMESIZE, "if%u", ifindex);
+	}
+
+	return buf;
+}
+
+/*
+ * sfe_dump_proto()
+ *	Turn an IP protocol number into a name.
+ */
+static const char *sfe_dump_proto(unsigned int protocol, char *buf, size_t len)
+{
+	switch (protocol) {
+	case IPPROTO_TCP:
+		return "tcp";
+	case IPPROTO_UDP:
+		return "udp";
+	}
+
+	snprintf(buf, len, "%u", protocol);
+	return buf;
+}
+
+/*
+ * sfe_dump_print_table()
+ *	Print an engine's state as a table.
+ */
+static void sfe_dump_print_table(struct sfe_dump_engine *e)
+{
+	struct sfe_dump_stats *st = &e->stats;
+	size_t i;
+
+	printf("%s connections: %zu\n", e->name, e->num_conns);
+	printf("%-5s %-10s %-47s %-47s %-10s %12s %14s %12s %14s %8s %8s\n",
+	       "proto", "src_dev", "src (xlate)", "dest (xlate)", "dest_dev",
+	       "src_pkts", "src_bytes", "dest_pkts", "dest_bytes", "sync_ms", "mark");
+
+	for (i = 0; i < e->num_conns; i++) {
+		struct sfe_dump_connection *c = &e->conns[i];
+		char ip[INET6_ADDRSTRLEN];
+		char ip_xlate[INET6_ADDRSTRLEN];
+		char src[64];
+		char dest[64];
+		char src_dev[IF_NAMESIZE];
+		char dest_dev[IF_NAMESIZE];
+		char proto[8];
+
+		inet_ntop(e->af, c->src_ip, ip, sizeof(ip));
+		inet_ntop(e->af, c->src_ip_xlate, ip_xlate, sizeof(ip_xlate));
+		snprintf(src, sizeof(src), "%s:%u (%s:%u)", ip, ntohs(c->src_port),
+			 ip_xlate, ntohs(c->src_port_xlate));
+
+		inet_ntop(e->af, c->dest_ip, ip, sizeof(ip));
+		inet_ntop(e->af, c->dest_ip_xlate, ip_xlate, sizeof(ip_xlate));
+		snprintf(dest, sizeof(dest), "%s:%u (%s:%u)", ip, ntohs(c->dest_port),
+			 ip_xlate, ntohs(c->dest_port_xlate));
+
+		printf("%-5s %-10s %-47s %-47s %-10s %12llu %14llu %12llu %14llu %8llu %08x\n",
+		       sfe_dump_proto(c->protocol, proto, sizeof(proto)),
+		       sfe_dump_ifname(c->src_ifindex, src_dev), src,
+		       dest, sfe_dump_ifname(c->dest_ifindex, dest_dev),
+		       (unsigned long long)c->src_rx_packets, (unsigned long long)c->src_rx_bytes,
+		       (unsigned long long)c->dest_rx_packets, (unsigned long long)c->dest_rx_bytes,
+		       (unsigned long long)c->last_sync_msecs, c->mark);
+	}
+
+	if (e->num_rules) {
+		printf("\n%s wildcard rules: %zu\n", e->name, e->num_rules);
+		printf("%-5s %-10s %-4s %-29s %-21s %-10s %12s %14s\n",
+		       "proto", "match_dev", "side", "match", "xlate", "xmit_dev", "pkts", "bytes");
+	}
+
+	for (i = 0; i < e->num_rules; i++) {
+		struct sfe_dump_wildcard_rule *r = &e->rules[i];
+		char ip[INET6_ADDRSTRLEN];
+		char match[48];
+		char xlate[32];
+		char match_dev[IF_NAMESIZE];
+		char xmit_dev[IF_NAMESIZE];
+		char proto[8];
+
+		inet_ntop(e->af, r->ip, ip, sizeof(ip));
+		snprintf(match, sizeof(match), "%s:%u-%u", ip, ntohs(r->port_lo), ntohs(r->port_hi));
+		inet_ntop(e->af, r->ip_xlate, ip, sizeof(ip));
+		snprintf(xlate, sizeof(xlate), "%s:%u", ip, ntohs(r->port_xlate));
+
+		printf("%-5s %-10s %-4s %-29s %-21s %-10s %12llu %14llu\n",
+		       sfe_dump_proto(r->protocol, proto, sizeof(proto)),
+		       sfe_dump_ifname(r->match_ifindex, match_dev),
+		       (r->flags & SFE_DUMP_WILDCARD_F_MATCH_SRC) ? "src" : "dest",
+		       match, xlate, sfe_dump_ifname(r->xmit_ifindex, xmit_dev),
+		       (unsigned long long)r->rx_packets, (unsigned long long)r->rx_bytes);
+	}
+
+	printf("\n%s stats:\n", e->name);
+	printf("  num_connections       %u\n", st->num_connections);
+	printf("  pkts_forwarded        %llu\n", (unsigned long long)st->packets_forwarded);
+	printf("  pkts_not_forwarded    %llu\n", (unsigned long long)st->packets_not_forwarded);
+	printf("  create_requests       %llu\n", (unsigned long long)st->connection_create_requests);
+	printf("  create_collisions     %llu\n", (unsigned long long)st->connection_create_collisions);
+	printf("  destroy_requests      %llu\n", (unsigned long long)st->connection_destroy_requests);
+	printf("  destroy_misses        %llu\n", (unsigned long long)st->connection_destroy_misses);
+	printf("  flushes               %llu\n", (unsigned long long)st->connection_flushes);
+	printf("  hash_hits             %llu\n", (unsigned long long)st->connection_match_hash_hits);
+	printf("  hash_reorders         %llu\n", (unsigned long long)st->connection_match_hash_reorders);
+	printf("  cache_hits            %llu\n", (unsigned long long)st->connection_match_cache_hits);
+
+	printf("\n%s per-CPU stats:\n", e->name);
+	printf("  %-4s %14s %18s %14s %14s %14s\n", "cpu", "pkts_forwarded", "pkts_not_forwarded",
+	       "hash_hits", "hash_reorders", "cache_hits");
+	for (i = 0; i < e->num_cpus; i++) {
+		struct sfe_dump_cpu_stats *cs = &e->cpus[i];
+
+		printf("  %-4u %14llu %18llu %14llu %14llu %14llu\n", cs->cpu,
+		       (unsigned long long)cs->packets_forwarded,
+		       (unsigned long long)cs->packets_not_forwarded,
+		       (unsigned long long)cs->connection_match_hash_hits,
+		       (unsigned long long)cs->connection_match_hash_reorders,
+		       (unsigned long long)cs->connection_match_cache_hits);
+	}
+
+	printf("\n%s exceptions:\n", e->name);
+	for (i = 0; i < e->num_exceptions; i++) {
+		printf("  %-40s %llu\n", e->exceptions[i].name,
+		       (unsigned long long)e->exceptions[i].count);
+	}
+
+	printf("\n%s sync latency:\n", e->name);
+	for (i = 0; i < SFE_DUMP_SYNC_LATENCY_BUCKETS; i++) {
+		char range[32];
+
+		if (!i) {
+			snprintf(range, sizeof(range), "< 1ms");
+		} else if (i == SFE_DUMP_SYNC_LATENCY_BUCKETS - 1) {
+			snprintf(range, sizeof(range), ">= %ums", 1U << (i - 1));
+		} else {
+			snprintf(range, sizeof(range), "%u-%ums", 1U << (i - 1), (1U << i) - 1);
+		}
+
+		printf("  %-16s %llu\n", range, (unsigned long long)e->sync_latency.count[i]);
+	}
+
+	printf("\n");
+}
+
+/*
+ * sfe_dump_print_json()
+ *	Print an engine's state as a JSON object member.
+ */
+static void sfe_dump_print_json(struct sfe_dump_engine *e)
+{
+	struct sfe_dump_stats *st = &e->stats;
+	size_t i;
+
+	printf("\"%s\":{\"connections\":[", e->name);
+	for (i = 0; i < e->num_conns; i++) {
+		struct sfe_dump_connection *c = &e->conns[i];
+		char src_ip[INET6_ADDRSTRLEN];
+		char src_ip_xlate[INET6_ADDRSTRLEN];
+		char dest_ip[INET6_ADDRSTRLEN];
+		char dest_ip_xlate[INET6_ADDRSTRLEN];
+		char src_dev[IF_NAMESIZE];
+		char dest_dev[IF_NAMESIZE];
+
+		inet_ntop(e->af, c->src_ip, src_ip, sizeof(src_ip));
+		inet_ntop(e->af, c->src_ip_xlate, src_ip_xlate, sizeof(src_ip_xlate));
+		inet_ntop(e->af, c->dest_ip, dest_ip, sizeof(dest_ip));
+		inet_ntop(e->af, c->dest_ip_xlate, dest_ip_xlate, sizeof(dest_ip_xlate));
+
+		printf("%s{\"protocol\":%u,"
+		       "\"src_dev\":\"%s\",\"src_ip\":\"%s\",\"src_ip_xlate\":\"%s\","
+		       "\"src_port\":%u,\"src_port_xlate\":%u,"
+		       "\"src_priority\":%u,\"src_dscp\":%u,"
+		       "\"src_rx_pkts\":%llu,\"src_rx_bytes\":%llu,"
+		       "\"dest_dev\":\"%s\",\"dest_ip\":\"%s\",\"dest_ip_xlate\":\"%s\","
+		       "\"dest_port\":%u,\"dest_port_xlate\":%u,"
+		       "\"dest_priority\":%u,\"dest_dscp\":%u,"
+		       "\"dest_rx_pkts\":%llu,\"dest_rx_bytes\":%llu,"
+		       "\"last_sync_ms\":%llu,\"mark\":%u}",
+		       i ? "," : "", c->protocol,
+		       sfe_dump_ifname(c->src_ifindex, src_dev), src_ip, src_ip_xlate,
+		       ntohs(c->src_port), ntohs(c->src_port_xlate),
+		       c->src_priority, c->src_dscp,
+		       (unsigned long long)c->src_rx_packets, (unsigned long long)c->src_rx_bytes,
+		       sfe_dump_ifname(c->dest_ifindex, dest_dev), dest_ip, dest_ip_xlate,
+		       ntohs(c->dest_port), ntohs(c->dest_port_xlate),
+		       c->dest_priority, c->dest_dscp,
+		       (unsigned long long)c->dest_rx_packets, (unsigned long long)c->dest_rx_bytes,
+		       (unsigned long long)c->last_sync_msecs, c->mark);
+	}
+
+	printf("],\"wildcard_rules\":[");
+	for (i = 0; i < e->num_rules; i++) {
+		struct sfe_dump_wildcard_rule *r = &e->rules[i];
+		char ip[INET6_ADDRSTRLEN];
+		char ip_xlate[INET6_ADDRSTRLEN];
+		char match_dev[IF_NAMESIZE];
+		char xmit_dev[IF_NAMESIZE];
+
+		inet_ntop(e->af, r->ip, ip, sizeof(ip));
+		inet_ntop(e->af, r->ip_xlate, ip_xlate, sizeof(ip_xlate));
+
+		printf("%s{\"protocol\":%u,\"match_dev\":\"%s\",\"match_src\":%s,"
+		       "\"ip\":\"%s\",\"port_lo\":%u,\"port_hi\":%u,"
+		       "\"ip_xlate\":\"%s\",\"port_xlate\":%u,\"xmit_dev\":\"%s\","
+		       "\"mark\":%u,\"rx_pkts\":%llu,\"rx_bytes\":%llu}",
+		       i ? "," : "", r->protocol, sfe_dump_ifname(r->match_ifindex, match_dev),
+		       (r->flags & SFE_DUMP_WILDCARD_F_MATCH_SRC) ? "true" : "false",
+		       ip, ntohs(r->port_lo), ntohs(r->port_hi), ip_xlate, ntohs(r->port_xlate),
+		       sfe_dump_ifname(r->xmit_ifindex, xmit_dev), r->mark,
+		       (unsigned long long)r->rx_packets, (unsigned long long)r->rx_bytes);
+	}
+
+	printf("],\"stats\":{\"num_connections\":%u,"
+	       "\"pkts_forwarded\":%llu,\"pkts_not_forwarded\":%llu,"
+	       "\"create_requests\":%llu,\"create_collisions\":%llu,"
+	       "\"destroy_requests\":%llu,\"destroy_misses\":%llu,"
+	       "\"flushes\":%llu,\"hash_hits\":%llu,\"hash_reorders\":%llu,"
+	       "\"cache_hits\":%llu}",
+	       st->num_connections,
+	       (unsigned long long)st->packets_forwarded,
+	       (unsigned long long)st->packets_not_forwarded,
+	       (unsigned long long)st->connection_create_requests,
+	       (unsigned long long)st->connection_create_collisions,
+	       (unsigned long long)st->connection_destroy_requests,
+	       (unsigned long long)st->connection_destroy_misses,
+	       (unsigned long long)st->connection_flushes,
+	       (unsigned long long)st->connection_match_hash_hits,
+	       (unsigned long long)st->connection_match_hash_reorders,
+	       (unsigned long long)st->connection_match_cache_hits);
+
+	printf(",\"cpu_stats\":[");
+	for (i = 0; i < e->num_cpus; i++) {
+		struct sfe_dump_cpu_stats *cs = &e->cpus[i];
+
+		printf("%s{\"cpu\":%u,\"pkts_forwarded\":%llu,\"pkts_not_forwarded\":%llu,"
+		       "\"hash_hits\":%llu,\"hash_reorders\":%llu,\"cache_hits\":%llu}",
+		       i ? "," : "", cs->cpu,
+		       (unsigned long long)cs->packets_forwarded,
+		       (unsigned long long)cs->packets_not_forwarded,
+		       (unsigned long long)cs->connection_match_hash_hits,
+		       (unsigned long long)cs->connection_match_hash_reorders,
+		       (unsigned long long)cs->connection_match_cache_hits);
+	}
+
+	printf("],\"exceptions\":{");
+	for (i = 0; i < e->num_exceptions; i++) {
+		printf("%s\"%s\":%llu", i ? "," : "", e->exceptions[i].name,
+		       (unsigned long long)e->exceptions[i].count);
+	}
+
+	printf("},\"sync_latency\":[");
+	for (i = 0; i < SFE_DUMP_SYNC_LATENCY_BUCKETS; i++) {
+		printf("%s%llu", i ? "," : "", (unsigned long long)e->sync_latency.count[i]);
+	}
+
+	printf("]}");
+}
+
+/*
+ * sfe_dump_usage()
+ */
+static void sfe_dump_usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-j] [ipv4|ipv6]\n", prog);
+	fprintf(stderr, "  -j  print JSON rather than a table\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct sfe_dump_engine engines[] = {
+		{ .name = "ipv4", .genl_name = SFE_DUMP_GENL_NAME_IPV4, .af = AF_INET },
+		{ .name = "ipv6", .genl_name = SFE_DUMP_GENL_NAME_IPV6, .af = AF_INET6 },
+	};
+	const char *only = NULL;
+	struct nl_sock *sock;
+	int printed = 0;
+	int failed = 0;
+	int opt;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "jh")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = 1;
+			break;
+		default:
+			sfe_dump_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind < argc) {
+		only = argv[optind];
+		if (strcmp(only, "ipv4") && strcmp(only, "ipv6")) {
+			sfe_dump_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	sock = nl_socket_alloc();
+	if (!sock) {
+		fprintf(stderr, "Unable to allocate socket\n");
+		return 1;
+	}
+
+	if (genl_connect(sock) < 0) {
+		fprintf(stderr, "Unable to connect generic netlink socket\n");
+		nl_socket_free(sock);
+		return 1;
+	}
+
+	/*
+	 * Connection dumps can be big so give ourselves a large receive buffer.
+	 * Errors are still reported without asking for an ACK to every request.
+	 */
+	nl_socket_set_buffer_size(sock, 1024 * 1024, 0);
+	nl_socket_disable_auto_ack(sock);
+
+	if (json) {
+		printf("{");
+	}
+
+	for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+		struct sfe_dump_engine *e = &engines[i];
+
+		if (only && strcmp(only, e->name)) {
+			continue;
+		}
+
+		if (sfe_dump_collect(sock, e) < 0) {
+			failed = 1;
+		} else if (json) {
+			printf("%s", printed ? "," : "");
+			sfe_dump_print_json(e);
+			printed = 1;
+		} else {
+			sfe_dump_print_table(e);
+		}
+
+		free(e->conns);
+		free(e->cpus);
+		free(e->exceptions);
+		free(e->rules);
+	}
+
+	if (json) {
+		printf("}\n");
+	}
+
+	nl_close(sock);
+	nl_socket_free(sock);
+	return failed;
+}
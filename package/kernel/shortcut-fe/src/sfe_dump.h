@@ -0,0 +1,212 @@
+/*
+ * sfe_dump.h
+ *	Shortcut forwarding engine - generic netlink state dump interface.
+ *
+ * This header is shared between the kernel modules and user space tools.
+ *
+ * Copyright (c) 2013-2016 The Linux Foundation. All rights reserved.
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all copies.
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <linux/types.h>
+
+/*
+ * Each of the IPv4 and IPv6 engines registers its own family.  Both use the
+ * same commands, attributes and record layouts.
+ */
+#define SFE_DUMP_GENL_VERSION	(1)
+#define SFE_DUMP_GENL_NAME_IPV4	"SFE_IPV4"
+#define SFE_DUMP_GENL_NAME_IPV6	"SFE_IPV6"
+#define SFE_DUMP_GENL_HDRSIZE	(0)
+
+enum {
+	SFE_DUMP_A_UNSPEC,
+	SFE_DUMP_A_CONNECTION,		/* struct sfe_dump_connection */
+	SFE_DUMP_A_STATS,		/* struct sfe_dump_stats */
+	SFE_DUMP_A_CPU_STATS,		/* struct sfe_dump_cpu_stats, one per possible CPU */
+	SFE_DUMP_A_EXCEPTION,		/* struct sfe_dump_exception, one per non-zero exception */
+	SFE_DUMP_A_SYNC_LATENCY,	/* struct sfe_dump_sync_latency */
+	SFE_DUMP_A_WILDCARD_RULE,	/* struct sfe_dump_wildcard_rule */
+	__SFE_DUMP_A_MAX,
+};
+
+#define SFE_DUMP_A_MAX (__SFE_DUMP_A_MAX - 1)
+
+enum {
+	SFE_DUMP_C_UNSPEC,
+	SFE_DUMP_C_CONNECTIONS,		/* Dump request, one message per connection */
+	SFE_DUMP_C_STATS,		/* Global, per-CPU and exception counters */
+	SFE_DUMP_C_WILDCARD_RULES,	/* Dump request, one message per wildcard rule */
+	SFE_DUMP_C_WILDCARD_ADD,	/* Add the wildcard rule given in SFE_DUMP_A_WILDCARD_RULE */
+	SFE_DUMP_C_WILDCARD_DEL,	/* Delete the wildcard rule with the same match */
+	SFE_DUMP_C_CONNECTION_ACCOUNT,	/* Add packets forwarded elsewhere to a connection's counts */
+	__SFE_DUMP_C_MAX,
+};
+
+#define SFE_DUMP_C_MAX (__SFE_DUMP_C_MAX - 1)
+
+/*
+ * Connection direction flags.
+ */
+#define SFE_DUMP_CONNECTION_F_ETH_HDR		0x1
+					/* Packets are sent with an Ethernet header using the xmit MAC addresses */
+#define SFE_DUMP_CONNECTION_F_ENCAP		0x2
+					/* Packets also get a VLAN tag or PPPoE header */
+#define SFE_DUMP_CONNECTION_F_DSCP_REMARK	0x4
+					/* The DSCP of packets is changed */
+#define SFE_DUMP_CONNECTION_F_NO_SEQ_CHECK	0x8
+					/* TCP sequence numbers are not checked */
+
+/*
+ * A connection.  IPv4 addresses only use the first word of each address.
+ * Addresses and ports are in network byte order.
+ *
+ * SFE_DUMP_C_CONNECTION_ACCOUNT takes one of these too.  Only the protocol,
+ * the pre-translation addresses and ports and the rx counts, which are added
+ * to the connection's, are used.
+ */
+struct sfe_dump_connection {
+	__be32 src_ip[4];		/* Src IP addr pre-translation */
+	__be32 src_ip_xlate[4];		/* Src IP addr post-translation */
+	__be32 dest_ip[4];		/* Dest IP addr pre-translation */
+	__be32 dest_ip_xlate[4];	/* Dest IP addr post-translation */
+	__be16 src_port;		/* Src port pre-translation */
+	__be16 src_port_xlate;		/* Src port post-translation */
+	__be16 dest_port;		/* Dest port pre-translation */
+	__be16 dest_port_xlate;		/* Dest port post-translation */
+	__u32 src_ifindex;		/* Original direction source device */
+	__u32 dest_ifindex;		/* Reply direction source device */
+	__u32 mark;			/* mark for outgoing packet */
+	__u32 src_priority;		/* Original direction skb priority */
+	__u32 dest_priority;		/* Reply direction skb priority */
+	__u8 protocol;			/* IP protocol number */
+	__u8 src_dscp;			/* Original direction DSCP */
+	__u8 dest_dscp;			/* Reply direction DSCP */
+	__u8 reserved;
+	__u64 src_rx_packets;		/* Packets received in the original direction */
+	__u64 src_rx_bytes;		/* Bytes received in the original direction */
+	__u64 dest_rx_packets;		/* Packets received in the reply direction */
+	__u64 dest_rx_bytes;		/* Bytes received in the reply direction */
+	__u64 last_sync_msecs;		/* Time since the connection was last synced */
+	__u32 src_xmit_ifindex;		/* Original direction transmit device */
+	__u32 dest_xmit_ifindex;	/* Reply direction transmit device */
+	__u32 src_xmit_mtu;		/* Original direction transmit MTU */
+	__u32 dest_xmit_mtu;		/* Reply direction transmit MTU */
+	__u32 src_flags;		/* Original direction SFE_DUMP_CONNECTION_F_* */
+	__u32 dest_flags;		/* Reply direction SFE_DUMP_CONNECTION_F_* */
+	__u8 src_xmit_src_mac[6];	/* Original direction source MAC address */
+	__u8 src_xmit_dest_mac[6];	/* Original direction destination MAC address */
+	__u8 dest_xmit_src_mac[6];	/* Reply direction source MAC address */
+	__u8 dest_xmit_dest_mac[6];	/* Reply direction destination MAC address */
+};
+
+/*
+ * Global counters.
+ */
+struct sfe_dump_stats {
+	__u32 num_connections;		/* Number of connections */
+	__u32 reserved;
+	__u64 packets_forwarded;	/* Number of packets forwarded */
+	__u64 packets_not_forwarded;	/* Number of packets not forwarded */
+	__u64 connection_create_requests;
+					/* Number of connection create requests */
+	__u64 connection_create_collisions;
+					/* Number of connection create requests that collided with existing entries */
+	__u64 connection_destroy_requests;
+					/* Number of connection destroy requests */
+	__u64 connection_destroy_misses;
+					/* Number of connection destroy requests that missed */
+	__u64 connection_flushes;	/* Number of connection flushes */
+	__u64 connection_match_hash_hits;
+					/* Number of connection match hash hits */
+	__u64 connection_match_hash_reorders;
+					/* Number of connection match hash hits found beyond the head of a chain */
+	__u64 connection_match_cache_hits;
+					/* Number of connection matches found in the flow hash caches */
+};
+
+/*
+ * Counters kept by one CPU's forwarding path.
+ */
+struct sfe_dump_cpu_stats {
+	__u32 cpu;			/* CPU number */
+	__u32 reserved;
+	__u64 packets_forwarded;	/* Number of packets forwarded */
+	__u64 connection_match_hash_hits;
+					/* Number of connection match hash hits */
+	__u64 connection_match_hash_reorders;
+					/* Number of connection match hash hits found beyond the head of a chain */
+	__u64 packets_not_forwarded;	/* Number of packets not forwarded */
+	__u64 connection_match_cache_hits;
+					/* Number of connection matches found in the flow hash cache */
+};
+
+#define SFE_DUMP_EXCEPTION_NAME_LEN 48
+
+/*
+ * An exception event counter.
+ */
+struct sfe_dump_exception {
+	__u64 count;			/* Number of times the exception has happened */
+	char name[SFE_DUMP_EXCEPTION_NAME_LEN];
+					/* Exception name */
+};
+
+#define SFE_DUMP_SYNC_LATENCY_BUCKETS 16
+
+/*
+ * How long connections waited between becoming active and being synced.
+ * Bucket 0 counts waits of under a millisecond and bucket n, waits of 2^(n - 1)
+ * to 2^n - 1 milliseconds.  The last bucket also counts anything longer.
+ */
+struct sfe_dump_sync_latency {
+	__u64 count[SFE_DUMP_SYNC_LATENCY_BUCKETS];
+					/* Number of connections synced after each wait */
+};
+
+/*
+ * Wildcard rule flags.
+ */
+#define SFE_DUMP_WILDCARD_F_MATCH_SRC		0x1
+					/* Match the source rather than the destination address and ports */
+#define SFE_DUMP_WILDCARD_F_REMARK_PRIORITY	0x2
+					/* Set the skb priority of forwarded packets */
+#define SFE_DUMP_WILDCARD_F_REMARK_DSCP		0x4
+					/* Set the DSCP of forwarded packets */
+
+/*
+ * A wildcard rule.  Only IPv4 has wildcard rules so only the first word of each
+ * address is used.  Addresses and ports are in network byte order.  A zero
+ * address matches any address, and a zero translated address or port is left
+ * unchanged.  The packet counts are ignored when adding or deleting a rule,
+ * and deleting one only needs the fields that make up its match.
+ */
+struct sfe_dump_wildcard_rule {
+	__be32 ip[4];			/* Address to match */
+	__be32 ip_xlate[4];		/* Address after translation */
+	__be16 port_lo;			/* First port to match */
+	__be16 port_hi;			/* Last port to match */
+	__be16 port_xlate;		/* Port that port_lo translates to */
+	__u8 protocol;			/* IP protocol number */
+	__u8 dscp;			/* DSCP to set */
+	__u32 flags;			/* SFE_DUMP_WILDCARD_F_* */
+	__u32 match_ifindex;		/* Device packets are received on */
+	__u32 xmit_ifindex;		/* Device packets are transmitted on */
+	__u32 xmit_mtu;			/* MTU to use on the transmit device, 0 for its own */
+	__u32 mark;			/* mark for outgoing packet */
+	__u32 priority;			/* skb priority to set */
+	__u8 xmit_src_mac[6];		/* Source MAC address to transmit with */
+	__u8 xmit_dest_mac[6];		/* Destination MAC address to transmit with */
+	__u32 reserved;
+	__u64 rx_packets;		/* Packets forwarded by the rule */
+	__u64 rx_bytes;			/* Bytes forwarded by the rule */
+};
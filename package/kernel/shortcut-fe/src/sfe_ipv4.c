@@ -21,10 +21,26 @@
 #include <linux/icmp.h>
 #include <net/tcp.h>
 #include <linux/etherdevice.h>
+#include <linux/if_vlan.h>
+#include <linux/if_pppox.h>
+#include <linux/ppp_defs.h>
 #include <linux/version.h>
+#include <linux/percpu.h>
+#include <linux/rculist.h>
+#include <linux/rculist_nulls.h>
+#include <linux/llist.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
+#include <linux/random.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <net/genetlink.h>
+#include <linux/netfilter/nf_conntrack_common.h>
 
 #include "sfe.h"
 #include "sfe_cm.h"
+#include "sfe_dump.h"
 
 /*
  * By default Linux IP header and transport layer header structures are
@@ -171,43 +187,75 @@ struct sfe_ipv4_tcp_connection_match {
 					/* remark priority of SKB */
 #define SFE_IPV4_CONNECTION_MATCH_FLAG_DSCP_REMARK (1<<6)
 					/* remark DSCP of packet */
+#define SFE_IPV4_CONNECTION_MATCH_FLAG_VLAN_TAG (1<<7)
+					/* Push a VLAN tag on transmit */
+#define SFE_IPV4_CONNECTION_MATCH_FLAG_PPPOE_ENCAP (1<<8)
+					/* Add a PPPoE header on transmit */
 
 /*
  * IPv4 connection matching structure.
  */
 struct sfe_ipv4_connection_match {
 	/*
-	 * References to other objects.
+	 * Fast path state.  Everything here is read, and never written, by the
+	 * forwarding path, so it is packed together at the start of the match to
+	 * keep the hash lookup and the packet rewrite within one 64-byte cache
+	 * line on both 32-bit and 64-bit systems (see sfe_ipv4_init()).
 	 */
-	struct sfe_ipv4_connection_match *next;
-	struct sfe_ipv4_connection_match *prev;
-	struct sfe_ipv4_connection *connection;
-	struct sfe_ipv4_connection_match *counter_match;
-					/* Matches the flow in the opposite direction as the one in *connection */
-	struct sfe_ipv4_connection_match *active_next;
-	struct sfe_ipv4_connection_match *active_prev;
-	bool active;			/* Flag to indicate if we're on the active list */
+	struct hlist_nulls_node hnode;	/* Connection match hash chain linkage (RCU protected) */
+	struct net_device *match_dev;	/* Network device */
 
 	/*
 	 * Characteristics that identify flows that match this rule.
 	 */
-	struct net_device *match_dev;	/* Network device */
-	u8 match_protocol;		/* Protocol */
 	__be32 match_src_ip;		/* Source IP address */
 	__be32 match_dest_ip;		/* Destination IP address */
 	__be16 match_src_port;		/* Source port/connection ident */
 	__be16 match_dest_port;		/* Destination port/connection ident */
+	u8 match_protocol;		/* Protocol */
+	unsigned short int xmit_dev_mtu;
+					/* Interface MTU, fills the hole after match_protocol */
 
 	/*
 	 * Control the operations of the match.
 	 */
 	u32 flags;			/* Bit flags */
-#ifdef CONFIG_NF_FLOW_COOKIE
-	u32 flow_cookie;		/* used flow cookie, for debug */
-#endif
-#ifdef CONFIG_XFRM
-	u32 flow_accel;             /* The flow accelerated or not */
-#endif
+
+	/*
+	 * Packet translation information.
+	 */
+	__be32 xlate_src_ip;		/* Address after source translation */
+	__be32 xlate_dest_ip;		/* Address after destination translation */
+	__be16 xlate_src_port;		/* Port/connection ident after source translation */
+	__be16 xlate_dest_port;		/* Port/connection ident after destination translation */
+	u16 xlate_src_csum_adjustment;
+					/* Transport layer checksum adjustment after source translation */
+	u16 xlate_dest_csum_adjustment;
+					/* Transport layer checksum adjustment after destination translation */
+
+
+	/*
+	 * Stats recorded in a sync period. These stats will be added to
+	 * rx_packet_count64/rx_byte_count64 after a sync period.
+	 *
+	 * These are written for every packet, so they start a new cache line
+	 * rather than sharing one with the read-mostly state above.
+	 */
+	atomic_t rx_packet_count ____cacheline_aligned_in_smp;
+	atomic_t rx_byte_count;
+
+	/*
+	 * Packet transmit information.  This is only needed once the packet
+	 * has been accepted, so it shares a cache line with the counters above,
+	 * which we write for every packet anyway.
+	 */
+	struct net_device *xmit_dev;	/* Network device on which to transmit */
+	u16 xmit_dest_mac[ETH_ALEN / 2];
+					/* Destination MAC address to use when forwarding */
+	u16 xmit_src_mac[ETH_ALEN / 2];
+					/* Source MAC address to use when forwarding */
+	u16 xmit_vlan_tag;		/* VLAN ID to push */
+	__be16 xmit_pppoe_session_id;	/* PPPoE session ID */
 
 	/*
 	 * Connection state that we track once we match.
@@ -215,27 +263,19 @@ struct sfe_ipv4_connection_match {
 	union {				/* Protocol-specific state */
 		struct sfe_ipv4_tcp_connection_match tcp;
 	} protocol_state;
+
 	/*
-	 * Stats recorded in a sync period. These stats will be added to
-	 * rx_packet_count64/rx_byte_count64 after a sync period.
+	 * References to other objects.
 	 */
-	u32 rx_packet_count;
-	u32 rx_byte_count;
+	struct sfe_ipv4_connection *connection;
+	struct sfe_ipv4_connection_match *counter_match;
+					/* Matches the flow in the opposite direction as the one in connection */
 
 	/*
-	 * Packet translation information.
+	 * Less commonly used packet translation information.
 	 */
-	__be32 xlate_src_ip;		/* Address after source translation */
-	__be16 xlate_src_port;	/* Port/connection ident after source translation */
-	u16 xlate_src_csum_adjustment;
-					/* Transport layer checksum adjustment after source translation */
 	u16 xlate_src_partial_csum_adjustment;
 					/* Transport layer pseudo header checksum adjustment after source translation */
-
-	__be32 xlate_dest_ip;		/* Address after destination translation */
-	__be16 xlate_dest_port;	/* Port/connection ident after destination translation */
-	u16 xlate_dest_csum_adjustment;
-					/* Transport layer checksum adjustment after destination translation */
 	u16 xlate_dest_partial_csum_adjustment;
 					/* Transport layer pseudo header checksum adjustment after destination translation */
 
@@ -245,16 +285,21 @@ struct sfe_ipv4_connection_match {
 	u32 priority;
 	u32 dscp;
 
+	u32 flow_hash;			/* skb->hash this match is held under in the flow hash caches, 0 if none */
+#ifdef CONFIG_NF_FLOW_COOKIE
+	u32 flow_cookie;		/* used flow cookie, for debug */
+#endif
+#ifdef CONFIG_XFRM
+	u32 flow_accel;			/* The flow accelerated or not */
+#endif
+
 	/*
-	 * Packet transmit information.
+	 * Active list linkage, only used under the lock.
 	 */
-	struct net_device *xmit_dev;	/* Network device on which to transmit */
-	unsigned short int xmit_dev_mtu;
-					/* Interface MTU */
-	u16 xmit_dest_mac[ETH_ALEN / 2];
-					/* Destination MAC address to use when forwarding */
-	u16 xmit_src_mac[ETH_ALEN / 2];
-					/* Source MAC address to use when forwarding */
+	struct sfe_ipv4_connection_match *active_next;
+	struct sfe_ipv4_connection_match *active_prev;
+	bool active;			/* Flag to indicate if we're on the active list */
+	unsigned long active_jiffies;	/* When we were put on the active list */
 
 	/*
 	 * Summary stats.
@@ -267,10 +312,7 @@ struct sfe_ipv4_connection_match {
  * Per-connection data structure.
  */
 struct sfe_ipv4_connection {
-	struct sfe_ipv4_connection *next;
-					/* Pointer to the next entry in a hash chain */
-	struct sfe_ipv4_connection *prev;
-					/* Pointer to the previous entry in a hash chain */
+	struct hlist_nulls_node hnode;	/* Connection hash chain linkage */
 	int protocol;			/* IP protocol number */
 	__be32 src_ip;			/* Src IP addr pre-translation */
 	__be32 src_ip_xlate;		/* Src IP addr post-translation */
@@ -294,14 +336,57 @@ struct sfe_ipv4_connection {
 					/* Pointer to the previous entry in the list of all connections */
 	u32 mark;			/* mark for outgoing packet */
 	u32 debug_read_seq;		/* sequence number for debug dump */
+	bool removed;			/* Indicates the connection has been removed from the hash tables */
+	struct nf_conntrack *ct;	/* Connection manager's conntrack entry, which we hold, or NULL */
+	struct rcu_head rcu;		/* Delayed free once lockless readers are done with us */
+};
+
+/*
+ * A connection and its two matches are allocated together as one object.
+ */
+struct sfe_ipv4_connection_object {
+	struct sfe_ipv4_connection_match original_match;
+					/* Original direction matching structure */
+	struct sfe_ipv4_connection_match reply_match;
+					/* Reply direction matching structure */
+	struct sfe_ipv4_connection conn;
+	struct llist_node pool_node;	/* Linkage on the free pool */
 };
 
+/*
+ * Connection allocation limits.
+ */
+#define SFE_IPV4_MAX_CONNECTIONS 0
+#define SFE_IPV4_CONNECTION_POOL_SIZE 256
+#define SFE_IPV4_CONNECTION_EVICT_IDLE (2 * HZ)
+
 /*
  * IPv4 connections and hash table size information.
  */
 #define SFE_IPV4_CONNECTION_HASH_SHIFT 12
 #define SFE_IPV4_CONNECTION_HASH_SIZE (1 << SFE_IPV4_CONNECTION_HASH_SHIFT)
-#define SFE_IPV4_CONNECTION_HASH_MASK (SFE_IPV4_CONNECTION_HASH_SIZE - 1)
+#define SFE_IPV4_CONNECTION_HASH_SHIFT_MIN 6
+#define SFE_IPV4_CONNECTION_HASH_SHIFT_MAX 20
+#define SFE_IPV4_HASH_RESIZE_BATCH 256	/* Buckets moved per lock hold when resizing */
+
+/*
+ * A connection or connection match hash table.  Tables never change size; when
+ * the load factor goes out of range a future table is allocated and entries are
+ * moved across to it a batch of buckets at a time, rhashtable style.  Until the
+ * old table is empty a lookup that misses in it goes on to the future table.
+ *
+ * Every chain ends in a nulls marker naming its table and bucket, so a lockless
+ * reader can tell when an entry was moved to another chain under it.
+ */
+struct sfe_ipv4_hash_table {
+	unsigned int shift;		/* Number of buckets is 1 << shift */
+	u32 seed;			/* Random seed for the hash function */
+	unsigned int nulls;		/* Low bit of our nulls markers, never the same as the future table's */
+	struct sfe_ipv4_hash_table __rcu *future;
+					/* Table we are being resized into, or NULL */
+	struct hlist_nulls_head buckets[];
+					/* Hash chains */
+};
 
 #ifdef CONFIG_NF_FLOW_COOKIE
 #define SFE_FLOW_COOKIE_SIZE 2048
@@ -351,6 +436,9 @@ enum sfe_ipv4_exception_events {
 	SFE_IPV4_EXCEPTION_EVENT_IP_OPTIONS_INCOMPLETE,
 	SFE_IPV4_EXCEPTION_EVENT_UNHANDLED_PROTOCOL,
 	SFE_IPV4_EXCEPTION_EVENT_CLONED_SKB_UNSHARE_ERROR,
+	SFE_IPV4_EXCEPTION_EVENT_PPPOE_NEEDS_SLOW_PATH,
+	SFE_IPV4_EXCEPTION_EVENT_CONNECTION_NO_MEMORY,
+	SFE_IPV4_EXCEPTION_EVENT_CONNECTION_LIMIT,
 	SFE_IPV4_EXCEPTION_EVENT_LAST
 };
 
@@ -391,7 +479,122 @@ static char *sfe_ipv4_exception_events_string[SFE_IPV4_EXCEPTION_EVENT_LAST] = {
 	"DATAGRAM_INCOMPLETE",
 	"IP_OPTIONS_INCOMPLETE",
 	"UNHANDLED_PROTOCOL",
-	"CLONED_SKB_UNSHARE_ERROR"
+	"CLONED_SKB_UNSHARE_ERROR",
+	"PPPOE_NEEDS_SLOW_PATH",
+	"CONNECTION_NO_MEMORY",
+	"CONNECTION_LIMIT"
+};
+
+/*
+ * Per-CPU statistics for the lockless forwarding path.
+ */
+struct sfe_ipv4_stats {
+	u64 connection_match_hash_hits64;
+					/* Number of IPv4 connection match hash hits */
+	u64 connection_match_hash_reorders64;
+					/* Number of IPv4 connection match hash hits found beyond the head of a chain */
+	u64 connection_match_cache_hits64;
+					/* Number of IPv4 connection matches found in the flow hash cache */
+	u64 packets_forwarded64;	/* Number of IPv4 packets forwarded */
+	u64 packets_not_forwarded64;	/* Number of IPv4 packets not forwarded */
+	u64 exception_events64[SFE_IPV4_EXCEPTION_EVENT_LAST];
+					/* Number of IPv4 packets that took each exception path */
+	u64 sync_latency64[SFE_DUMP_SYNC_LATENCY_BUCKETS];
+					/* Number of IPv4 connection matches synced, by how long they waited */
+};
+
+/*
+ * Every active connection is synced at least once per SFE_IPV4_SYNC_PERIOD, by
+ * sync timers that run every SFE_IPV4_SYNC_INTERVAL on each CPU.  Each timer hands
+ * up to SFE_IPV4_SYNC_BATCH_SIZE connections to the sync callback at a time.
+ */
+#define SFE_IPV4_SYNC_PERIOD (HZ / 2)
+#define SFE_IPV4_SYNC_INTERVAL ((HZ + 99) / 100)
+#define SFE_IPV4_SYNC_BATCH_SIZE 16
+
+/*
+ * Per-CPU periodic sync state.
+ */
+struct sfe_ipv4_sync_state {
+	struct timer_list timer;	/* Timer used for periodic sync ops */
+	bool running;			/* Flag to indicate if the timer has been started */
+	struct sfe_connection_sync sis[SFE_IPV4_SYNC_BATCH_SIZE];
+					/* Sync messages passed to the sync callback in one call */
+};
+
+/*
+ * Per-CPU cache of recently used connection matches, indexed by skb->hash.
+ */
+#define SFE_IPV4_FLOW_HASH_CACHE_SHIFT 8
+#define SFE_IPV4_FLOW_HASH_CACHE_SIZE (1 << SFE_IPV4_FLOW_HASH_CACHE_SHIFT)
+#define SFE_IPV4_FLOW_HASH_CACHE_MASK (SFE_IPV4_FLOW_HASH_CACHE_SIZE - 1)
+
+struct sfe_ipv4_flow_hash_cache_entry {
+	u32 hash;			/* skb->hash of the packets that hit this entry */
+	struct sfe_ipv4_connection_match *cm;
+					/* Connection match, or NULL if the entry is empty */
+};
+
+struct sfe_ipv4_flow_hash_cache {
+	struct sfe_ipv4_flow_hash_cache_entry entries[SFE_IPV4_FLOW_HASH_CACHE_SIZE];
+};
+
+/*
+ * Wildcard rules.  These are kept on a short list that is only searched for
+ * packets that don't match a connection.
+ */
+#define SFE_IPV4_WILDCARD_RULES_MAX 64
+
+struct sfe_ipv4_wildcard_stats {
+	u64 rx_packets;			/* Number of packets forwarded by the rule */
+	u64 rx_bytes;			/* Number of bytes forwarded by the rule */
+};
+
+struct sfe_ipv4_wildcard_rule {
+	struct list_head list;		/* Entry in the list of wildcard rules */
+	struct rcu_head rcu;		/* RCU head used to free the rule */
+
+	/*
+	 * Packet matching information.
+	 */
+	struct net_device *match_dev;	/* Network device */
+	u8 match_protocol;		/* Protocol */
+	bool match_src;			/* Match the source rather than the destination address and port */
+	__be32 match_ip;		/* Address to match, 0 to match any */
+	u16 match_port_lo;		/* First port of the range to match (host order) */
+	u16 match_port_hi;		/* Last port of the range to match (host order) */
+
+	/*
+	 * Control the operations of the match.
+	 */
+	u32 flags;			/* Bit flags, as for a connection match */
+
+	/*
+	 * Packet translation information.
+	 */
+	__be32 xlate_ip;		/* Address after translation, 0 to leave it unchanged */
+	u16 xlate_port;			/* Port that match_port_lo translates to (host order), 0 to leave ports unchanged */
+
+	/*
+	 * QoS information
+	 */
+	u32 priority;
+	u32 dscp;
+	u32 mark;			/* mark for outgoing packet */
+
+	/*
+	 * Packet transmit information.
+	 */
+	struct net_device *xmit_dev;	/* Network device on which to transmit */
+	unsigned short int xmit_dev_mtu;
+					/* Interface MTU */
+	u16 xmit_dest_mac[ETH_ALEN / 2];
+					/* Destination MAC address to use when forwarding */
+	u16 xmit_src_mac[ETH_ALEN / 2];
+					/* Source MAC address to use when forwarding */
+
+	struct sfe_ipv4_wildcard_stats __percpu *stats;
+					/* Per-CPU packet and byte counts */
 };
 
 /*
@@ -408,13 +611,29 @@ struct sfe_ipv4 {
 	struct sfe_ipv4_connection *all_connections_tail;
 					/* Tail of the list of all connections */
 	unsigned int num_connections;	/* Number of connections */
-	struct timer_list timer;	/* Timer used for periodic sync ops */
+	unsigned int num_active;	/* Number of connection matches on the active list */
+	unsigned int num_sync_cpus;	/* Number of CPUs running a periodic sync timer */
 	sfe_sync_rule_callback_t __rcu sync_rule_callback;
 					/* Callback function registered by a connection manager for stats syncing */
-	struct sfe_ipv4_connection *conn_hash[SFE_IPV4_CONNECTION_HASH_SIZE];
+	struct sfe_ipv4_hash_table *conn_hash;
 					/* Connection hash table */
-	struct sfe_ipv4_connection_match *conn_match_hash[SFE_IPV4_CONNECTION_HASH_SIZE];
-					/* Connection match hash table */
+	struct sfe_ipv4_hash_table __rcu *conn_match_hash;
+					/* Connection match hash table (RCU protected) */
+	unsigned int hash_shift_min;	/* Smallest size the hash tables will shrink to */
+	unsigned int hash_resize_seq;	/* Bumped whenever connections move between hash tables */
+	struct work_struct hash_resize_work;
+					/* Work item used to resize the hash tables */
+	struct sfe_ipv4_stats __percpu *stats_pcpu;
+					/* Per-CPU statistics for the forwarding path */
+	struct kmem_cache *connection_cache;
+					/* Cache line aligned allocator for connection objects */
+	struct llist_head connection_pool;
+					/* Free connection objects kept for reuse */
+	atomic_t connection_pool_count;	/* Number of objects in the free pool */
+	struct list_head wildcard_rules;
+					/* Wildcard rules (RCU protected) */
+	unsigned int num_wildcard_rules;
+					/* Number of wildcard rules */
 #ifdef CONFIG_NF_FLOW_COOKIE
 	struct sfe_flow_cookie_entry sfe_flow_cookie_table[SFE_FLOW_COOKIE_SIZE];
 					/* flow cookie table*/
@@ -436,14 +655,7 @@ struct sfe_ipv4 {
 					/* Number of IPv4 connection destroy requests */
 	u32 connection_destroy_misses;
 					/* Number of IPv4 connection destroy requests that missed our hash table */
-	u32 connection_match_hash_hits;
-					/* Number of IPv4 connection match hash hits */
-	u32 connection_match_hash_reorders;
-					/* Number of IPv4 connection match hash reorders */
 	u32 connection_flushes;		/* Number of IPv4 connection flushes */
-	u32 packets_forwarded;		/* Number of IPv4 packets forwarded */
-	u32 packets_not_forwarded;	/* Number of IPv4 packets not forwarded */
-	u32 exception_events[SFE_IPV4_EXCEPTION_EVENT_LAST];
 
 	/*
 	 * Summary statistics.
@@ -456,15 +668,7 @@ struct sfe_ipv4 {
 					/* Number of IPv4 connection destroy requests */
 	u64 connection_destroy_misses64;
 					/* Number of IPv4 connection destroy requests that missed our hash table */
-	u64 connection_match_hash_hits64;
-					/* Number of IPv4 connection match hash hits */
-	u64 connection_match_hash_reorders64;
-					/* Number of IPv4 connection match hash reorders */
 	u64 connection_flushes64;	/* Number of IPv4 connection flushes */
-	u64 packets_forwarded64;	/* Number of IPv4 packets forwarded */
-	u64 packets_not_forwarded64;
-					/* Number of IPv4 packets not forwarded */
-	u64 exception_events64[SFE_IPV4_EXCEPTION_EVENT_LAST];
 
 	/*
 	 * Control state.
@@ -503,6 +707,33 @@ typedef bool (*sfe_ipv4_debug_xml_write_method_t)(struct sfe_ipv4 *si, char *buf
 						  int *total_read, struct sfe_ipv4_debug_xml_write_state *ws);
 
 static struct sfe_ipv4 __si;
+static DEFINE_PER_CPU(struct sfe_ipv4_flow_hash_cache, sfe_ipv4_flow_hash_caches);
+static DEFINE_PER_CPU(struct sfe_ipv4_sync_state, sfe_ipv4_sync_states);
+
+/*
+ * Initial number of buckets in each of the connection hash tables.  The tables
+ * grow and shrink with the number of connections but never go below this.
+ */
+static unsigned int hash_size = SFE_IPV4_CONNECTION_HASH_SIZE;
+module_param(hash_size, uint, S_IRUGO);
+MODULE_PARM_DESC(hash_size, "Initial number of connection hash buckets");
+
+/*
+ * Optional hard limit on the number of connections, off by default so that
+ * the table can grow with conntrack.  When we reach it, the connection that
+ * has been idle longest makes way for a new one.
+ */
+static unsigned int max_connections = SFE_IPV4_MAX_CONNECTIONS;
+module_param(max_connections, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_connections, "Maximum number of connections, 0 for no limit");
+
+/*
+ * Number of connection objects allocated up front and kept for reuse, so that
+ * bursts of new connections don't depend on atomic allocations succeeding.
+ */
+static unsigned int pool_size = SFE_IPV4_CONNECTION_POOL_SIZE;
+module_param(pool_size, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_size, "Number of preallocated connection objects");
 
 /*
  * sfe_ipv4_gen_ip_csum()
@@ -532,142 +763,399 @@ static inline u16 sfe_ipv4_gen_ip_csum(struct sfe_ipv4_ip_hdr *iph)
 }
 
 /*
- * sfe_ipv4_get_connection_match_hash()
- *	Generate the hash used in connection match lookups.
- */
-static inline unsigned int sfe_ipv4_get_connection_match_hash(struct net_device *dev, u8 protocol,
-							      __be32 src_ip, __be16 src_port,
-							      __be32 dest_ip, __be16 dest_port)
-{
-	size_t dev_addr = (size_t)dev;
-	u32 hash = ((u32)dev_addr) ^ ntohl(src_ip ^ dest_ip) ^ protocol ^ ntohs(src_port ^ dest_port);
-	return ((hash >> SFE_IPV4_CONNECTION_HASH_SHIFT) ^ hash) & SFE_IPV4_CONNECTION_HASH_MASK;
-}
-
-/*
- * sfe_ipv4_find_sfe_ipv4_connection_match()
- *	Get the IPv4 flow match info that corresponds to a particular 5-tuple.
+ * sfe_ipv4_skb_fits_mtu()
+ *	Check whether a packet, or each segment of a GSO packet, fits an MTU.
  *
- * On entry we must be holding the lock that protects the hash table.
+ * GRO super-packets are forwarded intact and cut back into segments by GSO/TSO
+ * on the egress device, so what matters for them is the size of the segments
+ * and not of the aggregate.
  */
-static struct sfe_ipv4_connection_match *
-sfe_ipv4_find_sfe_ipv4_connection_match(struct sfe_ipv4 *si, struct net_device *dev, u8 protocol,
-					__be32 src_ip, __be16 src_port,
-					__be32 dest_ip, __be16 dest_port)
+static inline bool sfe_ipv4_skb_fits_mtu(struct sk_buff *skb, unsigned int len,
+					unsigned int ihl, unsigned int mtu)
 {
-	struct sfe_ipv4_connection_match *cm;
-	struct sfe_ipv4_connection_match *head;
-	unsigned int conn_match_idx;
-
-	conn_match_idx = sfe_ipv4_get_connection_match_hash(dev, protocol, src_ip, src_port, dest_ip, dest_port);
-	cm = si->conn_match_hash[conn_match_idx];
-
-	/*
-	 * If we don't have anything in this chain then bail.
-	 */
-	if (unlikely(!cm)) {
-		return NULL;
+	if (likely(len <= mtu)) {
+		return true;
 	}
 
-	/*
-	 * Hopefully the first entry is the one we want.
-	 */
-	if ((cm->match_src_port == src_port)
-	    && (cm->match_dest_port == dest_port)
-	    && (cm->match_src_ip == src_ip)
-	    && (cm->match_dest_ip == dest_ip)
-	    && (cm->match_protocol == protocol)
-	    && (cm->match_dev == dev)) {
-		si->connection_match_hash_hits++;
-		return cm;
+	if (!skb_is_gso(skb)) {
+		return false;
 	}
 
 	/*
-	 * Unfortunately we didn't find it at head, so we search it in chain and
-	 * move matching entry to the top of the hash chain. We presume that this
-	 * will be reused again very quickly.
+	 * The segment length is worked out from the network and transport header
+	 * offsets so make sure they describe this packet.
 	 */
-	head = cm;
-	do {
-		cm = cm->next;
-	} while (cm && (cm->match_src_port != src_port
-		 || cm->match_dest_port != dest_port
-		 || cm->match_src_ip != src_ip
-		 || cm->match_dest_ip != dest_ip
-		 || cm->match_protocol != protocol
-		 || cm->match_dev != dev));
+	skb_reset_network_header(skb);
+	skb_set_transport_header(skb, ihl);
+	return skb_gso_validate_network_len(skb, mtu);
+}
 
-	/*
-	 * Not found then we're done.
-	 */
-	if (unlikely(!cm)) {
+/*
+ * sfe_ipv4_hash_table_nulls()
+ *	Get the nulls marker that ends one of a table's hash chains.
+ */
+static inline unsigned long sfe_ipv4_hash_table_nulls(struct sfe_ipv4_hash_table *t, unsigned int idx)
+{
+	return ((unsigned long)idx << 1) | t->nulls;
+}
+
+/*
+ * sfe_ipv4_hash_table_alloc()
+ *	Allocate an empty hash table with 1 << shift buckets.
+ */
+static struct sfe_ipv4_hash_table *sfe_ipv4_hash_table_alloc(unsigned int shift, unsigned int nulls)
+{
+	struct sfe_ipv4_hash_table *t;
+	unsigned int i;
+
+	t = kvzalloc(struct_size(t, buckets, 1U << shift), GFP_KERNEL);
+	if (!t) {
 		return NULL;
 	}
 
-	/*
-	 * We found a match so move it.
-	 */
-	if (cm->next) {
-		cm->next->prev = cm->prev;
+	t->shift = shift;
+	t->seed = get_random_u32();
+	t->nulls = nulls;
+	for (i = 0; i < (1U << shift); i++) {
+		INIT_HLIST_NULLS_HEAD(&t->buckets[i], sfe_ipv4_hash_table_nulls(t, i));
 	}
-	cm->prev->next = cm->next;
-	cm->prev = NULL;
-	cm->next = head;
-	head->prev = cm;
-	si->conn_match_hash[conn_match_idx] = cm;
-	si->connection_match_hash_reorders++;
 
-	return cm;
+	return t;
 }
 
 /*
- * sfe_ipv4_connection_match_update_summary_stats()
- *	Update the summary stats for a connection match entry.
+ * sfe_ipv4_hash_table_future()
+ *	Get the table that a resize is moving our entries into, if any.
+ *
+ * On entry we must be holding the lock that protects the hash table.
  */
-static inline void sfe_ipv4_connection_match_update_summary_stats(struct sfe_ipv4_connection_match *cm)
+static inline struct sfe_ipv4_hash_table *sfe_ipv4_hash_table_future(struct sfe_ipv4 *si,
+								     struct sfe_ipv4_hash_table *t)
 {
-	cm->rx_packet_count64 += cm->rx_packet_count;
-	cm->rx_packet_count = 0;
-	cm->rx_byte_count64 += cm->rx_byte_count;
-	cm->rx_byte_count = 0;
+	return rcu_dereference_protected(t->future, lockdep_is_held(&si->lock));
 }
 
 /*
- * sfe_ipv4_connection_match_compute_translations()
- *	Compute port and address translations for a connection match entry.
+ * sfe_ipv4_hash_table_last()
+ *	Get the table that new entries should be added to.
+ *
+ * On entry we must be holding the lock that protects the hash table.
  */
-static void sfe_ipv4_connection_match_compute_translations(struct sfe_ipv4_connection_match *cm)
+static inline struct sfe_ipv4_hash_table *sfe_ipv4_hash_table_last(struct sfe_ipv4 *si,
+								   struct sfe_ipv4_hash_table *t)
 {
-	/*
-	 * Before we insert the entry look to see if this is tagged as doing address
-	 * translations.  If it is then work out the adjustment that we need to apply
-	 * to the transport checksum.
-	 */
-	if (cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_XLATE_SRC) {
-		/*
-		 * Precompute an incremental checksum adjustment so we can
-		 * edit packets in this stream very quickly.  The algorithm is from RFC1624.
-		 */
-		u16 src_ip_hi = cm->match_src_ip >> 16;
-		u16 src_ip_lo = cm->match_src_ip & 0xffff;
-		u32 xlate_src_ip = ~cm->xlate_src_ip;
-		u16 xlate_src_ip_hi = xlate_src_ip >> 16;
-		u16 xlate_src_ip_lo = xlate_src_ip & 0xffff;
-		u16 xlate_src_port = ~cm->xlate_src_port;
-		u32 adj;
+	struct sfe_ipv4_hash_table *future = sfe_ipv4_hash_table_future(si, t);
 
-		/*
-		 * When we compute this fold it down to a 16-bit offset
-		 * as that way we can avoid having to do a double
-		 * folding of the twos-complement result because the
-		 * addition of 2 16-bit values cannot cause a double
-		 * wrap-around!
-		 */
-		adj = src_ip_hi + src_ip_lo + cm->match_src_port
-		      + xlate_src_ip_hi + xlate_src_ip_lo + xlate_src_port;
-		adj = (adj & 0xffff) + (adj >> 16);
-		adj = (adj & 0xffff) + (adj >> 16);
-		cm->xlate_src_csum_adjustment = (u16)adj;
+	return future ? future : t;
+}
+
+/*
+ * sfe_ipv4_hash_table_move()
+ *	Move the first entry of one hash chain to the head of another.
+ *
+ * Lockless readers may be walking either chain.  The entry is linked into its
+ * new chain before it is unlinked from the old one, so a reader that looks in
+ * the old table and then the future one always finds it.  A reader that is on
+ * the entry as it moves carries on down the new chain, but then finds the wrong
+ * nulls marker at the end and starts over.
+ *
+ * On entry we must be holding the lock that protects the hash table.
+ */
+static void sfe_ipv4_hash_table_move(struct hlist_nulls_head *from, struct hlist_nulls_head *to)
+{
+	struct hlist_nulls_node *n = from->first;
+	struct hlist_nulls_node *next = n->next;
+	struct hlist_nulls_node *first = to->first;
+
+	WRITE_ONCE(n->next, first);
+	WRITE_ONCE(n->pprev, &to->first);
+	if (!is_a_nulls(first)) {
+		WRITE_ONCE(first->pprev, &n->next);
+	}
+	rcu_assign_pointer(hlist_nulls_first_rcu(to), n);
+
+	rcu_assign_pointer(hlist_nulls_first_rcu(from), next);
+	if (!is_a_nulls(next)) {
+		WRITE_ONCE(next->pprev, &from->first);
+	}
+}
+
+/*
+ * sfe_ipv4_hash_table_shift()
+ *	Work out the table size we want for a particular number of entries.
+ *
+ * We aim for a load factor of no more than 3/4.
+ */
+static unsigned int sfe_ipv4_hash_table_shift(struct sfe_ipv4 *si, unsigned int nelems)
+{
+	unsigned int shift = ilog2(roundup_pow_of_two(nelems + nelems / 3 + 1));
+
+	return clamp(shift, si->hash_shift_min, (unsigned int)SFE_IPV4_CONNECTION_HASH_SHIFT_MAX);
+}
+
+/*
+ * sfe_ipv4_hash_table_needs_resize()
+ *	Check whether a table's load factor has gone out of range.
+ *
+ * We grow above a load factor of 3/4 and shrink below 3/10 so that a table
+ * sized by sfe_ipv4_hash_table_shift() doesn't immediately bounce back.
+ */
+static inline bool sfe_ipv4_hash_table_needs_resize(struct sfe_ipv4 *si, struct sfe_ipv4_hash_table *t,
+						    unsigned int nelems)
+{
+	unsigned int size = 1U << t->shift;
+
+	if (nelems > size / 4 * 3) {
+		return t->shift < SFE_IPV4_CONNECTION_HASH_SHIFT_MAX;
+	}
+
+	if (nelems < size / 10 * 3) {
+		return t->shift > si->hash_shift_min;
+	}
+
+	return false;
+}
+
+/*
+ * sfe_ipv4_get_connection_match_hash()
+ *	Generate the hash used in connection match lookups.
+ *
+ * The hash is seeded per table so the bucket a flow lands in can't be predicted
+ * from outside.
+ */
+static inline unsigned int sfe_ipv4_get_connection_match_hash(struct sfe_ipv4_hash_table *t,
+							      struct net_device *dev, u8 protocol,
+							      __be32 src_ip, __be16 src_port,
+							      __be32 dest_ip, __be16 dest_port)
+{
+	u32 hash = jhash_3words((__force u32)src_ip, (__force u32)dest_ip,
+				((__force u32)src_port << 16) | (__force u32)dest_port,
+				t->seed ^ hash32_ptr(dev) ^ protocol);
+	return hash & ((1U << t->shift) - 1);
+}
+
+/*
+ * sfe_ipv4_find_sfe_ipv4_connection_match()
+ *	Get the IPv4 flow match info that corresponds to a particular 5-tuple.
+ *
+ * On entry we must be within an RCU read-side critical section.  The hash chains
+ * are only modified with the lock held so the lookup itself never takes it.
+ */
+static struct sfe_ipv4_connection_match *
+sfe_ipv4_find_sfe_ipv4_connection_match(struct sfe_ipv4 *si, struct net_device *dev, u8 protocol,
+					__be32 src_ip, __be16 src_port,
+					__be32 dest_ip, __be16 dest_port)
+{
+	struct sfe_ipv4_connection_match *cm;
+	struct sfe_ipv4_hash_table *t;
+	struct hlist_nulls_node *node;
+	unsigned int conn_match_idx;
+	bool head;
+
+	WARN_ON_ONCE(!rcu_read_lock_held());
+
+restart:
+	t = rcu_dereference(si->conn_match_hash);
+	do {
+		conn_match_idx = sfe_ipv4_get_connection_match_hash(t, dev, protocol, src_ip, src_port,
+								    dest_ip, dest_port);
+
+		/*
+		 * We can't move entries to the front of the chain without the lock, so
+		 * we simply record when we had to walk past the head to find our match.
+		 */
+		head = true;
+		hlist_nulls_for_each_entry_rcu(cm, node, &t->buckets[conn_match_idx], hnode) {
+			if ((cm->match_src_port == src_port)
+			    && (cm->match_dest_port == dest_port)
+			    && (cm->match_src_ip == src_ip)
+			    && (cm->match_dest_ip == dest_ip)
+			    && (cm->match_protocol == protocol)
+			    && (cm->match_dev == dev)) {
+				this_cpu_inc(si->stats_pcpu->connection_match_hash_hits64);
+				if (unlikely(!head)) {
+					this_cpu_inc(si->stats_pcpu->connection_match_hash_reorders64);
+				}
+
+				return cm;
+			}
+
+			head = false;
+		}
+
+		/*
+		 * If a resize moved an entry we were walking past then we finished on
+		 * another chain and may have missed our match.
+		 */
+		if (unlikely(get_nulls_value(node) != sfe_ipv4_hash_table_nulls(t, conn_match_idx))) {
+			goto restart;
+		}
+
+		/*
+		 * Entries that a resize has already moved can only be found in the
+		 * future table.  Pairs with the ordering in sfe_ipv4_hash_table_move().
+		 */
+		smp_rmb();
+		t = rcu_dereference(t->future);
+	} while (unlikely(t));
+
+	return NULL;
+}
+
+/*
+ * sfe_ipv4_flow_hash_cache_add()
+ *	Remember a connection match in this CPU's flow hash cache.
+ *
+ * A match is only ever cached under one hash value so that removing it only has
+ * to clear one slot on each CPU.  Removal marks the connection as removed before
+ * clearing the slots and we look at the flag again once our slot is filled, so
+ * a match that is about to be freed can never be left behind in the cache.
+ */
+static inline void sfe_ipv4_flow_hash_cache_add(struct sfe_ipv4_flow_hash_cache_entry *e, u32 hash,
+						struct sfe_ipv4_connection_match *cm)
+{
+	if (unlikely(READ_ONCE(cm->flow_hash) != hash) && cmpxchg(&cm->flow_hash, 0, hash)) {
+		return;
+	}
+
+	e->hash = hash;
+	WRITE_ONCE(e->cm, cm);
+
+	smp_mb();
+	if (unlikely(READ_ONCE(cm->connection->removed))) {
+		cmpxchg(&e->cm, cm, NULL);
+	}
+}
+
+/*
+ * sfe_ipv4_flow_hash_cache_invalidate()
+ *	Make sure that no CPU's flow hash cache refers to a connection match.
+ *
+ * Called with the lock held, after the connection has been marked as removed.
+ */
+static void sfe_ipv4_flow_hash_cache_invalidate(struct sfe_ipv4_connection_match *cm)
+{
+	u32 hash = READ_ONCE(cm->flow_hash);
+	int cpu;
+
+	if (!hash) {
+		return;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct sfe_ipv4_flow_hash_cache_entry *e;
+
+		e = &per_cpu_ptr(&sfe_ipv4_flow_hash_caches, cpu)->entries[hash & SFE_IPV4_FLOW_HASH_CACHE_MASK];
+		cmpxchg(&e->cm, cm, NULL);
+	}
+}
+
+/*
+ * sfe_ipv4_find_connection_match_cached()
+ *	Get the flow match info for a packet, trying this CPU's flow hash cache first.
+ *
+ * Most NICs give us an RSS hash in skb->hash, and it is the same for every packet
+ * of a flow, so we use it to index a small direct-mapped cache of recently used
+ * matches.  A hit still has to match the full 5-tuple but saves hashing the tuple
+ * and walking the chain.  Packets without a hash just use the hash table.
+ *
+ * On entry we must be within an RCU read-side critical section.
+ */
+static inline struct sfe_ipv4_connection_match *
+sfe_ipv4_find_connection_match_cached(struct sfe_ipv4 *si, struct sk_buff *skb, struct net_device *dev, u8 protocol,
+				      __be32 src_ip, __be16 src_port,
+				      __be32 dest_ip, __be16 dest_port)
+{
+	struct sfe_ipv4_flow_hash_cache_entry *e;
+	struct sfe_ipv4_connection_match *cm;
+	u32 hash = skb_get_hash_raw(skb);
+
+	if (unlikely(!hash)) {
+		return sfe_ipv4_find_sfe_ipv4_connection_match(si, dev, protocol, src_ip, src_port, dest_ip, dest_port);
+	}
+
+	e = &this_cpu_ptr(&sfe_ipv4_flow_hash_caches)->entries[hash & SFE_IPV4_FLOW_HASH_CACHE_MASK];
+	cm = READ_ONCE(e->cm);
+	if (likely(cm && (e->hash == hash)
+		   && (cm->match_src_port == src_port)
+		   && (cm->match_dest_port == dest_port)
+		   && (cm->match_src_ip == src_ip)
+		   && (cm->match_dest_ip == dest_ip)
+		   && (cm->match_protocol == protocol)
+		   && (cm->match_dev == dev))) {
+		this_cpu_inc(si->stats_pcpu->connection_match_cache_hits64);
+		return cm;
+	}
+
+	cm = sfe_ipv4_find_sfe_ipv4_connection_match(si, dev, protocol, src_ip, src_port, dest_ip, dest_port);
+	if (likely(cm)) {
+		sfe_ipv4_flow_hash_cache_add(e, hash, cm);
+	}
+
+	return cm;
+}
+
+/*
+ * sfe_ipv4_connection_match_update_summary_stats()
+ *	Update the summary stats for a connection match entry.
+ *
+ * The per-period counts are returned so that a sync message can report them.
+ * The fast path updates these counters without the lock so we only subtract what
+ * we have actually folded into the summary.
+ */
+static inline void sfe_ipv4_connection_match_update_summary_stats(struct sfe_ipv4_connection_match *cm,
+								  u32 *packets, u32 *bytes)
+{
+	u32 packet_count, byte_count;
+
+	packet_count = atomic_read(&cm->rx_packet_count);
+	cm->rx_packet_count64 += packet_count;
+	atomic_sub(packet_count, &cm->rx_packet_count);
+
+	byte_count = atomic_read(&cm->rx_byte_count);
+	cm->rx_byte_count64 += byte_count;
+	atomic_sub(byte_count, &cm->rx_byte_count);
+
+	*packets = packet_count;
+	*bytes = byte_count;
+}
+
+/*
+ * sfe_ipv4_connection_match_compute_translations()
+ *	Compute port and address translations for a connection match entry.
+ */
+static void sfe_ipv4_connection_match_compute_translations(struct sfe_ipv4_connection_match *cm)
+{
+	/*
+	 * Before we insert the entry look to see if this is tagged as doing address
+	 * translations.  If it is then work out the adjustment that we need to apply
+	 * to the transport checksum.
+	 */
+	if (cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_XLATE_SRC) {
+		/*
+		 * Precompute an incremental checksum adjustment so we can
+		 * edit packets in this stream very quickly.  The algorithm is from RFC1624.
+		 */
+		u16 src_ip_hi = cm->match_src_ip >> 16;
+		u16 src_ip_lo = cm->match_src_ip & 0xffff;
+		u32 xlate_src_ip = ~cm->xlate_src_ip;
+		u16 xlate_src_ip_hi = xlate_src_ip >> 16;
+		u16 xlate_src_ip_lo = xlate_src_ip & 0xffff;
+		u16 xlate_src_port = ~cm->xlate_src_port;
+		u32 adj;
+
+		/*
+		 * When we compute this fold it down to a 16-bit offset
+		 * as that way we can avoid having to do a double
+		 * folding of the twos-complement result because the
+		 * addition of 2 16-bit values cannot cause a double
+		 * wrap-around!
+		 */
+		adj = src_ip_hi + src_ip_lo + cm->match_src_port
+		      + xlate_src_ip_hi + xlate_src_ip_lo + xlate_src_port;
+		adj = (adj & 0xffff) + (adj >> 16);
+		adj = (adj & 0xffff) + (adj >> 16);
+		cm->xlate_src_csum_adjustment = (u16)adj;
 
 	}
 
@@ -728,8 +1216,6 @@ static void sfe_ipv4_connection_match_compute_translations(struct sfe_ipv4_conne
  */
 static void sfe_ipv4_update_summary_stats(struct sfe_ipv4 *si)
 {
-	int i;
-
 	si->connection_create_requests64 += si->connection_create_requests;
 	si->connection_create_requests = 0;
 	si->connection_create_collisions64 += si->connection_create_collisions;
@@ -738,23 +1224,79 @@ static void sfe_ipv4_update_summary_stats(struct sfe_ipv4 *si)
 	si->connection_destroy_requests = 0;
 	si->connection_destroy_misses64 += si->connection_destroy_misses;
 	si->connection_destroy_misses = 0;
-	si->connection_match_hash_hits64 += si->connection_match_hash_hits;
-	si->connection_match_hash_hits = 0;
-	si->connection_match_hash_reorders64 += si->connection_match_hash_reorders;
-	si->connection_match_hash_reorders = 0;
 	si->connection_flushes64 += si->connection_flushes;
 	si->connection_flushes = 0;
-	si->packets_forwarded64 += si->packets_forwarded;
-	si->packets_forwarded = 0;
-	si->packets_not_forwarded64 += si->packets_not_forwarded;
-	si->packets_not_forwarded = 0;
+}
 
-	for (i = 0; i < SFE_IPV4_EXCEPTION_EVENT_LAST; i++) {
-		si->exception_events64[i] += si->exception_events[i];
-		si->exception_events[i] = 0;
+/*
+ * sfe_ipv4_stats_pcpu_sum()
+ *	Add up the per-CPU forwarding statistics.
+ */
+static void sfe_ipv4_stats_pcpu_sum(struct sfe_ipv4 *si, struct sfe_ipv4_stats *stats)
+{
+	int cpu;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for_each_possible_cpu(cpu) {
+		const struct sfe_ipv4_stats *s = per_cpu_ptr(si->stats_pcpu, cpu);
+
+		stats->connection_match_hash_hits64 += s->connection_match_hash_hits64;
+		stats->connection_match_hash_reorders64 += s->connection_match_hash_reorders64;
+		stats->connection_match_cache_hits64 += s->connection_match_cache_hits64;
+		stats->packets_forwarded64 += s->packets_forwarded64;
+		stats->packets_not_forwarded64 += s->packets_not_forwarded64;
+
+		for (i = 0; i < SFE_IPV4_EXCEPTION_EVENT_LAST; i++) {
+			stats->exception_events64[i] += s->exception_events64[i];
+		}
+
+		for (i = 0; i < SFE_DUMP_SYNC_LATENCY_BUCKETS; i++) {
+			stats->sync_latency64[i] += s->sync_latency64[i];
+		}
+	}
+}
+
+/*
+ * sfe_ipv4_stats_pcpu_clear()
+ *	Reset the per-CPU forwarding statistics.
+ */
+static void sfe_ipv4_stats_pcpu_clear(struct sfe_ipv4 *si)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(si->stats_pcpu, cpu), 0, sizeof(struct sfe_ipv4_stats));
 	}
 }
 
+/*
+ * sfe_ipv4_exception_stats_sum()
+ *	Add up the per-CPU counts for one exception event.
+ */
+static u64 sfe_ipv4_exception_stats_sum(struct sfe_ipv4 *si, enum sfe_ipv4_exception_events reason)
+{
+	u64 count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		count += per_cpu_ptr(si->stats_pcpu, cpu)->exception_events64[reason];
+	}
+
+	return count;
+}
+
+/*
+ * sfe_ipv4_exception_stats_inc()
+ *	Count a packet that we are not forwarding, along with the reason why.
+ */
+static inline void sfe_ipv4_exception_stats_inc(struct sfe_ipv4 *si, enum sfe_ipv4_exception_events reason)
+{
+	this_cpu_inc(si->stats_pcpu->exception_events64[reason]);
+	this_cpu_inc(si->stats_pcpu->packets_not_forwarded64);
+}
+
 /*
  * sfe_ipv4_insert_sfe_ipv4_connection_match()
  *	Insert a connection match into the hash.
@@ -764,22 +1306,15 @@ static void sfe_ipv4_update_summary_stats(struct sfe_ipv4 *si)
 static inline void sfe_ipv4_insert_sfe_ipv4_connection_match(struct sfe_ipv4 *si,
 							     struct sfe_ipv4_connection_match *cm)
 {
-	struct sfe_ipv4_connection_match **hash_head;
-	struct sfe_ipv4_connection_match *prev_head;
+	struct sfe_ipv4_hash_table *t
+		= sfe_ipv4_hash_table_last(si, rcu_dereference_protected(si->conn_match_hash,
+									 lockdep_is_held(&si->lock)));
 	unsigned int conn_match_idx
-		= sfe_ipv4_get_connection_match_hash(cm->match_dev, cm->match_protocol,
+		= sfe_ipv4_get_connection_match_hash(t, cm->match_dev, cm->match_protocol,
 						     cm->match_src_ip, cm->match_src_port,
 						     cm->match_dest_ip, cm->match_dest_port);
 
-	hash_head = &si->conn_match_hash[conn_match_idx];
-	prev_head = *hash_head;
-	cm->prev = NULL;
-	if (prev_head) {
-		prev_head->prev = cm;
-	}
-
-	cm->next = prev_head;
-	*hash_head = cm;
+	hlist_nulls_add_head_rcu(&cm->hnode, &t->buckets[conn_match_idx]);
 
 #ifdef CONFIG_NF_FLOW_COOKIE
 	if (!si->flow_cookie_enable)
@@ -851,26 +1386,16 @@ static inline void sfe_ipv4_remove_sfe_ipv4_connection_match(struct sfe_ipv4 *si
 #endif
 
 	/*
-	 * Unlink the connection match entry from the hash.
+	 * Unlink the connection match entry from the hash.  Lockless readers may
+	 * still be looking at it so it is only freed after an RCU grace period.
 	 */
-	if (cm->prev) {
-		cm->prev->next = cm->next;
-	} else {
-		unsigned int conn_match_idx
-			= sfe_ipv4_get_connection_match_hash(cm->match_dev, cm->match_protocol,
-							     cm->match_src_ip, cm->match_src_port,
-							     cm->match_dest_ip, cm->match_dest_port);
-		si->conn_match_hash[conn_match_idx] = cm->next;
-	}
-
-	if (cm->next) {
-		cm->next->prev = cm->prev;
-	}
+	hlist_nulls_del_init_rcu(&cm->hnode);
 
 	/*
 	 * If the connection match entry is in the active list remove it.
 	 */
 	if (cm->active) {
+		si->num_active--;
 		if (likely(cm->active_prev)) {
 			cm->active_prev->active_next = cm->active_next;
 		} else {
@@ -889,11 +1414,14 @@ static inline void sfe_ipv4_remove_sfe_ipv4_connection_match(struct sfe_ipv4 *si
  * sfe_ipv4_get_connection_hash()
  *	Generate the hash used in connection lookups.
  */
-static inline unsigned int sfe_ipv4_get_connection_hash(u8 protocol, __be32 src_ip, __be16 src_port,
+static inline unsigned int sfe_ipv4_get_connection_hash(struct sfe_ipv4_hash_table *t, u8 protocol,
+							__be32 src_ip, __be16 src_port,
 							__be32 dest_ip, __be16 dest_port)
 {
-	u32 hash = ntohl(src_ip ^ dest_ip) ^ protocol ^ ntohs(src_port ^ dest_port);
-	return ((hash >> SFE_IPV4_CONNECTION_HASH_SHIFT) ^ hash) & SFE_IPV4_CONNECTION_HASH_MASK;
+	u32 hash = jhash_3words((__force u32)src_ip, (__force u32)dest_ip,
+				((__force u32)src_port << 16) | (__force u32)dest_port,
+				t->seed ^ protocol);
+	return hash & ((1U << t->shift) - 1);
 }
 
 /*
@@ -906,44 +1434,32 @@ static inline struct sfe_ipv4_connection *sfe_ipv4_find_sfe_ipv4_connection(stru
 									    __be32 src_ip, __be16 src_port,
 									    __be32 dest_ip, __be16 dest_port)
 {
+	struct sfe_ipv4_hash_table *t = si->conn_hash;
 	struct sfe_ipv4_connection *c;
-	unsigned int conn_idx = sfe_ipv4_get_connection_hash(protocol, src_ip, src_port, dest_ip, dest_port);
-	c = si->conn_hash[conn_idx];
+	struct hlist_nulls_node *node;
+	unsigned int conn_idx;
 
-	/*
-	 * If we don't have anything in this chain then bale.
-	 */
-	if (unlikely(!c)) {
-		return NULL;
-	}
+	do {
+		conn_idx = sfe_ipv4_get_connection_hash(t, protocol, src_ip, src_port, dest_ip, dest_port);
 
-	/*
-	 * Hopefully the first entry is the one we want.
-	 */
-	if ((c->src_port == src_port)
-	    && (c->dest_port == dest_port)
-	    && (c->src_ip == src_ip)
-	    && (c->dest_ip == dest_ip)
-	    && (c->protocol == protocol)) {
-		return c;
-	}
+		/*
+		 * Will need connection entry for next create/destroy metadata,
+		 * So no need to re-order entry for these requests
+		 */
+		hlist_nulls_for_each_entry(c, node, &t->buckets[conn_idx], hnode) {
+			if ((c->src_port == src_port)
+			    && (c->dest_port == dest_port)
+			    && (c->src_ip == src_ip)
+			    && (c->dest_ip == dest_ip)
+			    && (c->protocol == protocol)) {
+				return c;
+			}
+		}
 
-	/*
-	 * Unfortunately we didn't find it at head, so we search it in chain.
-	 */
-	do {
-		c = c->next;
-	} while (c && (c->src_port != src_port
-		 || c->dest_port != dest_port
-		 || c->src_ip != src_ip
-		 || c->dest_ip != dest_ip
-		 || c->protocol != protocol));
+		t = sfe_ipv4_hash_table_future(si, t);
+	} while (unlikely(t));
 
-	/*
-	 * Will need connection entry for next create/destroy metadata,
-	 * So no need to re-order entry for these requests
-	 */
-	return c;
+	return NULL;
 }
 
 /*
@@ -975,83 +1491,262 @@ void sfe_ipv4_mark_rule(struct sfe_connection_mark *mark)
 }
 
 /*
- * sfe_ipv4_insert_sfe_ipv4_connection()
- *	Insert a connection into the hash.
+ * sfe_ipv4_hash_resize_check()
+ *	Kick off a resize if either of the hash tables is now the wrong size.
  *
  * On entry we must be holding the lock that protects the hash table.
  */
-static void sfe_ipv4_insert_sfe_ipv4_connection(struct sfe_ipv4 *si, struct sfe_ipv4_connection *c)
+static inline void sfe_ipv4_hash_resize_check(struct sfe_ipv4 *si)
 {
-	struct sfe_ipv4_connection **hash_head;
-	struct sfe_ipv4_connection *prev_head;
-	unsigned int conn_idx;
-
-	/*
-	 * Insert entry into the connection hash.
-	 */
-	conn_idx = sfe_ipv4_get_connection_hash(c->protocol, c->src_ip, c->src_port,
-						c->dest_ip, c->dest_port);
-	hash_head = &si->conn_hash[conn_idx];
-	prev_head = *hash_head;
-	c->prev = NULL;
-	if (prev_head) {
-		prev_head->prev = c;
+	struct sfe_ipv4_hash_table *conn_hash = sfe_ipv4_hash_table_last(si, si->conn_hash);
+	struct sfe_ipv4_hash_table *conn_match_hash
+		= sfe_ipv4_hash_table_last(si, rcu_dereference_protected(si->conn_match_hash,
+									 lockdep_is_held(&si->lock)));
+
+	if (unlikely(sfe_ipv4_hash_table_needs_resize(si, conn_hash, si->num_connections)
+		     || sfe_ipv4_hash_table_needs_resize(si, conn_match_hash, si->num_connections * 2))) {
+		schedule_work(&si->hash_resize_work);
 	}
+}
 
-	c->next = prev_head;
-	*hash_head = c;
+/*
+ * sfe_ipv4_connection_rehash()
+ *	Get the bucket a connection belongs in within another table.
+ */
+static unsigned int sfe_ipv4_connection_rehash(struct sfe_ipv4_hash_table *t, struct hlist_nulls_node *n)
+{
+	struct sfe_ipv4_connection *c = hlist_nulls_entry(n, struct sfe_ipv4_connection, hnode);
 
-	/*
-	 * Insert entry into the "all connections" list.
-	 */
-	if (si->all_connections_tail) {
-		c->all_connections_prev = si->all_connections_tail;
-		si->all_connections_tail->all_connections_next = c;
-	} else {
-		c->all_connections_prev = NULL;
-		si->all_connections_head = c;
-	}
+	return sfe_ipv4_get_connection_hash(t, c->protocol, c->src_ip, c->src_port,
+					    c->dest_ip, c->dest_port);
+}
 
-	si->all_connections_tail = c;
-	c->all_connections_next = NULL;
-	si->num_connections++;
+/*
+ * sfe_ipv4_connection_match_rehash()
+ *	Get the bucket a connection match belongs in within another table.
+ */
+static unsigned int sfe_ipv4_connection_match_rehash(struct sfe_ipv4_hash_table *t, struct hlist_nulls_node *n)
+{
+	struct sfe_ipv4_connection_match *cm = hlist_nulls_entry(n, struct sfe_ipv4_connection_match, hnode);
 
-	/*
-	 * Insert the connection match objects too.
-	 */
-	sfe_ipv4_insert_sfe_ipv4_connection_match(si, c->original_match);
-	sfe_ipv4_insert_sfe_ipv4_connection_match(si, c->reply_match);
+	return sfe_ipv4_get_connection_match_hash(t, cm->match_dev, cm->match_protocol,
+						  cm->match_src_ip, cm->match_src_port,
+						  cm->match_dest_ip, cm->match_dest_port);
 }
 
 /*
- * sfe_ipv4_remove_sfe_ipv4_connection()
- *	Remove a sfe_ipv4_connection object from the hash.
+ * sfe_ipv4_hash_table_migrate()
+ *	Move every entry of a hash table into its future table.
  *
- * On entry we must be holding the lock that protects the hash table.
+ * The lock is only held while one batch of buckets is moved, so even a table
+ * with a very large number of entries never holds off the fast path for long.
  */
-static void sfe_ipv4_remove_sfe_ipv4_connection(struct sfe_ipv4 *si, struct sfe_ipv4_connection *c)
+static void sfe_ipv4_hash_table_migrate(struct sfe_ipv4 *si, struct sfe_ipv4_hash_table *old,
+					unsigned int (*rehash)(struct sfe_ipv4_hash_table *t,
+							       struct hlist_nulls_node *n))
 {
-	/*
-	 * Remove the connection match objects.
-	 */
-	sfe_ipv4_remove_sfe_ipv4_connection_match(si, c->reply_match);
-	sfe_ipv4_remove_sfe_ipv4_connection_match(si, c->original_match);
+	struct sfe_ipv4_hash_table *new = rcu_dereference_protected(old->future, true);
+	unsigned int size = 1U << old->shift;
+	unsigned int i = 0;
+
+	while (i < size) {
+		unsigned int end = min(i + SFE_IPV4_HASH_RESIZE_BATCH, size);
+
+		spin_lock_bh(&si->lock);
+		for (; i < end; i++) {
+			struct hlist_nulls_head *h = &old->buckets[i];
+
+			while (!is_a_nulls(h->first)) {
+				sfe_ipv4_hash_table_move(h, &new->buckets[rehash(new, h->first)]);
+			}
+		}
+		si->hash_resize_seq++;
+		spin_unlock_bh(&si->lock);
+
+		cond_resched();
+	}
+}
+
+/*
+ * sfe_ipv4_hash_resize_work()
+ *	Resize the connection and connection match hash tables.
+ *
+ * New tables are allocated without the lock held and hung off the old ones as
+ * their future tables.  From then on new entries go straight into the future
+ * table and lookups that miss in the old table go on to look there, while we
+ * move the existing entries across in batches.  Once the old table is empty the
+ * future table takes its place.  Connection match lookups don't take the lock,
+ * so the old match table can't be freed until all such readers are done with it.
+ */
+static void sfe_ipv4_hash_resize_work(struct work_struct *work)
+{
+	struct sfe_ipv4 *si = container_of(work, struct sfe_ipv4, hash_resize_work);
+	struct sfe_ipv4_hash_table *new_conn_hash = NULL;
+	struct sfe_ipv4_hash_table *new_conn_match_hash = NULL;
+	struct sfe_ipv4_hash_table *old_conn_hash = si->conn_hash;
+	struct sfe_ipv4_hash_table *old_conn_match_hash = rcu_dereference_protected(si->conn_match_hash, true);
+	unsigned int num_connections;
+	unsigned int conn_shift, conn_match_shift;
+
+	spin_lock_bh(&si->lock);
+	num_connections = si->num_connections;
+	spin_unlock_bh(&si->lock);
 
 	/*
-	 * Unlink the connection.
+	 * The table pointers only ever change here so we can look at them without
+	 * the lock.
+	 */
+	conn_shift = sfe_ipv4_hash_table_shift(si, num_connections);
+	if (conn_shift != old_conn_hash->shift) {
+		new_conn_hash = sfe_ipv4_hash_table_alloc(conn_shift, !old_conn_hash->nulls);
+		if (!new_conn_hash) {
+			DEBUG_WARN("failed to allocate connection hash with %u buckets\n", 1U << conn_shift);
+		}
+	}
+
+	conn_match_shift = sfe_ipv4_hash_table_shift(si, num_connections * 2);
+	if (conn_match_shift != old_conn_match_hash->shift) {
+		new_conn_match_hash = sfe_ipv4_hash_table_alloc(conn_match_shift, !old_conn_match_hash->nulls);
+		if (!new_conn_match_hash) {
+			DEBUG_WARN("failed to allocate connection match hash with %u buckets\n", 1U << conn_match_shift);
+		}
+	}
+
+	if (new_conn_hash) {
+		spin_lock_bh(&si->lock);
+		rcu_assign_pointer(old_conn_hash->future, new_conn_hash);
+		spin_unlock_bh(&si->lock);
+
+		sfe_ipv4_hash_table_migrate(si, old_conn_hash, sfe_ipv4_connection_rehash);
+
+		spin_lock_bh(&si->lock);
+		si->conn_hash = new_conn_hash;
+		si->hash_resize_seq++;
+		spin_unlock_bh(&si->lock);
+
+		DEBUG_INFO("connection hash resized from %u to %u buckets\n",
+			   1U << old_conn_hash->shift, 1U << new_conn_hash->shift);
+		kvfree(old_conn_hash);
+	}
+
+	if (new_conn_match_hash) {
+		spin_lock_bh(&si->lock);
+		rcu_assign_pointer(old_conn_match_hash->future, new_conn_match_hash);
+		spin_unlock_bh(&si->lock);
+
+		sfe_ipv4_hash_table_migrate(si, old_conn_match_hash, sfe_ipv4_connection_match_rehash);
+
+		spin_lock_bh(&si->lock);
+		rcu_assign_pointer(si->conn_match_hash, new_conn_match_hash);
+		spin_unlock_bh(&si->lock);
+
+		DEBUG_INFO("connection match hash resized from %u to %u buckets\n",
+			   1U << old_conn_match_hash->shift, 1U << new_conn_match_hash->shift);
+
+		/*
+		 * Readers that started in the old table may still be walking it or
+		 * following its future pointer.
+		 */
+		synchronize_rcu();
+		kvfree(old_conn_match_hash);
+	}
+}
+
+/*
+ * sfe_ipv4_insert_sfe_ipv4_connection()
+ *	Insert a connection into the hash.
+ *
+ * On entry we must be holding the lock that protects the hash table.
+ */
+static void sfe_ipv4_insert_sfe_ipv4_connection(struct sfe_ipv4 *si, struct sfe_ipv4_connection *c)
+{
+	struct sfe_ipv4_hash_table *t = sfe_ipv4_hash_table_last(si, si->conn_hash);
+	unsigned int conn_idx;
+
+	/*
+	 * Insert entry into the connection hash.
+	 */
+	conn_idx = sfe_ipv4_get_connection_hash(t, c->protocol, c->src_ip, c->src_port,
+						c->dest_ip, c->dest_port);
+	hlist_nulls_add_head(&c->hnode, &t->buckets[conn_idx]);
+
+	/*
+	 * Insert entry into the "all connections" list.
+	 */
+	if (si->all_connections_tail) {
+		c->all_connections_prev = si->all_connections_tail;
+		si->all_connections_tail->all_connections_next = c;
+	} else {
+		c->all_connections_prev = NULL;
+		si->all_connections_head = c;
+	}
+
+	si->all_connections_tail = c;
+	c->all_connections_next = NULL;
+	si->num_connections++;
+
+	/*
+	 * Insert the connection match objects too.
 	 */
-	if (c->prev) {
-		c->prev->next = c->next;
+	sfe_ipv4_insert_sfe_ipv4_connection_match(si, c->original_match);
+	sfe_ipv4_insert_sfe_ipv4_connection_match(si, c->reply_match);
+
+	sfe_ipv4_hash_resize_check(si);
+}
+
+/*
+ * sfe_ipv4_connection_touch()
+ *	Move a connection to the tail of the list of all connections.
+ *
+ * On entry we must be holding the lock that protects the hash table.
+ */
+static void sfe_ipv4_connection_touch(struct sfe_ipv4 *si, struct sfe_ipv4_connection *c)
+{
+	if (!c->all_connections_next) {
+		return;
+	}
+
+	c->all_connections_next->all_connections_prev = c->all_connections_prev;
+	if (c->all_connections_prev) {
+		c->all_connections_prev->all_connections_next = c->all_connections_next;
 	} else {
-		unsigned int conn_idx = sfe_ipv4_get_connection_hash(c->protocol, c->src_ip, c->src_port,
-								     c->dest_ip, c->dest_port);
-		si->conn_hash[conn_idx] = c->next;
+		si->all_connections_head = c->all_connections_next;
 	}
 
-	if (c->next) {
-		c->next->prev = c->prev;
+	c->all_connections_prev = si->all_connections_tail;
+	c->all_connections_next = NULL;
+	si->all_connections_tail->all_connections_next = c;
+	si->all_connections_tail = c;
+}
+
+/*
+ * sfe_ipv4_remove_sfe_ipv4_connection()
+ *	Remove a sfe_ipv4_connection object from the hash.
+ *
+ * On entry we must be holding the lock that protects the hash table.  Several
+ * CPUs may find the same connection in the fast path and try to remove it, so
+ * only the first caller gets true back and is responsible for the flush.
+ */
+static bool sfe_ipv4_remove_sfe_ipv4_connection(struct sfe_ipv4 *si, struct sfe_ipv4_connection *c)
+{
+	lockdep_assert_held(&si->lock);
+
+	if (c->removed) {
+		DEBUG_TRACE("%p: connection already removed\n", c);
+		return false;
 	}
 
+	/*
+	 * Remove the connection match objects.
+	 */
+	sfe_ipv4_remove_sfe_ipv4_connection_match(si, c->reply_match);
+	sfe_ipv4_remove_sfe_ipv4_connection_match(si, c->original_match);
+
+	/*
+	 * Unlink the connection.
+	 */
+	hlist_nulls_del(&c->hnode);
+
 	/*
 	 * Unlink connection from all_connections list
 	 */
@@ -1067,7 +1762,19 @@ static void sfe_ipv4_remove_sfe_ipv4_connection(struct sfe_ipv4 *si, struct sfe_
 		si->all_connections_tail = c->all_connections_prev;
 	}
 
+	c->removed = true;
 	si->num_connections--;
+
+	/*
+	 * Nobody can add our matches to a flow hash cache once they see that we
+	 * have been removed, so now clear out any that are already there.
+	 */
+	smp_mb();
+	sfe_ipv4_flow_hash_cache_invalidate(c->original_match);
+	sfe_ipv4_flow_hash_cache_invalidate(c->reply_match);
+
+	sfe_ipv4_hash_resize_check(si);
+	return true;
 }
 
 /*
@@ -1100,20 +1807,17 @@ static void sfe_ipv4_gen_sync_sfe_ipv4_connection(struct sfe_ipv4 *si, struct sf
 
 	original_cm = c->original_match;
 	reply_cm = c->reply_match;
-	sis->src_td_max_window = original_cm->protocol_state.tcp.max_win;
-	sis->src_td_end = original_cm->protocol_state.tcp.end;
-	sis->src_td_max_end = original_cm->protocol_state.tcp.max_end;
-	sis->dest_td_max_window = reply_cm->protocol_state.tcp.max_win;
-	sis->dest_td_end = reply_cm->protocol_state.tcp.end;
-	sis->dest_td_max_end = reply_cm->protocol_state.tcp.max_end;
-
-	sis->src_new_packet_count = original_cm->rx_packet_count;
-	sis->src_new_byte_count = original_cm->rx_byte_count;
-	sis->dest_new_packet_count = reply_cm->rx_packet_count;
-	sis->dest_new_byte_count = reply_cm->rx_byte_count;
-
-	sfe_ipv4_connection_match_update_summary_stats(original_cm);
-	sfe_ipv4_connection_match_update_summary_stats(reply_cm);
+	sis->src_td_max_window = READ_ONCE(original_cm->protocol_state.tcp.max_win);
+	sis->src_td_end = READ_ONCE(original_cm->protocol_state.tcp.end);
+	sis->src_td_max_end = READ_ONCE(original_cm->protocol_state.tcp.max_end);
+	sis->dest_td_max_window = READ_ONCE(reply_cm->protocol_state.tcp.max_win);
+	sis->dest_td_end = READ_ONCE(reply_cm->protocol_state.tcp.end);
+	sis->dest_td_max_end = READ_ONCE(reply_cm->protocol_state.tcp.max_end);
+
+	sfe_ipv4_connection_match_update_summary_stats(original_cm, &sis->src_new_packet_count,
+						       &sis->src_new_byte_count);
+	sfe_ipv4_connection_match_update_summary_stats(reply_cm, &sis->dest_new_packet_count,
+						       &sis->dest_new_byte_count);
 
 	sis->src_dev = original_cm->match_dev;
 	sis->src_packet_count = original_cm->rx_packet_count64;
@@ -1124,6 +1828,7 @@ static void sfe_ipv4_gen_sync_sfe_ipv4_connection(struct sfe_ipv4 *si, struct sf
 	sis->dest_byte_count = reply_cm->rx_byte_count64;
 
 	sis->reason = reason;
+	sis->ct = c->ct;
 
 	/*
 	 * Get the time increment since our last sync.
@@ -1132,6 +1837,62 @@ static void sfe_ipv4_gen_sync_sfe_ipv4_connection(struct sfe_ipv4 *si, struct sf
 	c->last_sync_jiffies = now_jiffies;
 }
 
+/*
+ * sfe_ipv4_alloc_connection_object()
+ *	Allocate a connection object, from the free pool if we can.
+ *
+ * On entry we must be holding the lock, which makes us the pool's only consumer.
+ */
+static struct sfe_ipv4_connection_object *sfe_ipv4_alloc_connection_object(struct sfe_ipv4 *si)
+{
+	struct llist_node *node;
+
+	lockdep_assert_held(&si->lock);
+
+	node = llist_del_first(&si->connection_pool);
+	if (likely(node)) {
+		atomic_dec(&si->connection_pool_count);
+		return llist_entry(node, struct sfe_ipv4_connection_object, pool_node);
+	}
+
+	return kmem_cache_alloc(si->connection_cache, GFP_ATOMIC);
+}
+
+/*
+ * sfe_ipv4_free_connection_object()
+ *	Return a connection object to the free pool, or to the slab if the pool is full.
+ */
+static void sfe_ipv4_free_connection_object(struct sfe_ipv4 *si, struct sfe_ipv4_connection_object *obj)
+{
+	if (atomic_read(&si->connection_pool_count) < (int)pool_size) {
+		atomic_inc(&si->connection_pool_count);
+		llist_add(&obj->pool_node, &si->connection_pool);
+		return;
+	}
+
+	kmem_cache_free(si->connection_cache, obj);
+}
+
+/*
+ * sfe_ipv4_free_sfe_ipv4_connection_rcu()
+ *	Called at the end of an RCU grace period to free a connection.
+ */
+static void sfe_ipv4_free_sfe_ipv4_connection_rcu(struct rcu_head *head)
+{
+	struct sfe_ipv4_connection *c = container_of(head, struct sfe_ipv4_connection, rcu);
+
+	/*
+	 * Release our hold of the source and dest devices and free the memory
+	 * for our connection objects.
+	 */
+	dev_put(c->original_dev);
+	dev_put(c->reply_dev);
+	dev_put(c->original_match->xmit_dev);
+	dev_put(c->reply_match->xmit_dev);
+	nf_conntrack_put(c->ct);
+	sfe_ipv4_free_connection_object(&__si, container_of(c, struct sfe_ipv4_connection_object, conn));
+}
+
 /*
  * sfe_ipv4_flush_sfe_ipv4_connection()
  *	Flush a connection and free all associated resources.
@@ -1161,127 +1922,397 @@ static void sfe_ipv4_flush_sfe_ipv4_connection(struct sfe_ipv4 *si,
 		 */
 		now_jiffies = get_jiffies_64();
 		sfe_ipv4_gen_sync_sfe_ipv4_connection(si, c, &sis, reason, now_jiffies);
-		sync_rule_callback(&sis);
+		sync_rule_callback(&sis, 1);
 	}
 
 	rcu_read_unlock();
 
 	/*
-	 * Release our hold of the source and dest devices and free the memory
-	 * for our connection objects.
+	 * The fast path may still be using this connection so defer releasing it
+	 * until all current RCU readers have finished.
 	 */
-	dev_put(c->original_dev);
-	dev_put(c->reply_dev);
-	kfree(c->original_match);
-	kfree(c->reply_match);
-	kfree(c);
+	call_rcu(&c->rcu, sfe_ipv4_free_sfe_ipv4_connection_rcu);
 }
 
 /*
- * sfe_ipv4_recv_udp()
- *	Handle UDP packet receives and forwarding.
+ * sfe_ipv4_write_encap_hdrs()
+ *	Add the PPPoE and Ethernet headers, and the VLAN tag, for a packet we're forwarding.
  */
-static int sfe_ipv4_recv_udp(struct sfe_ipv4 *si, struct sk_buff *skb, struct net_device *dev,
-			     unsigned int len, struct sfe_ipv4_ip_hdr *iph, unsigned int ihl, bool flush_on_find)
+static inline void sfe_ipv4_write_encap_hdrs(struct sk_buff *skb, struct sfe_ipv4_connection_match *cm)
 {
-	struct sfe_ipv4_udp_hdr *udph;
-	__be32 src_ip;
-	__be32 dest_ip;
-	__be16 src_port;
-	__be16 dest_port;
-	struct sfe_ipv4_connection_match *cm;
-	u8 ttl;
-	struct net_device *xmit_dev;
+	struct sfe_ipv4_eth_hdr *eth;
+	__be16 proto = htons(ETH_P_IP);
+
+	if (cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_PPPOE_ENCAP) {
+		struct pppoe_hdr *ph;
+		unsigned int len = skb->len + sizeof(__be16);
+
+		ph = (struct pppoe_hdr *)__skb_push(skb, PPPOE_SES_HLEN);
+		ph->ver = 1;
+		ph->type = 1;
+		ph->code = 0;
+		ph->sid = cm->xmit_pppoe_session_id;
+		ph->length = htons(len);
+		*(__be16 *)(ph + 1) = htons(PPP_IP);
+
+		proto = htons(ETH_P_PPP_SES);
+		skb->protocol = proto;
+	}
 
-	/*
-	 * Is our packet too short to contain a valid UDP header?
-	 */
-	if (unlikely(!pskb_may_pull(skb, (sizeof(struct sfe_ipv4_udp_hdr) + ihl)))) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_UDP_HEADER_INCOMPLETE]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+	eth = (struct sfe_ipv4_eth_hdr *)__skb_push(skb, ETH_HLEN);
+	eth->h_proto = proto;
+	eth->h_dest[0] = cm->xmit_dest_mac[0];
+	eth->h_dest[1] = cm->xmit_dest_mac[1];
+	eth->h_dest[2] = cm->xmit_dest_mac[2];
+	eth->h_source[0] = cm->xmit_src_mac[0];
+	eth->h_source[1] = cm->xmit_src_mac[1];
+	eth->h_source[2] = cm->xmit_src_mac[2];
+
+	if (cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_VLAN_TAG) {
+		__vlan_hwaccel_put_tag(skb, htons(ETH_P_8021Q), cm->xmit_vlan_tag);
+	}
+}
 
-		DEBUG_TRACE("packet too short for UDP header\n");
-		return 0;
+/*
+ * sfe_ipv4_find_wildcard_rule()
+ *	Find the first wildcard rule that matches a packet.
+ *
+ * On entry we must be within an RCU read-side critical section.
+ */
+static struct sfe_ipv4_wildcard_rule *sfe_ipv4_find_wildcard_rule(struct sfe_ipv4 *si, struct net_device *dev,
+								  u8 protocol, __be32 src_ip, __be16 src_port,
+								  __be32 dest_ip, __be16 dest_port)
+{
+	struct sfe_ipv4_wildcard_rule *wr;
+
+	list_for_each_entry_rcu(wr, &si->wildcard_rules, list) {
+		__be32 ip;
+		u16 port;
+
+		if ((wr->match_dev != dev) || (wr->match_protocol != protocol)) {
+			continue;
+		}
+
+		if (wr->match_src) {
+			ip = src_ip;
+			port = ntohs(src_port);
+		} else {
+			ip = dest_ip;
+			port = ntohs(dest_port);
+		}
+
+		if (wr->match_ip && (wr->match_ip != ip)) {
+			continue;
+		}
+
+		if ((port < wr->match_port_lo) || (port > wr->match_port_hi)) {
+			continue;
+		}
+
+		return wr;
 	}
 
-	/*
-	 * Read the IP address and port information.  Read the IP header data first
-	 * because we've almost certainly got that in the cache.  We may not yet have
-	 * the UDP header cached though so allow more time for any prefetching.
-	 */
-	src_ip = iph->saddr;
-	dest_ip = iph->daddr;
+	return NULL;
+}
+
+/*
+ * sfe_ipv4_recv_udp_wildcard()
+ *	Forward a UDP packet that has no connection using a wildcard rule.
+ *
+ * There is no per-flow state here, so unlike a connection the translation
+ * checksum adjustments are worked out for each packet.
+ */
+static int sfe_ipv4_recv_udp_wildcard(struct sfe_ipv4 *si, struct sk_buff *skb, struct net_device *dev,
+				      unsigned int len, struct sfe_ipv4_ip_hdr *iph, unsigned int ihl)
+{
+	struct sfe_ipv4_udp_hdr *udph;
+	struct sfe_ipv4_wildcard_rule *wr;
+	struct sfe_ipv4_wildcard_stats *ws;
+	struct net_device *xmit_dev;
+	u8 ttl;
 
 	udph = (struct sfe_ipv4_udp_hdr *)(skb->data + ihl);
-	src_port = udph->source;
-	dest_port = udph->dest;
 
-	spin_lock_bh(&si->lock);
+	rcu_read_lock();
 
-	/*
-	 * Look for a connection match.
-	 */
-#ifdef CONFIG_NF_FLOW_COOKIE
-	cm = si->sfe_flow_cookie_table[skb->flow_cookie & SFE_FLOW_COOKIE_MASK].match;
-	if (unlikely(!cm)) {
-		cm = sfe_ipv4_find_sfe_ipv4_connection_match(si, dev, IPPROTO_UDP, src_ip, src_port, dest_ip, dest_port);
-	}
-#else
-	cm = sfe_ipv4_find_sfe_ipv4_connection_match(si, dev, IPPROTO_UDP, src_ip, src_port, dest_ip, dest_port);
-#endif
-	if (unlikely(!cm)) {
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_UDP_NO_CONNECTION]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+	wr = sfe_ipv4_find_wildcard_rule(si, dev, IPPROTO_UDP, iph->saddr, udph->source, iph->daddr, udph->dest);
+	if (!wr) {
+		rcu_read_unlock();
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_UDP_NO_CONNECTION);
 
-		DEBUG_TRACE("no connection found\n");
+		DEBUG_TRACE("no connection or wildcard rule found\n");
 		return 0;
 	}
 
 	/*
-	 * If our packet has beern marked as "flush on find" we can't actually
-	 * forward it in the fast path, but now that we've found an associated
-	 * connection we can flush that out before we process the packet.
+	 * Does our TTL allow forwarding?
 	 */
-	if (unlikely(flush_on_find)) {
-		struct sfe_ipv4_connection *c = cm->connection;
-		sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_UDP_IP_OPTIONS_OR_INITIAL_FRAGMENT]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+	ttl = iph->ttl;
+	if (unlikely(ttl < 2)) {
+		rcu_read_unlock();
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_UDP_SMALL_TTL);
 
-		DEBUG_TRACE("flush on find\n");
-		sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+		DEBUG_TRACE("ttl too low\n");
 		return 0;
 	}
 
-#ifdef CONFIG_XFRM
 	/*
-	 * We can't accelerate the flow on this direction, just let it go
-	 * through the slow path.
+	 * If our packet is larger than the MTU of the transmit interface then
+	 * we can't forward it easily.
 	 */
-	if (unlikely(!cm->flow_accel)) {
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+	if (unlikely(len > wr->xmit_dev_mtu)) {
+		rcu_read_unlock();
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_UDP_NEEDS_FRAGMENTATION);
+
+		DEBUG_TRACE("larger than mtu\n");
 		return 0;
 	}
-#endif
 
 	/*
-	 * Does our TTL allow forwarding?
+	 * From this point on we're good to modify the packet.
+	 */
+
+	/*
+	 * Check if skb was cloned. If it was, unshare it. Because
+	 * the data area is going to be written in this path and we don't want to
+	 * change the cloned skb's data section.
+	 */
+	if (unlikely(skb_cloned(skb))) {
+		DEBUG_TRACE("%p: skb is a cloned skb\n", skb);
+		skb = skb_unshare(skb, GFP_ATOMIC);
+		if (!skb) {
+			DEBUG_WARN("Failed to unshare the cloned skb\n");
+			rcu_read_unlock();
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_CLONED_SKB_UNSHARE_ERROR);
+
+			return 0;
+		}
+
+		iph = (struct sfe_ipv4_ip_hdr *)skb->data;
+		udph = (struct sfe_ipv4_udp_hdr *)(skb->data + ihl);
+	}
+
+	/*
+	 * Update DSCP
+	 */
+	if (unlikely(wr->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_DSCP_REMARK)) {
+		iph->tos = (iph->tos & SFE_IPV4_DSCP_MASK) | wr->dscp;
+	}
+
+	/*
+	 * Decrement our TTL.
+	 */
+	iph->ttl = ttl - 1;
+
+	/*
+	 * Translate the matched address and port.  Ports keep their offset within
+	 * the matched range.
+	 */
+	if (unlikely(wr->flags & (SFE_IPV4_CONNECTION_MATCH_FLAG_XLATE_SRC | SFE_IPV4_CONNECTION_MATCH_FLAG_XLATE_DEST))) {
+		__be32 *ip;
+		__be16 *port;
+		__be32 new_ip;
+		__be16 new_port;
+
+		if (wr->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_XLATE_SRC) {
+			ip = &iph->saddr;
+			port = &udph->source;
+		} else {
+			ip = &iph->daddr;
+			port = &udph->dest;
+		}
+
+		new_ip = wr->xlate_ip ? wr->xlate_ip : *ip;
+		new_port = wr->xlate_port ? htons(wr->xlate_port + (ntohs(*port) - wr->match_port_lo)) : *port;
+
+		/*
+		 * Do we have a non-zero UDP checksum?  If we do then we need
+		 * to update it.
+		 */
+		if (likely(udph->check)) {
+			inet_proto_csum_replace4(&udph->check, skb, *ip, new_ip, true);
+			inet_proto_csum_replace2(&udph->check, skb, *port, new_port, false);
+			if (unlikely(!udph->check)) {
+				udph->check = CSUM_MANGLED_0;
+			}
+		}
+
+		*ip = new_ip;
+		*port = new_port;
+	}
+
+	/*
+	 * Replace the IP checksum.
+	 */
+	iph->check = sfe_ipv4_gen_ip_csum(iph);
+
+	/*
+	 * Update traffic stats.
+	 */
+	ws = this_cpu_ptr(wr->stats);
+	ws->rx_packets++;
+	ws->rx_bytes += len;
+
+	xmit_dev = wr->xmit_dev;
+	skb->dev = xmit_dev;
+
+	/*
+	 * Check to see if we need to write a header.
+	 */
+	if (likely(wr->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_L2_HDR)) {
+		if (unlikely(!(wr->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_FAST_ETH_HDR))) {
+			dev_hard_header(skb, xmit_dev, ETH_P_IP,
+					wr->xmit_dest_mac, wr->xmit_src_mac, len);
+		} else {
+			/*
+			 * For the simple case we write this really fast.
+			 */
+			struct sfe_ipv4_eth_hdr *eth = (struct sfe_ipv4_eth_hdr *)__skb_push(skb, ETH_HLEN);
+			eth->h_proto = htons(ETH_P_IP);
+			eth->h_dest[0] = wr->xmit_dest_mac[0];
+			eth->h_dest[1] = wr->xmit_dest_mac[1];
+			eth->h_dest[2] = wr->xmit_dest_mac[2];
+			eth->h_source[0] = wr->xmit_src_mac[0];
+			eth->h_source[1] = wr->xmit_src_mac[1];
+			eth->h_source[2] = wr->xmit_src_mac[2];
+		}
+	}
+
+	/*
+	 * Update priority of skb.
+	 */
+	if (unlikely(wr->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_PRIORITY_REMARK)) {
+		skb->priority = wr->priority;
+	}
+
+	/*
+	 * Mark outgoing packet.
+	 */
+	skb->mark = wr->mark;
+
+	this_cpu_inc(si->stats_pcpu->packets_forwarded64);
+	rcu_read_unlock();
+
+	/*
+	 * Mark that this packet has been fast forwarded.
+	 */
+	skb->fast_forwarded = 1;
+
+	/*
+	 * Send the packet on its way.
+	 */
+	dev_queue_xmit(skb);
+
+	return 1;
+}
+
+/*
+ * sfe_ipv4_recv_udp()
+ *	Handle UDP packet receives and forwarding.
+ */
+static int sfe_ipv4_recv_udp(struct sfe_ipv4 *si, struct sk_buff *skb, struct net_device *dev,
+			     unsigned int len, struct sfe_ipv4_ip_hdr *iph, unsigned int ihl, bool slow_path)
+{
+	struct sfe_ipv4_udp_hdr *udph;
+	__be32 src_ip;
+	__be32 dest_ip;
+	__be16 src_port;
+	__be16 dest_port;
+	struct sfe_ipv4_connection_match *cm;
+	u8 ttl;
+	struct net_device *xmit_dev;
+	bool ret;
+
+	/*
+	 * Is our packet too short to contain a valid UDP header?
+	 */
+	if (unlikely(!pskb_may_pull(skb, (sizeof(struct sfe_ipv4_udp_hdr) + ihl)))) {
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_UDP_HEADER_INCOMPLETE);
+
+		DEBUG_TRACE("packet too short for UDP header\n");
+		return 0;
+	}
+
+	/*
+	 * IP options and fragmented datagrams have to go through the slow path, but
+	 * they say nothing about the connection so we leave any rule we have in place.
+	 */
+	if (unlikely(slow_path)) {
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_UDP_IP_OPTIONS_OR_INITIAL_FRAGMENT);
+
+		DEBUG_TRACE("IP options or fragment\n");
+		return 0;
+	}
+
+	/*
+	 * Read the IP address and port information.  Read the IP header data first
+	 * because we've almost certainly got that in the cache.  We may not yet have
+	 * the UDP header cached though so allow more time for any prefetching.
+	 */
+	src_ip = iph->saddr;
+	dest_ip = iph->daddr;
+
+	udph = (struct sfe_ipv4_udp_hdr *)(skb->data + ihl);
+	src_port = udph->source;
+	dest_port = udph->dest;
+
+	rcu_read_lock();
+
+	/*
+	 * Look for a connection match.
+	 */
+#ifdef CONFIG_NF_FLOW_COOKIE
+	cm = si->sfe_flow_cookie_table[skb->flow_cookie & SFE_FLOW_COOKIE_MASK].match;
+	if (unlikely(!cm)) {
+		cm = sfe_ipv4_find_connection_match_cached(si, skb, dev, IPPROTO_UDP, src_ip, src_port, dest_ip, dest_port);
+	}
+#else
+	cm = sfe_ipv4_find_connection_match_cached(si, skb, dev, IPPROTO_UDP, src_ip, src_port, dest_ip, dest_port);
+#endif
+	if (unlikely(!cm)) {
+		rcu_read_unlock();
+
+		/*
+		 * Flows covered by a wildcard rule don't get a connection of their own.
+		 */
+		if (unlikely(READ_ONCE(si->num_wildcard_rules))) {
+			return sfe_ipv4_recv_udp_wildcard(si, skb, dev, len, iph, ihl);
+		}
+
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_UDP_NO_CONNECTION);
+
+		DEBUG_TRACE("no connection found\n");
+		return 0;
+	}
+
+#ifdef CONFIG_XFRM
+	/*
+	 * We can't accelerate the flow on this direction, just let it go
+	 * through the slow path.
+	 */
+	if (unlikely(!cm->flow_accel)) {
+		rcu_read_unlock();
+		this_cpu_inc(si->stats_pcpu->packets_not_forwarded64);
+		return 0;
+	}
+#endif
+
+	/*
+	 * Does our TTL allow forwarding?
 	 */
 	ttl = iph->ttl;
 	if (unlikely(ttl < 2)) {
 		struct sfe_ipv4_connection *c = cm->connection;
-		sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_UDP_SMALL_TTL]++;
-		si->packets_not_forwarded++;
+		spin_lock_bh(&si->lock);
+		ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_UDP_SMALL_TTL);
 
 		DEBUG_TRACE("ttl too low\n");
-		sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+		if (ret) {
+			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+		}
+		rcu_read_unlock();
 		return 0;
 	}
 
@@ -1291,13 +2322,29 @@ static int sfe_ipv4_recv_udp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 	 */
 	if (unlikely(len > cm->xmit_dev_mtu)) {
 		struct sfe_ipv4_connection *c = cm->connection;
-		sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_UDP_NEEDS_FRAGMENTATION]++;
-		si->packets_not_forwarded++;
+		spin_lock_bh(&si->lock);
+		ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_UDP_NEEDS_FRAGMENTATION);
 
 		DEBUG_TRACE("larger than mtu\n");
-		sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+		if (ret) {
+			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+		}
+		rcu_read_unlock();
+		return 0;
+	}
+
+	/*
+	 * We need room for a PPPoE header and can't add one to a GSO packet, so
+	 * leave those to the slow path.
+	 */
+	if (unlikely((cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_PPPOE_ENCAP) &&
+		     (skb_is_gso(skb) || (skb_headroom(skb) < (ETH_HLEN + PPPOE_SES_HLEN))))) {
+		rcu_read_unlock();
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_PPPOE_NEEDS_SLOW_PATH);
+
+		DEBUG_TRACE("can't add PPPoE header\n");
 		return 0;
 	}
 
@@ -1315,9 +2362,8 @@ static int sfe_ipv4_recv_udp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 		skb = skb_unshare(skb, GFP_ATOMIC);
                 if (!skb) {
 			DEBUG_WARN("Failed to unshare the cloned skb\n");
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_CLONED_SKB_UNSHARE_ERROR]++;
-			si->packets_not_forwarded++;
-			spin_unlock_bh(&si->lock);
+			rcu_read_unlock();
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_CLONED_SKB_UNSHARE_ERROR);
 
 			return 0;
 		}
@@ -1405,22 +2451,30 @@ static int sfe_ipv4_recv_udp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 	/*
 	 * Update traffic stats.
 	 */
-	cm->rx_packet_count++;
-	cm->rx_byte_count += len;
+	atomic_inc(&cm->rx_packet_count);
+	atomic_add(len, &cm->rx_byte_count);
 
 	/*
 	 * If we're not already on the active list then insert ourselves at the tail
-	 * of the current list.
+	 * of the current list.  This only needs the lock once per sync period so we
+	 * check without it first and then again once we hold it.  A connection that
+	 * has already been removed must never be put back on the list.
 	 */
 	if (unlikely(!cm->active)) {
-		cm->active = true;
-		cm->active_prev = si->active_tail;
-		if (likely(si->active_tail)) {
-			si->active_tail->active_next = cm;
-		} else {
-			si->active_head = cm;
+		spin_lock_bh(&si->lock);
+		if (likely(!cm->active && !cm->connection->removed)) {
+			cm->active = true;
+			cm->active_jiffies = jiffies;
+			si->num_active++;
+			cm->active_prev = si->active_tail;
+			if (likely(si->active_tail)) {
+				si->active_tail->active_next = cm;
+			} else {
+				si->active_head = cm;
+			}
+			si->active_tail = cm;
 		}
-		si->active_tail = cm;
+		spin_unlock_bh(&si->lock);
 	}
 
 	xmit_dev = cm->xmit_dev;
@@ -1430,7 +2484,9 @@ static int sfe_ipv4_recv_udp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 	 * Check to see if we need to write a header.
 	 */
 	if (likely(cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_L2_HDR)) {
-		if (unlikely(!(cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_FAST_ETH_HDR))) {
+		if (unlikely(cm->flags & (SFE_IPV4_CONNECTION_MATCH_FLAG_VLAN_TAG | SFE_IPV4_CONNECTION_MATCH_FLAG_PPPOE_ENCAP))) {
+			sfe_ipv4_write_encap_hdrs(skb, cm);
+		} else if (unlikely(!(cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_FAST_ETH_HDR))) {
 			dev_hard_header(skb, xmit_dev, ETH_P_IP,
 					cm->xmit_dest_mac, cm->xmit_src_mac, len);
 		} else {
@@ -1463,8 +2519,8 @@ static int sfe_ipv4_recv_udp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 		DEBUG_TRACE("SKB MARK is NON ZERO %x\n", skb->mark);
 	}
 
-	si->packets_forwarded++;
-	spin_unlock_bh(&si->lock);
+	this_cpu_inc(si->stats_pcpu->packets_forwarded64);
+	rcu_read_unlock();
 
 	/*
 	 * We're going to check for GSO flags when we transmit the packet so
@@ -1565,12 +2621,52 @@ static bool sfe_ipv4_process_tcp_option_sack(const struct sfe_ipv4_tcp_hdr *th,
 	return true;
 }
 
+/*
+ * sfe_ipv4_tcp_advance_seq()
+ *	Move a window sequence number forward to val, but never back.
+ *
+ * The window state is updated from the fast path without holding any lock,
+ * so two CPUs may race here.  The cmpxchg loop makes sure that the larger
+ * value always wins and that no update is lost.
+ */
+static inline void sfe_ipv4_tcp_advance_seq(u32 *seqp, u32 val)
+{
+	u32 old = READ_ONCE(*seqp);
+
+	while ((s32)(val - old) > 0) {
+		u32 prev = cmpxchg(seqp, old, val);
+		if (prev == old) {
+			break;
+		}
+
+		old = prev;
+	}
+}
+
+/*
+ * sfe_ipv4_tcp_advance_win()
+ *	Raise a maximum window size to val, but never lower it.
+ */
+static inline void sfe_ipv4_tcp_advance_win(u32 *winp, u32 val)
+{
+	u32 old = READ_ONCE(*winp);
+
+	while (old < val) {
+		u32 prev = cmpxchg(winp, old, val);
+		if (prev == old) {
+			break;
+		}
+
+		old = prev;
+	}
+}
+
 /*
  * sfe_ipv4_recv_tcp()
  *	Handle TCP packet receives and forwarding.
  */
 static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct net_device *dev,
-			     unsigned int len, struct sfe_ipv4_ip_hdr *iph, unsigned int ihl, bool flush_on_find)
+			     unsigned int len, struct sfe_ipv4_ip_hdr *iph, unsigned int ihl, bool slow_path)
 {
 	struct sfe_ipv4_tcp_hdr *tcph;
 	__be32 src_ip;
@@ -1582,20 +2678,29 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 	u8 ttl;
 	u32 flags;
 	struct net_device *xmit_dev;
+	bool ret;
 
 	/*
 	 * Is our packet too short to contain a valid UDP header?
 	 */
 	if (unlikely(!pskb_may_pull(skb, (sizeof(struct sfe_ipv4_tcp_hdr) + ihl)))) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_HEADER_INCOMPLETE]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_HEADER_INCOMPLETE);
 
 		DEBUG_TRACE("packet too short for TCP header\n");
 		return 0;
 	}
 
+	/*
+	 * IP options and fragmented segments have to go through the slow path, but
+	 * they say nothing about the connection so we leave any rule we have in place.
+	 */
+	if (unlikely(slow_path)) {
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_IP_OPTIONS_OR_INITIAL_FRAGMENT);
+
+		DEBUG_TRACE("IP options or fragment\n");
+		return 0;
+	}
+
 	/*
 	 * Read the IP address and port information.  Read the IP header data first
 	 * because we've almost certainly got that in the cache.  We may not yet have
@@ -1609,7 +2714,7 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 	dest_port = tcph->dest;
 	flags = tcp_flag_word(tcph);
 
-	spin_lock_bh(&si->lock);
+	rcu_read_lock();
 
 	/*
 	 * Look for a connection match.
@@ -1617,10 +2722,10 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 #ifdef CONFIG_NF_FLOW_COOKIE
 	cm = si->sfe_flow_cookie_table[skb->flow_cookie & SFE_FLOW_COOKIE_MASK].match;
 	if (unlikely(!cm)) {
-		cm = sfe_ipv4_find_sfe_ipv4_connection_match(si, dev, IPPROTO_TCP, src_ip, src_port, dest_ip, dest_port);
+		cm = sfe_ipv4_find_connection_match_cached(si, skb, dev, IPPROTO_TCP, src_ip, src_port, dest_ip, dest_port);
 	}
 #else
-	cm = sfe_ipv4_find_sfe_ipv4_connection_match(si, dev, IPPROTO_TCP, src_ip, src_port, dest_ip, dest_port);
+	cm = sfe_ipv4_find_connection_match_cached(si, skb, dev, IPPROTO_TCP, src_ip, src_port, dest_ip, dest_port);
 #endif
 	if (unlikely(!cm)) {
 		/*
@@ -1628,48 +2733,28 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 		 * may be because this is a non-fast connection (not running established).
 		 * For diagnostic purposes we differentiate this here.
 		 */
+		rcu_read_unlock();
 		if (likely((flags & (TCP_FLAG_SYN | TCP_FLAG_RST | TCP_FLAG_FIN | TCP_FLAG_ACK)) == TCP_FLAG_ACK)) {
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_NO_CONNECTION_FAST_FLAGS]++;
-			si->packets_not_forwarded++;
-			spin_unlock_bh(&si->lock);
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_NO_CONNECTION_FAST_FLAGS);
 
 			DEBUG_TRACE("no connection found - fast flags\n");
 			return 0;
 		}
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_NO_CONNECTION_SLOW_FLAGS]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_NO_CONNECTION_SLOW_FLAGS);
 
 		DEBUG_TRACE("no connection found - slow flags: 0x%x\n",
 			    flags & (TCP_FLAG_SYN | TCP_FLAG_RST | TCP_FLAG_FIN | TCP_FLAG_ACK));
 		return 0;
 	}
 
-	/*
-	 * If our packet has beern marked as "flush on find" we can't actually
-	 * forward it in the fast path, but now that we've found an associated
-	 * connection we can flush that out before we process the packet.
-	 */
-	if (unlikely(flush_on_find)) {
-		struct sfe_ipv4_connection *c = cm->connection;
-		sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_IP_OPTIONS_OR_INITIAL_FRAGMENT]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
-
-		DEBUG_TRACE("flush on find\n");
-		sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
-		return 0;
-	}
-
 #ifdef CONFIG_XFRM
 	/*
 	 * We can't accelerate the flow on this direction, just let it go
 	 * through the slow path.
 	 */
 	if (unlikely(!cm->flow_accel)) {
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		rcu_read_unlock();
+		this_cpu_inc(si->stats_pcpu->packets_not_forwarded64);
 		return 0;
 	}
 #endif
@@ -1679,29 +2764,36 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 	ttl = iph->ttl;
 	if (unlikely(ttl < 2)) {
 		struct sfe_ipv4_connection *c = cm->connection;
-		sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_SMALL_TTL]++;
-		si->packets_not_forwarded++;
+		spin_lock_bh(&si->lock);
+		ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_SMALL_TTL);
 
 		DEBUG_TRACE("ttl too low\n");
-		sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+		if (ret) {
+			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+		}
+		rcu_read_unlock();
 		return 0;
 	}
 
 	/*
 	 * If our packet is larger than the MTU of the transmit interface then
-	 * we can't forward it easily.
+	 * we can't forward it easily.  GRO super-packets are fine provided the
+	 * segments GSO will cut them back into fit.
 	 */
-	if (unlikely((len > cm->xmit_dev_mtu) && !skb_is_gso(skb))) {
+	if (unlikely(!sfe_ipv4_skb_fits_mtu(skb, len, ihl, cm->xmit_dev_mtu))) {
 		struct sfe_ipv4_connection *c = cm->connection;
-		sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_NEEDS_FRAGMENTATION]++;
-		si->packets_not_forwarded++;
+		spin_lock_bh(&si->lock);
+		ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_NEEDS_FRAGMENTATION);
 
 		DEBUG_TRACE("larger than mtu\n");
-		sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+		if (ret) {
+			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+		}
+		rcu_read_unlock();
 		return 0;
 	}
 
@@ -1711,14 +2803,17 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 	 */
 	if (unlikely((flags & (TCP_FLAG_SYN | TCP_FLAG_RST | TCP_FLAG_FIN | TCP_FLAG_ACK)) != TCP_FLAG_ACK)) {
 		struct sfe_ipv4_connection *c = cm->connection;
-		sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_FLAGS]++;
-		si->packets_not_forwarded++;
+		spin_lock_bh(&si->lock);
+		ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_FLAGS);
 
 		DEBUG_TRACE("TCP flags: 0x%x are not fast\n",
 			    flags & (TCP_FLAG_SYN | TCP_FLAG_RST | TCP_FLAG_FIN | TCP_FLAG_ACK));
-		sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+		if (ret) {
+			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+		}
+		rcu_read_unlock();
 		return 0;
 	}
 
@@ -1726,6 +2821,9 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 
 	/*
 	 * Are we doing sequence number checking?
+	 *
+	 * The window state is updated without holding the lock, see
+	 * sfe_ipv4_tcp_advance_seq().
 	 */
 	if (likely(!(cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_NO_SEQ_CHECK))) {
 		u32 seq;
@@ -1735,22 +2833,24 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 		u32 end;
 		u32 left_edge;
 		u32 scaled_win;
-		u32 max_end;
 
 		/*
 		 * Is our sequence fully past the right hand edge of the window?
 		 */
 		seq = ntohl(tcph->seq);
-		if (unlikely((s32)(seq - (cm->protocol_state.tcp.max_end + 1)) > 0)) {
+		if (unlikely((s32)(seq - (READ_ONCE(cm->protocol_state.tcp.max_end) + 1)) > 0)) {
 			struct sfe_ipv4_connection *c = cm->connection;
-			sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_SEQ_EXCEEDS_RIGHT_EDGE]++;
-			si->packets_not_forwarded++;
+			spin_lock_bh(&si->lock);
+			ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 			spin_unlock_bh(&si->lock);
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_SEQ_EXCEEDS_RIGHT_EDGE);
 
 			DEBUG_TRACE("seq: %u exceeds right edge: %u\n",
 				    seq, cm->protocol_state.tcp.max_end + 1);
-			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			if (ret) {
+				sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			}
+			rcu_read_unlock();
 			return 0;
 		}
 
@@ -1760,13 +2860,16 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 		data_offs = tcph->doff << 2;
 		if (unlikely(data_offs < sizeof(struct sfe_ipv4_tcp_hdr))) {
 			struct sfe_ipv4_connection *c = cm->connection;
-			sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_SMALL_DATA_OFFS]++;
-			si->packets_not_forwarded++;
+			spin_lock_bh(&si->lock);
+			ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 			spin_unlock_bh(&si->lock);
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_SMALL_DATA_OFFS);
 
 			DEBUG_TRACE("TCP data offset: %u, too small\n", data_offs);
-			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			if (ret) {
+				sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			}
+			rcu_read_unlock();
 			return 0;
 		}
 
@@ -1777,13 +2880,16 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 		sack = ack;
 		if (unlikely(!sfe_ipv4_process_tcp_option_sack(tcph, data_offs, &sack))) {
 			struct sfe_ipv4_connection *c = cm->connection;
-			sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_BAD_SACK]++;
-			si->packets_not_forwarded++;
+			spin_lock_bh(&si->lock);
+			ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 			spin_unlock_bh(&si->lock);
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_BAD_SACK);
 
 			DEBUG_TRACE("TCP option SACK size is wrong\n");
-			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			if (ret) {
+				sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			}
+			rcu_read_unlock();
 			return 0;
 		}
 
@@ -1793,68 +2899,85 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 		data_offs += sizeof(struct sfe_ipv4_ip_hdr);
 		if (unlikely(len < data_offs)) {
 			struct sfe_ipv4_connection *c = cm->connection;
-			sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_BIG_DATA_OFFS]++;
-			si->packets_not_forwarded++;
+			spin_lock_bh(&si->lock);
+			ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 			spin_unlock_bh(&si->lock);
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_BIG_DATA_OFFS);
 
 			DEBUG_TRACE("TCP data offset: %u, past end of packet: %u\n",
 				    data_offs, len);
-			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			if (ret) {
+				sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			}
+			rcu_read_unlock();
 			return 0;
 		}
 
+		/*
+		 * For a GRO super-packet this covers the payload of every merged
+		 * segment, which is exactly what the receiver will see once GSO has
+		 * split it up again, so the window tracking holds as it is.
+		 */
 		end = seq + len - data_offs;
 
 		/*
 		 * Is our sequence fully before the left hand edge of the window?
 		 */
-		if (unlikely((s32)(end - (cm->protocol_state.tcp.end
-						- counter_cm->protocol_state.tcp.max_win - 1)) < 0)) {
+		if (unlikely((s32)(end - (READ_ONCE(cm->protocol_state.tcp.end)
+						- READ_ONCE(counter_cm->protocol_state.tcp.max_win) - 1)) < 0)) {
 			struct sfe_ipv4_connection *c = cm->connection;
-			sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_SEQ_BEFORE_LEFT_EDGE]++;
-			si->packets_not_forwarded++;
+			spin_lock_bh(&si->lock);
+			ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 			spin_unlock_bh(&si->lock);
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_SEQ_BEFORE_LEFT_EDGE);
 
 			DEBUG_TRACE("seq: %u before left edge: %u\n",
 				    end, cm->protocol_state.tcp.end - counter_cm->protocol_state.tcp.max_win - 1);
-			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			if (ret) {
+				sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			}
+			rcu_read_unlock();
 			return 0;
 		}
 
 		/*
 		 * Are we acking data that is to the right of what has been sent?
 		 */
-		if (unlikely((s32)(sack - (counter_cm->protocol_state.tcp.end + 1)) > 0)) {
+		if (unlikely((s32)(sack - (READ_ONCE(counter_cm->protocol_state.tcp.end) + 1)) > 0)) {
 			struct sfe_ipv4_connection *c = cm->connection;
-			sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_ACK_EXCEEDS_RIGHT_EDGE]++;
-			si->packets_not_forwarded++;
+			spin_lock_bh(&si->lock);
+			ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 			spin_unlock_bh(&si->lock);
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_ACK_EXCEEDS_RIGHT_EDGE);
 
 			DEBUG_TRACE("ack: %u exceeds right edge: %u\n",
 				    sack, counter_cm->protocol_state.tcp.end + 1);
-			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			if (ret) {
+				sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			}
+			rcu_read_unlock();
 			return 0;
 		}
 
 		/*
 		 * Is our ack too far before the left hand edge of the window?
 		 */
-		left_edge = counter_cm->protocol_state.tcp.end
-			    - cm->protocol_state.tcp.max_win
+		left_edge = READ_ONCE(counter_cm->protocol_state.tcp.end)
+			    - READ_ONCE(cm->protocol_state.tcp.max_win)
 			    - SFE_IPV4_TCP_MAX_ACK_WINDOW
 			    - 1;
 		if (unlikely((s32)(sack - left_edge) < 0)) {
 			struct sfe_ipv4_connection *c = cm->connection;
-			sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_TCP_ACK_BEFORE_LEFT_EDGE]++;
-			si->packets_not_forwarded++;
+			spin_lock_bh(&si->lock);
+			ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 			spin_unlock_bh(&si->lock);
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_TCP_ACK_BEFORE_LEFT_EDGE);
 
 			DEBUG_TRACE("ack: %u before left edge: %u\n", sack, left_edge);
-			sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			if (ret) {
+				sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+			}
+			rcu_read_unlock();
 			return 0;
 		}
 
@@ -1864,21 +2987,26 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 		 */
 		scaled_win = ntohs(tcph->window) << cm->protocol_state.tcp.win_scale;
 		scaled_win += (sack - ack);
-		if (unlikely(cm->protocol_state.tcp.max_win < scaled_win)) {
-			cm->protocol_state.tcp.max_win = scaled_win;
-		}
+		sfe_ipv4_tcp_advance_win(&cm->protocol_state.tcp.max_win, scaled_win);
 
 		/*
 		 * If our sequence and/or ack numbers have advanced then record the new state.
 		 */
-		if (likely((s32)(end - cm->protocol_state.tcp.end) >= 0)) {
-			cm->protocol_state.tcp.end = end;
-		}
+		sfe_ipv4_tcp_advance_seq(&cm->protocol_state.tcp.end, end);
+		sfe_ipv4_tcp_advance_seq(&counter_cm->protocol_state.tcp.max_end, sack + scaled_win);
+	}
 
-		max_end = sack + scaled_win;
-		if (likely((s32)(max_end - counter_cm->protocol_state.tcp.max_end) >= 0)) {
-			counter_cm->protocol_state.tcp.max_end = max_end;
-		}
+	/*
+	 * We need room for a PPPoE header and can't add one to a GSO packet, so
+	 * leave those to the slow path.
+	 */
+	if (unlikely((cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_PPPOE_ENCAP) &&
+		     (skb_is_gso(skb) || (skb_headroom(skb) < (ETH_HLEN + PPPOE_SES_HLEN))))) {
+		rcu_read_unlock();
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_PPPOE_NEEDS_SLOW_PATH);
+
+		DEBUG_TRACE("can't add PPPoE header\n");
+		return 0;
 	}
 
 	/*
@@ -1895,9 +3023,8 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 		skb = skb_unshare(skb, GFP_ATOMIC);
                 if (!skb) {
 			DEBUG_WARN("Failed to unshare the cloned skb\n");
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_CLONED_SKB_UNSHARE_ERROR]++;
-			si->packets_not_forwarded++;
-			spin_unlock_bh(&si->lock);
+			rcu_read_unlock();
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_CLONED_SKB_UNSHARE_ERROR);
 
 			return 0;
 		}
@@ -1977,24 +3104,40 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 	iph->check = sfe_ipv4_gen_ip_csum(iph);
 
 	/*
-	 * Update traffic stats.
+	 * Update traffic stats.  A GRO super-packet leaves as gso_segs packets, each
+	 * carrying its own copy of the IP and TCP headers.
 	 */
-	cm->rx_packet_count++;
-	cm->rx_byte_count += len;
+	if (unlikely(skb_is_gso(skb))) {
+		unsigned int segs = max_t(unsigned int, skb_shinfo(skb)->gso_segs, 1);
+
+		atomic_add(segs, &cm->rx_packet_count);
+		atomic_add(len + (segs - 1) * (ihl + (tcph->doff << 2)), &cm->rx_byte_count);
+	} else {
+		atomic_inc(&cm->rx_packet_count);
+		atomic_add(len, &cm->rx_byte_count);
+	}
 
 	/*
 	 * If we're not already on the active list then insert ourselves at the tail
-	 * of the current list.
+	 * of the current list.  This only needs the lock once per sync period so we
+	 * check without it first and then again once we hold it.  A connection that
+	 * has already been removed must never be put back on the list.
 	 */
 	if (unlikely(!cm->active)) {
-		cm->active = true;
-		cm->active_prev = si->active_tail;
-		if (likely(si->active_tail)) {
-			si->active_tail->active_next = cm;
-		} else {
-			si->active_head = cm;
+		spin_lock_bh(&si->lock);
+		if (likely(!cm->active && !cm->connection->removed)) {
+			cm->active = true;
+			cm->active_jiffies = jiffies;
+			si->num_active++;
+			cm->active_prev = si->active_tail;
+			if (likely(si->active_tail)) {
+				si->active_tail->active_next = cm;
+			} else {
+				si->active_head = cm;
+			}
+			si->active_tail = cm;
 		}
-		si->active_tail = cm;
+		spin_unlock_bh(&si->lock);
 	}
 
 	xmit_dev = cm->xmit_dev;
@@ -2004,7 +3147,9 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 	 * Check to see if we need to write a header.
 	 */
 	if (likely(cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_L2_HDR)) {
-		if (unlikely(!(cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_FAST_ETH_HDR))) {
+		if (unlikely(cm->flags & (SFE_IPV4_CONNECTION_MATCH_FLAG_VLAN_TAG | SFE_IPV4_CONNECTION_MATCH_FLAG_PPPOE_ENCAP))) {
+			sfe_ipv4_write_encap_hdrs(skb, cm);
+		} else if (unlikely(!(cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_FAST_ETH_HDR))) {
 			dev_hard_header(skb, xmit_dev, ETH_P_IP,
 					cm->xmit_dest_mac, cm->xmit_src_mac, len);
 		} else {
@@ -2037,8 +3182,8 @@ static int sfe_ipv4_recv_tcp(struct sfe_ipv4 *si, struct sk_buff *skb, struct ne
 		DEBUG_TRACE("SKB MARK is NON ZERO %x\n", skb->mark);
 	}
 
-	si->packets_forwarded++;
-	spin_unlock_bh(&si->lock);
+	this_cpu_inc(si->stats_pcpu->packets_forwarded64);
+	rcu_read_unlock();
 
 	/*
 	 * We're going to check for GSO flags when we transmit the packet so
@@ -2086,16 +3231,14 @@ static int sfe_ipv4_recv_icmp(struct sfe_ipv4 *si, struct sk_buff *skb, struct n
 	struct sfe_ipv4_connection_match *cm;
 	struct sfe_ipv4_connection *c;
 	u32 pull_len = sizeof(struct icmphdr) + ihl;
+	bool ret;
 
 	/*
 	 * Is our packet too short to contain a valid ICMP header?
 	 */
 	len -= ihl;
 	if (!pskb_may_pull(skb, pull_len)) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_ICMP_HEADER_INCOMPLETE]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_ICMP_HEADER_INCOMPLETE);
 
 		DEBUG_TRACE("packet too short for ICMP header\n");
 		return 0;
@@ -2107,10 +3250,7 @@ static int sfe_ipv4_recv_icmp(struct sfe_ipv4 *si, struct sk_buff *skb, struct n
 	icmph = (struct icmphdr *)(skb->data + ihl);
 	if ((icmph->type != ICMP_DEST_UNREACH)
 	    && (icmph->type != ICMP_TIME_EXCEEDED)) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_ICMP_UNHANDLED_TYPE]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_ICMP_UNHANDLED_TYPE);
 
 		DEBUG_TRACE("unhandled ICMP type: 0x%x\n", icmph->type);
 		return 0;
@@ -2122,10 +3262,7 @@ static int sfe_ipv4_recv_icmp(struct sfe_ipv4 *si, struct sk_buff *skb, struct n
 	len -= sizeof(struct icmphdr);
 	pull_len += sizeof(struct sfe_ipv4_ip_hdr);
 	if (!pskb_may_pull(skb, pull_len)) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_HEADER_INCOMPLETE]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_HEADER_INCOMPLETE);
 
 		DEBUG_TRACE("Embedded IP header not complete\n");
 		return 0;
@@ -2136,10 +3273,7 @@ static int sfe_ipv4_recv_icmp(struct sfe_ipv4 *si, struct sk_buff *skb, struct n
 	 */
 	icmp_iph = (struct sfe_ipv4_ip_hdr *)(icmph + 1);
 	if (unlikely(icmp_iph->version != 4)) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_NON_V4]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_NON_V4);
 
 		DEBUG_TRACE("IP version: %u\n", icmp_iph->version);
 		return 0;
@@ -2152,10 +3286,7 @@ static int sfe_ipv4_recv_icmp(struct sfe_ipv4 *si, struct sk_buff *skb, struct n
 	icmp_ihl = icmp_ihl_words << 2;
 	pull_len += icmp_ihl - sizeof(struct sfe_ipv4_ip_hdr);
 	if (!pskb_may_pull(skb, pull_len)) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_IP_OPTIONS_INCOMPLETE]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_IP_OPTIONS_INCOMPLETE);
 
 		DEBUG_TRACE("Embedded header not large enough for IP options\n");
 		return 0;
@@ -2175,10 +3306,7 @@ static int sfe_ipv4_recv_icmp(struct sfe_ipv4 *si, struct sk_buff *skb, struct n
 		 */
 		pull_len += 8;
 		if (!pskb_may_pull(skb, pull_len)) {
-			spin_lock_bh(&si->lock);
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_UDP_HEADER_INCOMPLETE]++;
-			si->packets_not_forwarded++;
-			spin_unlock_bh(&si->lock);
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_UDP_HEADER_INCOMPLETE);
 
 			DEBUG_TRACE("Incomplete embedded UDP header\n");
 			return 0;
@@ -2196,10 +3324,7 @@ static int sfe_ipv4_recv_icmp(struct sfe_ipv4 *si, struct sk_buff *skb, struct n
 		 */
 		pull_len += 8;
 		if (!pskb_may_pull(skb, pull_len)) {
-			spin_lock_bh(&si->lock);
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_TCP_HEADER_INCOMPLETE]++;
-			si->packets_not_forwarded++;
-			spin_unlock_bh(&si->lock);
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_TCP_HEADER_INCOMPLETE);
 
 			DEBUG_TRACE("Incomplete embedded TCP header\n");
 			return 0;
@@ -2211,10 +3336,7 @@ static int sfe_ipv4_recv_icmp(struct sfe_ipv4 *si, struct sk_buff *skb, struct n
 		break;
 
 	default:
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_UNHANDLED_PROTOCOL]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_ICMP_IPV4_UNHANDLED_PROTOCOL);
 
 		DEBUG_TRACE("Unhandled embedded IP protocol: %u\n", icmp_iph->protocol);
 		return 0;
@@ -2223,7 +3345,7 @@ static int sfe_ipv4_recv_icmp(struct sfe_ipv4 *si, struct sk_buff *skb, struct n
 	src_ip = icmp_iph->saddr;
 	dest_ip = icmp_iph->daddr;
 
-	spin_lock_bh(&si->lock);
+	rcu_read_lock();
 
 	/*
 	 * Look for a connection match.  Note that we reverse the source and destination
@@ -2234,9 +3356,8 @@ static int sfe_ipv4_recv_icmp(struct sfe_ipv4 *si, struct sk_buff *skb, struct n
 	 */
 	cm = sfe_ipv4_find_sfe_ipv4_connection_match(si, dev, icmp_iph->protocol, dest_ip, dest_port, src_ip, src_port);
 	if (unlikely(!cm)) {
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_ICMP_NO_CONNECTION]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		rcu_read_unlock();
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_ICMP_NO_CONNECTION);
 
 		DEBUG_TRACE("no connection found\n");
 		return 0;
@@ -2247,12 +3368,15 @@ static int sfe_ipv4_recv_icmp(struct sfe_ipv4 *si, struct sk_buff *skb, struct n
 	 * its state.
 	 */
 	c = cm->connection;
-	sfe_ipv4_remove_sfe_ipv4_connection(si, c);
-	si->exception_events[SFE_IPV4_EXCEPTION_EVENT_ICMP_FLUSHED_CONNECTION]++;
-	si->packets_not_forwarded++;
+	spin_lock_bh(&si->lock);
+	ret = sfe_ipv4_remove_sfe_ipv4_connection(si, c);
 	spin_unlock_bh(&si->lock);
+	sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_ICMP_FLUSHED_CONNECTION);
 
-	sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+	if (ret) {
+		sfe_ipv4_flush_sfe_ipv4_connection(si, c, SFE_SYNC_REASON_FLUSH);
+	}
+	rcu_read_unlock();
 	return 0;
 }
 
@@ -2269,8 +3393,7 @@ int sfe_ipv4_recv(struct net_device *dev, struct sk_buff *skb)
 	unsigned int tot_len;
 	unsigned int frag_off;
 	unsigned int ihl;
-	bool flush_on_find;
-	bool ip_options;
+	bool slow_path;
 	struct sfe_ipv4_ip_hdr *iph;
 	u32 protocol;
 
@@ -2279,10 +3402,7 @@ int sfe_ipv4_recv(struct net_device *dev, struct sk_buff *skb)
 	 */
 	len = skb->len;
 	if (unlikely(!pskb_may_pull(skb, sizeof(struct sfe_ipv4_ip_hdr)))) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_HEADER_INCOMPLETE]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_HEADER_INCOMPLETE);
 
 		DEBUG_TRACE("len: %u is too short\n", len);
 		return 0;
@@ -2294,10 +3414,7 @@ int sfe_ipv4_recv(struct net_device *dev, struct sk_buff *skb)
 	iph = (struct sfe_ipv4_ip_hdr *)skb->data;
 	tot_len = ntohs(iph->tot_len);
 	if (unlikely(tot_len < sizeof(struct sfe_ipv4_ip_hdr))) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_BAD_TOTAL_LENGTH]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_BAD_TOTAL_LENGTH);
 
 		DEBUG_TRACE("tot_len: %u is too short\n", tot_len);
 		return 0;
@@ -2307,10 +3424,7 @@ int sfe_ipv4_recv(struct net_device *dev, struct sk_buff *skb)
 	 * Is our IP version wrong?
 	 */
 	if (unlikely(iph->version != 4)) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_NON_V4]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_NON_V4);
 
 		DEBUG_TRACE("IP version: %u\n", iph->version);
 		return 0;
@@ -2320,71 +3434,59 @@ int sfe_ipv4_recv(struct net_device *dev, struct sk_buff *skb)
 	 * Does our datagram fit inside the skb?
 	 */
 	if (unlikely(tot_len > len)) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_DATAGRAM_INCOMPLETE]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_DATAGRAM_INCOMPLETE);
 
 		DEBUG_TRACE("tot_len: %u, exceeds len: %u\n", tot_len, len);
 		return 0;
 	}
 
-	/*
-	 * Do we have a non-initial fragment?
-	 */
-	frag_off = ntohs(iph->frag_off);
-	if (unlikely(frag_off & IP_OFFSET)) {
-		spin_lock_bh(&si->lock);
-		si->exception_events[SFE_IPV4_EXCEPTION_EVENT_NON_INITIAL_FRAGMENT]++;
-		si->packets_not_forwarded++;
-		spin_unlock_bh(&si->lock);
-
-		DEBUG_TRACE("non-initial fragment\n");
-		return 0;
-	}
-
-	/*
-	 * If we have a (first) fragment then mark it to cause any connection to flush.
-	 */
-	flush_on_find = unlikely(frag_off & IP_MF) ? true : false;
-
 	/*
 	 * Do we have any IP options?  That's definite a slow path!  If we do have IP
 	 * options we need to recheck our header size.
 	 */
 	ihl = iph->ihl << 2;
-	ip_options = unlikely(ihl != sizeof(struct sfe_ipv4_ip_hdr)) ? true : false;
-	if (unlikely(ip_options)) {
+	slow_path = unlikely(ihl != sizeof(struct sfe_ipv4_ip_hdr)) ? true : false;
+	if (unlikely(slow_path)) {
 		if (unlikely(len < ihl)) {
-			spin_lock_bh(&si->lock);
-			si->exception_events[SFE_IPV4_EXCEPTION_EVENT_IP_OPTIONS_INCOMPLETE]++;
-			si->packets_not_forwarded++;
-			spin_unlock_bh(&si->lock);
+			sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_IP_OPTIONS_INCOMPLETE);
 
 			DEBUG_TRACE("len: %u is too short for header of size: %u\n", len, ihl);
 			return 0;
 		}
-
-		flush_on_find = true;
 	}
 
 	protocol = iph->protocol;
+
+	/*
+	 * Do we have a non-initial fragment?  Conntrack has to reassemble the
+	 * datagram, so the first fragment has to take the slow path too.  None of
+	 * this says anything about the connection, so we leave any rule in place.
+	 */
+	frag_off = ntohs(iph->frag_off);
+	if (unlikely(frag_off & IP_OFFSET)) {
+		sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_NON_INITIAL_FRAGMENT);
+
+		DEBUG_TRACE("non-initial fragment\n");
+		return 0;
+	}
+
+	if (unlikely(frag_off & IP_MF)) {
+		slow_path = true;
+	}
+
 	if (IPPROTO_UDP == protocol) {
-		return sfe_ipv4_recv_udp(si, skb, dev, len, iph, ihl, flush_on_find);
+		return sfe_ipv4_recv_udp(si, skb, dev, len, iph, ihl, slow_path);
 	}
 
 	if (IPPROTO_TCP == protocol) {
-		return sfe_ipv4_recv_tcp(si, skb, dev, len, iph, ihl, flush_on_find);
+		return sfe_ipv4_recv_tcp(si, skb, dev, len, iph, ihl, slow_path);
 	}
 
 	if (IPPROTO_ICMP == protocol) {
 		return sfe_ipv4_recv_icmp(si, skb, dev, len, iph, ihl);
 	}
 
-	spin_lock_bh(&si->lock);
-	si->exception_events[SFE_IPV4_EXCEPTION_EVENT_UNHANDLED_PROTOCOL]++;
-	si->packets_not_forwarded++;
-	spin_unlock_bh(&si->lock);
+	sfe_ipv4_exception_stats_inc(si, SFE_IPV4_EXCEPTION_EVENT_UNHANDLED_PROTOCOL);
 
 	DEBUG_TRACE("not UDP, TCP or ICMP: %u\n", protocol);
 	return 0;
@@ -2405,26 +3507,14 @@ sfe_ipv4_update_tcp_state(struct sfe_ipv4_connection *c,
 	repl_tcp = &repl_cm->protocol_state.tcp;
 
 	/* update orig */
-	if (orig_tcp->max_win < sic->src_td_max_window) {
-		orig_tcp->max_win = sic->src_td_max_window;
-	}
-	if ((s32)(orig_tcp->end - sic->src_td_end) < 0) {
-		orig_tcp->end = sic->src_td_end;
-	}
-	if ((s32)(orig_tcp->max_end - sic->src_td_max_end) < 0) {
-		orig_tcp->max_end = sic->src_td_max_end;
-	}
+	sfe_ipv4_tcp_advance_win(&orig_tcp->max_win, sic->src_td_max_window);
+	sfe_ipv4_tcp_advance_seq(&orig_tcp->end, sic->src_td_end);
+	sfe_ipv4_tcp_advance_seq(&orig_tcp->max_end, sic->src_td_max_end);
 
 	/* update reply */
-	if (repl_tcp->max_win < sic->dest_td_max_window) {
-		repl_tcp->max_win = sic->dest_td_max_window;
-	}
-	if ((s32)(repl_tcp->end - sic->dest_td_end) < 0) {
-		repl_tcp->end = sic->dest_td_end;
-	}
-	if ((s32)(repl_tcp->max_end - sic->dest_td_max_end) < 0) {
-		repl_tcp->max_end = sic->dest_td_max_end;
-	}
+	sfe_ipv4_tcp_advance_win(&repl_tcp->max_win, sic->dest_td_max_window);
+	sfe_ipv4_tcp_advance_seq(&repl_tcp->end, sic->dest_td_end);
+	sfe_ipv4_tcp_advance_seq(&repl_tcp->max_end, sic->dest_td_max_end);
 
 	/* update match flags */
 	orig_cm->flags &= ~SFE_IPV4_CONNECTION_MATCH_FLAG_NO_SEQ_CHECK;
@@ -2466,6 +3556,32 @@ void sfe_ipv4_update_rule(struct sfe_connection_create *sic)
 	spin_unlock_bh(&si->lock);
 }
 
+/*
+ * sfe_ipv4_match_set_encap()
+ *	Set up a connection match to add VLAN and PPPoE encapsulation itself.
+ */
+static void sfe_ipv4_match_set_encap(struct sfe_ipv4_connection_match *cm, struct sfe_connection_encap *encap)
+{
+	if (!encap->dev) {
+		return;
+	}
+
+	cm->xmit_dev = encap->dev;
+	memcpy(cm->xmit_src_mac, encap->src_mac, ETH_ALEN);
+	memcpy(cm->xmit_dest_mac, encap->dest_mac, ETH_ALEN);
+	cm->flags |= SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_L2_HDR;
+
+	if (encap->vlan_tag) {
+		cm->xmit_vlan_tag = encap->vlan_tag;
+		cm->flags |= SFE_IPV4_CONNECTION_MATCH_FLAG_VLAN_TAG;
+	}
+
+	if (encap->pppoe_session_id) {
+		cm->xmit_pppoe_session_id = encap->pppoe_session_id;
+		cm->flags |= SFE_IPV4_CONNECTION_MATCH_FLAG_PPPOE_ENCAP;
+	}
+}
+
 /*
  * sfe_ipv4_create_rule()
  *	Create a forwarding rule.
@@ -2473,6 +3589,8 @@ void sfe_ipv4_update_rule(struct sfe_connection_create *sic)
 int sfe_ipv4_create_rule(struct sfe_connection_create *sic)
 {
 	struct sfe_ipv4 *si = &__si;
+	struct sfe_ipv4_connection_object *obj;
+	struct sfe_ipv4_connection *evict = NULL;
 	struct sfe_ipv4_connection *c;
 	struct sfe_ipv4_connection_match *original_cm;
 	struct sfe_ipv4_connection_match *reply_cm;
@@ -2520,29 +3638,37 @@ int sfe_ipv4_create_rule(struct sfe_connection_create *sic)
 	}
 
 	/*
-	 * Allocate the various connection tracking objects.
+	 * If we're at our limit then make room by evicting the least recently
+	 * active connection, but only if it has actually gone idle.
 	 */
-	c = (struct sfe_ipv4_connection *)kmalloc(sizeof(struct sfe_ipv4_connection), GFP_ATOMIC);
-	if (unlikely(!c)) {
-		spin_unlock_bh(&si->lock);
-		return -ENOMEM;
-	}
+	if (unlikely(max_connections && (si->num_connections >= max_connections))) {
+		evict = si->all_connections_head;
+		if (!evict || ((get_jiffies_64() - evict->last_sync_jiffies) < SFE_IPV4_CONNECTION_EVICT_IDLE)) {
+			this_cpu_inc(si->stats_pcpu->exception_events64[SFE_IPV4_EXCEPTION_EVENT_CONNECTION_LIMIT]);
+			spin_unlock_bh(&si->lock);
+			return -ENOSPC;
+		}
 
-	original_cm = (struct sfe_ipv4_connection_match *)kmalloc(sizeof(struct sfe_ipv4_connection_match), GFP_ATOMIC);
-	if (unlikely(!original_cm)) {
-		spin_unlock_bh(&si->lock);
-		kfree(c);
-		return -ENOMEM;
+		sfe_ipv4_remove_sfe_ipv4_connection(si, evict);
 	}
 
-	reply_cm = (struct sfe_ipv4_connection_match *)kmalloc(sizeof(struct sfe_ipv4_connection_match), GFP_ATOMIC);
-	if (unlikely(!reply_cm)) {
+	/*
+	 * Allocate the connection and both of its matches in one go.
+	 */
+	obj = sfe_ipv4_alloc_connection_object(si);
+	if (unlikely(!obj)) {
+		this_cpu_inc(si->stats_pcpu->exception_events64[SFE_IPV4_EXCEPTION_EVENT_CONNECTION_NO_MEMORY]);
 		spin_unlock_bh(&si->lock);
-		kfree(original_cm);
-		kfree(c);
+		if (evict) {
+			sfe_ipv4_flush_sfe_ipv4_connection(si, evict, SFE_SYNC_REASON_FLUSH);
+		}
 		return -ENOMEM;
 	}
 
+	c = &obj->conn;
+	original_cm = &obj->original_match;
+	reply_cm = &obj->reply_match;
+
 	/*
 	 * Fill in the "original" direction connection matching object.
 	 * Note that the transmit MAC address is "dest_mac_xlate" because
@@ -2559,9 +3685,9 @@ int sfe_ipv4_create_rule(struct sfe_connection_create *sic)
 	original_cm->xlate_src_port = sic->src_port_xlate;
 	original_cm->xlate_dest_ip = sic->dest_ip_xlate.ip;
 	original_cm->xlate_dest_port = sic->dest_port_xlate;
-	original_cm->rx_packet_count = 0;
+	atomic_set(&original_cm->rx_packet_count, 0);
 	original_cm->rx_packet_count64 = 0;
-	original_cm->rx_byte_count = 0;
+	atomic_set(&original_cm->rx_byte_count, 0);
 	original_cm->rx_byte_count64 = 0;
 	original_cm->xmit_dev = dest_dev;
 	original_cm->xmit_dev_mtu = sic->dest_mtu;
@@ -2570,6 +3696,7 @@ int sfe_ipv4_create_rule(struct sfe_connection_create *sic)
 	original_cm->connection = c;
 	original_cm->counter_match = reply_cm;
 	original_cm->flags = 0;
+	original_cm->flow_hash = 0;
 	if (sic->flags & SFE_CREATE_FLAG_REMARK_PRIORITY) {
 		original_cm->priority = sic->src_priority;
 		original_cm->flags |= SFE_IPV4_CONNECTION_MATCH_FLAG_PRIORITY_REMARK;
@@ -2618,9 +3745,9 @@ int sfe_ipv4_create_rule(struct sfe_connection_create *sic)
 	reply_cm->xlate_src_port = sic->dest_port;
 	reply_cm->xlate_dest_ip = sic->src_ip.ip;
 	reply_cm->xlate_dest_port = sic->src_port;
-	reply_cm->rx_packet_count = 0;
+	atomic_set(&reply_cm->rx_packet_count, 0);
 	reply_cm->rx_packet_count64 = 0;
-	reply_cm->rx_byte_count = 0;
+	atomic_set(&reply_cm->rx_byte_count, 0);
 	reply_cm->rx_byte_count64 = 0;
 	reply_cm->xmit_dev = src_dev;
 	reply_cm->xmit_dev_mtu = sic->src_mtu;
@@ -2629,6 +3756,7 @@ int sfe_ipv4_create_rule(struct sfe_connection_create *sic)
 	reply_cm->connection = c;
 	reply_cm->counter_match = original_cm;
 	reply_cm->flags = 0;
+	reply_cm->flow_hash = 0;
 	if (sic->flags & SFE_CREATE_FLAG_REMARK_PRIORITY) {
 		reply_cm->priority = sic->dest_priority;
 		reply_cm->flags |= SFE_IPV4_CONNECTION_MATCH_FLAG_PRIORITY_REMARK;
@@ -2675,6 +3803,13 @@ int sfe_ipv4_create_rule(struct sfe_connection_create *sic)
 		reply_cm->flags |= SFE_IPV4_CONNECTION_MATCH_FLAG_XLATE_DEST;
 	}
 
+	/*
+	 * If the connection manager found VLAN or PPPoE encapsulation under our
+	 * devices then we add it ourselves and transmit on the Ethernet device.
+	 */
+	sfe_ipv4_match_set_encap(original_cm, &sic->dest_encap);
+	sfe_ipv4_match_set_encap(reply_cm, &sic->src_encap);
+
 	c->protocol = sic->protocol;
 	c->src_ip = sic->src_ip.ip;
 	c->src_ip_xlate = sic->src_ip_xlate.ip;
@@ -2691,12 +3826,19 @@ int sfe_ipv4_create_rule(struct sfe_connection_create *sic)
 	c->mark = sic->mark;
 	c->debug_read_seq = 0;
 	c->last_sync_jiffies = get_jiffies_64();
+	c->removed = false;
 
 	/*
-	 * Take hold of our source and dest devices for the duration of the connection.
+	 * Take hold of our source, dest and transmit devices, and of any conntrack
+	 * entry we're handed, for the duration of the connection.  Holding the
+	 * conntrack entry lets the connection manager sync straight to it.
 	 */
 	dev_hold(c->original_dev);
 	dev_hold(c->reply_dev);
+	dev_hold(original_cm->xmit_dev);
+	dev_hold(reply_cm->xmit_dev);
+	c->ct = sic->ct;
+	nf_conntrack_get(c->ct);
 
 	/*
 	 * Initialize the protocol-specific information that we track.
@@ -2724,6 +3866,11 @@ int sfe_ipv4_create_rule(struct sfe_connection_create *sic)
 
 	spin_unlock_bh(&si->lock);
 
+	if (evict) {
+		DEBUG_TRACE("%p: evicted to make room for %p\n", evict, c);
+		sfe_ipv4_flush_sfe_ipv4_connection(si, evict, SFE_SYNC_REASON_FLUSH);
+	}
+
 	/*
 	 * We have everything we need!
 	 */
@@ -2780,6 +3927,201 @@ void sfe_ipv4_destroy_rule(struct sfe_connection_destroy *sid)
 		   &sid->dest_ip.ip, ntohs(sid->dest_port));
 }
 
+/*
+ * sfe_ipv4_free_wildcard_rule_rcu()
+ *	Called at RCU qs state to free a wildcard rule.
+ */
+static void sfe_ipv4_free_wildcard_rule_rcu(struct rcu_head *head)
+{
+	struct sfe_ipv4_wildcard_rule *wr = container_of(head, struct sfe_ipv4_wildcard_rule, rcu);
+
+	dev_put(wr->match_dev);
+	dev_put(wr->xmit_dev);
+	free_percpu(wr->stats);
+	kfree(wr);
+}
+
+/*
+ * sfe_ipv4_find_wildcard_rule_by_key()
+ *	Find a wildcard rule with the same match as a request.
+ *
+ * Must be called with the lock held.
+ */
+static struct sfe_ipv4_wildcard_rule *sfe_ipv4_find_wildcard_rule_by_key(struct sfe_ipv4 *si,
+									 struct sfe_wildcard_rule *swr)
+{
+	struct sfe_ipv4_wildcard_rule *wr;
+	bool match_src = (swr->flags & SFE_WILDCARD_FLAG_MATCH_SRC) ? true : false;
+
+	list_for_each_entry(wr, &si->wildcard_rules, list) {
+		if ((wr->match_dev == swr->match_dev)
+		    && (wr->match_protocol == swr->protocol)
+		    && (wr->match_src == match_src)
+		    && (wr->match_ip == swr->ip.ip)
+		    && (wr->match_port_lo == ntohs(swr->port_lo))
+		    && (wr->match_port_hi == ntohs(swr->port_hi))) {
+			return wr;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * sfe_ipv4_create_wildcard_rule()
+ *	Create a wildcard forwarding rule.
+ *
+ * Packets that match a connection always use that; wildcard rules are only
+ * tried for packets that don't, in the order the rules were added.
+ */
+int sfe_ipv4_create_wildcard_rule(struct sfe_wildcard_rule *swr)
+{
+	struct sfe_ipv4 *si = &__si;
+	struct sfe_ipv4_wildcard_rule *wr;
+	struct net_device *xmit_dev = swr->xmit_dev;
+	u16 port_lo = ntohs(swr->port_lo);
+	u16 port_hi = ntohs(swr->port_hi);
+
+	/*
+	 * Only UDP is supported for now.  TCP would need its state tracking, which
+	 * is exactly what a wildcard rule doesn't have.
+	 */
+	if (swr->protocol != IPPROTO_UDP) {
+		return -EPROTONOSUPPORT;
+	}
+
+	if (unlikely((swr->match_dev->reg_state != NETREG_REGISTERED) ||
+		     (xmit_dev->reg_state != NETREG_REGISTERED))) {
+		return -EINVAL;
+	}
+
+	/*
+	 * The translated ports must not wrap.
+	 */
+	if ((port_lo > port_hi) || (swr->port_xlate && ((u32)ntohs(swr->port_xlate) + (port_hi - port_lo) > 0xffff))) {
+		return -EINVAL;
+	}
+
+	wr = kzalloc(sizeof(struct sfe_ipv4_wildcard_rule), GFP_ATOMIC);
+	if (!wr) {
+		return -ENOMEM;
+	}
+
+	wr->stats = alloc_percpu_gfp(struct sfe_ipv4_wildcard_stats, GFP_ATOMIC);
+	if (!wr->stats) {
+		kfree(wr);
+		return -ENOMEM;
+	}
+
+	wr->match_dev = swr->match_dev;
+	wr->match_protocol = swr->protocol;
+	wr->match_src = (swr->flags & SFE_WILDCARD_FLAG_MATCH_SRC) ? true : false;
+	wr->match_ip = swr->ip.ip;
+	wr->match_port_lo = port_lo;
+	wr->match_port_hi = port_hi;
+	wr->xlate_ip = swr->ip_xlate.ip;
+	wr->xlate_port = ntohs(swr->port_xlate);
+	if (wr->xlate_ip || wr->xlate_port) {
+		wr->flags |= wr->match_src ? SFE_IPV4_CONNECTION_MATCH_FLAG_XLATE_SRC : SFE_IPV4_CONNECTION_MATCH_FLAG_XLATE_DEST;
+	}
+
+	if (swr->flags & SFE_WILDCARD_FLAG_REMARK_PRIORITY) {
+		wr->priority = swr->priority;
+		wr->flags |= SFE_IPV4_CONNECTION_MATCH_FLAG_PRIORITY_REMARK;
+	}
+
+	if (swr->flags & SFE_WILDCARD_FLAG_REMARK_DSCP) {
+		wr->dscp = swr->dscp << SFE_IPV4_DSCP_SHIFT;
+		wr->flags |= SFE_IPV4_CONNECTION_MATCH_FLAG_DSCP_REMARK;
+	}
+
+	wr->mark = swr->mark;
+	wr->xmit_dev = xmit_dev;
+	wr->xmit_dev_mtu = swr->xmit_mtu ? swr->xmit_mtu : xmit_dev->mtu;
+	memcpy(wr->xmit_src_mac, swr->xmit_src_mac, ETH_ALEN);
+	memcpy(wr->xmit_dest_mac, swr->xmit_dest_mac, ETH_ALEN);
+
+	/*
+	 * For PPP links we don't write an L2 header.  For everything else we do.
+	 */
+	if (!(xmit_dev->flags & IFF_POINTOPOINT)) {
+		wr->flags |= SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_L2_HDR;
+
+		/*
+		 * If our dev writes Ethernet headers then we can write a really fast
+		 * version.
+		 */
+		if (xmit_dev->header_ops) {
+			if (xmit_dev->header_ops->create == eth_header) {
+				wr->flags |= SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_FAST_ETH_HDR;
+			}
+		}
+	}
+
+	spin_lock_bh(&si->lock);
+
+	if (sfe_ipv4_find_wildcard_rule_by_key(si, swr)) {
+		spin_unlock_bh(&si->lock);
+		free_percpu(wr->stats);
+		kfree(wr);
+		return -EADDRINUSE;
+	}
+
+	if (si->num_wildcard_rules >= SFE_IPV4_WILDCARD_RULES_MAX) {
+		spin_unlock_bh(&si->lock);
+		free_percpu(wr->stats);
+		kfree(wr);
+		return -ENOSPC;
+	}
+
+	dev_hold(wr->match_dev);
+	dev_hold(wr->xmit_dev);
+	list_add_tail_rcu(&wr->list, &si->wildcard_rules);
+	WRITE_ONCE(si->num_wildcard_rules, si->num_wildcard_rules + 1);
+
+	spin_unlock_bh(&si->lock);
+
+	DEBUG_INFO("wildcard rule created - p: %d, %s: %s:%pI4:%u-%u, xlate: %pI4:%u, xmit: %s:%pM\n",
+		   swr->protocol, wr->match_src ? "s" : "d", swr->match_dev->name, &swr->ip.ip,
+		   port_lo, port_hi, &swr->ip_xlate.ip, ntohs(swr->port_xlate),
+		   xmit_dev->name, swr->xmit_dest_mac);
+	return 0;
+}
+
+/*
+ * sfe_ipv4_remove_wildcard_rule()
+ *	Remove a wildcard rule and free it once no packet can be using it.
+ *
+ * Must be called with the lock held.
+ */
+static void sfe_ipv4_remove_wildcard_rule(struct sfe_ipv4 *si, struct sfe_ipv4_wildcard_rule *wr)
+{
+	list_del_rcu(&wr->list);
+	WRITE_ONCE(si->num_wildcard_rules, si->num_wildcard_rules - 1);
+	call_rcu(&wr->rcu, sfe_ipv4_free_wildcard_rule_rcu);
+}
+
+/*
+ * sfe_ipv4_destroy_wildcard_rule()
+ *	Destroy the wildcard rule with the same match as a request.
+ */
+int sfe_ipv4_destroy_wildcard_rule(struct sfe_wildcard_rule *swr)
+{
+	struct sfe_ipv4 *si = &__si;
+	struct sfe_ipv4_wildcard_rule *wr;
+
+	spin_lock_bh(&si->lock);
+	wr = sfe_ipv4_find_wildcard_rule_by_key(si, swr);
+	if (!wr) {
+		spin_unlock_bh(&si->lock);
+		return -ENOENT;
+	}
+
+	sfe_ipv4_remove_wildcard_rule(si, wr);
+	spin_unlock_bh(&si->lock);
+	return 0;
+}
+
 /*
  * sfe_ipv4_register_sync_rule_callback()
  *	Register a callback for rule synchronization.
@@ -2820,14 +4162,24 @@ static const struct device_attribute sfe_ipv4_debug_dev_attr =
 
 /*
  * sfe_ipv4_destroy_all_rules_for_dev()
- *	Destroy all connections that match a particular device.
+ *	Destroy all connections and wildcard rules that match a particular device.
  *
- * If we pass dev as NULL then this destroys all connections.
+ * If we pass dev as NULL then this destroys all connections and wildcard rules.
  */
 void sfe_ipv4_destroy_all_rules_for_dev(struct net_device *dev)
 {
 	struct sfe_ipv4 *si = &__si;
 	struct sfe_ipv4_connection *c;
+	struct sfe_ipv4_wildcard_rule *wr;
+	struct sfe_ipv4_wildcard_rule *tmp;
+
+	spin_lock_bh(&si->lock);
+	list_for_each_entry_safe(wr, tmp, &si->wildcard_rules, list) {
+		if (!dev || (dev == wr->match_dev) || (dev == wr->xmit_dev)) {
+			sfe_ipv4_remove_wildcard_rule(si, wr);
+		}
+	}
+	spin_unlock_bh(&si->lock);
 
 another_round:
 	spin_lock_bh(&si->lock);
@@ -2838,7 +4190,9 @@ another_round:
 		 */
 		if (!dev
 		    || (dev == c->original_dev)
-		    || (dev == c->reply_dev)) {
+		    || (dev == c->reply_dev)
+		    || (dev == c->original_match->xmit_dev)
+		    || (dev == c->reply_match->xmit_dev)) {
 			break;
 		}
 	}
@@ -2855,8 +4209,24 @@ another_round:
 	}
 }
 
+/*
+ * sfe_ipv4_sync_latency_bucket()
+ *	Work out which sync latency histogram bucket a wait falls into.
+ */
+static inline unsigned int sfe_ipv4_sync_latency_bucket(unsigned long wait)
+{
+	return min_t(unsigned int, fls(jiffies_to_msecs(wait)), SFE_DUMP_SYNC_LATENCY_BUCKETS - 1);
+}
+
 /*
  * sfe_ipv4_periodic_sync()
+ *	Sync this CPU's share of the active connections.
+ *
+ * Each CPU takes an equal share of the connections to be synced in this tick,
+ * sized from the length of the active list so that every active connection is
+ * synced within SFE_IPV4_SYNC_PERIOD however many of them there are.  Connections
+ * are taken off the active list a batch at a time with a single hold of the
+ * lock, and each batch is handed to the sync callback in one call.
  */
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0))
 static void sfe_ipv4_periodic_sync(struct timer_list *arg)
@@ -2865,12 +4235,13 @@ static void sfe_ipv4_periodic_sync(unsigned long arg)
 #endif /*KERNEL_VERSION(4, 15, 0)*/
 {
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0))
-	struct sfe_ipv4 *si = (struct sfe_ipv4 *)arg->cust_data;
+	struct sfe_ipv4_sync_state *ss = from_timer(ss, arg, timer);
 #else
-	struct sfe_ipv4 *si = (struct sfe_ipv4 *)arg;
+	struct sfe_ipv4_sync_state *ss = (struct sfe_ipv4_sync_state *)arg;
 #endif /*KERNEL_VERSION(4, 15, 0)*/
+	struct sfe_ipv4 *si = &__si;
 	u64 now_jiffies;
-	int quota;
+	unsigned int quota;
 	sfe_sync_rule_callback_t sync_rule_callback;
 
 	now_jiffies = get_jiffies_64();
@@ -2886,72 +4257,90 @@ static void sfe_ipv4_periodic_sync(unsigned long arg)
 	sfe_ipv4_update_summary_stats(si);
 
 	/*
-	 * Get an estimate of the number of connections to parse in this sync.
+	 * Work out our share of the connections to sync in this tick.
 	 */
-	quota = (si->num_connections + 63) / 64;
+	quota = DIV_ROUND_UP(si->num_active,
+			     (SFE_IPV4_SYNC_PERIOD / SFE_IPV4_SYNC_INTERVAL) * si->num_sync_cpus);
 
-	/*
-	 * Walk the "active" list and sync the connection state.
-	 */
-	while (quota--) {
-		struct sfe_ipv4_connection_match *cm;
-		struct sfe_ipv4_connection_match *counter_cm;
-		struct sfe_ipv4_connection *c;
-		struct sfe_connection_sync sis;
-
-		cm = si->active_head;
-		if (!cm) {
-			break;
-		}
+	while (quota) {
+		int num = 0;
 
 		/*
-		 * There's a possibility that our counter match is in the active list too.
-		 * If it is then remove it.
+		 * Walk the "active" list and sync the connection state.
 		 */
-		counter_cm = cm->counter_match;
-		if (counter_cm->active) {
-			counter_cm->active = false;
+		while ((num < SFE_IPV4_SYNC_BATCH_SIZE) && (num < quota)) {
+			struct sfe_ipv4_connection_match *cm;
+			struct sfe_ipv4_connection_match *counter_cm;
+			struct sfe_ipv4_connection *c;
+
+			cm = si->active_head;
+			if (!cm) {
+				break;
+			}
 
 			/*
-			 * We must have a connection preceding this counter match
-			 * because that's the one that got us to this point, so we don't have
-			 * to worry about removing the head of the list.
+			 * There's a possibility that our counter match is in the active list too.
+			 * If it is then remove it.
 			 */
-			counter_cm->active_prev->active_next = counter_cm->active_next;
+			counter_cm = cm->counter_match;
+			if (counter_cm->active) {
+				counter_cm->active = false;
+				si->num_active--;
+
+				/*
+				 * We must have a connection preceding this counter match
+				 * because that's the one that got us to this point, so we don't have
+				 * to worry about removing the head of the list.
+				 */
+				counter_cm->active_prev->active_next = counter_cm->active_next;
+
+				if (likely(counter_cm->active_next)) {
+					counter_cm->active_next->active_prev = counter_cm->active_prev;
+				} else {
+					si->active_tail = counter_cm->active_prev;
+				}
 
-			if (likely(counter_cm->active_next)) {
-				counter_cm->active_next->active_prev = counter_cm->active_prev;
+				counter_cm->active_next = NULL;
+				counter_cm->active_prev = NULL;
+			}
+
+			/*
+			 * Now remove the head of the active scan list.
+			 */
+			cm->active = false;
+			si->num_active--;
+			si->active_head = cm->active_next;
+			if (likely(cm->active_next)) {
+				cm->active_next->active_prev = NULL;
 			} else {
-				si->active_tail = counter_cm->active_prev;
+				si->active_tail = NULL;
 			}
+			cm->active_next = NULL;
 
-			counter_cm->active_next = NULL;
-			counter_cm->active_prev = NULL;
+			this_cpu_inc(si->stats_pcpu->sync_latency64[sfe_ipv4_sync_latency_bucket(jiffies - cm->active_jiffies)]);
+
+			/*
+			 * Sync the connection state, and move it to the end of the list
+			 * of all connections so that the head is always the one that
+			 * has been idle longest.
+			 */
+			c = cm->connection;
+			sfe_ipv4_connection_touch(si, c);
+			sfe_ipv4_gen_sync_sfe_ipv4_connection(si, c, &ss->sis[num], SFE_SYNC_REASON_STATS, now_jiffies);
+			num++;
 		}
 
-		/*
-		 * Now remove the head of the active scan list.
-		 */
-		cm->active = false;
-		si->active_head = cm->active_next;
-		if (likely(cm->active_next)) {
-			cm->active_next->active_prev = NULL;
-		} else {
-			si->active_tail = NULL;
+		if (!num) {
+			break;
 		}
-		cm->active_next = NULL;
 
-		/*
-		 * Sync the connection state.
-		 */
-		c = cm->connection;
-		sfe_ipv4_gen_sync_sfe_ipv4_connection(si, c, &sis, SFE_SYNC_REASON_STATS, now_jiffies);
+		quota -= num;
 
 		/*
 		 * We don't want to be holding the lock when we sync!
 		 */
 		spin_unlock_bh(&si->lock);
-		sync_rule_callback(&sis);
+		sync_rule_callback(ss->sis, num);
 		spin_lock_bh(&si->lock);
 	}
 
@@ -2959,7 +4348,56 @@ static void sfe_ipv4_periodic_sync(unsigned long arg)
 	rcu_read_unlock();
 
 done:
-	mod_timer(&si->timer, jiffies + ((HZ + 99) / 100));
+	mod_timer(&ss->timer, jiffies + SFE_IPV4_SYNC_INTERVAL);
+}
+
+/*
+ * sfe_ipv4_sync_timers_start()
+ *	Start a periodic sync timer on each online CPU.
+ *
+ * If a CPU goes offline its timer moves to another CPU and carries on, so the
+ * active list is still covered.  CPUs that come online later don't get a timer
+ * of their own.
+ */
+static void sfe_ipv4_sync_timers_start(struct sfe_ipv4 *si)
+{
+	int cpu;
+
+	get_online_cpus();
+	si->num_sync_cpus = num_online_cpus();
+
+	for_each_online_cpu(cpu) {
+		struct sfe_ipv4_sync_state *ss = per_cpu_ptr(&sfe_ipv4_sync_states, cpu);
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0))
+		timer_setup(&ss->timer, sfe_ipv4_periodic_sync, TIMER_PINNED);
+#else
+		setup_timer(&ss->timer, sfe_ipv4_periodic_sync, (unsigned long)ss);
+#endif /*KERNEL_VERSION(4, 15, 0)*/
+		ss->timer.expires = jiffies + SFE_IPV4_SYNC_INTERVAL;
+		add_timer_on(&ss->timer, cpu);
+		ss->running = true;
+	}
+
+	put_online_cpus();
+}
+
+/*
+ * sfe_ipv4_sync_timers_stop()
+ *	Stop all of the periodic sync timers.
+ */
+static void sfe_ipv4_sync_timers_stop(struct sfe_ipv4 *si)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct sfe_ipv4_sync_state *ss = per_cpu_ptr(&sfe_ipv4_sync_states, cpu);
+
+		if (ss->running) {
+			del_timer_sync(&ss->timer);
+			ss->running = false;
+		}
+	}
 }
 
 #define CHAR_DEV_MSG_SIZE 768
@@ -3036,6 +4474,7 @@ static bool sfe_ipv4_debug_dev_read_connections_connection(struct sfe_ipv4 *si,
 	u64 dest_rx_bytes;
 	u64 last_sync_jiffies;
 	u32 mark, src_priority, dest_priority, src_dscp, dest_dscp;
+	u32 packets, bytes;
 #ifdef CONFIG_NF_FLOW_COOKIE
 	int src_flow_cookie, dst_flow_cookie;
 #endif
@@ -3070,8 +4509,8 @@ static bool sfe_ipv4_debug_dev_read_connections_connection(struct sfe_ipv4 *si,
 	src_priority = original_cm->priority;
 	src_dscp = original_cm->dscp >> SFE_IPV4_DSCP_SHIFT;
 
-	sfe_ipv4_connection_match_update_summary_stats(original_cm);
-	sfe_ipv4_connection_match_update_summary_stats(reply_cm);
+	sfe_ipv4_connection_match_update_summary_stats(original_cm, &packets, &bytes);
+	sfe_ipv4_connection_match_update_summary_stats(reply_cm, &packets, &bytes);
 
 	src_rx_packets = original_cm->rx_packet_count64;
 	src_rx_bytes = original_cm->rx_byte_count64;
@@ -3186,9 +4625,7 @@ static bool sfe_ipv4_debug_dev_read_exceptions_exception(struct sfe_ipv4 *si, ch
 {
 	u64 ct;
 
-	spin_lock_bh(&si->lock);
-	ct = si->exception_events64[ws->iter_exception];
-	spin_unlock_bh(&si->lock);
+	ct = sfe_ipv4_exception_stats_sum(si, ws->iter_exception);
 
 	if (ct) {
 		int bytes_read;
@@ -3223,210 +4660,784 @@ static bool sfe_ipv4_debug_dev_read_exceptions_end(struct sfe_ipv4 *si, char *bu
 {
 	int bytes_read;
 
-	bytes_read = snprintf(msg, CHAR_DEV_MSG_SIZE, "\t</exceptions>\n");
-	if (copy_to_user(buffer + *total_read, msg, CHAR_DEV_MSG_SIZE)) {
-		return false;
+	bytes_read = snprintf(msg, CHAR_DEV_MSG_SIZE, "\t</exceptions>\n");
+	if (copy_to_user(buffer + *total_read, msg, CHAR_DEV_MSG_SIZE)) {
+		return false;
+	}
+
+	*length -= bytes_read;
+	*total_read += bytes_read;
+
+	ws->state++;
+	return true;
+}
+
+/*
+ * sfe_ipv4_debug_dev_read_stats()
+ *	Generate part of the XML output.
+ */
+static bool sfe_ipv4_debug_dev_read_stats(struct sfe_ipv4 *si, char *buffer, char *msg, size_t *length,
+					  int *total_read, struct sfe_ipv4_debug_xml_write_state *ws)
+{
+	int bytes_read;
+	unsigned int num_connections;
+	u64 connection_create_requests;
+	u64 connection_create_collisions;
+	u64 connection_destroy_requests;
+	u64 connection_destroy_misses;
+	u64 connection_flushes;
+	struct sfe_ipv4_stats stats;
+
+	spin_lock_bh(&si->lock);
+	sfe_ipv4_update_summary_stats(si);
+
+	num_connections = si->num_connections;
+	connection_create_requests = si->connection_create_requests64;
+	connection_create_collisions = si->connection_create_collisions64;
+	connection_destroy_requests = si->connection_destroy_requests64;
+	connection_destroy_misses = si->connection_destroy_misses64;
+	connection_flushes = si->connection_flushes64;
+	spin_unlock_bh(&si->lock);
+
+	sfe_ipv4_stats_pcpu_sum(si, &stats);
+
+	bytes_read = snprintf(msg, CHAR_DEV_MSG_SIZE, "\t<stats "
+			      "num_connections=\"%u\" "
+			      "pkts_forwarded=\"%llu\" pkts_not_forwarded=\"%llu\" "
+			      "create_requests=\"%llu\" create_collisions=\"%llu\" "
+			      "destroy_requests=\"%llu\" destroy_misses=\"%llu\" "
+			      "flushes=\"%llu\" "
+			      "hash_hits=\"%llu\" hash_reorders=\"%llu\" "
+			      "cache_hits=\"%llu\" />\n",
+			      num_connections,
+			      stats.packets_forwarded64,
+			      stats.packets_not_forwarded64,
+			      connection_create_requests,
+			      connection_create_collisions,
+			      connection_destroy_requests,
+			      connection_destroy_misses,
+			      connection_flushes,
+			      stats.connection_match_hash_hits64,
+			      stats.connection_match_hash_reorders64,
+			      stats.connection_match_cache_hits64);
+	if (copy_to_user(buffer + *total_read, msg, CHAR_DEV_MSG_SIZE)) {
+		return false;
+	}
+
+	*length -= bytes_read;
+	*total_read += bytes_read;
+
+	ws->state++;
+	return true;
+}
+
+/*
+ * sfe_ipv4_debug_dev_read_end()
+ *	Generate part of the XML output.
+ */
+static bool sfe_ipv4_debug_dev_read_end(struct sfe_ipv4 *si, char *buffer, char *msg, size_t *length,
+					int *total_read, struct sfe_ipv4_debug_xml_write_state *ws)
+{
+	int bytes_read;
+
+	bytes_read = snprintf(msg, CHAR_DEV_MSG_SIZE, "</sfe_ipv4>\n");
+	if (copy_to_user(buffer + *total_read, msg, CHAR_DEV_MSG_SIZE)) {
+		return false;
+	}
+
+	*length -= bytes_read;
+	*total_read += bytes_read;
+
+	ws->state++;
+	return true;
+}
+
+/*
+ * Array of write functions that write various XML elements that correspond to
+ * our XML output state machine.
+ */
+static sfe_ipv4_debug_xml_write_method_t sfe_ipv4_debug_xml_write_methods[SFE_IPV4_DEBUG_XML_STATE_DONE] = {
+	sfe_ipv4_debug_dev_read_start,
+	sfe_ipv4_debug_dev_read_connections_start,
+	sfe_ipv4_debug_dev_read_connections_connection,
+	sfe_ipv4_debug_dev_read_connections_end,
+	sfe_ipv4_debug_dev_read_exceptions_start,
+	sfe_ipv4_debug_dev_read_exceptions_exception,
+	sfe_ipv4_debug_dev_read_exceptions_end,
+	sfe_ipv4_debug_dev_read_stats,
+	sfe_ipv4_debug_dev_read_end,
+};
+
+/*
+ * sfe_ipv4_debug_dev_read()
+ *	Send info to userspace upon read request from user
+ */
+static ssize_t sfe_ipv4_debug_dev_read(struct file *filp, char *buffer, size_t length, loff_t *offset)
+{
+	char msg[CHAR_DEV_MSG_SIZE];
+	int total_read = 0;
+	struct sfe_ipv4_debug_xml_write_state *ws;
+	struct sfe_ipv4 *si = &__si;
+
+	ws = (struct sfe_ipv4_debug_xml_write_state *)filp->private_data;
+	while ((ws->state != SFE_IPV4_DEBUG_XML_STATE_DONE) && (length > CHAR_DEV_MSG_SIZE)) {
+		if ((sfe_ipv4_debug_xml_write_methods[ws->state])(si, buffer, msg, &length, &total_read, ws)) {
+			continue;
+		}
+	}
+
+	return total_read;
+}
+
+/*
+ * sfe_ipv4_debug_dev_write()
+ *	Write to char device resets some stats
+ */
+static ssize_t sfe_ipv4_debug_dev_write(struct file *filp, const char *buffer, size_t length, loff_t *offset)
+{
+	struct sfe_ipv4 *si = &__si;
+
+	spin_lock_bh(&si->lock);
+	sfe_ipv4_update_summary_stats(si);
+
+	si->connection_create_requests64 = 0;
+	si->connection_create_collisions64 = 0;
+	si->connection_destroy_requests64 = 0;
+	si->connection_destroy_misses64 = 0;
+	si->connection_flushes64 = 0;
+	spin_unlock_bh(&si->lock);
+
+	sfe_ipv4_stats_pcpu_clear(si);
+
+	return length;
+}
+
+/*
+ * sfe_ipv4_debug_dev_open()
+ */
+static int sfe_ipv4_debug_dev_open(struct inode *inode, struct file *file)
+{
+	struct sfe_ipv4_debug_xml_write_state *ws;
+
+	ws = (struct sfe_ipv4_debug_xml_write_state *)file->private_data;
+	if (!ws) {
+		ws = kzalloc(sizeof(struct sfe_ipv4_debug_xml_write_state), GFP_KERNEL);
+		if (!ws) {
+			return -ENOMEM;
+		}
+
+		ws->state = SFE_IPV4_DEBUG_XML_STATE_START;
+		file->private_data = ws;
+	}
+
+	return 0;
+}
+
+/*
+ * sfe_ipv4_debug_dev_release()
+ */
+static int sfe_ipv4_debug_dev_release(struct inode *inode, struct file *file)
+{
+	struct sfe_ipv4_debug_xml_write_state *ws;
+
+	ws = (struct sfe_ipv4_debug_xml_write_state *)file->private_data;
+	if (ws) {
+		/*
+		 * We've finished with our output so free the write state.
+		 */
+		kfree(ws);
+	}
+
+	return 0;
+}
+
+/*
+ * File operations used in the debug char device
+ */
+static struct file_operations sfe_ipv4_debug_dev_fops = {
+	.read = sfe_ipv4_debug_dev_read,
+	.write = sfe_ipv4_debug_dev_write,
+	.open = sfe_ipv4_debug_dev_open,
+	.release = sfe_ipv4_debug_dev_release
+};
+
+static struct genl_family sfe_ipv4_genl_family;
+
+/*
+ * sfe_ipv4_genl_match_flags()
+ *	Work out the dump record flags for one direction of a connection.
+ */
+static u32 sfe_ipv4_genl_match_flags(struct sfe_ipv4_connection_match *cm)
+{
+	u32 flags = 0;
+
+	if (cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_WRITE_FAST_ETH_HDR) {
+		flags |= SFE_DUMP_CONNECTION_F_ETH_HDR;
+	}
+
+	if (cm->flags & (SFE_IPV4_CONNECTION_MATCH_FLAG_VLAN_TAG | SFE_IPV4_CONNECTION_MATCH_FLAG_PPPOE_ENCAP)) {
+		flags |= SFE_DUMP_CONNECTION_F_ENCAP;
+	}
+
+	if (cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_DSCP_REMARK) {
+		flags |= SFE_DUMP_CONNECTION_F_DSCP_REMARK;
+	}
+
+	if (cm->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_NO_SEQ_CHECK) {
+		flags |= SFE_DUMP_CONNECTION_F_NO_SEQ_CHECK;
+	}
+
+	return flags;
+}
+
+/*
+ * sfe_ipv4_genl_fill_connection()
+ *	Fill in the dump record for a connection.
+ *
+ * Must be called with the lock held.  The per-period packet counts are left for
+ * the periodic sync to collect, so we only read them here.
+ */
+static void sfe_ipv4_genl_fill_connection(struct sfe_ipv4_connection *c, struct sfe_dump_connection *rec)
+{
+	struct sfe_ipv4_connection_match *original_cm = c->original_match;
+	struct sfe_ipv4_connection_match *reply_cm = c->reply_match;
+
+	memset(rec, 0, sizeof(*rec));
+
+	rec->protocol = c->protocol;
+	rec->src_ip[0] = c->src_ip;
+	rec->src_ip_xlate[0] = c->src_ip_xlate;
+	rec->dest_ip[0] = c->dest_ip;
+	rec->dest_ip_xlate[0] = c->dest_ip_xlate;
+	rec->src_port = c->src_port;
+	rec->src_port_xlate = c->src_port_xlate;
+	rec->dest_port = c->dest_port;
+	rec->dest_port_xlate = c->dest_port_xlate;
+	rec->src_ifindex = c->original_dev->ifindex;
+	rec->dest_ifindex = c->reply_dev->ifindex;
+	rec->mark = c->mark;
+	rec->src_priority = original_cm->priority;
+	rec->dest_priority = reply_cm->priority;
+	rec->src_dscp = original_cm->dscp >> SFE_IPV4_DSCP_SHIFT;
+	rec->dest_dscp = reply_cm->dscp >> SFE_IPV4_DSCP_SHIFT;
+	rec->src_rx_packets = original_cm->rx_packet_count64 + atomic_read(&original_cm->rx_packet_count);
+	rec->src_rx_bytes = original_cm->rx_byte_count64 + atomic_read(&original_cm->rx_byte_count);
+	rec->dest_rx_packets = reply_cm->rx_packet_count64 + atomic_read(&reply_cm->rx_packet_count);
+	rec->dest_rx_bytes = reply_cm->rx_byte_count64 + atomic_read(&reply_cm->rx_byte_count);
+	rec->last_sync_msecs = jiffies_to_msecs((unsigned long)(get_jiffies_64() - c->last_sync_jiffies));
+	rec->src_xmit_ifindex = original_cm->xmit_dev->ifindex;
+	rec->dest_xmit_ifindex = reply_cm->xmit_dev->ifindex;
+	rec->src_xmit_mtu = original_cm->xmit_dev_mtu;
+	rec->dest_xmit_mtu = reply_cm->xmit_dev_mtu;
+	rec->src_flags = sfe_ipv4_genl_match_flags(original_cm);
+	rec->dest_flags = sfe_ipv4_genl_match_flags(reply_cm);
+	memcpy(rec->src_xmit_src_mac, original_cm->xmit_src_mac, ETH_ALEN);
+	memcpy(rec->src_xmit_dest_mac, original_cm->xmit_dest_mac, ETH_ALEN);
+	memcpy(rec->dest_xmit_src_mac, reply_cm->xmit_src_mac, ETH_ALEN);
+	memcpy(rec->dest_xmit_dest_mac, reply_cm->xmit_dest_mac, ETH_ALEN);
+}
+
+/*
+ * sfe_ipv4_genl_dump_connections()
+ *	Dump connections, one netlink message per connection.
+ *
+ * The lock is only held while one skb is being filled so that dumping a large
+ * table does not stall the fast path.  We walk the connection hash, and its
+ * future table if it is being resized, keeping the bucket and the position
+ * within it in cb->args[] between calls.  If connections are moved between
+ * tables part way through then those positions no longer mean the same thing,
+ * so the dump is flagged as interrupted and user space can retry.
+ */
+static int sfe_ipv4_genl_dump_connections(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct sfe_ipv4 *si = &__si;
+	struct sfe_ipv4_hash_table *t;
+	struct sfe_ipv4_connection *c;
+	struct hlist_nulls_node *node;
+	unsigned long bucket = cb->args[0];
+	unsigned long skip = cb->args[1];
+	unsigned long base = 0;
+	unsigned long idx = 0;
+
+	spin_lock_bh(&si->lock);
+	cb->seq = si->hash_resize_seq;
+
+	/*
+	 * The buckets of the future table are numbered on from those of the
+	 * current one.
+	 */
+	t = si->conn_hash;
+	while (t) {
+		for (; bucket < base + (1UL << t->shift); bucket++, skip = 0) {
+			idx = 0;
+			hlist_nulls_for_each_entry(c, node, &t->buckets[bucket - base], hnode) {
+				struct nlattr *nla;
+				void *hdr;
+
+				if (idx < skip) {
+					idx++;
+					continue;
+				}
+
+				hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+						  &sfe_ipv4_genl_family, NLM_F_MULTI, SFE_DUMP_C_CONNECTIONS);
+				if (!hdr) {
+					goto done;
+				}
+
+				genl_dump_check_consistent(cb, hdr);
+
+				nla = nla_reserve(skb, SFE_DUMP_A_CONNECTION, sizeof(struct sfe_dump_connection));
+				if (!nla) {
+					genlmsg_cancel(skb, hdr);
+					goto done;
+				}
+
+				sfe_ipv4_genl_fill_connection(c, nla_data(nla));
+				genlmsg_end(skb, hdr);
+				idx++;
+			}
+		}
+
+		base += 1UL << t->shift;
+		t = sfe_ipv4_hash_table_future(si, t);
+	}
+
+	idx = 0;
+
+done:
+	spin_unlock_bh(&si->lock);
+
+	cb->args[0] = bucket;
+	cb->args[1] = idx;
+	return skb->len;
+}
+
+/*
+ * sfe_ipv4_genl_get_stats()
+ *	Report the global, per-CPU and exception counters.
+ */
+static int sfe_ipv4_genl_get_stats(struct sk_buff *skb, struct genl_info *info)
+{
+	struct sfe_ipv4 *si = &__si;
+	struct sfe_ipv4_stats stats;
+	struct sfe_dump_stats *st;
+	struct sk_buff *msg;
+	struct nlattr *nla;
+	size_t size;
+	void *hdr;
+	int cpu;
+	int i;
+
+	size = nla_total_size(sizeof(struct sfe_dump_stats))
+	       + num_possible_cpus() * nla_total_size(sizeof(struct sfe_dump_cpu_stats))
+	       + SFE_IPV4_EXCEPTION_EVENT_LAST * nla_total_size(sizeof(struct sfe_dump_exception))
+	       + nla_total_size(sizeof(struct sfe_dump_sync_latency));
+
+	msg = genlmsg_new(size, GFP_KERNEL);
+	if (!msg) {
+		return -ENOMEM;
+	}
+
+	hdr = genlmsg_put_reply(msg, info, &sfe_ipv4_genl_family, 0, SFE_DUMP_C_STATS);
+	if (!hdr) {
+		goto nla_failure;
+	}
+
+	nla = nla_reserve(msg, SFE_DUMP_A_STATS, sizeof(struct sfe_dump_stats));
+	if (!nla) {
+		goto nla_failure;
+	}
+
+	st = nla_data(nla);
+	memset(st, 0, sizeof(*st));
+
+	spin_lock_bh(&si->lock);
+	sfe_ipv4_update_summary_stats(si);
+
+	st->num_connections = si->num_connections;
+	st->connection_create_requests = si->connection_create_requests64;
+	st->connection_create_collisions = si->connection_create_collisions64;
+	st->connection_destroy_requests = si->connection_destroy_requests64;
+	st->connection_destroy_misses = si->connection_destroy_misses64;
+	st->connection_flushes = si->connection_flushes64;
+	spin_unlock_bh(&si->lock);
+
+	sfe_ipv4_stats_pcpu_sum(si, &stats);
+	st->packets_forwarded = stats.packets_forwarded64;
+	st->packets_not_forwarded = stats.packets_not_forwarded64;
+	st->connection_match_hash_hits = stats.connection_match_hash_hits64;
+	st->connection_match_hash_reorders = stats.connection_match_hash_reorders64;
+	st->connection_match_cache_hits = stats.connection_match_cache_hits64;
+
+	for (i = 0; i < SFE_IPV4_EXCEPTION_EVENT_LAST; i++) {
+		struct sfe_dump_exception *ex;
+
+		if (!stats.exception_events64[i]) {
+			continue;
+		}
+
+		nla = nla_reserve(msg, SFE_DUMP_A_EXCEPTION, sizeof(struct sfe_dump_exception));
+		if (!nla) {
+			goto nla_failure;
+		}
+
+		ex = nla_data(nla);
+		memset(ex, 0, sizeof(*ex));
+		ex->count = stats.exception_events64[i];
+		strlcpy(ex->name, sfe_ipv4_exception_events_string[i], sizeof(ex->name));
+	}
+
+	nla = nla_reserve(msg, SFE_DUMP_A_SYNC_LATENCY, sizeof(struct sfe_dump_sync_latency));
+	if (!nla) {
+		goto nla_failure;
 	}
 
-	*length -= bytes_read;
-	*total_read += bytes_read;
+	memcpy(nla_data(nla), stats.sync_latency64, sizeof(struct sfe_dump_sync_latency));
 
-	ws->state++;
-	return true;
+	for_each_possible_cpu(cpu) {
+		const struct sfe_ipv4_stats *s = per_cpu_ptr(si->stats_pcpu, cpu);
+		struct sfe_dump_cpu_stats *cs;
+
+		nla = nla_reserve(msg, SFE_DUMP_A_CPU_STATS, sizeof(struct sfe_dump_cpu_stats));
+		if (!nla) {
+			goto nla_failure;
+		}
+
+		cs = nla_data(nla);
+		memset(cs, 0, sizeof(*cs));
+		cs->cpu = cpu;
+		cs->packets_forwarded = s->packets_forwarded64;
+		cs->packets_not_forwarded = s->packets_not_forwarded64;
+		cs->connection_match_hash_hits = s->connection_match_hash_hits64;
+		cs->connection_match_hash_reorders = s->connection_match_hash_reorders64;
+		cs->connection_match_cache_hits = s->connection_match_cache_hits64;
+	}
+
+	genlmsg_end(msg, hdr);
+	return genlmsg_reply(msg, info);
+
+nla_failure:
+	nlmsg_free(msg);
+	return -EMSGSIZE;
 }
 
 /*
- * sfe_ipv4_debug_dev_read_stats()
- *	Generate part of the XML output.
+ * sfe_ipv4_genl_dump_wildcard_rules()
+ *	Dump the wildcard rules, one netlink message per rule.
  */
-static bool sfe_ipv4_debug_dev_read_stats(struct sfe_ipv4 *si, char *buffer, char *msg, size_t *length,
-					  int *total_read, struct sfe_ipv4_debug_xml_write_state *ws)
+static int sfe_ipv4_genl_dump_wildcard_rules(struct sk_buff *skb, struct netlink_callback *cb)
 {
-	int bytes_read;
-	unsigned int num_connections;
-	u64 packets_forwarded;
-	u64 packets_not_forwarded;
-	u64 connection_create_requests;
-	u64 connection_create_collisions;
-	u64 connection_destroy_requests;
-	u64 connection_destroy_misses;
-	u64 connection_flushes;
-	u64 connection_match_hash_hits;
-	u64 connection_match_hash_reorders;
+	struct sfe_ipv4 *si = &__si;
+	struct sfe_ipv4_wildcard_rule *wr;
+	unsigned long skip = cb->args[0];
+	unsigned long idx = 0;
 
 	spin_lock_bh(&si->lock);
-	sfe_ipv4_update_summary_stats(si);
 
-	num_connections = si->num_connections;
-	packets_forwarded = si->packets_forwarded64;
-	packets_not_forwarded = si->packets_not_forwarded64;
-	connection_create_requests = si->connection_create_requests64;
-	connection_create_collisions = si->connection_create_collisions64;
-	connection_destroy_requests = si->connection_destroy_requests64;
-	connection_destroy_misses = si->connection_destroy_misses64;
-	connection_flushes = si->connection_flushes64;
-	connection_match_hash_hits = si->connection_match_hash_hits64;
-	connection_match_hash_reorders = si->connection_match_hash_reorders64;
-	spin_unlock_bh(&si->lock);
+	list_for_each_entry(wr, &si->wildcard_rules, list) {
+		struct sfe_dump_wildcard_rule *rec;
+		struct nlattr *nla;
+		void *hdr;
+		int cpu;
 
-	bytes_read = snprintf(msg, CHAR_DEV_MSG_SIZE, "\t<stats "
-			      "num_connections=\"%u\" "
-			      "pkts_forwarded=\"%llu\" pkts_not_forwarded=\"%llu\" "
-			      "create_requests=\"%llu\" create_collisions=\"%llu\" "
-			      "destroy_requests=\"%llu\" destroy_misses=\"%llu\" "
-			      "flushes=\"%llu\" "
-			      "hash_hits=\"%llu\" hash_reorders=\"%llu\" />\n",
-			      num_connections,
-			      packets_forwarded,
-			      packets_not_forwarded,
-			      connection_create_requests,
-			      connection_create_collisions,
-			      connection_destroy_requests,
-			      connection_destroy_misses,
-			      connection_flushes,
-			      connection_match_hash_hits,
-			      connection_match_hash_reorders);
-	if (copy_to_user(buffer + *total_read, msg, CHAR_DEV_MSG_SIZE)) {
-		return false;
+		if (idx < skip) {
+			idx++;
+			continue;
+		}
+
+		hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+				  &sfe_ipv4_genl_family, NLM_F_MULTI, SFE_DUMP_C_WILDCARD_RULES);
+		if (!hdr) {
+			break;
+		}
+
+		nla = nla_reserve(skb, SFE_DUMP_A_WILDCARD_RULE, sizeof(struct sfe_dump_wildcard_rule));
+		if (!nla) {
+			genlmsg_cancel(skb, hdr);
+			break;
+		}
+
+		rec = nla_data(nla);
+		memset(rec, 0, sizeof(*rec));
+		rec->protocol = wr->match_protocol;
+		rec->ip[0] = wr->match_ip;
+		rec->ip_xlate[0] = wr->xlate_ip;
+		rec->port_lo = htons(wr->match_port_lo);
+		rec->port_hi = htons(wr->match_port_hi);
+		rec->port_xlate = htons(wr->xlate_port);
+		rec->match_ifindex = wr->match_dev->ifindex;
+		rec->xmit_ifindex = wr->xmit_dev->ifindex;
+		rec->xmit_mtu = wr->xmit_dev_mtu;
+		memcpy(rec->xmit_src_mac, wr->xmit_src_mac, ETH_ALEN);
+		memcpy(rec->xmit_dest_mac, wr->xmit_dest_mac, ETH_ALEN);
+		rec->mark = wr->mark;
+		if (wr->match_src) {
+			rec->flags |= SFE_DUMP_WILDCARD_F_MATCH_SRC;
+		}
+
+		if (wr->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_PRIORITY_REMARK) {
+			rec->flags |= SFE_DUMP_WILDCARD_F_REMARK_PRIORITY;
+			rec->priority = wr->priority;
+		}
+
+		if (wr->flags & SFE_IPV4_CONNECTION_MATCH_FLAG_DSCP_REMARK) {
+			rec->flags |= SFE_DUMP_WILDCARD_F_REMARK_DSCP;
+			rec->dscp = wr->dscp >> SFE_IPV4_DSCP_SHIFT;
+		}
+
+		for_each_possible_cpu(cpu) {
+			const struct sfe_ipv4_wildcard_stats *ws = per_cpu_ptr(wr->stats, cpu);
+
+			rec->rx_packets += ws->rx_packets;
+			rec->rx_bytes += ws->rx_bytes;
+		}
+
+		genlmsg_end(skb, hdr);
+		idx++;
 	}
 
-	*length -= bytes_read;
-	*total_read += bytes_read;
+	spin_unlock_bh(&si->lock);
 
-	ws->state++;
-	return true;
+	cb->args[0] = idx;
+	return skb->len;
 }
 
 /*
- * sfe_ipv4_debug_dev_read_end()
- *	Generate part of the XML output.
+ * sfe_ipv4_genl_parse_wildcard_rule()
+ *	Turn a wildcard rule record from user space into a rule request.
+ *
+ * On success the devices in the request are held and must be put by the caller.
  */
-static bool sfe_ipv4_debug_dev_read_end(struct sfe_ipv4 *si, char *buffer, char *msg, size_t *length,
-					int *total_read, struct sfe_ipv4_debug_xml_write_state *ws)
+static int sfe_ipv4_genl_parse_wildcard_rule(struct genl_info *info, struct sfe_wildcard_rule *swr)
 {
-	int bytes_read;
+	struct sfe_dump_wildcard_rule *rec;
 
-	bytes_read = snprintf(msg, CHAR_DEV_MSG_SIZE, "</sfe_ipv4>\n");
-	if (copy_to_user(buffer + *total_read, msg, CHAR_DEV_MSG_SIZE)) {
-		return false;
+	if (!info->attrs[SFE_DUMP_A_WILDCARD_RULE]) {
+		return -EINVAL;
 	}
 
-	*length -= bytes_read;
-	*total_read += bytes_read;
+	rec = nla_data(info->attrs[SFE_DUMP_A_WILDCARD_RULE]);
+
+	memset(swr, 0, sizeof(*swr));
+	swr->protocol = rec->protocol;
+	swr->ip.ip = rec->ip[0];
+	swr->ip_xlate.ip = rec->ip_xlate[0];
+	swr->port_lo = rec->port_lo;
+	swr->port_hi = rec->port_hi;
+	swr->port_xlate = rec->port_xlate;
+	swr->xmit_mtu = rec->xmit_mtu;
+	memcpy(swr->xmit_src_mac, rec->xmit_src_mac, ETH_ALEN);
+	memcpy(swr->xmit_dest_mac, rec->xmit_dest_mac, ETH_ALEN);
+	swr->mark = rec->mark;
+	swr->priority = rec->priority;
+	swr->dscp = rec->dscp;
+	if (rec->flags & SFE_DUMP_WILDCARD_F_MATCH_SRC) {
+		swr->flags |= SFE_WILDCARD_FLAG_MATCH_SRC;
+	}
 
-	ws->state++;
-	return true;
-}
+	if (rec->flags & SFE_DUMP_WILDCARD_F_REMARK_PRIORITY) {
+		swr->flags |= SFE_WILDCARD_FLAG_REMARK_PRIORITY;
+	}
 
-/*
- * Array of write functions that write various XML elements that correspond to
- * our XML output state machine.
- */
-static sfe_ipv4_debug_xml_write_method_t sfe_ipv4_debug_xml_write_methods[SFE_IPV4_DEBUG_XML_STATE_DONE] = {
-	sfe_ipv4_debug_dev_read_start,
-	sfe_ipv4_debug_dev_read_connections_start,
-	sfe_ipv4_debug_dev_read_connections_connection,
-	sfe_ipv4_debug_dev_read_connections_end,
-	sfe_ipv4_debug_dev_read_exceptions_start,
-	sfe_ipv4_debug_dev_read_exceptions_exception,
-	sfe_ipv4_debug_dev_read_exceptions_end,
-	sfe_ipv4_debug_dev_read_stats,
-	sfe_ipv4_debug_dev_read_end,
-};
+	if (rec->flags & SFE_DUMP_WILDCARD_F_REMARK_DSCP) {
+		swr->flags |= SFE_WILDCARD_FLAG_REMARK_DSCP;
+	}
 
-/*
- * sfe_ipv4_debug_dev_read()
- *	Send info to userspace upon read request from user
- */
-static ssize_t sfe_ipv4_debug_dev_read(struct file *filp, char *buffer, size_t length, loff_t *offset)
-{
-	char msg[CHAR_DEV_MSG_SIZE];
-	int total_read = 0;
-	struct sfe_ipv4_debug_xml_write_state *ws;
-	struct sfe_ipv4 *si = &__si;
+	swr->match_dev = dev_get_by_index(genl_info_net(info), rec->match_ifindex);
+	if (!swr->match_dev) {
+		return -ENODEV;
+	}
 
-	ws = (struct sfe_ipv4_debug_xml_write_state *)filp->private_data;
-	while ((ws->state != SFE_IPV4_DEBUG_XML_STATE_DONE) && (length > CHAR_DEV_MSG_SIZE)) {
-		if ((sfe_ipv4_debug_xml_write_methods[ws->state])(si, buffer, msg, &length, &total_read, ws)) {
-			continue;
-		}
+	/*
+	 * Deleting a rule doesn't need the transmit device.
+	 */
+	if (info->genlhdr->cmd == SFE_DUMP_C_WILDCARD_DEL) {
+		return 0;
 	}
 
-	return total_read;
+	swr->xmit_dev = dev_get_by_index(genl_info_net(info), rec->xmit_ifindex);
+	if (!swr->xmit_dev) {
+		dev_put(swr->match_dev);
+		return -ENODEV;
+	}
+
+	return 0;
 }
 
 /*
- * sfe_ipv4_debug_dev_write()
- *	Write to char device resets some stats
+ * sfe_ipv4_genl_add_wildcard_rule()
+ *	Add a wildcard rule.
  */
-static ssize_t sfe_ipv4_debug_dev_write(struct file *filp, const char *buffer, size_t length, loff_t *offset)
+static int sfe_ipv4_genl_add_wildcard_rule(struct sk_buff *skb, struct genl_info *info)
 {
-	struct sfe_ipv4 *si = &__si;
-
-	spin_lock_bh(&si->lock);
-	sfe_ipv4_update_summary_stats(si);
+	struct sfe_wildcard_rule swr;
+	int ret;
 
-	si->packets_forwarded64 = 0;
-	si->packets_not_forwarded64 = 0;
-	si->connection_create_requests64 = 0;
-	si->connection_create_collisions64 = 0;
-	si->connection_destroy_requests64 = 0;
-	si->connection_destroy_misses64 = 0;
-	si->connection_flushes64 = 0;
-	si->connection_match_hash_hits64 = 0;
-	si->connection_match_hash_reorders64 = 0;
-	spin_unlock_bh(&si->lock);
+	ret = sfe_ipv4_genl_parse_wildcard_rule(info, &swr);
+	if (ret) {
+		return ret;
+	}
 
-	return length;
+	ret = sfe_ipv4_create_wildcard_rule(&swr);
+	dev_put(swr.match_dev);
+	dev_put(swr.xmit_dev);
+	return ret;
 }
 
 /*
- * sfe_ipv4_debug_dev_open()
+ * sfe_ipv4_genl_del_wildcard_rule()
+ *	Delete a wildcard rule.
  */
-static int sfe_ipv4_debug_dev_open(struct inode *inode, struct file *file)
+static int sfe_ipv4_genl_del_wildcard_rule(struct sk_buff *skb, struct genl_info *info)
 {
-	struct sfe_ipv4_debug_xml_write_state *ws;
+	struct sfe_wildcard_rule swr;
+	int ret;
 
-	ws = (struct sfe_ipv4_debug_xml_write_state *)file->private_data;
-	if (!ws) {
-		ws = kzalloc(sizeof(struct sfe_ipv4_debug_xml_write_state), GFP_KERNEL);
-		if (!ws) {
-			return -ENOMEM;
-		}
-
-		ws->state = SFE_IPV4_DEBUG_XML_STATE_START;
-		file->private_data = ws;
+	ret = sfe_ipv4_genl_parse_wildcard_rule(info, &swr);
+	if (ret) {
+		return ret;
 	}
 
-	return 0;
+	ret = sfe_ipv4_destroy_wildcard_rule(&swr);
+	dev_put(swr.match_dev);
+	return ret;
 }
 
 /*
- * sfe_ipv4_debug_dev_release()
+ * sfe_ipv4_genl_account_connection()
+ *	Add packets that were forwarded outside of the engine to a connection.
+ *
+ * An offload that forwards a connection's packets without passing them to us
+ * uses this so that they are still synced to the connection manager, which
+ * keeps the connection alive.
  */
-static int sfe_ipv4_debug_dev_release(struct inode *inode, struct file *file)
+static int sfe_ipv4_genl_account_connection(struct sk_buff *skb, struct genl_info *info)
 {
-	struct sfe_ipv4_debug_xml_write_state *ws;
+	struct sfe_ipv4 *si = &__si;
+	struct sfe_dump_connection *rec;
+	struct sfe_ipv4_connection *c;
+	struct sfe_ipv4_connection_match *cm[2];
+	u64 packets[2];
+	u64 bytes[2];
+	int i;
+
+	if (!info->attrs[SFE_DUMP_A_CONNECTION]) {
+		return -EINVAL;
+	}
+
+	rec = nla_data(info->attrs[SFE_DUMP_A_CONNECTION]);
+	packets[0] = rec->src_rx_packets;
+	bytes[0] = rec->src_rx_bytes;
+	packets[1] = rec->dest_rx_packets;
+	bytes[1] = rec->dest_rx_bytes;
+
+	spin_lock_bh(&si->lock);
+	c = sfe_ipv4_find_sfe_ipv4_connection(si, rec->protocol, rec->src_ip[0], rec->src_port,
+					      rec->dest_ip[0], rec->dest_port);
+	if (!c) {
+		spin_unlock_bh(&si->lock);
+		return -ENOENT;
+	}
+
+	cm[0] = c->original_match;
+	cm[1] = c->reply_match;
+	for (i = 0; i < 2; i++) {
+		if (!packets[i]) {
+			continue;
+		}
+
+		atomic_add((int)packets[i], &cm[i]->rx_packet_count);
+		atomic_add((int)bytes[i], &cm[i]->rx_byte_count);
 
-	ws = (struct sfe_ipv4_debug_xml_write_state *)file->private_data;
-	if (ws) {
 		/*
-		 * We've finished with our output so free the write state.
+		 * Get the match synced in the next period, just as the forwarding
+		 * path would have done.
 		 */
-		kfree(ws);
+		if (!cm[i]->active) {
+			cm[i]->active = true;
+			cm[i]->active_jiffies = jiffies;
+			si->num_active++;
+			cm[i]->active_prev = si->active_tail;
+			if (likely(si->active_tail)) {
+				si->active_tail->active_next = cm[i];
+			} else {
+				si->active_head = cm[i];
+			}
+			si->active_tail = cm[i];
+		}
 	}
 
+	spin_unlock_bh(&si->lock);
 	return 0;
 }
 
+static const struct nla_policy sfe_ipv4_genl_policy[SFE_DUMP_A_MAX + 1] = {
+	[SFE_DUMP_A_CONNECTION] = { .len = sizeof(struct sfe_dump_connection) },
+	[SFE_DUMP_A_WILDCARD_RULE] = { .len = sizeof(struct sfe_dump_wildcard_rule) },
+};
+
 /*
- * File operations used in the debug char device
+ * Generic netlink operations.  These expose every connection and can change
+ * the forwarding rules so they are restricted to CAP_NET_ADMIN.
  */
-static struct file_operations sfe_ipv4_debug_dev_fops = {
-	.read = sfe_ipv4_debug_dev_read,
-	.write = sfe_ipv4_debug_dev_write,
-	.open = sfe_ipv4_debug_dev_open,
-	.release = sfe_ipv4_debug_dev_release
+static struct genl_ops sfe_ipv4_genl_ops[] = {
+	{
+		.cmd = SFE_DUMP_C_CONNECTIONS,
+		.flags = GENL_ADMIN_PERM,
+		.doit = NULL,
+		.dumpit = sfe_ipv4_genl_dump_connections,
+	},
+	{
+		.cmd = SFE_DUMP_C_STATS,
+		.flags = GENL_ADMIN_PERM,
+		.doit = sfe_ipv4_genl_get_stats,
+		.dumpit = NULL,
+	},
+	{
+		.cmd = SFE_DUMP_C_WILDCARD_RULES,
+		.flags = GENL_ADMIN_PERM,
+		.doit = NULL,
+		.dumpit = sfe_ipv4_genl_dump_wildcard_rules,
+	},
+	{
+		.cmd = SFE_DUMP_C_WILDCARD_ADD,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+		.validate = GENL_DONT_VALIDATE_STRICT,
+#endif /*KERNEL_VERSION(5, 2, 0)*/
+		.flags = GENL_ADMIN_PERM,
+		.doit = sfe_ipv4_genl_add_wildcard_rule,
+		.dumpit = NULL,
+	},
+	{
+		.cmd = SFE_DUMP_C_WILDCARD_DEL,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+		.validate = GENL_DONT_VALIDATE_STRICT,
+#endif /*KERNEL_VERSION(5, 2, 0)*/
+		.flags = GENL_ADMIN_PERM,
+		.doit = sfe_ipv4_genl_del_wildcard_rule,
+		.dumpit = NULL,
+	},
+	{
+		.cmd = SFE_DUMP_C_CONNECTION_ACCOUNT,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+		.validate = GENL_DONT_VALIDATE_STRICT,
+#endif /*KERNEL_VERSION(5, 2, 0)*/
+		.flags = GENL_ADMIN_PERM,
+		.doit = sfe_ipv4_genl_account_connection,
+		.dumpit = NULL,
+	},
+};
+
+static struct genl_family sfe_ipv4_genl_family = {
+	.hdrsize = SFE_DUMP_GENL_HDRSIZE,
+	.name = SFE_DUMP_GENL_NAME_IPV4,
+	.version = SFE_DUMP_GENL_VERSION,
+	.maxattr = SFE_DUMP_A_MAX,
+	.policy = sfe_ipv4_genl_policy,
+	.module = THIS_MODULE,
+	.ops = sfe_ipv4_genl_ops,
+	.n_ops = ARRAY_SIZE(sfe_ipv4_genl_ops),
 };
 
 #ifdef CONFIG_NF_FLOW_COOKIE
@@ -3497,23 +5508,107 @@ static const struct device_attribute sfe_ipv4_flow_cookie_attr =
 	__ATTR(flow_cookie_enable, S_IWUSR | S_IRUGO, sfe_ipv4_get_flow_cookie, sfe_ipv4_set_flow_cookie);
 #endif /*CONFIG_NF_FLOW_COOKIE*/
 
+/*
+ * sfe_ipv4_drain_connection_pool()
+ *	Release all of the objects in the free pool.
+ */
+static void sfe_ipv4_drain_connection_pool(struct sfe_ipv4 *si)
+{
+	struct sfe_ipv4_connection_object *obj;
+	struct sfe_ipv4_connection_object *tmp;
+
+	llist_for_each_entry_safe(obj, tmp, llist_del_all(&si->connection_pool), pool_node) {
+		kmem_cache_free(si->connection_cache, obj);
+	}
+
+	atomic_set(&si->connection_pool_count, 0);
+}
+
 /*
  * sfe_ipv4_init()
  */
 static int __init sfe_ipv4_init(void)
 {
 	struct sfe_ipv4 *si = &__si;
+	struct sfe_ipv4_hash_table *t;
 	int result = -1;
 
 	DEBUG_INFO("SFE IPv4 init\n");
 
+	/*
+	 * The lookup and rewrite state of a match must fit in one cache line.
+	 */
+	BUILD_BUG_ON(offsetofend(struct sfe_ipv4_connection_match,
+				 xlate_dest_csum_adjustment) > 64);
+
+	/*
+	 * Size the hash tables from our module parameter.
+	 */
+	hash_size = clamp(hash_size, 1U << SFE_IPV4_CONNECTION_HASH_SHIFT_MIN,
+			  1U << SFE_IPV4_CONNECTION_HASH_SHIFT_MAX);
+	si->hash_shift_min = order_base_2(hash_size);
+	INIT_WORK(&si->hash_resize_work, sfe_ipv4_hash_resize_work);
+
+	/*
+	 * Dumps only check the sequence number for changes once it is non-zero.
+	 */
+	si->hash_resize_seq = 1;
+
+	si->conn_hash = sfe_ipv4_hash_table_alloc(si->hash_shift_min, 0);
+	if (!si->conn_hash) {
+		DEBUG_ERROR("failed to allocate connection hash\n");
+		result = -ENOMEM;
+		goto exit0;
+	}
+
+	t = sfe_ipv4_hash_table_alloc(si->hash_shift_min, 0);
+	if (!t) {
+		DEBUG_ERROR("failed to allocate connection match hash\n");
+		result = -ENOMEM;
+		goto exit1;
+	}
+	RCU_INIT_POINTER(si->conn_match_hash, t);
+
+	si->stats_pcpu = alloc_percpu_gfp(struct sfe_ipv4_stats, GFP_KERNEL | __GFP_ZERO);
+	if (!si->stats_pcpu) {
+		DEBUG_ERROR("failed to allocate per-CPU stats\n");
+		result = -ENOMEM;
+		goto exit2;
+	}
+
+	si->connection_cache = KMEM_CACHE(sfe_ipv4_connection_object, SLAB_HWCACHE_ALIGN);
+	if (!si->connection_cache) {
+		DEBUG_ERROR("failed to create connection cache\n");
+		result = -ENOMEM;
+		goto exit3;
+	}
+
+	/*
+	 * Fill the free pool.  Running short here isn't fatal; we'll fall
+	 * back to the slab.
+	 */
+	init_llist_head(&si->connection_pool);
+	INIT_LIST_HEAD(&si->wildcard_rules);
+	atomic_set(&si->connection_pool_count, 0);
+	while (atomic_read(&si->connection_pool_count) < (int)pool_size) {
+		struct sfe_ipv4_connection_object *obj;
+
+		obj = kmem_cache_alloc(si->connection_cache, GFP_KERNEL);
+		if (!obj) {
+			DEBUG_WARN("only preallocated %d connections\n", atomic_read(&si->connection_pool_count));
+			break;
+		}
+
+		sfe_ipv4_free_connection_object(si, obj);
+	}
+
 	/*
 	 * Create sys/sfe_ipv4
 	 */
 	si->sys_sfe_ipv4 = kobject_create_and_add("sfe_ipv4", NULL);
 	if (!si->sys_sfe_ipv4) {
 		DEBUG_ERROR("failed to register sfe_ipv4\n");
-		goto exit1;
+		goto exit4;
 	}
 
 	/*
@@ -3522,14 +5617,14 @@ static int __init sfe_ipv4_init(void)
 	result = sysfs_create_file(si->sys_sfe_ipv4, &sfe_ipv4_debug_dev_attr.attr);
 	if (result) {
 		DEBUG_ERROR("failed to register debug dev file: %d\n", result);
-		goto exit2;
+		goto exit5;
 	}
 
 #ifdef CONFIG_NF_FLOW_COOKIE
 	result = sysfs_create_file(si->sys_sfe_ipv4, &sfe_ipv4_flow_cookie_attr.attr);
 	if (result) {
 		DEBUG_ERROR("failed to register flow cookie enable file: %d\n", result);
-		goto exit3;
+		goto exit6;
 	}
 #endif /* CONFIG_NF_FLOW_COOKIE */
 
@@ -3539,38 +5634,58 @@ static int __init sfe_ipv4_init(void)
 	result = register_chrdev(0, "sfe_ipv4", &sfe_ipv4_debug_dev_fops);
 	if (result < 0) {
 		DEBUG_ERROR("Failed to register chrdev: %d\n", result);
-		goto exit4;
+		goto exit7;
 	}
 
 	si->debug_dev = result;
 
 	/*
-	 * Create a timer to handle periodic statistics.
+	 * Create timers to handle periodic statistics.
 	 */
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0))
-	timer_setup(&si->timer, sfe_ipv4_periodic_sync, 0);
-	si->timer.cust_data = (unsigned long)si;
-#else
-	setup_timer(&si->timer, sfe_ipv4_periodic_sync, (unsigned long)si);
-#endif /*KERNEL_VERSION(4, 15, 0)*/
-	mod_timer(&si->timer, jiffies + ((HZ + 99) / 100));
+	sfe_ipv4_sync_timers_start(si);
 
 	spin_lock_init(&si->lock);
 
+	/*
+	 * Register our generic netlink family for dumping our state.
+	 */
+	result = genl_register_family(&sfe_ipv4_genl_family);
+	if (result) {
+		DEBUG_ERROR("failed to register genl family: %d\n", result);
+		goto exit8;
+	}
+
 	return 0;
 
-exit4:
+exit8:
+	sfe_ipv4_sync_timers_stop(si);
+	unregister_chrdev(si->debug_dev, "sfe_ipv4");
+
+exit7:
 #ifdef CONFIG_NF_FLOW_COOKIE
 	sysfs_remove_file(si->sys_sfe_ipv4, &sfe_ipv4_flow_cookie_attr.attr);
 
-exit3:
+exit6:
 #endif /* CONFIG_NF_FLOW_COOKIE */
 	sysfs_remove_file(si->sys_sfe_ipv4, &sfe_ipv4_debug_dev_attr.attr);
 
-exit2:
+exit5:
 	kobject_put(si->sys_sfe_ipv4);
 
+exit4:
+	sfe_ipv4_drain_connection_pool(si);
+	kmem_cache_destroy(si->connection_cache);
+
+exit3:
+	free_percpu(si->stats_pcpu);
+
+exit2:
+	kvfree(rcu_dereference_protected(si->conn_match_hash, true));
+
 exit1:
+	kvfree(si->conn_hash);
+
+exit0:
 	return result;
 }
 
@@ -3583,12 +5698,20 @@ static void __exit sfe_ipv4_exit(void)
 
 	DEBUG_INFO("SFE IPv4 exit\n");
 
+	genl_unregister_family(&sfe_ipv4_genl_family);
+
 	/*
 	 * Destroy all connections.
 	 */
 	sfe_ipv4_destroy_all_rules_for_dev(NULL);
 
-	del_timer_sync(&si->timer);
+	sfe_ipv4_sync_timers_stop(si);
+	cancel_work_sync(&si->hash_resize_work);
+
+	/*
+	 * Wait for any connections still queued for freeing.
+	 */
+	rcu_barrier();
 
 	unregister_chrdev(si->debug_dev, "sfe_ipv4");
 
@@ -3599,6 +5722,11 @@ static void __exit sfe_ipv4_exit(void)
 
 	kobject_put(si->sys_sfe_ipv4);
 
+	sfe_ipv4_drain_connection_pool(si);
+	kmem_cache_destroy(si->connection_cache);
+	free_percpu(si->stats_pcpu);
+	kvfree(rcu_dereference_protected(si->conn_match_hash, true));
+	kvfree(si->conn_hash);
 }
 
 module_init(sfe_ipv4_init)
@@ -3611,6 +5739,8 @@ EXPORT_SYMBOL(sfe_ipv4_destroy_all_rules_for_dev);
 EXPORT_SYMBOL(sfe_ipv4_register_sync_rule_callback);
 EXPORT_SYMBOL(sfe_ipv4_mark_rule);
 EXPORT_SYMBOL(sfe_ipv4_update_rule);
+EXPORT_SYMBOL(sfe_ipv4_create_wildcard_rule);
+EXPORT_SYMBOL(sfe_ipv4_destroy_wildcard_rule);
 #ifdef CONFIG_NF_FLOW_COOKIE
 EXPORT_SYMBOL(sfe_register_flow_cookie_cb);
 EXPORT_SYMBOL(sfe_unregister_flow_cookie_cb);
@@ -23,10 +23,22 @@
 #include "taxonomy.h"
 #include "airtime_policy.h"
 
+#ifdef CONFIG_DRIVER_NL80211
+#include <net/if.h>
+#include <netlink/genl/genl.h>
+#include <netlink/genl/ctrl.h>
+#include "drivers/nl80211_copy.h"
+#endif
+
 static struct ubus_context *ctx;
 static struct blob_buf b;
 static int ctx_ref;
 
+#ifdef CONFIG_DRIVER_NL80211
+static struct nl_sock *nl_sock;
+static int nl80211_id;
+#endif
+
 static inline struct hapd_interfaces *get_hapd_interfaces_from_object(struct ubus_object *obj)
 {
 	return container_of(obj, struct hapd_interfaces, ubus);
@@ -42,6 +54,61 @@ struct ubus_banned_client {
 	u8 addr[ETH_ALEN];
 };
 
+/* subscriber verdicts are cached per station and event type */
+#define HOSTAPD_UBUS_DECISION_TTL	10000 /* ms */
+#define HOSTAPD_UBUS_DECISION_TIMEOUT	1000 /* ms */
+#define HOSTAPD_UBUS_DECISION_MAX	512
+
+struct ubus_decision_key {
+	u8 addr[ETH_ALEN];
+	u8 type;
+};
+
+struct ubus_decision {
+	struct avl_node avl;
+	struct ubus_decision_key key;
+	struct ubus_notify_request nreq;
+	struct hostapd_data *hapd;
+	bool pending;
+	int resp;
+};
+
+/* driver statistics are shared by all get_clients callers */
+#define HOSTAPD_UBUS_STA_STATS_INTERVAL	1000 /* ms */
+#define HOSTAPD_UBUS_STA_STATS_HISTORY	64 /* generations */
+
+struct ubus_sta_stats {
+	struct avl_node avl;
+	u8 addr[ETH_ALEN];
+	struct hostap_sta_driver_data data;
+	bool valid;
+	u32 flags;
+	unsigned int seen;
+	unsigned int updated;
+	unsigned int changed;
+	unsigned int removed;
+};
+
+/* events may be coalesced into a single "batch" notification */
+#define HOSTAPD_UBUS_BATCH_MAX		32
+#define HOSTAPD_UBUS_BATCH_LIMIT	256
+#define HOSTAPD_UBUS_CAPS_TTL		60 /* s */
+#define HOSTAPD_UBUS_CAPS_MAX		1024
+
+struct ubus_batch_event {
+	struct list_head list;
+	char *type;
+	u8 addr[ETH_ALEN];
+	bool caps;
+	int count;
+	struct blob_attr *data;
+};
+
+struct ubus_caps_sent {
+	struct avl_node avl;
+	u8 addr[ETH_ALEN];
+};
+
 static void ubus_receive(int sock, void *eloop_ctx, void *sock_ctx)
 {
 	struct ubus_context *ctx = eloop_ctx;
@@ -95,6 +162,13 @@ static void hostapd_ubus_ref_dec(void)
 	eloop_unregister_read_sock(ctx->sock.fd);
 	ubus_free(ctx);
 	ctx = NULL;
+
+#ifdef CONFIG_DRIVER_NL80211
+	if (nl_sock) {
+		nl_socket_free(nl_sock);
+		nl_sock = NULL;
+	}
+#endif
 }
 
 void hostapd_ubus_add_iface(struct hostapd_iface *iface)
@@ -195,6 +269,278 @@ hostapd_bss_ban_client(struct hostapd_data *hapd, u8 *addr, int time)
 	eloop_register_timeout(0, time * 1000, hostapd_bss_del_ban, ban, hapd);
 }
 
+static void
+hostapd_ubus_caps_expire(void *eloop_data, void *user_ctx)
+{
+	struct ubus_caps_sent *cs = eloop_data;
+	struct hostapd_data *hapd = user_ctx;
+
+	avl_delete(&hapd->ubus.caps_sent, &cs->avl);
+	free(cs);
+}
+
+static void
+hostapd_ubus_caps_flush(struct hostapd_data *hapd)
+{
+	struct ubus_caps_sent *cs, *tmp;
+
+	avl_for_each_element_safe(&hapd->ubus.caps_sent, cs, avl, tmp) {
+		eloop_cancel_timeout(hostapd_ubus_caps_expire, cs, hapd);
+		hostapd_ubus_caps_expire(cs, hapd);
+	}
+}
+
+static void
+hostapd_ubus_caps_mark(struct hostapd_data *hapd, const u8 *addr)
+{
+	struct ubus_caps_sent *cs;
+
+	cs = avl_find_element(&hapd->ubus.caps_sent, addr, cs, avl);
+	if (!cs) {
+		if (hapd->ubus.caps_sent.count >= HOSTAPD_UBUS_CAPS_MAX)
+			return;
+
+		cs = os_zalloc(sizeof(*cs));
+		if (!cs)
+			return;
+
+		memcpy(cs->addr, addr, sizeof(cs->addr));
+		cs->avl.key = cs->addr;
+		avl_insert(&hapd->ubus.caps_sent, &cs->avl);
+	} else {
+		eloop_cancel_timeout(hostapd_ubus_caps_expire, cs, hapd);
+	}
+
+	eloop_register_timeout(HOSTAPD_UBUS_CAPS_TTL, 0, hostapd_ubus_caps_expire, cs, hapd);
+}
+
+/* with batching enabled, capabilities are only sent once per station */
+static bool
+hostapd_ubus_send_caps(struct hostapd_data *hapd, const u8 *addr)
+{
+	if (!hapd->ubus.event_interval)
+		return true;
+
+	return !avl_find(&hapd->ubus.caps_sent, addr);
+}
+
+static void
+hostapd_ubus_batch_flush(struct hostapd_data *hapd)
+{
+	struct ubus_batch_event *ev, *tmp;
+	struct blob_attr *cur;
+	void *list, *c;
+	int rem;
+
+	if (list_empty(&hapd->ubus.events))
+		return;
+
+	if (hapd->ubus.obj.has_subscribers) {
+		blob_buf_init(&b, 0);
+		list = blobmsg_open_array(&b, "events");
+		list_for_each_entry(ev, &hapd->ubus.events, list) {
+			c = blobmsg_open_table(&b, NULL);
+			blobmsg_add_string(&b, "type", ev->type);
+			blobmsg_add_u32(&b, "count", ev->count);
+			blob_for_each_attr(cur, ev->data, rem)
+				blobmsg_add_blob(&b, cur);
+			blobmsg_close_table(&b, c);
+
+			if (ev->caps)
+				hostapd_ubus_caps_mark(hapd, ev->addr);
+		}
+		blobmsg_close_array(&b, list);
+		ubus_notify(ctx, &hapd->ubus.obj, "batch", b.head, -1);
+	}
+
+	list_for_each_entry_safe(ev, tmp, &hapd->ubus.events, list) {
+		list_del(&ev->list);
+		free(ev->data);
+		free(ev->type);
+		free(ev);
+	}
+	hapd->ubus.event_count = 0;
+}
+
+static void
+hostapd_ubus_batch_timeout(void *eloop_data, void *user_ctx)
+{
+	hostapd_ubus_batch_flush(eloop_data);
+}
+
+/*
+ * Send an event that does not expect a response. When batching is enabled,
+ * the event is queued and sent along with the others at the end of the batch
+ * window; repeated events from the same station can be merged into one.
+ */
+static void
+hostapd_ubus_notify_event(struct hostapd_data *hapd, const char *type,
+			  const u8 *addr, struct blob_attr *msg, bool merge,
+			  bool caps)
+{
+	struct ubus_batch_event *ev;
+	struct blob_attr *data;
+
+	if (!hapd->ubus.event_interval) {
+		ubus_notify(ctx, &hapd->ubus.obj, type, msg, -1);
+		return;
+	}
+
+	data = blob_memdup(msg);
+	if (!data)
+		return;
+
+	if (merge) {
+		list_for_each_entry(ev, &hapd->ubus.events, list) {
+			if (strcmp(ev->type, type) != 0 ||
+			    memcmp(ev->addr, addr, ETH_ALEN) != 0)
+				continue;
+
+			free(ev->data);
+			ev->data = data;
+			ev->caps = caps;
+			ev->count++;
+			return;
+		}
+	}
+
+	ev = os_zalloc(sizeof(*ev));
+	if (!ev) {
+		free(data);
+		return;
+	}
+
+	ev->type = os_strdup(type);
+	if (!ev->type) {
+		free(data);
+		free(ev);
+		return;
+	}
+
+	memcpy(ev->addr, addr, ETH_ALEN);
+	ev->caps = caps;
+	ev->count = 1;
+	ev->data = data;
+	list_add_tail(&ev->list, &hapd->ubus.events);
+
+	if (++hapd->ubus.event_count >= hapd->ubus.event_max) {
+		eloop_cancel_timeout(hostapd_ubus_batch_timeout, hapd, NULL);
+		hostapd_ubus_batch_flush(hapd);
+	} else if (hapd->ubus.event_count == 1) {
+		eloop_register_timeout(0, hapd->ubus.event_interval * 1000,
+				       hostapd_ubus_batch_timeout, hapd, NULL);
+	}
+}
+
+static void
+hostapd_ubus_decision_free(struct hostapd_data *hapd, struct ubus_decision *dec)
+{
+	if (dec->pending)
+		ubus_abort_request(ctx, &dec->nreq.req);
+
+	avl_delete(&hapd->ubus.decisions, &dec->avl);
+	free(dec);
+}
+
+static void
+hostapd_ubus_decision_timeout(void *eloop_data, void *user_ctx)
+{
+	hostapd_ubus_decision_free(user_ctx, eloop_data);
+}
+
+static void
+hostapd_ubus_flush_decisions(struct hostapd_data *hapd)
+{
+	struct ubus_decision *dec, *tmp;
+
+	avl_for_each_element_safe(&hapd->ubus.decisions, dec, avl, tmp) {
+		eloop_cancel_timeout(hostapd_ubus_decision_timeout, dec, hapd);
+		hostapd_ubus_decision_free(hapd, dec);
+	}
+}
+
+static void
+hostapd_ubus_decision_status_cb(struct ubus_notify_request *req, int idx, int ret)
+{
+	struct ubus_decision *dec = container_of(req, struct ubus_decision, nreq);
+
+	dec->resp = ret;
+}
+
+static void
+hostapd_ubus_decision_complete_cb(struct ubus_notify_request *req, int idx, int ret)
+{
+	struct ubus_decision *dec = container_of(req, struct ubus_decision, nreq);
+	struct hostapd_data *hapd = dec->hapd;
+
+	if (!dec->pending)
+		return;
+
+	/* keep the verdict around until it expires */
+	dec->pending = false;
+	eloop_cancel_timeout(hostapd_ubus_decision_timeout, dec, hapd);
+	eloop_register_timeout(0, hapd->ubus.decision_ttl * 1000,
+			       hostapd_ubus_decision_timeout, dec, hapd);
+}
+
+/*
+ * Never wait for subscribers in the management frame path: a cached verdict
+ * is returned if there is one, otherwise the request is sent asynchronously
+ * and the station gets the default response until the subscribers answer.
+ */
+static int
+hostapd_ubus_decision(struct hostapd_data *hapd, enum hostapd_ubus_event_type type,
+		      const u8 *addr, const char *name, struct blob_attr *msg,
+		      bool caps)
+{
+	struct ubus_decision_key key = {};
+	struct ubus_decision *dec;
+	bool merge = type == HOSTAPD_UBUS_PROBE_REQ;
+
+	memcpy(key.addr, addr, ETH_ALEN);
+	key.type = type;
+
+	dec = avl_find_element(&hapd->ubus.decisions, &key, dec, avl);
+	if (dec) {
+		/* subscribers still see every frame */
+		hostapd_ubus_notify_event(hapd, name, addr, msg, merge, caps);
+		return dec->pending ? hapd->ubus.default_response : dec->resp;
+	}
+
+	if (hapd->ubus.decisions.count >= HOSTAPD_UBUS_DECISION_MAX)
+		goto out;
+
+	dec = os_zalloc(sizeof(*dec));
+	if (!dec)
+		goto out;
+
+	if (ubus_notify_async(ctx, &hapd->ubus.obj, name, msg, &dec->nreq)) {
+		free(dec);
+		return hapd->ubus.default_response;
+	}
+
+	memcpy(&dec->key, &key, sizeof(dec->key));
+	dec->avl.key = &dec->key;
+	dec->hapd = hapd;
+	dec->pending = true;
+	dec->nreq.status_cb = hostapd_ubus_decision_status_cb;
+	dec->nreq.complete_cb = hostapd_ubus_decision_complete_cb;
+	avl_insert(&hapd->ubus.decisions, &dec->avl);
+
+	ubus_complete_request_async(ctx, &dec->nreq.req);
+	eloop_register_timeout(0, HOSTAPD_UBUS_DECISION_TIMEOUT * 1000,
+			       hostapd_ubus_decision_timeout, dec, hapd);
+
+	if (caps && hapd->ubus.event_interval)
+		hostapd_ubus_caps_mark(hapd, addr);
+
+	return hapd->ubus.default_response;
+
+out:
+	hostapd_ubus_notify_event(hapd, name, addr, msg, merge, caps);
+	return hapd->ubus.default_response;
+}
+
 static int
 hostapd_bss_reload(struct ubus_context *ctx, struct ubus_object *obj,
 		   struct ubus_request_data *req, const char *method,
@@ -276,14 +622,324 @@ hostapd_parse_capab_blobmsg(struct sta_info *sta)
 	blobmsg_close_table(&b, v);
 }
 
+static void
+hostapd_ubus_sta_stats_set(struct ubus_sta_stats *st,
+			   struct hostap_sta_driver_data *data, unsigned int gen)
+{
+	st->updated = gen;
+	if (st->valid && !memcmp(&st->data, data, sizeof(*data)))
+		return;
+
+	memcpy(&st->data, data, sizeof(*data));
+	st->valid = true;
+	st->changed = gen;
+}
+
+#ifdef CONFIG_DRIVER_NL80211
+static int
+hostapd_ubus_nl_finish(struct nl_msg *msg, void *arg)
+{
+	int *err = arg;
+
+	*err = 0;
+	return NL_SKIP;
+}
+
+static int
+hostapd_ubus_nl_error(struct sockaddr_nl *nla, struct nlmsgerr *nlerr, void *arg)
+{
+	int *err = arg;
+
+	*err = nlerr->error;
+	return NL_STOP;
+}
+
+static unsigned long
+hostapd_ubus_nl_bitrate(struct nlattr *attr)
+{
+	static struct nla_policy rate_policy[NL80211_RATE_INFO_MAX + 1] = {
+		[NL80211_RATE_INFO_BITRATE] = { .type = NLA_U16 },
+		[NL80211_RATE_INFO_BITRATE32] = { .type = NLA_U32 },
+	};
+	struct nlattr *rate[NL80211_RATE_INFO_MAX + 1];
+
+	if (nla_parse_nested(rate, NL80211_RATE_INFO_MAX, attr, rate_policy))
+		return 0;
+
+	/* in 100 kbit/s, as reported by read_sta_data */
+	if (rate[NL80211_RATE_INFO_BITRATE32])
+		return nla_get_u32(rate[NL80211_RATE_INFO_BITRATE32]);
+	if (rate[NL80211_RATE_INFO_BITRATE])
+		return nla_get_u16(rate[NL80211_RATE_INFO_BITRATE]);
+
+	return 0;
+}
+
+static int
+hostapd_ubus_sta_dump_cb(struct nl_msg *msg, void *arg)
+{
+	static struct nla_policy stats_policy[NL80211_STA_INFO_MAX + 1] = {
+		[NL80211_STA_INFO_RX_BYTES] = { .type = NLA_U32 },
+		[NL80211_STA_INFO_TX_BYTES] = { .type = NLA_U32 },
+		[NL80211_STA_INFO_RX_BYTES64] = { .type = NLA_U64 },
+		[NL80211_STA_INFO_TX_BYTES64] = { .type = NLA_U64 },
+		[NL80211_STA_INFO_RX_PACKETS] = { .type = NLA_U32 },
+		[NL80211_STA_INFO_TX_PACKETS] = { .type = NLA_U32 },
+		[NL80211_STA_INFO_RX_DURATION] = { .type = NLA_U64 },
+		[NL80211_STA_INFO_TX_DURATION] = { .type = NLA_U64 },
+		[NL80211_STA_INFO_SIGNAL] = { .type = NLA_U8 },
+		[NL80211_STA_INFO_TX_BITRATE] = { .type = NLA_NESTED },
+		[NL80211_STA_INFO_RX_BITRATE] = { .type = NLA_NESTED },
+	};
+	struct hostapd_data *hapd = arg;
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *tb[NL80211_ATTR_MAX + 1];
+	struct nlattr *stats[NL80211_STA_INFO_MAX + 1];
+	struct hostap_sta_driver_data data;
+	struct ubus_sta_stats *st;
+
+	nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
+
+	if (!tb[NL80211_ATTR_MAC] || !tb[NL80211_ATTR_STA_INFO] ||
+	    nla_len(tb[NL80211_ATTR_MAC]) != ETH_ALEN)
+		return NL_SKIP;
+
+	/* only stations hostapd knows about are reported */
+	st = avl_find_element(&hapd->ubus.sta_stats, nla_data(tb[NL80211_ATTR_MAC]), st, avl);
+	if (!st || st->removed)
+		return NL_SKIP;
+
+	if (nla_parse_nested(stats, NL80211_STA_INFO_MAX,
+			     tb[NL80211_ATTR_STA_INFO], stats_policy))
+		return NL_SKIP;
+
+	memset(&data, 0, sizeof(data));
+	if (stats[NL80211_STA_INFO_RX_BYTES64] && stats[NL80211_STA_INFO_TX_BYTES64]) {
+		data.rx_bytes = nla_get_u64(stats[NL80211_STA_INFO_RX_BYTES64]);
+		data.tx_bytes = nla_get_u64(stats[NL80211_STA_INFO_TX_BYTES64]);
+		data.bytes_64bit = 1;
+	} else {
+		if (stats[NL80211_STA_INFO_RX_BYTES])
+			data.rx_bytes = nla_get_u32(stats[NL80211_STA_INFO_RX_BYTES]);
+		if (stats[NL80211_STA_INFO_TX_BYTES])
+			data.tx_bytes = nla_get_u32(stats[NL80211_STA_INFO_TX_BYTES]);
+	}
+	if (stats[NL80211_STA_INFO_RX_PACKETS])
+		data.rx_packets = nla_get_u32(stats[NL80211_STA_INFO_RX_PACKETS]);
+	if (stats[NL80211_STA_INFO_TX_PACKETS])
+		data.tx_packets = nla_get_u32(stats[NL80211_STA_INFO_TX_PACKETS]);
+	if (stats[NL80211_STA_INFO_RX_DURATION])
+		data.rx_airtime = nla_get_u64(stats[NL80211_STA_INFO_RX_DURATION]);
+	if (stats[NL80211_STA_INFO_TX_DURATION])
+		data.tx_airtime = nla_get_u64(stats[NL80211_STA_INFO_TX_DURATION]);
+	if (stats[NL80211_STA_INFO_SIGNAL])
+		data.signal = nla_get_u8(stats[NL80211_STA_INFO_SIGNAL]);
+	if (stats[NL80211_STA_INFO_TX_BITRATE])
+		data.current_tx_rate = hostapd_ubus_nl_bitrate(stats[NL80211_STA_INFO_TX_BITRATE]);
+	if (stats[NL80211_STA_INFO_RX_BITRATE])
+		data.current_rx_rate = hostapd_ubus_nl_bitrate(stats[NL80211_STA_INFO_RX_BITRATE]);
+
+	hostapd_ubus_sta_stats_set(st, &data, hapd->ubus.sta_stats_gen);
+
+	return NL_SKIP;
+}
+
+/*
+ * Fetch the statistics of the stations on the BSS interface with a single
+ * NL80211_CMD_GET_STATION dump instead of one request per station.
+ */
+static int
+hostapd_ubus_sta_dump(struct hostapd_data *hapd)
+{
+	struct nl_msg *msg;
+	struct nl_cb *cb;
+	int ifindex;
+	int err;
+
+	if (!hapd->driver || !hapd->driver->name ||
+	    strcmp(hapd->driver->name, "nl80211") != 0)
+		return -1;
+
+	ifindex = if_nametoindex(hapd->conf->iface);
+	if (!ifindex)
+		return -1;
+
+	if (!nl_sock) {
+		nl_sock = nl_socket_alloc();
+		if (!nl_sock)
+			return -1;
+
+		if (genl_connect(nl_sock) ||
+		    (nl80211_id = genl_ctrl_resolve(nl_sock, "nl80211")) < 0) {
+			nl_socket_free(nl_sock);
+			nl_sock = NULL;
+			return -1;
+		}
+	}
+
+	msg = nlmsg_alloc();
+	if (!msg)
+		return -1;
+
+	cb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (!cb) {
+		nlmsg_free(msg);
+		return -1;
+	}
+
+	genlmsg_put(msg, 0, 0, nl80211_id, 0, NLM_F_DUMP, NL80211_CMD_GET_STATION, 0);
+	nla_put_u32(msg, NL80211_ATTR_IFINDEX, ifindex);
+
+	err = nl_send_auto_complete(nl_sock, msg);
+	if (err < 0)
+		goto out;
+
+	err = 1;
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, hostapd_ubus_sta_dump_cb, hapd);
+	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, hostapd_ubus_nl_finish, &err);
+	nl_cb_err(cb, NL_CB_CUSTOM, hostapd_ubus_nl_error, &err);
+
+	while (err > 0) {
+		if (nl_recvmsgs(nl_sock, cb) < 0 && err > 0)
+			err = -1;
+	}
+
+out:
+	nl_cb_put(cb);
+	nlmsg_free(msg);
+
+	return err;
+}
+#else
+static int
+hostapd_ubus_sta_dump(struct hostapd_data *hapd)
+{
+	return -1;
+}
+#endif
+
+static void
+hostapd_ubus_sta_stats_flush(struct hostapd_data *hapd)
+{
+	struct ubus_sta_stats *st, *tmp;
+
+	avl_for_each_element_safe(&hapd->ubus.sta_stats, st, avl, tmp) {
+		avl_delete(&hapd->ubus.sta_stats, &st->avl);
+		free(st);
+	}
+}
+
+/*
+ * Refresh the station statistics snapshot, at most once per
+ * sta_stats_interval. Every refresh starts a new generation; stations
+ * record the generation they last changed in, so that pollers can ask
+ * for the changes since the generation they saw last.
+ */
+static void
+hostapd_ubus_sta_stats_refresh(struct hostapd_data *hapd)
+{
+	struct hostap_sta_driver_data data;
+	struct ubus_sta_stats *st, *tmp;
+	struct os_reltime age;
+	struct sta_info *sta;
+	unsigned int gen;
+
+	if (hapd->ubus.sta_stats_gen) {
+		os_reltime_age(&hapd->ubus.sta_stats_time, &age);
+		if (age.sec * 1000 + age.usec / 1000 < hapd->ubus.sta_stats_interval)
+			return;
+	}
+
+	os_get_reltime(&hapd->ubus.sta_stats_time);
+	gen = ++hapd->ubus.sta_stats_gen;
+
+	for (sta = hapd->sta_list; sta; sta = sta->next) {
+		st = avl_find_element(&hapd->ubus.sta_stats, sta->addr, st, avl);
+		if (!st || st->removed) {
+			if (!st) {
+				st = os_zalloc(sizeof(*st));
+				if (!st)
+					continue;
+
+				memcpy(st->addr, sta->addr, sizeof(st->addr));
+				st->avl.key = st->addr;
+				avl_insert(&hapd->ubus.sta_stats, &st->avl);
+			}
+			st->removed = 0;
+			st->valid = false;
+			st->changed = gen;
+		}
+
+		st->seen = gen;
+		if (st->flags != sta->flags) {
+			st->flags = sta->flags;
+			st->changed = gen;
+		}
+	}
+
+	/*
+	 * The dump only covers the BSS interface itself, stations on AP_VLAN
+	 * interfaces (dynamic VLAN, WDS) and any the dump missed are queried
+	 * one by one.
+	 */
+	hostapd_ubus_sta_dump(hapd);
+
+	avl_for_each_element(&hapd->ubus.sta_stats, st, avl) {
+		if (st->seen != gen || st->updated == gen)
+			continue;
+
+		memset(&data, 0, sizeof(data));
+		if (hostapd_drv_read_sta_data(hapd, &data, st->addr) >= 0)
+			hostapd_ubus_sta_stats_set(st, &data, gen);
+	}
+
+	avl_for_each_element_safe(&hapd->ubus.sta_stats, st, avl, tmp) {
+		if (st->removed) {
+			/* keep departed stations around for delta requests */
+			if (gen - st->removed < HOSTAPD_UBUS_STA_STATS_HISTORY)
+				continue;
+
+			if (hapd->ubus.sta_stats_purged < st->removed)
+				hapd->ubus.sta_stats_purged = st->removed;
+			avl_delete(&hapd->ubus.sta_stats, &st->avl);
+			free(st);
+			continue;
+		}
+
+		if (st->seen != gen) {
+			st->removed = gen;
+			st->changed = gen;
+			continue;
+		}
+
+		if (st->valid && st->updated != gen) {
+			st->valid = false;
+			st->changed = gen;
+		}
+	}
+}
+
+enum {
+	CLIENTS_SINCE,
+	__CLIENTS_MAX
+};
+
+static const struct blobmsg_policy clients_policy[__CLIENTS_MAX] = {
+	[CLIENTS_SINCE] = { "since", BLOBMSG_TYPE_INT32 },
+};
+
 static int
 hostapd_bss_get_clients(struct ubus_context *ctx, struct ubus_object *obj,
 			struct ubus_request_data *req, const char *method,
 			struct blob_attr *msg)
 {
 	struct hostapd_data *hapd = container_of(obj, struct hostapd_data, ubus.obj);
-	struct hostap_sta_driver_data sta_driver_data;
+	struct blob_attr *tb[__CLIENTS_MAX];
+	struct ubus_sta_stats *st;
 	struct sta_info *sta;
+	unsigned int since = 0;
+	bool delta = false;
 	void *list, *c;
 	char mac_buf[20];
 	static const struct {
@@ -303,13 +959,30 @@ hostapd_bss_get_clients(struct ubus_context *ctx, struct ubus_object *obj,
 		{ "mfp", WLAN_STA_MFP },
 	};
 
+	blobmsg_parse(clients_policy, __CLIENTS_MAX, tb, blob_data(msg), blob_len(msg));
+
+	hostapd_ubus_sta_stats_refresh(hapd);
+
+	/* fall back to a full reply once departed stations have been purged */
+	if (tb[CLIENTS_SINCE]) {
+		since = blobmsg_get_u32(tb[CLIENTS_SINCE]);
+		delta = since >= hapd->ubus.sta_stats_purged &&
+			since <= hapd->ubus.sta_stats_gen;
+	}
+
 	blob_buf_init(&b, 0);
 	blobmsg_add_u32(&b, "freq", hapd->iface->freq);
+	blobmsg_add_u32(&b, "generation", hapd->ubus.sta_stats_gen);
+	blobmsg_add_u8(&b, "delta", delta);
 	list = blobmsg_open_table(&b, "clients");
 	for (sta = hapd->sta_list; sta; sta = sta->next) {
 		void *r;
 		int i;
 
+		st = avl_find_element(&hapd->ubus.sta_stats, sta->addr, st, avl);
+		if (delta && st && !st->removed && st->changed <= since)
+			continue;
+
 		sprintf(mac_buf, MACSTR, MAC2STR(sta->addr));
 		c = blobmsg_open_table(&b, mac_buf);
 		for (i = 0; i < ARRAY_SIZE(sta_flags); i++)
@@ -328,25 +1001,25 @@ hostapd_bss_get_clients(struct ubus_context *ctx, struct ubus_object *obj,
 #endif
 
 		/* Driver information */
-		if (hostapd_drv_read_sta_data(hapd, &sta_driver_data, sta->addr) >= 0) {
+		if (st && !st->removed && st->valid) {
 			r = blobmsg_open_table(&b, "bytes");
-			blobmsg_add_u64(&b, "rx", sta_driver_data.rx_bytes);
-			blobmsg_add_u64(&b, "tx", sta_driver_data.tx_bytes);
+			blobmsg_add_u64(&b, "rx", st->data.rx_bytes);
+			blobmsg_add_u64(&b, "tx", st->data.tx_bytes);
 			blobmsg_close_table(&b, r);
 			r = blobmsg_open_table(&b, "airtime");
-			blobmsg_add_u64(&b, "rx", sta_driver_data.rx_airtime);
-			blobmsg_add_u64(&b, "tx", sta_driver_data.tx_airtime);
+			blobmsg_add_u64(&b, "rx", st->data.rx_airtime);
+			blobmsg_add_u64(&b, "tx", st->data.tx_airtime);
 			blobmsg_close_table(&b, r);
 			r = blobmsg_open_table(&b, "packets");
-			blobmsg_add_u32(&b, "rx", sta_driver_data.rx_packets);
-			blobmsg_add_u32(&b, "tx", sta_driver_data.tx_packets);
+			blobmsg_add_u32(&b, "rx", st->data.rx_packets);
+			blobmsg_add_u32(&b, "tx", st->data.tx_packets);
 			blobmsg_close_table(&b, r);
 			r = blobmsg_open_table(&b, "rate");
 			/* Rate in kbits */
-			blobmsg_add_u32(&b, "rx", sta_driver_data.current_rx_rate * 100);
-			blobmsg_add_u32(&b, "tx", sta_driver_data.current_tx_rate * 100);
+			blobmsg_add_u32(&b, "rx", st->data.current_rx_rate * 100);
+			blobmsg_add_u32(&b, "tx", st->data.current_tx_rate * 100);
 			blobmsg_close_table(&b, r);
-			blobmsg_add_u32(&b, "signal", sta_driver_data.signal);
+			blobmsg_add_u32(&b, "signal", st->data.signal);
 		}
 
 		hostapd_parse_capab_blobmsg(sta);
@@ -354,6 +1027,16 @@ hostapd_bss_get_clients(struct ubus_context *ctx, struct ubus_object *obj,
 		blobmsg_close_table(&b, c);
 	}
 	blobmsg_close_array(&b, list);
+
+	if (delta) {
+		list = blobmsg_open_array(&b, "removed");
+		avl_for_each_element(&hapd->ubus.sta_stats, st, avl) {
+			if (st->removed > since)
+				blobmsg_printf(&b, NULL, MACSTR, MAC2STR(st->addr));
+		}
+		blobmsg_close_array(&b, list);
+	}
+
 	ubus_send_reply(ctx, req, b.head);
 
 	return 0;
@@ -453,11 +1136,15 @@ hostapd_bss_get_status(struct ubus_context *ctx, struct ubus_object *obj,
 
 enum {
 	NOTIFY_RESPONSE,
+	NOTIFY_DECISION_TTL,
+	NOTIFY_DEFAULT_RESPONSE,
 	__NOTIFY_MAX
 };
 
 static const struct blobmsg_policy notify_policy[__NOTIFY_MAX] = {
 	[NOTIFY_RESPONSE] = { "notify_response", BLOBMSG_TYPE_INT32 },
+	[NOTIFY_DECISION_TTL] = { "decision_ttl", BLOBMSG_TYPE_INT32 },
+	[NOTIFY_DEFAULT_RESPONSE] = { "default_response", BLOBMSG_TYPE_INT32 },
 };
 
 static int
@@ -479,6 +1166,95 @@ hostapd_notify_response(struct ubus_context *ctx, struct ubus_object *obj,
 
 	hapd->ubus.notify_response = blobmsg_get_u32(tb[NOTIFY_RESPONSE]);
 
+	if (tb[NOTIFY_DECISION_TTL])
+		hapd->ubus.decision_ttl = blobmsg_get_u32(tb[NOTIFY_DECISION_TTL]);
+
+	if (tb[NOTIFY_DEFAULT_RESPONSE])
+		hapd->ubus.default_response = blobmsg_get_u32(tb[NOTIFY_DEFAULT_RESPONSE]);
+
+	if (hapd->ubus.decision_ttl < 0)
+		hapd->ubus.decision_ttl = 0;
+
+	/* verdicts given under the old settings no longer apply */
+	hostapd_ubus_flush_decisions(hapd);
+
+	return UBUS_STATUS_OK;
+}
+
+enum {
+	CLIENTS_INTERVAL,
+	__CLIENTS_INTERVAL_MAX
+};
+
+static const struct blobmsg_policy clients_interval_policy[__CLIENTS_INTERVAL_MAX] = {
+	[CLIENTS_INTERVAL] = { "interval", BLOBMSG_TYPE_INT32 },
+};
+
+static int
+hostapd_bss_set_clients_interval(struct ubus_context *ctx, struct ubus_object *obj,
+				 struct ubus_request_data *req, const char *method,
+				 struct blob_attr *msg)
+{
+	struct blob_attr *tb[__CLIENTS_INTERVAL_MAX];
+	struct hostapd_data *hapd = get_hapd_from_object(obj);
+	int interval;
+
+	blobmsg_parse(clients_interval_policy, __CLIENTS_INTERVAL_MAX, tb,
+		      blob_data(msg), blob_len(msg));
+
+	if (!tb[CLIENTS_INTERVAL])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	interval = blobmsg_get_u32(tb[CLIENTS_INTERVAL]);
+	if (interval < 0)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	hapd->ubus.sta_stats_interval = interval;
+
+	return UBUS_STATUS_OK;
+}
+
+enum {
+	EVENT_BATCH_INTERVAL,
+	EVENT_BATCH_MAX,
+	__EVENT_BATCH_MAX
+};
+
+static const struct blobmsg_policy event_batch_policy[__EVENT_BATCH_MAX] = {
+	[EVENT_BATCH_INTERVAL] = { "interval", BLOBMSG_TYPE_INT32 },
+	[EVENT_BATCH_MAX] = { "max_events", BLOBMSG_TYPE_INT32 },
+};
+
+static int
+hostapd_bss_set_event_batch(struct ubus_context *ctx, struct ubus_object *obj,
+			    struct ubus_request_data *req, const char *method,
+			    struct blob_attr *msg)
+{
+	struct blob_attr *tb[__EVENT_BATCH_MAX];
+	struct hostapd_data *hapd = get_hapd_from_object(obj);
+	int interval, max = HOSTAPD_UBUS_BATCH_MAX;
+
+	blobmsg_parse(event_batch_policy, __EVENT_BATCH_MAX, tb,
+		      blob_data(msg), blob_len(msg));
+
+	if (!tb[EVENT_BATCH_INTERVAL])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	interval = blobmsg_get_u32(tb[EVENT_BATCH_INTERVAL]);
+	if (tb[EVENT_BATCH_MAX])
+		max = blobmsg_get_u32(tb[EVENT_BATCH_MAX]);
+
+	if (interval < 0 || max < 1 || max > HOSTAPD_UBUS_BATCH_LIMIT)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	/* send whatever was queued under the old settings */
+	eloop_cancel_timeout(hostapd_ubus_batch_timeout, hapd, NULL);
+	hostapd_ubus_batch_flush(hapd);
+	hostapd_ubus_caps_flush(hapd);
+
+	hapd->ubus.event_interval = interval;
+	hapd->ubus.event_max = max;
+
 	return UBUS_STATUS_OK;
 }
 
@@ -1500,7 +2276,8 @@ hostapd_bss_update_airtime(struct ubus_context *ctx, struct ubus_object *obj,
 
 static const struct ubus_method bss_methods[] = {
 	UBUS_METHOD_NOARG("reload", hostapd_bss_reload),
-	UBUS_METHOD_NOARG("get_clients", hostapd_bss_get_clients),
+	UBUS_METHOD("get_clients", hostapd_bss_get_clients, clients_policy),
+	UBUS_METHOD("set_clients_interval", hostapd_bss_set_clients_interval, clients_interval_policy),
 	UBUS_METHOD_NOARG("get_status", hostapd_bss_get_status),
 	UBUS_METHOD("del_client", hostapd_bss_del_client, del_policy),
 #ifdef CONFIG_AIRTIME_POLICY
@@ -1519,6 +2296,7 @@ static const struct ubus_method bss_methods[] = {
 #endif
 	UBUS_METHOD("set_vendor_elements", hostapd_vendor_elements, ve_policy),
 	UBUS_METHOD("notify_response", hostapd_notify_response, notify_policy),
+	UBUS_METHOD("set_event_batch", hostapd_bss_set_event_batch, event_batch_policy),
 	UBUS_METHOD("bss_mgmt_enable", hostapd_bss_mgmt_enable, bss_mgmt_enable_policy),
 	UBUS_METHOD_NOARG("rrm_nr_get_own", hostapd_rrm_nr_get_own),
 	UBUS_METHOD_NOARG("rrm_nr_list", hostapd_rrm_nr_list),
@@ -1538,6 +2316,20 @@ static int avl_compare_macaddr(const void *k1, const void *k2, void *ptr)
 	return memcmp(k1, k2, ETH_ALEN);
 }
 
+static void
+hostapd_bss_subscribe_cb(struct ubus_context *ctx, struct ubus_object *obj)
+{
+	struct hostapd_data *hapd = get_hapd_from_object(obj);
+
+	/* new subscribers have not seen any capabilities yet */
+	hostapd_ubus_caps_flush(hapd);
+}
+
+static int avl_compare_decision(const void *k1, const void *k2, void *ptr)
+{
+	return memcmp(k1, k2, sizeof(struct ubus_decision_key));
+}
+
 void hostapd_ubus_add_bss(struct hostapd_data *hapd)
 {
 	struct ubus_object *obj = &hapd->ubus.obj;
@@ -1556,10 +2348,19 @@ void hostapd_ubus_add_bss(struct hostapd_data *hapd)
 		return;
 
 	avl_init(&hapd->ubus.banned, avl_compare_macaddr, false, NULL);
+	avl_init(&hapd->ubus.decisions, avl_compare_decision, false, NULL);
+	hapd->ubus.decision_ttl = HOSTAPD_UBUS_DECISION_TTL;
+	hapd->ubus.default_response = WLAN_STATUS_SUCCESS;
+	avl_init(&hapd->ubus.sta_stats, avl_compare_macaddr, false, NULL);
+	hapd->ubus.sta_stats_interval = HOSTAPD_UBUS_STA_STATS_INTERVAL;
+	INIT_LIST_HEAD(&hapd->ubus.events);
+	avl_init(&hapd->ubus.caps_sent, avl_compare_macaddr, false, NULL);
+	hapd->ubus.event_max = HOSTAPD_UBUS_BATCH_MAX;
 	obj->name = name;
 	obj->type = &bss_object_type;
 	obj->methods = bss_object_type.methods;
 	obj->n_methods = bss_object_type.n_methods;
+	obj->subscribe_cb = hostapd_bss_subscribe_cb;
 	ret = ubus_add_object(ctx, obj);
 	hostapd_ubus_ref_inc();
 
@@ -1581,6 +2382,12 @@ void hostapd_ubus_free_bss(struct hostapd_data *hapd)
 
 	hostapd_send_shared_event(&hapd->iface->interfaces->ubus, hapd->conf->iface, "remove");
 
+	hostapd_ubus_flush_decisions(hapd);
+	hostapd_ubus_sta_stats_flush(hapd);
+	eloop_cancel_timeout(hostapd_ubus_batch_timeout, hapd, NULL);
+	hostapd_ubus_batch_flush(hapd);
+	hostapd_ubus_caps_flush(hapd);
+
 	if (obj->id) {
 		ubus_remove_object(ctx, obj);
 		hostapd_ubus_ref_dec();
@@ -1667,19 +2474,6 @@ void hostapd_ubus_free(struct hapd_interfaces *interfaces)
 	free(name);
 }
 
-struct ubus_event_req {
-	struct ubus_notify_request nreq;
-	int resp;
-};
-
-static void
-ubus_event_cb(struct ubus_notify_request *req, int idx, int ret)
-{
-	struct ubus_event_req *ureq = container_of(req, struct ubus_event_req, nreq);
-
-	ureq->resp = ret;
-}
-
 int hostapd_ubus_handle_event(struct hostapd_data *hapd, struct hostapd_ubus_request *req)
 {
 	struct ubus_banned_client *ban;
@@ -1689,7 +2483,7 @@ int hostapd_ubus_handle_event(struct hostapd_data *hapd, struct hostapd_ubus_req
 		[HOSTAPD_UBUS_ASSOC_REQ] = "assoc",
 	};
 	const char *type = "mgmt";
-	struct ubus_event_req ureq = {};
+	bool caps = false;
 	const u8 *addr;
 
 	if (req->mgmt_frame)
@@ -1715,7 +2509,8 @@ int hostapd_ubus_handle_event(struct hostapd_data *hapd, struct hostapd_ubus_req
 		blobmsg_add_u32(&b, "signal", req->ssi_signal);
 	blobmsg_add_u32(&b, "freq", hapd->iface->freq);
 
-	if (req->elems) {
+	if (req->elems && hostapd_ubus_send_caps(hapd, addr)) {
+		caps = req->elems->ht_capabilities || req->elems->vht_capabilities;
 		if(req->elems->ht_capabilities)
 		{
 			struct ieee80211_ht_capabilities *ht_capabilities;
@@ -1757,20 +2552,12 @@ int hostapd_ubus_handle_event(struct hostapd_data *hapd, struct hostapd_ubus_req
 	}
 
 	if (!hapd->ubus.notify_response) {
-		ubus_notify(ctx, &hapd->ubus.obj, type, b.head, -1);
+		hostapd_ubus_notify_event(hapd, type, addr, b.head,
+					  req->type == HOSTAPD_UBUS_PROBE_REQ, caps);
 		return WLAN_STATUS_SUCCESS;
 	}
 
-	if (ubus_notify_async(ctx, &hapd->ubus.obj, type, b.head, &ureq.nreq))
-		return WLAN_STATUS_SUCCESS;
-
-	ureq.nreq.status_cb = ubus_event_cb;
-	ubus_complete_request(ctx, &ureq.nreq.req, 100);
-
-	if (ureq.resp)
-		return ureq.resp;
-
-	return WLAN_STATUS_SUCCESS;
+	return hostapd_ubus_decision(hapd, req->type, addr, type, b.head, caps);
 }
 
 void hostapd_ubus_notify(struct hostapd_data *hapd, const char *type, const u8 *addr)
@@ -1784,7 +2571,7 @@ void hostapd_ubus_notify(struct hostapd_data *hapd, const char *type, const u8 *
 	blob_buf_init(&b, 0);
 	blobmsg_add_macaddr(&b, "address", addr);
 
-	ubus_notify(ctx, &hapd->ubus.obj, type, b.head, -1);
+	hostapd_ubus_notify_event(hapd, type, addr, b.head, false, false);
 }
 
 void hostapd_ubus_notify_beacon_report(
@@ -36,7 +36,20 @@ struct rrm_measurement_beacon_report;
 struct hostapd_ubus_bss {
 	struct ubus_object obj;
 	struct avl_tree banned;
+	struct avl_tree decisions;
 	int notify_response;
+	int decision_ttl; /* ms */
+	int default_response;
+	struct avl_tree sta_stats;
+	struct os_reltime sta_stats_time;
+	int sta_stats_interval; /* ms */
+	unsigned int sta_stats_gen;
+	unsigned int sta_stats_purged;
+	struct list_head events;
+	int event_count;
+	int event_interval; /* ms */
+	int event_max;
+	struct avl_tree caps_sent;
 };
 
 void hostapd_ubus_add_iface(struct hostapd_iface *iface);
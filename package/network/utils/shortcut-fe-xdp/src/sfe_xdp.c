@@ -0,0 +1,688 @@
+/*
+ * sfe_xdp.c
+ *	Mirror the shortcut forwarding engine connections into the XDP flow table.
+ *
+ * The engine's IPv4 connections are dumped periodically and each direction
+ * that the XDP program can forward is put in its flow table.  Packets that
+ * the XDP program forwards never reach the engine, so their counts are
+ * handed back to it, which keeps the connections alive in conntrack.
+ *
+ * Copyright (c) 2016 The Linux Foundation. All rights reserved.
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all copies.
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <linux/if_link.h>
+#include <netlink/genl/genl.h>
+#include <netlink/genl/ctrl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include "sfe_dump.h"
+#include "sfe_xdp.h"
+
+#define SFE_XDP_DEFAULT_OBJ "/lib/bpf/sfe-xdp-bpf.o"
+#define SFE_XDP_DEFAULT_INTERVAL 1000
+
+/*
+ * How many times we restart a connection dump that raced with a hash resize.
+ */
+#define SFE_XDP_RETRIES 3
+
+/*
+ * The part of a flow that the agent sets, as opposed to the counters.
+ */
+#define SFE_XDP_FLOW_ACTION_LEN offsetof(struct sfe_xdp_flow, rx_packets)
+
+/*
+ * A flow we want in the table.
+ */
+struct sfe_xdp_entry {
+	struct sfe_xdp_flow_key key;	/* Flow table key */
+	struct sfe_xdp_flow flow;	/* Flow table value, with zero counters */
+	size_t conn;			/* Index of the connection in conns */
+	int reply;			/* Set for the reply direction of the connection */
+	int present;			/* Set once we've found the flow in the table */
+	__u64 rx_packets;		/* Packet count already handed back to the engine */
+	__u64 rx_bytes;			/* Byte count already handed back to the engine */
+};
+
+/*
+ * Counts to hand back for a connection.
+ */
+struct sfe_xdp_account {
+	__u64 rx_packets[2];		/* Packets in the original and reply directions */
+	__u64 rx_bytes[2];		/* Bytes in the original and reply directions */
+};
+
+/*
+ * Growable array.
+ */
+struct sfe_xdp_array {
+	void *items;			/* Elements */
+	size_t num;			/* Number of elements in use */
+	size_t max;			/* Number of elements allocated */
+};
+
+static struct sfe_xdp_array conns;
+static struct sfe_xdp_array entries;
+static struct sfe_xdp_array prev_entries;
+static int devs[SFE_XDP_MAX_DEVS];
+static int num_devs;
+static volatile sig_atomic_t stop;
+
+/*
+ * sfe_xdp_append()
+ *	Grow an array by one element and return the new element.
+ */
+static void *sfe_xdp_append(struct sfe_xdp_array *a, size_t size)
+{
+	if (a->num == a->max) {
+		size_t new_max = a->max ? a->max * 2 : 256;
+		void *p = realloc(a->items, new_max * size);
+
+		if (!p) {
+			return NULL;
+		}
+
+		a->items = p;
+		a->max = new_max;
+	}
+
+	return (char *)a->items + a->num++ * size;
+}
+
+/*
+ * sfe_xdp_msg_recv()
+ *	Handle one message of a connection dump.
+ */
+static int sfe_xdp_msg_recv(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+	struct nlattr *nla;
+	int rem;
+
+	nla_for_each_attr(nla, genlmsg_attrdata(nlmsg_data(nlh), SFE_DUMP_GENL_HDRSIZE),
+			  genlmsg_attrlen(nlmsg_data(nlh), SFE_DUMP_GENL_HDRSIZE), rem) {
+		struct sfe_dump_connection *c;
+		size_t len = nla_len(nla);
+
+		if (nla_type(nla) != SFE_DUMP_A_CONNECTION) {
+			continue;
+		}
+
+		c = sfe_xdp_append(&conns, sizeof(struct sfe_dump_connection));
+		if (!c) {
+			return NL_STOP;
+		}
+
+		memset(c, 0, sizeof(*c));
+		memcpy(c, nla_data(nla), len < sizeof(*c) ? len : sizeof(*c));
+	}
+
+	return NL_OK;
+}
+
+/*
+ * sfe_xdp_put_msg()
+ *	Start a request to the engine.
+ */
+static struct nl_msg *sfe_xdp_put_msg(int family_id, int cmd, int flags)
+{
+	struct nl_msg *msg;
+
+	msg = nlmsg_alloc();
+	if (!msg) {
+		return NULL;
+	}
+
+	if (!genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, family_id, SFE_DUMP_GENL_HDRSIZE,
+			 flags, cmd, SFE_DUMP_GENL_VERSION)) {
+		nlmsg_free(msg);
+		return NULL;
+	}
+
+	return msg;
+}
+
+/*
+ * sfe_xdp_collect()
+ *	Fetch the engine's connections.
+ */
+static int sfe_xdp_collect(struct nl_sock *sock, int family_id)
+{
+	int tries;
+	int ret = 0;
+
+	for (tries = 0; tries < SFE_XDP_RETRIES; tries++) {
+		struct nl_msg *msg;
+
+		conns.num = 0;
+		msg = sfe_xdp_put_msg(family_id, SFE_DUMP_C_CONNECTIONS, NLM_F_DUMP);
+		if (!msg) {
+			return -NLE_NOMEM;
+		}
+
+		ret = nl_send_auto(sock, msg);
+		nlmsg_free(msg);
+		if (ret < 0) {
+			return ret;
+		}
+
+		ret = nl_recvmsgs_default(sock);
+		if (ret != -NLE_DUMP_INTR) {
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * sfe_xdp_account()
+ *	Hand the counts of packets we forwarded back to the engine.
+ */
+static void sfe_xdp_account(struct nl_sock *sock, int family_id, struct sfe_dump_connection *c,
+			    struct sfe_xdp_account *acct)
+{
+	struct sfe_dump_connection rec;
+	struct nl_msg *msg;
+	int ret;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.protocol = c->protocol;
+	rec.src_ip[0] = c->src_ip[0];
+	rec.src_port = c->src_port;
+	rec.dest_ip[0] = c->dest_ip[0];
+	rec.dest_port = c->dest_port;
+	rec.src_rx_packets = acct->rx_packets[0];
+	rec.src_rx_bytes = acct->rx_bytes[0];
+	rec.dest_rx_packets = acct->rx_packets[1];
+	rec.dest_rx_bytes = acct->rx_bytes[1];
+
+	msg = sfe_xdp_put_msg(family_id, SFE_DUMP_C_CONNECTION_ACCOUNT, NLM_F_REQUEST);
+	if (!msg) {
+		return;
+	}
+
+	if (nla_put(msg, SFE_DUMP_A_CONNECTION, sizeof(rec), &rec) < 0) {
+		nlmsg_free(msg);
+		return;
+	}
+
+	/*
+	 * The connection may have gone since we dumped it, which is fine.
+	 */
+	ret = nl_send_sync(sock, msg);
+	if (ret < 0 && ret != -NLE_OBJ_NOTFOUND) {
+		fprintf(stderr, "accounting failed: %s\n", nl_geterror(ret));
+	}
+}
+
+/*
+ * sfe_xdp_dev_attached()
+ *	Is the XDP program attached to a device?
+ */
+static int sfe_xdp_dev_attached(unsigned int ifindex)
+{
+	int i;
+
+	for (i = 0; i < num_devs; i++) {
+		if (devs[i] == (int)ifindex) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * sfe_xdp_key_cmp()
+ *	Order entries by their flow table key.
+ */
+static int sfe_xdp_key_cmp(const void *a, const void *b)
+{
+	return memcmp(&((const struct sfe_xdp_entry *)a)->key, &((const struct sfe_xdp_entry *)b)->key,
+		      sizeof(struct sfe_xdp_flow_key));
+}
+
+/*
+ * sfe_xdp_find()
+ *	Find the entry for a flow table key.
+ */
+static struct sfe_xdp_entry *sfe_xdp_find(struct sfe_xdp_array *a, struct sfe_xdp_flow_key *key)
+{
+	return bsearch(key, a->items, a->num, sizeof(struct sfe_xdp_entry), sfe_xdp_key_cmp);
+}
+
+/*
+ * sfe_xdp_add_entry()
+ *	Add an entry for one direction of a connection, if we can forward it.
+ */
+static int sfe_xdp_add_entry(size_t idx, int reply)
+{
+	struct sfe_dump_connection *c = (struct sfe_dump_connection *)conns.items + idx;
+	struct sfe_xdp_entry *e;
+	unsigned int ifindex = reply ? c->dest_ifindex : c->src_ifindex;
+	unsigned int xmit_ifindex = reply ? c->dest_xmit_ifindex : c->src_xmit_ifindex;
+	unsigned int flags = reply ? c->dest_flags : c->src_flags;
+
+	/*
+	 * We can only write a plain Ethernet header, and only between devices
+	 * that we're attached to.
+	 */
+	if (!(flags & SFE_DUMP_CONNECTION_F_ETH_HDR) || (flags & SFE_DUMP_CONNECTION_F_ENCAP)) {
+		return 0;
+	}
+
+	if (!sfe_xdp_dev_attached(ifindex) || !sfe_xdp_dev_attached(xmit_ifindex)) {
+		return 0;
+	}
+
+	/*
+	 * We don't track TCP windows, so if the engine checks sequence numbers
+	 * it has to keep seeing every segment.  Otherwise its window goes stale
+	 * and the FIN or RST we pass up would be out of window.
+	 */
+	if ((c->protocol == IPPROTO_TCP) && !(flags & SFE_DUMP_CONNECTION_F_NO_SEQ_CHECK)) {
+		return 0;
+	}
+
+	e = sfe_xdp_append(&entries, sizeof(struct sfe_xdp_entry));
+	if (!e) {
+		return -ENOMEM;
+	}
+
+	memset(e, 0, sizeof(*e));
+	e->conn = idx;
+	e->reply = reply;
+	e->key.ifindex = ifindex;
+	e->key.protocol = c->protocol;
+	e->flow.xmit_ifindex = xmit_ifindex;
+
+	if (!reply) {
+		e->key.src_ip = c->src_ip[0];
+		e->key.src_port = c->src_port;
+		e->key.dest_ip = c->dest_ip[0];
+		e->key.dest_port = c->dest_port;
+		e->flow.xlate_src_ip = c->src_ip_xlate[0];
+		e->flow.xlate_src_port = c->src_port_xlate;
+		e->flow.xlate_dest_ip = c->dest_ip_xlate[0];
+		e->flow.xlate_dest_port = c->dest_port_xlate;
+		e->flow.xmit_mtu = c->src_xmit_mtu;
+		e->flow.dscp = c->src_dscp;
+		memcpy(e->flow.xmit_src_mac, c->src_xmit_src_mac, 6);
+		memcpy(e->flow.xmit_dest_mac, c->src_xmit_dest_mac, 6);
+	} else {
+		e->key.src_ip = c->dest_ip_xlate[0];
+		e->key.src_port = c->dest_port_xlate;
+		e->key.dest_ip = c->src_ip_xlate[0];
+		e->key.dest_port = c->src_port_xlate;
+		e->flow.xlate_src_ip = c->dest_ip[0];
+		e->flow.xlate_src_port = c->dest_port;
+		e->flow.xlate_dest_ip = c->src_ip[0];
+		e->flow.xlate_dest_port = c->src_port;
+		e->flow.xmit_mtu = c->dest_xmit_mtu;
+		e->flow.dscp = c->dest_dscp;
+		memcpy(e->flow.xmit_src_mac, c->dest_xmit_src_mac, 6);
+		memcpy(e->flow.xmit_dest_mac, c->dest_xmit_dest_mac, 6);
+	}
+
+	if ((e->flow.xlate_src_ip != e->key.src_ip) || (e->flow.xlate_src_port != e->key.src_port)) {
+		e->flow.flags |= SFE_XDP_FLOW_F_XLATE_SRC;
+	}
+
+	if ((e->flow.xlate_dest_ip != e->key.dest_ip) || (e->flow.xlate_dest_port != e->key.dest_port)) {
+		e->flow.flags |= SFE_XDP_FLOW_F_XLATE_DEST;
+	}
+
+	if (flags & SFE_DUMP_CONNECTION_F_DSCP_REMARK) {
+		e->flow.flags |= SFE_XDP_FLOW_F_DSCP_REMARK;
+	}
+
+	return 0;
+}
+
+/*
+ * sfe_xdp_build_entries()
+ *	Work out which flows we want in the table.
+ */
+static int sfe_xdp_build_entries(void)
+{
+	size_t i;
+
+	entries.num = 0;
+	for (i = 0; i < conns.num; i++) {
+		struct sfe_dump_connection *c = (struct sfe_dump_connection *)conns.items + i;
+
+		if ((c->protocol != IPPROTO_TCP) && (c->protocol != IPPROTO_UDP)) {
+			continue;
+		}
+
+		/*
+		 * Marks are used to pick queues and policies further along the
+		 * stack, which XDP forwarding goes around.
+		 */
+		if (c->mark) {
+			continue;
+		}
+
+		if ((sfe_xdp_add_entry(i, 0) < 0) || (sfe_xdp_add_entry(i, 1) < 0)) {
+			return -ENOMEM;
+		}
+	}
+
+	qsort(entries.items, entries.num, sizeof(struct sfe_xdp_entry), sfe_xdp_key_cmp);
+	return 0;
+}
+
+/*
+ * sfe_xdp_sync()
+ *	Bring the flow table in line with the connections and hand back counts.
+ */
+static int sfe_xdp_sync(struct nl_sock *sock, int family_id, int flows_fd)
+{
+	struct sfe_xdp_account *acct;
+	struct sfe_xdp_flow_key *stale = NULL;
+	struct sfe_xdp_flow_key key;
+	struct sfe_xdp_flow_key *prev_key = NULL;
+	struct sfe_xdp_array tmp;
+	size_t num_stale = 0;
+	size_t max_stale = 0;
+	size_t i;
+
+	acct = calloc(conns.num ? conns.num : 1, sizeof(struct sfe_xdp_account));
+	if (!acct) {
+		return -ENOMEM;
+	}
+
+	/*
+	 * Walk the table, collecting the counts of flows we still want and
+	 * remembering the ones we don't.  Deleting while walking would restart
+	 * the walk, so those are deleted afterwards.
+	 */
+	while (!bpf_map_get_next_key(flows_fd, prev_key, &key)) {
+		struct sfe_xdp_entry *e;
+		struct sfe_xdp_entry *p;
+		struct sfe_xdp_flow flow;
+
+		prev_key = &key;
+
+		e = sfe_xdp_find(&entries, &key);
+		if (!e) {
+			if (num_stale == max_stale) {
+				size_t new_max = max_stale ? max_stale * 2 : 64;
+				void *s = realloc(stale, new_max * sizeof(key));
+
+				if (!s) {
+					continue;
+				}
+
+				stale = s;
+				max_stale = new_max;
+			}
+
+			stale[num_stale++] = key;
+			continue;
+		}
+
+		if (bpf_map_lookup_elem(flows_fd, &key, &flow)) {
+			continue;
+		}
+
+		e->present = 1;
+
+		p = sfe_xdp_find(&prev_entries, &key);
+		if (p && (flow.rx_packets >= p->rx_packets)) {
+			e->rx_packets = p->rx_packets;
+			e->rx_bytes = p->rx_bytes;
+		}
+
+		acct[e->conn].rx_packets[e->reply] += flow.rx_packets - e->rx_packets;
+		acct[e->conn].rx_bytes[e->reply] += flow.rx_bytes - e->rx_bytes;
+		e->rx_packets = flow.rx_packets;
+		e->rx_bytes = flow.rx_bytes;
+
+		/*
+		 * If the connection has been changed then update the flow, keeping
+		 * its counters.
+		 */
+		if (memcmp(&flow, &e->flow, SFE_XDP_FLOW_ACTION_LEN)) {
+			memcpy(&flow, &e->flow, SFE_XDP_FLOW_ACTION_LEN);
+			bpf_map_update_elem(flows_fd, &key, &flow, BPF_EXIST);
+		}
+	}
+
+	for (i = 0; i < num_stale; i++) {
+		bpf_map_delete_elem(flows_fd, &stale[i]);
+	}
+
+	free(stale);
+
+	for (i = 0; i < entries.num; i++) {
+		struct sfe_xdp_entry *e = (struct sfe_xdp_entry *)entries.items + i;
+
+		if (e->present) {
+			continue;
+		}
+
+		if (bpf_map_update_elem(flows_fd, &e->key, &e->flow, BPF_NOEXIST)) {
+			/*
+			 * The table is full.  The flow just stays with the engine.
+			 */
+			continue;
+		}
+	}
+
+	for (i = 0; i < conns.num; i++) {
+		if (acct[i].rx_packets[0] || acct[i].rx_packets[1]) {
+			sfe_xdp_account(sock, family_id, (struct sfe_dump_connection *)conns.items + i, &acct[i]);
+		}
+	}
+
+	free(acct);
+
+	/*
+	 * What we reported this time is the starting point for next time.
+	 */
+	tmp = prev_entries;
+	prev_entries = entries;
+	entries = tmp;
+	return 0;
+}
+
+/*
+ * sfe_xdp_signal()
+ */
+static void sfe_xdp_signal(int sig)
+{
+	stop = 1;
+}
+
+/*
+ * sfe_xdp_usage()
+ */
+static void sfe_xdp_usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-g|-n] [-t interval_ms] [-o object] -i device [-i device ...]\n", prog);
+	fprintf(stderr, "  -g  attach in generic (skb) mode\n");
+	fprintf(stderr, "  -n  attach in native (driver) mode\n");
+	fprintf(stderr, "  -t  how often to sync with the engine, default %u ms\n", SFE_XDP_DEFAULT_INTERVAL);
+	fprintf(stderr, "  -o  XDP object, default %s\n", SFE_XDP_DEFAULT_OBJ);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *obj_path = SFE_XDP_DEFAULT_OBJ;
+	unsigned int interval = SFE_XDP_DEFAULT_INTERVAL;
+	__u32 xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST;
+	struct bpf_object *obj;
+	struct bpf_program *prog;
+	struct nl_sock *dump_sock;
+	struct nl_sock *acct_sock;
+	int family_id;
+	int prog_fd;
+	int flows_fd;
+	int devs_fd;
+	int attached = 0;
+	int ret = 1;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "gni:o:t:h")) != -1) {
+		switch (opt) {
+		case 'g':
+			xdp_flags |= XDP_FLAGS_SKB_MODE;
+			break;
+		case 'n':
+			xdp_flags |= XDP_FLAGS_DRV_MODE;
+			break;
+		case 'i':
+			if (num_devs == SFE_XDP_MAX_DEVS) {
+				fprintf(stderr, "Too many devices\n");
+				return 1;
+			}
+
+			devs[num_devs] = if_nametoindex(optarg);
+			if (!devs[num_devs]) {
+				fprintf(stderr, "Unknown device %s\n", optarg);
+				return 1;
+			}
+
+			num_devs++;
+			break;
+		case 'o':
+			obj_path = optarg;
+			break;
+		case 't':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			sfe_xdp_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!num_devs || !interval) {
+		sfe_xdp_usage(argv[0]);
+		return 1;
+	}
+
+	dump_sock = nl_socket_alloc();
+	acct_sock = nl_socket_alloc();
+	if (!dump_sock || !acct_sock) {
+		fprintf(stderr, "Unable to allocate socket\n");
+		goto out_free_socks;
+	}
+
+	if ((genl_connect(dump_sock) < 0) || (genl_connect(acct_sock) < 0)) {
+		fprintf(stderr, "Unable to connect generic netlink socket\n");
+		goto out_free_socks;
+	}
+
+	/*
+	 * Dumps don't get acknowledged, but accounting requests do so that we
+	 * can wait for each one in turn.
+	 */
+	nl_socket_set_buffer_size(dump_sock, 1024 * 1024, 0);
+	nl_socket_disable_auto_ack(dump_sock);
+	nl_socket_modify_cb(dump_sock, NL_CB_VALID, NL_CB_CUSTOM, sfe_xdp_msg_recv, NULL);
+
+	family_id = genl_ctrl_resolve(dump_sock, SFE_DUMP_GENL_NAME_IPV4);
+	if (family_id < 0) {
+		fprintf(stderr, "Unable to resolve family %s, is the module loaded?\n", SFE_DUMP_GENL_NAME_IPV4);
+		goto out_free_socks;
+	}
+
+	obj = bpf_object__open_file(obj_path, NULL);
+	if (libbpf_get_error(obj)) {
+		fprintf(stderr, "Unable to open %s\n", obj_path);
+		goto out_free_socks;
+	}
+
+	if (bpf_object__load(obj)) {
+		fprintf(stderr, "Unable to load %s\n", obj_path);
+		goto out_close_obj;
+	}
+
+	prog = bpf_object__find_program_by_name(obj, SFE_XDP_PROG);
+	flows_fd = bpf_object__find_map_fd_by_name(obj, SFE_XDP_FLOWS_MAP);
+	devs_fd = bpf_object__find_map_fd_by_name(obj, SFE_XDP_DEVS_MAP);
+	if (!prog || (flows_fd < 0) || (devs_fd < 0)) {
+		fprintf(stderr, "%s is not an SFE XDP object\n", obj_path);
+		goto out_close_obj;
+	}
+
+	prog_fd = bpf_program__fd(prog);
+
+	for (attached = 0; attached < num_devs; attached++) {
+		__u32 ifindex = devs[attached];
+
+		if (bpf_map_update_elem(devs_fd, &ifindex, &ifindex, BPF_ANY)) {
+			fprintf(stderr, "Unable to add device %u to the transmit map\n", ifindex);
+			goto out_detach;
+		}
+
+		if (bpf_set_link_xdp_fd(ifindex, prog_fd, xdp_flags) < 0) {
+			fprintf(stderr, "Unable to attach to device %u\n", ifindex);
+			goto out_detach;
+		}
+	}
+
+	signal(SIGINT, sfe_xdp_signal);
+	signal(SIGTERM, sfe_xdp_signal);
+
+	while (!stop) {
+		int err;
+
+		err = sfe_xdp_collect(dump_sock, family_id);
+		if (err < 0) {
+			fprintf(stderr, "Connection dump failed: %s\n", nl_geterror(err));
+		} else if (!sfe_xdp_build_entries()) {
+			sfe_xdp_sync(acct_sock, family_id, flows_fd);
+		}
+
+		usleep(interval * 1000);
+	}
+
+	ret = 0;
+
+out_detach:
+	for (i = 0; i < attached; i++) {
+		bpf_set_link_xdp_fd(devs[i], -1, xdp_flags & ~XDP_FLAGS_UPDATE_IF_NOEXIST);
+	}
+
+out_close_obj:
+	bpf_object__close(obj);
+
+out_free_socks:
+	if (dump_sock) {
+		nl_socket_free(dump_sock);
+	}
+
+	if (acct_sock) {
+		nl_socket_free(acct_sock);
+	}
+
+	free(conns.items);
+	free(entries.items);
+	free(prev_entries.items);
+	return ret;
+}
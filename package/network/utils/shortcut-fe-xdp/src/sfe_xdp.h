@@ -0,0 +1,75 @@
+/*
+ * sfe_xdp.h
+ *	Shortcut forwarding engine - XDP flow table.
+ *
+ * This header is shared between the XDP program and the user space agent that
+ * fills in its flow table.
+ *
+ * Copyright (c) 2016 The Linux Foundation. All rights reserved.
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all copies.
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <linux/types.h>
+
+/*
+ * Map names and sizes.
+ */
+#define SFE_XDP_FLOWS_MAP	"sfe_xdp_flows"
+#define SFE_XDP_DEVS_MAP	"sfe_xdp_devs"
+#define SFE_XDP_PROG		"sfe_xdp_forward"
+#define SFE_XDP_MAX_FLOWS	16384
+#define SFE_XDP_MAX_DEVS	32
+
+/*
+ * Flow flags.
+ */
+#define SFE_XDP_FLOW_F_XLATE_SRC	0x1
+					/* Translate the source address and port */
+#define SFE_XDP_FLOW_F_XLATE_DEST	0x2
+					/* Translate the destination address and port */
+#define SFE_XDP_FLOW_F_DSCP_REMARK	0x4
+					/* Set the DSCP of forwarded packets */
+
+/*
+ * One direction of a connection, as the packets are received.  Addresses and
+ * ports are in network byte order.
+ */
+struct sfe_xdp_flow_key {
+	__u32 ifindex;			/* Device the packets are received on */
+	__be32 src_ip;			/* Source IP address */
+	__be32 dest_ip;			/* Destination IP address */
+	__be16 src_port;		/* Source port */
+	__be16 dest_port;		/* Destination port */
+	__u8 protocol;			/* IP protocol number */
+	__u8 reserved[3];
+};
+
+/*
+ * What to do with the packets of a flow.  The counters are kept by the XDP
+ * program and only ever grow.
+ */
+struct sfe_xdp_flow {
+	__u32 xmit_ifindex;		/* Device to transmit on */
+	__u32 xmit_mtu;			/* Largest IP packet we can transmit */
+	__be32 xlate_src_ip;		/* Source IP address after translation */
+	__be32 xlate_dest_ip;		/* Destination IP address after translation */
+	__be16 xlate_src_port;		/* Source port after translation */
+	__be16 xlate_dest_port;		/* Destination port after translation */
+	__u8 xmit_src_mac[6];		/* Source MAC address to transmit with */
+	__u8 xmit_dest_mac[6];		/* Destination MAC address to transmit with */
+	__u8 dscp;			/* DSCP to set */
+	__u8 flags;			/* SFE_XDP_FLOW_F_* */
+	__u16 reserved;
+	__u32 reserved2;
+	__u64 rx_packets;		/* Packets forwarded */
+	__u64 rx_bytes;			/* Bytes forwarded */
+};
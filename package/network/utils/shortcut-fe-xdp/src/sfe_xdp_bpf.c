@@ -0,0 +1,209 @@
+/*
+ * sfe_xdp_bpf.c
+ *	Shortcut forwarding engine - XDP forwarding of offloaded flows.
+ *
+ * Packets of flows in the flow table are rewritten and redirected straight
+ * from the receive driver.  Everything else is passed up to the stack, where
+ * the engine and the connection manager handle it as usual.
+ *
+ * Copyright (c) 2016 The Linux Foundation. All rights reserved.
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all copies.
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define KBUILD_MODNAME "sfe_xdp"
+#include <uapi/linux/bpf.h>
+#include <uapi/linux/if_ether.h>
+#include <uapi/linux/ip.h>
+#include <uapi/linux/in.h>
+#include <uapi/linux/tcp.h>
+#include <uapi/linux/udp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "sfe_xdp.h"
+
+/*
+ * IP header fragment offset and more fragments bits.
+ */
+#define SFE_XDP_IP_FRAG_MASK 0x3fff
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct sfe_xdp_flow_key);
+	__type(value, struct sfe_xdp_flow);
+	__uint(max_entries, SFE_XDP_MAX_FLOWS);
+} sfe_xdp_flows SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_DEVMAP_HASH);
+	__type(key, __u32);
+	__type(value, __u32);
+	__uint(max_entries, SFE_XDP_MAX_DEVS);
+} sfe_xdp_devs SEC(".maps");
+
+/*
+ * sfe_xdp_csum_replace2()
+ *	Update a checksum for a 16 bit word that has changed.
+ */
+static __always_inline void sfe_xdp_csum_replace2(__sum16 *sum, __u16 from, __u16 to)
+{
+	__u32 csum = (__u16)~*sum;
+
+	csum += (__u16)~from + to;
+	csum = (csum & 0xffff) + (csum >> 16);
+	csum = (csum & 0xffff) + (csum >> 16);
+	*sum = (__sum16)~csum;
+}
+
+/*
+ * sfe_xdp_csum_replace4()
+ *	Update a checksum for a 32 bit word that has changed.
+ */
+static __always_inline void sfe_xdp_csum_replace4(__sum16 *sum, __u32 from, __u32 to)
+{
+	sfe_xdp_csum_replace2(sum, (__u16)from, (__u16)to);
+	sfe_xdp_csum_replace2(sum, (__u16)(from >> 16), (__u16)(to >> 16));
+}
+
+SEC("xdp")
+int sfe_xdp_forward(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *data_end = (void *)(long)ctx->data_end;
+	struct ethhdr *eth = data;
+	struct sfe_xdp_flow_key key = {};
+	struct sfe_xdp_flow *flow;
+	struct iphdr *iph;
+	__be16 *ports;
+	__sum16 *l4_check;
+	bool l4_csum;
+	__u16 old;
+	__u32 len;
+
+	if ((void *)(eth + 1) > data_end) {
+		return XDP_PASS;
+	}
+
+	if (eth->h_proto != bpf_htons(ETH_P_IP)) {
+		return XDP_PASS;
+	}
+
+	/*
+	 * IP options, fragments and packets whose TTL is about to run out are
+	 * all left to the stack.
+	 */
+	iph = (struct iphdr *)(eth + 1);
+	if ((void *)(iph + 1) > data_end) {
+		return XDP_PASS;
+	}
+
+	if ((iph->ihl != 5) || (iph->frag_off & bpf_htons(SFE_XDP_IP_FRAG_MASK)) || (iph->ttl < 2)) {
+		return XDP_PASS;
+	}
+
+	if (iph->protocol == IPPROTO_TCP) {
+		struct tcphdr *tcph = (struct tcphdr *)(iph + 1);
+
+		if ((void *)(tcph + 1) > data_end) {
+			return XDP_PASS;
+		}
+
+		/*
+		 * The engine and conntrack need to see the connection change state.
+		 */
+		if (tcph->syn || tcph->fin || tcph->rst) {
+			return XDP_PASS;
+		}
+
+		ports = &tcph->source;
+		l4_check = &tcph->check;
+		l4_csum = true;
+	} else if (iph->protocol == IPPROTO_UDP) {
+		struct udphdr *udph = (struct udphdr *)(iph + 1);
+
+		if ((void *)(udph + 1) > data_end) {
+			return XDP_PASS;
+		}
+
+		ports = &udph->source;
+		l4_check = &udph->check;
+		l4_csum = udph->check != 0;
+	} else {
+		return XDP_PASS;
+	}
+
+	key.ifindex = ctx->ingress_ifindex;
+	key.src_ip = iph->saddr;
+	key.dest_ip = iph->daddr;
+	key.src_port = ports[0];
+	key.dest_port = ports[1];
+	key.protocol = iph->protocol;
+
+	flow = bpf_map_lookup_elem(&sfe_xdp_flows, &key);
+	if (!flow) {
+		return XDP_PASS;
+	}
+
+	len = bpf_ntohs(iph->tot_len);
+	if (len > flow->xmit_mtu) {
+		return XDP_PASS;
+	}
+
+	if (flow->flags & SFE_XDP_FLOW_F_XLATE_SRC) {
+		if (l4_csum) {
+			sfe_xdp_csum_replace4(l4_check, iph->saddr, flow->xlate_src_ip);
+			sfe_xdp_csum_replace2(l4_check, ports[0], flow->xlate_src_port);
+		}
+
+		sfe_xdp_csum_replace4(&iph->check, iph->saddr, flow->xlate_src_ip);
+		iph->saddr = flow->xlate_src_ip;
+		ports[0] = flow->xlate_src_port;
+	}
+
+	if (flow->flags & SFE_XDP_FLOW_F_XLATE_DEST) {
+		if (l4_csum) {
+			sfe_xdp_csum_replace4(l4_check, iph->daddr, flow->xlate_dest_ip);
+			sfe_xdp_csum_replace2(l4_check, ports[1], flow->xlate_dest_port);
+		}
+
+		sfe_xdp_csum_replace4(&iph->check, iph->daddr, flow->xlate_dest_ip);
+		iph->daddr = flow->xlate_dest_ip;
+		ports[1] = flow->xlate_dest_port;
+	}
+
+	/*
+	 * A UDP checksum that comes out as zero has to be sent as all ones.
+	 */
+	if ((iph->protocol == IPPROTO_UDP) && l4_csum && !*l4_check) {
+		*l4_check = (__sum16)0xffff;
+	}
+
+	if (flow->flags & SFE_XDP_FLOW_F_DSCP_REMARK) {
+		old = *(__u16 *)iph;
+		iph->tos = (iph->tos & 0x3) | (flow->dscp << 2);
+		sfe_xdp_csum_replace2(&iph->check, old, *(__u16 *)iph);
+	}
+
+	old = *(__u16 *)&iph->ttl;
+	iph->ttl--;
+	sfe_xdp_csum_replace2(&iph->check, old, *(__u16 *)&iph->ttl);
+
+	__builtin_memcpy(eth->h_dest, flow->xmit_dest_mac, ETH_ALEN);
+	__builtin_memcpy(eth->h_source, flow->xmit_src_mac, ETH_ALEN);
+
+	__sync_fetch_and_add(&flow->rx_packets, 1);
+	__sync_fetch_and_add(&flow->rx_bytes, len);
+
+	return bpf_redirect_map(&sfe_xdp_devs, flow->xmit_ifindex, 0);
+}
+
+char _license[] SEC("license") = "Dual BSD/GPL";
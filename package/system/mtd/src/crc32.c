@@ -38,6 +38,18 @@
  */
 
 #include <stdint.h>
+#include <string.h>
+#include "crc32.h"
+
+#if defined(__aarch64__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#include <sys/auxv.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32	(1 << 7)
+#endif
+
+#define CRC32_ARM64	1
+#endif
 
 const uint32_t crc32_table[256] = {
 	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
@@ -93,3 +105,89 @@ const uint32_t crc32_table[256] = {
 	0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
 	0x2d02ef8dL
 };
+
+/*
+ * Slicing-by-8: crc32_slice[n] holds the CRC of a byte followed by n zero
+ * bytes, so that eight bytes can be folded in with eight table lookups.
+ */
+static uint32_t crc32_slice[8][256];
+
+static uint32_t
+crc32_sb8(uint32_t val, const void *ss, int len)
+{
+	const unsigned char *s = ss;
+	uint32_t one, two;
+
+	while (len >= 8) {
+		one = val ^ (s[0] | (s[1] << 8) | (s[2] << 16) | ((uint32_t) s[3] << 24));
+		two = s[4] | (s[5] << 8) | (s[6] << 16) | ((uint32_t) s[7] << 24);
+		val = crc32_slice[7][one & 0xff] ^
+		      crc32_slice[6][(one >> 8) & 0xff] ^
+		      crc32_slice[5][(one >> 16) & 0xff] ^
+		      crc32_slice[4][one >> 24] ^
+		      crc32_slice[3][two & 0xff] ^
+		      crc32_slice[2][(two >> 8) & 0xff] ^
+		      crc32_slice[1][(two >> 16) & 0xff] ^
+		      crc32_slice[0][two >> 24];
+		s += 8;
+		len -= 8;
+	}
+
+	while (--len >= 0)
+		val = crc32_table[(val ^ *s++) & 0xff] ^ (val >> 8);
+
+	return val;
+}
+
+#ifdef CRC32_ARM64
+/* ARMv8 CRC32 instructions use the same polynomial */
+__attribute__((target("+crc")))
+static uint32_t
+crc32_arm64(uint32_t val, const void *ss, int len)
+{
+	const unsigned char *s = ss;
+	uint64_t v;
+
+	while (len > 0 && ((uintptr_t) s & 7)) {
+		val = __builtin_aarch64_crc32b(val, *s++);
+		len--;
+	}
+
+	while (len >= 8) {
+		memcpy(&v, s, sizeof(v));
+		val = __builtin_aarch64_crc32x(val, v);
+		s += 8;
+		len -= 8;
+	}
+
+	while (--len >= 0)
+		val = __builtin_aarch64_crc32b(val, *s++);
+
+	return val;
+}
+#endif
+
+static uint32_t (*crc32_impl)(uint32_t val, const void *ss, int len) = crc32_sb8;
+
+__attribute__((constructor))
+static void crc32_init(void)
+{
+	int i, n;
+
+	for (i = 0; i < 256; i++) {
+		crc32_slice[0][i] = crc32_table[i];
+		for (n = 1; n < 8; n++)
+			crc32_slice[n][i] = (crc32_slice[n - 1][i] >> 8) ^
+					    crc32_table[crc32_slice[n - 1][i] & 0xff];
+	}
+
+#ifdef CRC32_ARM64
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		crc32_impl = crc32_arm64;
+#endif
+}
+
+uint32_t crc32(uint32_t val, const void *ss, int len)
+{
+	return crc32_impl(val, ss, len);
+}
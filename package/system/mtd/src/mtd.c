@@ -34,6 +34,7 @@
 #include <sys/syscall.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <time.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -47,10 +48,12 @@
 #include "crc32.h"
 #include "fis.h"
 #include "mtd.h"
+#include "sha256.h"
 
 #include <libubox/md5.h>
 
 #define MAX_ARGS 8
+#define PREFETCH_BLOCKS		4
 #define JFFS2_DEFAULT_DIR	"" /* directory name without /, empty means root dir */
 
 #define TRX_MAGIC		0x48445230	/* "HDR0" */
@@ -74,6 +77,12 @@
 #error "Unsupported endianness"
 #endif
 
+enum mtd_hash {
+	MTD_HASH_NONE,
+	MTD_HASH_MD5,
+	MTD_HASH_SHA256,
+};
+
 enum mtd_image_format {
 	MTD_IMAGE_FORMAT_UNKNOWN,
 	MTD_IMAGE_FORMAT_TRX,
@@ -83,6 +92,8 @@ enum mtd_image_format {
 };
 
 static char *buf = NULL;
+static char *diffbuf = NULL;
+static char *verifybuf = NULL;
 static char *imagefile = NULL;
 static enum mtd_image_format imageformat = MTD_IMAGE_FORMAT_UNKNOWN;
 static char *jffs2file = NULL, *jffs2dir = JFFS2_DEFAULT_DIR;
@@ -90,11 +101,37 @@ static char *tpl_uboot_args_part;
 static int buflen = 0;
 int quiet;
 int no_erase;
+int diff_write;
+int verify_write;
+enum mtd_hash opt_hash = MTD_HASH_NONE;
 int mtdsize = 0;
 int erasesize = 0;
 int jffs2_skip_bytes=0;
 int mtdtype = 0;
 uint32_t opt_trxmagic = TRX_MAGIC;
+int prefetch_blocks = PREFETCH_BLOCKS;
+
+/*
+ * Ring of eraseblock sized buffers that a reader thread fills from the
+ * image, so that reading (and decompressing) the image overlaps with
+ * erasing and writing the flash.
+ */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	int n;
+	int size;
+	char **data;
+	int *len;
+	int head;
+	int tail;
+	int count;
+	int pos;
+	bool eof;
+	int err;
+} prefetch;
 
 int mtd_open(const char *mtd, bool block)
 {
@@ -184,6 +221,16 @@ int mtd_write_buffer(int fd, const char *buf, int offset, int length)
 	return 0;
 }
 
+/* check if the eraseblock at offset already holds the data */
+static bool
+mtd_block_unchanged(int fd, const char *data, int offset)
+{
+	if (pread(fd, diffbuf, erasesize, offset) != erasesize)
+		return false;
+
+	return !memcmp(diffbuf, data, erasesize);
+}
+
 static int
 image_check(int imagefd, const char *mtd)
 {
@@ -260,6 +307,12 @@ static int mtd_check(const char *mtd)
 		if (!buf)
 			buf = malloc(erasesize);
 
+		if (diff_write && !diffbuf)
+			diffbuf = malloc(erasesize);
+
+		if (verify_write && !verifybuf)
+			verifybuf = malloc(erasesize);
+
 		close(fd);
 		mtd = next;
 	} while (next);
@@ -405,6 +458,7 @@ mtd_verify(const char *mtd, char *file)
 	uint32_t f_md5[4], m_md5[4];
 	struct stat s;
 	md5_ctx_t ctx;
+	char *buf = NULL;
 	int ret = 0;
 	int fd;
 
@@ -422,10 +476,15 @@ mtd_verify(const char *mtd, char *file)
 		return -1;
 	}
 
+	buf = malloc(erasesize);
+	if (!buf) {
+		ret = -1;
+		goto out;
+	}
+
 	md5_begin(&ctx);
 	do {
-		char buf[256];
-		int len = (s.st_size > sizeof(buf)) ? (sizeof(buf)) : (s.st_size);
+		int len = (s.st_size > erasesize) ? (erasesize) : (s.st_size);
 		int rlen = read(fd, buf, len);
 
 		if (rlen < 0) {
@@ -452,10 +511,208 @@ mtd_verify(const char *mtd, char *file)
 		fprintf(stderr, "Failed\n");
 
 out:
+	free(buf);
 	close(fd);
 	return ret;
 }
 
+static void *
+prefetch_thread(void *arg)
+{
+	ssize_t r;
+	int len;
+
+	for (;;) {
+		pthread_mutex_lock(&prefetch.lock);
+		while (prefetch.count == prefetch.n)
+			pthread_cond_wait(&prefetch.cond, &prefetch.lock);
+		pthread_mutex_unlock(&prefetch.lock);
+
+		len = 0;
+		while (len < prefetch.size) {
+			r = read(prefetch.fd, prefetch.data[prefetch.head] + len, prefetch.size - len);
+			if (r < 0) {
+				if ((errno == EINTR) || (errno == EAGAIN))
+					continue;
+
+				prefetch.err = errno;
+				break;
+			}
+
+			if (r == 0)
+				break;
+
+			len += r;
+		}
+
+		pthread_mutex_lock(&prefetch.lock);
+		if (len > 0) {
+			prefetch.len[prefetch.head] = len;
+			prefetch.head = (prefetch.head + 1) % prefetch.n;
+			prefetch.count++;
+		}
+		if (len < prefetch.size)
+			prefetch.eof = true;
+		pthread_cond_signal(&prefetch.cond);
+		pthread_mutex_unlock(&prefetch.lock);
+
+		if (len < prefetch.size)
+			break;
+	}
+
+	return NULL;
+}
+
+static void
+prefetch_start(int imagefd)
+{
+	int i;
+
+	if (prefetch_blocks <= 0)
+		return;
+
+	prefetch.data = calloc(prefetch_blocks, sizeof(*prefetch.data));
+	prefetch.len = calloc(prefetch_blocks, sizeof(*prefetch.len));
+	if (!prefetch.data || !prefetch.len)
+		goto error;
+
+	for (i = 0; i < prefetch_blocks; i++) {
+		prefetch.data[i] = malloc(erasesize);
+		if (!prefetch.data[i])
+			goto error;
+	}
+
+	prefetch.fd = imagefd;
+	prefetch.n = prefetch_blocks;
+	prefetch.size = erasesize;
+	pthread_mutex_init(&prefetch.lock, NULL);
+	pthread_cond_init(&prefetch.cond, NULL);
+	if (pthread_create(&prefetch.thread, NULL, prefetch_thread, NULL) == 0)
+		return;
+
+	prefetch.n = 0;
+
+error:
+	/* fall back to reading the image directly */
+	if (prefetch.data) {
+		for (i = 0; i < prefetch_blocks; i++)
+			free(prefetch.data[i]);
+	}
+	free(prefetch.data);
+	free(prefetch.len);
+	prefetch.data = NULL;
+	prefetch.len = NULL;
+}
+
+static void
+prefetch_stop(void)
+{
+	int i;
+
+	if (!prefetch.n)
+		return;
+
+	pthread_join(prefetch.thread, NULL);
+	for (i = 0; i < prefetch.n; i++)
+		free(prefetch.data[i]);
+	free(prefetch.data);
+	free(prefetch.len);
+	prefetch.n = 0;
+}
+
+static ssize_t
+image_read(int imagefd, char *dest, size_t len)
+{
+	size_t avail;
+
+	if (!prefetch.n)
+		return read(imagefd, dest, len);
+
+	pthread_mutex_lock(&prefetch.lock);
+	while (!prefetch.count && !prefetch.eof)
+		pthread_cond_wait(&prefetch.cond, &prefetch.lock);
+
+	if (!prefetch.count) {
+		pthread_mutex_unlock(&prefetch.lock);
+		if (!prefetch.err)
+			return 0;
+
+		errno = prefetch.err;
+		return -1;
+	}
+	pthread_mutex_unlock(&prefetch.lock);
+
+	avail = prefetch.len[prefetch.tail] - prefetch.pos;
+	if (len > avail)
+		len = avail;
+
+	memcpy(dest, prefetch.data[prefetch.tail] + prefetch.pos, len);
+	prefetch.pos += len;
+
+	if (prefetch.pos == prefetch.len[prefetch.tail]) {
+		pthread_mutex_lock(&prefetch.lock);
+		prefetch.pos = 0;
+		prefetch.tail = (prefetch.tail + 1) % prefetch.n;
+		prefetch.count--;
+		pthread_cond_signal(&prefetch.cond);
+		pthread_mutex_unlock(&prefetch.lock);
+	}
+
+	return len;
+}
+
+static struct {
+	md5_ctx_t md5;
+	struct sha256_ctx sha256;
+	long long len;
+} image_hash;
+
+static void
+image_hash_begin(void)
+{
+	if (opt_hash == MTD_HASH_MD5)
+		md5_begin(&image_hash.md5);
+	else if (opt_hash == MTD_HASH_SHA256)
+		sha256_begin(&image_hash.sha256);
+	image_hash.len = 0;
+}
+
+static void
+image_hash_update(const char *data, int len)
+{
+	if (opt_hash == MTD_HASH_MD5)
+		md5_hash(data, len, &image_hash.md5);
+	else if (opt_hash == MTD_HASH_SHA256)
+		sha256_hash(data, len, &image_hash.sha256);
+	image_hash.len += len;
+}
+
+/* print the hash of the written image in a form that scripts can parse */
+static void
+image_hash_print(void)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	const char *name;
+	int i, len;
+
+	if (opt_hash == MTD_HASH_MD5) {
+		md5_end(digest, &image_hash.md5);
+		name = "md5";
+		len = 16;
+	} else if (opt_hash == MTD_HASH_SHA256) {
+		sha256_end(digest, &image_hash.sha256);
+		name = "sha256";
+		len = SHA256_DIGEST_SIZE;
+	} else {
+		return;
+	}
+
+	printf("%s=", name);
+	for (i = 0; i < len; i++)
+		printf("%02x", digest[i]);
+	printf("\nsize=%lld\n", image_hash.len);
+}
+
 static void
 indicate_writing(const char *mtd)
 {
@@ -478,6 +735,10 @@ mtd_write(int imagefd, const char *mtd, char *fis_layout, size_t part_offset)
 	int buflen_raw = 0;
 	int jffs2_replaced = 0;
 	int skip_bad_blocks = 0;
+	int diff_blocks = 0;
+	int verified_blocks = 0;
+	bool unchanged;
+	bool started = false;
 
 #ifdef FIS_SUPPORT
 	static struct fis_part new_parts[MAX_ARGS];
@@ -574,11 +835,17 @@ resume:
 
 	indicate_writing(mtd);
 
+	if (!started) {
+		prefetch_start(imagefd);
+		image_hash_begin();
+		started = true;
+	}
+
 	w = e = 0;
 	for (;;) {
 		/* buffer may contain data already (from trx check or last mtd partition write attempt) */
 		while (buflen < erasesize) {
-			r = read(imagefd, buf + buflen, erasesize - buflen);
+			r = image_read(imagefd, buf + buflen, erasesize - buflen);
 			if (r < 0) {
 				if ((errno == EINTR) || (errno == EAGAIN))
 					continue;
@@ -594,8 +861,10 @@ resume:
 			buflen += r;
 		}
 
-		if (buflen_raw == 0)
+		if (buflen_raw == 0) {
 			buflen_raw = buflen;
+			image_hash_update(buf, buflen_raw);
+		}
 
 		if (buflen == 0)
 			break;
@@ -642,6 +911,14 @@ resume:
 			mtd_parse_jffs2data(buf, jffs2dir);
 		}
 
+		/*
+		 * in differential mode, blocks that already hold the data are
+		 * neither erased nor written
+		 */
+		unchanged = false;
+		if (diff_write && no_erase && !offset && buflen == erasesize)
+			unchanged = mtd_block_unchanged(fd, buf, lseek(fd, 0, SEEK_CUR));
+
 		/* need to erase the next block before writing data to it */
 		if(!no_erase)
 		{
@@ -661,6 +938,14 @@ resume:
 					continue;
 				}
 
+				if (diff_write && !offset && buflen == erasesize &&
+				    w == e - skip_bad_blocks &&
+				    mtd_block_unchanged(fd, buf, e + part_offset)) {
+					unchanged = true;
+					e += erasesize;
+					continue;
+				}
+
 				if (mtd_erase_block(fd, e + part_offset) < 0) {
 					if (next) {
 						if (w < e) {
@@ -684,16 +969,34 @@ resume:
 			}
 		}
 
-		if (!quiet)
-			fprintf(stderr, "\b\b\b[w]");
+		if (unchanged) {
+			if (!quiet)
+				fprintf(stderr, "\b\b\b[s]");
 
-		if ((result = write(fd, buf + offset, buflen)) < buflen) {
-			if (result < 0) {
-				fprintf(stderr, "Error writing image.\n");
-				exit(1);
-			} else {
-				fprintf(stderr, "Insufficient space.\n");
-				exit(1);
+			lseek(fd, buflen, SEEK_CUR);
+			diff_blocks++;
+		} else {
+			if (!quiet)
+				fprintf(stderr, "\b\b\b[w]");
+
+			if ((result = write(fd, buf + offset, buflen)) < buflen) {
+				if (result < 0) {
+					fprintf(stderr, "Error writing image.\n");
+					exit(1);
+				} else {
+					fprintf(stderr, "Insufficient space.\n");
+					exit(1);
+				}
+			}
+
+			/* read the block back while its data is still at hand */
+			if (verify_write && !offset) {
+				if (pread(fd, verifybuf, buflen, lseek(fd, 0, SEEK_CUR) - buflen) != buflen ||
+				    memcmp(verifybuf, buf, buflen) != 0) {
+					fprintf(stderr, "\nVerification failed at 0x%08zx\n", w);
+					exit(1);
+				}
+				verified_blocks++;
 			}
 		}
 		w += buflen;
@@ -713,6 +1016,8 @@ resume:
 		offset = 0;
 	}
 
+	prefetch_stop();
+
 	if (jffs2_replaced) {
 		switch (imageformat) {
 		case MTD_IMAGE_FORMAT_TRX:
@@ -742,6 +1047,14 @@ resume:
 	if (quiet < 2)
 		fprintf(stderr, "\n");
 
+	if (diff_write && quiet < 2)
+		fprintf(stderr, "Skipped %d unchanged blocks (%lld bytes)\n",
+			diff_blocks, (long long) diff_blocks * erasesize);
+
+	image_hash_print();
+	if (verify_write)
+		printf("verified=%d\n", verified_blocks + diff_blocks);
+
 #ifdef FIS_SUPPORT
 	if (fis_layout) {
 		if (fis_remap(old_parts, n_old, new_parts, n_new) < 0)
@@ -801,6 +1114,10 @@ static void usage(void)
 	"        -q                      quiet mode (once: no [w] on writing,\n"
 	"                                           twice: no status messages)\n"
 	"        -n                      write without first erasing the blocks\n"
+	"        -D                      differential write: skip blocks that already hold the data\n"
+	"        -b <number>             number of eraseblocks to read ahead of the flash when writing, defaults to \"4\"\n"
+	"        -H md5|sha256           print the hash and size of the image data after writing\n"
+	"        -V                      read back and compare every block after writing it\n"
 	"        -r                      reboot after successful command\n"
 	"        -f                      force write without trx checks\n"
 	"        -e <device>             erase <device> before executing the command\n"
@@ -874,12 +1191,14 @@ int main (int argc, char **argv)
 	buflen = 0;
 	quiet = 0;
 	no_erase = 0;
+	diff_write = 0;
+	verify_write = 0;
 
 	while ((ch = getopt(argc, argv,
 #ifdef FIS_SUPPORT
 			"F:"
 #endif
-			"frnqe:d:s:j:p:o:c:t:l:M:")) != -1)
+			"frnDVqe:d:s:j:p:o:c:t:l:M:b:H:")) != -1)
 		switch (ch) {
 			case 'f':
 				force = 1;
@@ -890,6 +1209,30 @@ int main (int argc, char **argv)
 			case 'n':
 				no_erase = 1;
 				break;
+			case 'D':
+				diff_write = 1;
+				break;
+			case 'V':
+				verify_write = 1;
+				break;
+			case 'H':
+				if (!strcmp(optarg, "md5"))
+					opt_hash = MTD_HASH_MD5;
+				else if (!strcmp(optarg, "sha256"))
+					opt_hash = MTD_HASH_SHA256;
+				else {
+					fprintf(stderr, "-H: unknown hash\n");
+					usage();
+				}
+				break;
+			case 'b':
+				errno = 0;
+				prefetch_blocks = strtoul(optarg, 0, 0);
+				if (errno) {
+					fprintf(stderr, "-b: illegal numeric string\n");
+					usage();
+				}
+				break;
 			case 'j':
 				jffs2file = optarg;
 				break;
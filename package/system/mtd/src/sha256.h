@@ -0,0 +1,31 @@
+/*
+ * SHA-256 hash for mtd
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License v2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef __sha256_h
+#define __sha256_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE	32
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t len;
+	uint8_t buf[64];
+};
+
+extern void sha256_begin(struct sha256_ctx *ctx);
+extern void sha256_hash(const void *data, size_t len, struct sha256_ctx *ctx);
+extern void sha256_end(uint8_t *digest, struct sha256_ctx *ctx);
+
+#endif /* __sha256_h */
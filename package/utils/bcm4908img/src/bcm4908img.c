@@ -166,8 +166,27 @@ static const uint32_t crc32_tbl[] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
 };
 
-uint32_t bcm4908img_crc32(uint32_t crc, const void *buf, size_t len) {
+/* crc32_slice[n] holds the CRC of a byte followed by n zero bytes */
+static uint32_t crc32_slice[8][256];
+
+static uint32_t bcm4908img_crc32_sb8(uint32_t crc, const void *buf, size_t len) {
 	const uint8_t *in = buf;
+	uint32_t one, two;
+
+	while (len >= 8) {
+		one = crc ^ (in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24));
+		two = in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t)in[7] << 24);
+		crc = crc32_slice[7][one & 0xff] ^
+		      crc32_slice[6][(one >> 8) & 0xff] ^
+		      crc32_slice[5][(one >> 16) & 0xff] ^
+		      crc32_slice[4][one >> 24] ^
+		      crc32_slice[3][two & 0xff] ^
+		      crc32_slice[2][(two >> 8) & 0xff] ^
+		      crc32_slice[1][(two >> 16) & 0xff] ^
+		      crc32_slice[0][two >> 24];
+		in += 8;
+		len -= 8;
+	}
 
 	while (len) {
 		crc = crc32_tbl[(crc ^ *in) & 0xff] ^ (crc >> 8);
@@ -178,6 +197,62 @@ uint32_t bcm4908img_crc32(uint32_t crc, const void *buf, size_t len) {
 	return crc;
 }
 
+#if defined(__aarch64__) && (__BYTE_ORDER == __LITTLE_ENDIAN)
+#include <sys/auxv.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32	(1 << 7)
+#endif
+
+/* ARMv8 CRC32 instructions use the same polynomial */
+__attribute__((target("+crc")))
+static uint32_t bcm4908img_crc32_arm64(uint32_t crc, const void *buf, size_t len) {
+	const uint8_t *in = buf;
+	uint64_t v;
+
+	while (len && ((uintptr_t)in & 7)) {
+		crc = __builtin_aarch64_crc32b(crc, *in++);
+		len--;
+	}
+
+	while (len >= 8) {
+		memcpy(&v, in, sizeof(v));
+		crc = __builtin_aarch64_crc32x(crc, v);
+		in += 8;
+		len -= 8;
+	}
+
+	while (len) {
+		crc = __builtin_aarch64_crc32b(crc, *in++);
+		len--;
+	}
+
+	return crc;
+}
+#endif
+
+static uint32_t (*bcm4908img_crc32_impl)(uint32_t crc, const void *buf, size_t len) = bcm4908img_crc32_sb8;
+
+__attribute__((constructor))
+static void bcm4908img_crc32_init(void) {
+	int i, n;
+
+	for (i = 0; i < 256; i++) {
+		crc32_slice[0][i] = crc32_tbl[i];
+		for (n = 1; n < 8; n++)
+			crc32_slice[n][i] = (crc32_slice[n - 1][i] >> 8) ^ crc32_tbl[crc32_slice[n - 1][i] & 0xff];
+	}
+
+#if defined(__aarch64__) && (__BYTE_ORDER == __LITTLE_ENDIAN)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		bcm4908img_crc32_impl = bcm4908img_crc32_arm64;
+#endif
+}
+
+uint32_t bcm4908img_crc32(uint32_t crc, const void *buf, size_t len) {
+	return bcm4908img_crc32_impl(crc, buf, len);
+}
+
 /**************************************************
  * Helpers
  **************************************************/
@@ -23,6 +23,7 @@
  */
 
 #include "nvram.h"
+#include "nvramd.h"
 
 
 static nvram_handle_t * nvram_open_rdonly(void)
@@ -50,17 +51,19 @@ static nvram_handle_t * nvram_open_staging(void)
 	return NULL;
 }
 
-static int do_show(nvram_handle_t *nvram)
+static int do_show(nvram_handle_t *nvram, FILE *out)
 {
-	nvram_tuple_t *t;
+	nvram_tuple_t *t, *next;
 	int stat = 1;
 
 	if( (t = nvram_getall(nvram)) != NULL )
 	{
 		while( t )
 		{
-			printf("%s=%s\n", t->name, t->value);
-			t = t->next;
+			fprintf(out, "%s=%s\n", t->name, t->value);
+			next = t->next;
+			free(t);
+			t = next;
 		}
 
 		stat = 0;
@@ -69,14 +72,14 @@ static int do_show(nvram_handle_t *nvram)
 	return stat;
 }
 
-static int do_get(nvram_handle_t *nvram, const char *var)
+static int do_get(nvram_handle_t *nvram, const char *var, FILE *out)
 {
 	const char *val;
 	int stat = 1;
 
 	if( (val = nvram_get(nvram, var)) != NULL )
 	{
-		printf("%s\n", val);
+		fprintf(out, "%s\n", val);
 		stat = 0;
 	}
 
@@ -104,7 +107,7 @@ static int do_set(nvram_handle_t *nvram, const char *pair)
 	return stat;
 }
 
-static int do_info(nvram_handle_t *nvram)
+static int do_info(nvram_handle_t *nvram, FILE *out)
 {
 	nvram_header_t *hdr = nvram_header(nvram);
 
@@ -113,20 +116,20 @@ static int do_info(nvram_handle_t *nvram)
 		hdr->len - NVRAM_CRC_START_POSITION, 0xff);
 
 	/* Show info */
-	printf("Magic:         0x%08X\n",   hdr->magic);
-	printf("Length:        0x%08X\n",   hdr->len);
-	printf("Offset:        0x%08X\n",   nvram->offset);
+	fprintf(out, "Magic:         0x%08X\n",   hdr->magic);
+	fprintf(out, "Length:        0x%08X\n",   hdr->len);
+	fprintf(out, "Offset:        0x%08X\n",   nvram->offset);
 
-	printf("CRC8:          0x%02X (calculated: 0x%02X)\n",
+	fprintf(out, "CRC8:          0x%02X (calculated: 0x%02X)\n",
 		hdr->crc_ver_init & 0xFF, crc);
 
-	printf("Version:       0x%02X\n",   (hdr->crc_ver_init >> 8) & 0xFF);
-	printf("SDRAM init:    0x%04X\n",   (hdr->crc_ver_init >> 16) & 0xFFFF);
-	printf("SDRAM config:  0x%04X\n",   hdr->config_refresh & 0xFFFF);
-	printf("SDRAM refresh: 0x%04X\n",   (hdr->config_refresh >> 16) & 0xFFFF);
-	printf("NCDL values:   0x%08X\n\n", hdr->config_ncdl);
+	fprintf(out, "Version:       0x%02X\n",   (hdr->crc_ver_init >> 8) & 0xFF);
+	fprintf(out, "SDRAM init:    0x%04X\n",   (hdr->crc_ver_init >> 16) & 0xFFFF);
+	fprintf(out, "SDRAM config:  0x%04X\n",   hdr->config_refresh & 0xFFFF);
+	fprintf(out, "SDRAM refresh: 0x%04X\n",   (hdr->config_refresh >> 16) & 0xFFFF);
+	fprintf(out, "NCDL values:   0x%08X\n\n", hdr->config_ncdl);
 
-	printf("%i bytes used / %i bytes available (%.2f%%)\n",
+	fprintf(out, "%i bytes used / %i bytes available (%.2f%%)\n",
 		hdr->len, nvram->length - nvram->offset - hdr->len,
 		(100.00 / (double)(nvram->length - nvram->offset)) * (double)hdr->len);
 
@@ -143,23 +146,104 @@ static void usage(void)
 		"	nvram set variable=value [set ...]\n"
 		"	nvram unset variable [unset ...]\n"
 		"	nvram commit\n"
+		"	nvram daemon\n"
 	);
 }
 
+static int do_exec(nvram_handle_t *nvram, int argc, const char *argv[],
+	FILE *out, FILE *err, int *flags)
+{
+	int stat = 1;
+	int done = 0;
+	int i;
+
+	for( i = 0; i < argc; i++ )
+	{
+		if( !strcmp(argv[i], "show") )
+		{
+			stat = do_show(nvram, out);
+			done++;
+		}
+		else if( !strcmp(argv[i], "info") )
+		{
+			stat = do_info(nvram, out);
+			done++;
+		}
+		else if( !strcmp(argv[i], "get") || !strcmp(argv[i], "unset") || !strcmp(argv[i], "set") )
+		{
+			if( (i+1) < argc )
+			{
+				switch(argv[i++][0])
+				{
+					case 'g':
+						stat = do_get(nvram, argv[i], out);
+						break;
+
+					case 'u':
+						stat = do_unset(nvram, argv[i]);
+						*flags |= NVRAMD_WRITE;
+						break;
+
+					case 's':
+						stat = do_set(nvram, argv[i]);
+						*flags |= NVRAMD_WRITE;
+						break;
+				}
+				done++;
+			}
+			else
+			{
+				fprintf(err, "Command '%s' requires an argument!\n", argv[i]);
+				done = 0;
+				break;
+			}
+		}
+		else if( !strcmp(argv[i], "commit") )
+		{
+			*flags |= NVRAMD_COMMIT;
+			done++;
+		}
+		else
+		{
+			fprintf(err, "Unknown option '%s' !\n", argv[i]);
+			done = 0;
+			break;
+		}
+	}
+
+	if( !done )
+		*flags |= NVRAMD_USAGE;
+
+	return stat;
+}
+
 int main( int argc, const char *argv[] )
 {
 	nvram_handle_t *nvram;
-	int commit = 0;
+	int flags = 0;
 	int write = 0;
 	int stat = 1;
-	int done = 0;
-	int i;
 
 	if( argc < 2 ) {
 		usage();
 		return 1;
 	}
 
+	if( !strcmp(argv[1], "daemon") )
+		return nvramd_run(nvram_open_rdonly, do_exec);
+
+	/* Let nvramd handle the command if it is running */
+	if( nvramd_call(argc - 1, argv + 1, &stat) == 0 )
+	{
+		if( stat < 0 )
+		{
+			usage();
+			stat = 1;
+		}
+
+		return stat;
+	}
+
 	/* Ugly... iterate over arguments to see whether we can expect a write */
 	if( ( !strcmp(argv[1], "set")  && 2 < argc ) ||
 		( !strcmp(argv[1], "unset") && 2 < argc ) ||
@@ -171,64 +255,14 @@ int main( int argc, const char *argv[] )
 
 	if( nvram != NULL && argc > 1 )
 	{
-		for( i = 1; i < argc; i++ )
-		{
-			if( !strcmp(argv[i], "show") )
-			{
-				stat = do_show(nvram);
-				done++;
-			}
-			else if( !strcmp(argv[i], "info") )
-			{
-				stat = do_info(nvram);
-				done++;
-			}
-			else if( !strcmp(argv[i], "get") || !strcmp(argv[i], "unset") || !strcmp(argv[i], "set") )
-			{
-				if( (i+1) < argc )
-				{
-					switch(argv[i++][0])
-					{
-						case 'g':
-							stat = do_get(nvram, argv[i]);
-							break;
-
-						case 'u':
-							stat = do_unset(nvram, argv[i]);
-							break;
-
-						case 's':
-							stat = do_set(nvram, argv[i]);
-							break;
-					}
-					done++;
-				}
-				else
-				{
-					fprintf(stderr, "Command '%s' requires an argument!\n", argv[i]);
-					done = 0;
-					break;
-				}
-			}
-			else if( !strcmp(argv[i], "commit") )
-			{
-				commit = 1;
-				done++;
-			}
-			else
-			{
-				fprintf(stderr, "Unknown option '%s' !\n", argv[i]);
-				done = 0;
-				break;
-			}
-		}
+		stat = do_exec(nvram, argc - 1, argv + 1, stdout, stderr, &flags);
 
 		if( write )
 			stat = nvram_commit(nvram);
 
 		nvram_close(nvram);
 
-		if( commit )
+		if( flags & NVRAMD_COMMIT )
 			stat = staging_to_nvram();
 	}
 
@@ -245,7 +279,7 @@ int main( int argc, const char *argv[] )
 
 		stat = 1;
 	}
-	else if( !done )
+	else if( flags & NVRAMD_USAGE )
 	{
 		usage();
 		stat = 1;
@@ -545,3 +545,22 @@ int staging_to_nvram(void)
 	free(mtd);
 	return stat;
 }
+
+/* Copy NVRAM contents of a handle to a file or device. */
+int nvram_save(nvram_handle_t *h, const char *file)
+{
+	int fd, stat;
+
+	stat = -1;
+
+	if( (fd = open(file, O_WRONLY | O_CREAT | O_SYNC, 0600)) > -1 )
+	{
+		if( write(fd, h->mmap, h->length) == h->length )
+			stat = 0;
+
+		fsync(fd);
+		close(fd);
+	}
+
+	return stat;
+}
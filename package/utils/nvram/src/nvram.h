@@ -102,6 +102,9 @@ int staging_to_nvram(void);
 /* Check NVRAM staging file. */
 char * nvram_find_staging(void);
 
+/* Copy NVRAM contents of a handle to a file or device. */
+int nvram_save(nvram_handle_t *h, const char *file);
+
 
 /* Staging file for NVRAM */
 #define NVRAM_STAGING		"/tmp/.nvram"
@@ -0,0 +1,389 @@
+/*
+ * Resident NVRAM daemon and its client side
+ *
+ * The daemon parses the NVRAM once and keeps the table in memory. Variables
+ * that are set or unset only change that table, the image is regenerated and
+ * written to the device in one go when a commit is requested. Uncommitted
+ * changes are handed over to the staging file when the daemon terminates, so
+ * direct access picks them up again.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "nvramd.h"
+
+static volatile sig_atomic_t nvramd_quit = 0;
+
+/* Staging file the table was last loaded from, zeroed if there was none */
+static struct stat nvramd_staging;
+
+
+/*
+ * -- Helper functions --
+ */
+
+static int xread(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while( len > 0 )
+	{
+		if( (n = read(fd, p, len)) <= 0 )
+		{
+			if( n < 0 && errno == EINTR )
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int xwrite(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while( len > 0 )
+	{
+		if( (n = send(fd, p, len, MSG_NOSIGNAL)) < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void nvramd_addr(struct sockaddr_un *sun)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strncpy(sun->sun_path, NVRAMD_SOCKET, sizeof(sun->sun_path) - 1);
+}
+
+static void nvramd_signal(int sig)
+{
+	nvramd_quit = 1;
+}
+
+/* Remember which staging file, if any, the table was loaded from. */
+static void nvramd_snapshot(void)
+{
+	if( stat(NVRAM_STAGING, &nvramd_staging) )
+		memset(&nvramd_staging, 0, sizeof(nvramd_staging));
+}
+
+/* Check whether the staging file was changed by direct access. */
+static int nvramd_staging_changed(void)
+{
+	struct stat s;
+
+	if( stat(NVRAM_STAGING, &s) )
+		return 0;
+
+	return s.st_ino != nvramd_staging.st_ino ||
+		s.st_size != nvramd_staging.st_size ||
+		s.st_mtim.tv_sec != nvramd_staging.st_mtim.tv_sec ||
+		s.st_mtim.tv_nsec != nvramd_staging.st_mtim.tv_nsec;
+}
+
+/* Regenerate the image and write it to the device with a single write. */
+static int nvramd_commit(nvram_handle_t *h)
+{
+	char *mtd;
+	int stat = -1;
+
+	nvram_commit(h);
+
+	if( (mtd = nvram_find_mtd()) != NULL )
+	{
+		if( (stat = nvram_save(h, mtd)) == 0 )
+		{
+			unlink(NVRAM_STAGING);
+			nvramd_snapshot();
+		}
+
+		free(mtd);
+	}
+
+	return stat;
+}
+
+/* Read a request, run it and send back its status and output. */
+static void nvramd_handle(nvram_handle_t *h, nvramd_exec_t exec, int fd,
+	int *dirty)
+{
+	char *argv[NVRAMD_MAX_ARGS];
+	char *req, *p;
+	char *out = NULL, *err = NULL;
+	size_t outlen = 0, errlen = 0;
+	FILE *fout, *ferr;
+	uint32_t len, hdr[3];
+	int argc = 0;
+	int flags = 0;
+	int stat, i;
+
+	if( xread(fd, &len, sizeof(len)) || len == 0 || len > NVRAMD_MAX_REQUEST )
+		return;
+
+	if( (req = malloc(len + 1)) == NULL )
+		return;
+
+	if( xread(fd, req, len) )
+	{
+		free(req);
+		return;
+	}
+
+	/* Arguments are sent as a sequence of NUL terminated strings */
+	req[len] = '\0';
+
+	for( p = req; p < req + len && argc < NVRAMD_MAX_ARGS; p += strlen(p) + 1 )
+		argv[argc++] = p;
+
+	/* The header is only regenerated on commit, bring it up to date */
+	for( i = 0; *dirty && i < argc; i++ )
+	{
+		if( !strcmp(argv[i], "info") )
+		{
+			nvram_commit(h);
+			break;
+		}
+	}
+
+	fout = open_memstream(&out, &outlen);
+	ferr = open_memstream(&err, &errlen);
+
+	if( fout != NULL && ferr != NULL )
+	{
+		stat = exec(h, argc, (const char **)argv, fout, ferr, &flags);
+
+		if( flags & NVRAMD_WRITE )
+		{
+			*dirty = 1;
+			stat = 0;
+		}
+
+		if( flags & NVRAMD_COMMIT )
+		{
+			if( nvramd_commit(h) == 0 )
+				*dirty = stat = 0;
+			else
+				stat = 1;
+		}
+
+		if( flags & NVRAMD_USAGE )
+			stat = -1;
+	}
+	else
+	{
+		stat = 1;
+	}
+
+	if( fout != NULL )
+		fclose(fout);
+
+	if( ferr != NULL )
+		fclose(ferr);
+
+	hdr[0] = (uint32_t)stat;
+	hdr[1] = outlen;
+	hdr[2] = errlen;
+
+	if( !xwrite(fd, hdr, sizeof(hdr)) && !xwrite(fd, out, outlen) )
+		xwrite(fd, err, errlen);
+
+	free(out);
+	free(err);
+	free(req);
+}
+
+/* Copy len bytes of the response to a local stream. */
+static int nvramd_relay(int fd, uint32_t len, FILE *stream)
+{
+	char buf[4096];
+	size_t n;
+
+	while( len > 0 )
+	{
+		n = (len < sizeof(buf)) ? len : sizeof(buf);
+
+		if( xread(fd, buf, n) )
+			return -1;
+
+		fwrite(buf, 1, n, stream);
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+/*
+ * -- Public functions --
+ */
+
+/* Serve requests until terminated. */
+int nvramd_run(nvramd_open_t open_nvram, nvramd_exec_t exec)
+{
+	struct sockaddr_un sun;
+	struct sigaction sa;
+	struct timeval tv = { .tv_sec = 5 };
+	nvram_handle_t *h, *n;
+	int sock, fd;
+	int dirty = 0;
+
+	nvramd_addr(&sun);
+
+	if( (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 )
+	{
+		perror("socket");
+		return 1;
+	}
+
+	/*
+	 * Listen before loading the NVRAM, clients started in the meantime
+	 * then wait for us instead of changing the staging file behind our back.
+	 */
+	unlink(NVRAMD_SOCKET);
+
+	if( bind(sock, (struct sockaddr *)&sun, sizeof(sun)) ||
+		chmod(NVRAMD_SOCKET, 0600) || listen(sock, 16) )
+	{
+		perror("bind");
+		close(sock);
+		return 1;
+	}
+
+	nvramd_snapshot();
+
+	if( (h = open_nvram()) == NULL )
+	{
+		fprintf(stderr, "Could not open nvram!\n");
+		unlink(NVRAMD_SOCKET);
+		close(sock);
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = nvramd_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	while( !nvramd_quit )
+	{
+		if( (fd = accept(sock, NULL, NULL)) < 0 )
+			continue;
+
+		/*
+		 * A client that fell back to direct access before we were
+		 * listening may have changed the staging file, take it over
+		 * instead of committing a stale table later on.
+		 */
+		if( nvramd_staging_changed() )
+		{
+			nvramd_snapshot();
+
+			if( (n = open_nvram()) != NULL )
+			{
+				if( dirty )
+					fprintf(stderr, "Staging file changed, dropping uncommitted changes\n");
+
+				nvram_close(h);
+				h = n;
+				dirty = 0;
+			}
+		}
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		nvramd_handle(h, exec, fd, &dirty);
+		close(fd);
+	}
+
+	unlink(NVRAMD_SOCKET);
+	close(sock);
+
+	/* Hand uncommitted changes over to direct access */
+	if( dirty )
+	{
+		nvram_commit(h);
+		nvram_save(h, NVRAM_STAGING);
+	}
+
+	nvram_close(h);
+
+	return 0;
+}
+
+/* Let a running daemon execute argv, returns -1 if there is none. */
+int nvramd_call(int argc, const char *argv[], int *stat)
+{
+	struct sockaddr_un sun;
+	uint32_t len, hdr[3];
+	char *req, *p;
+	int fd, i;
+
+	for( i = 0, len = 0; i < argc; i++ )
+		len += strlen(argv[i]) + 1;
+
+	if( len == 0 || len > NVRAMD_MAX_REQUEST || argc > NVRAMD_MAX_ARGS )
+		return -1;
+
+	if( (req = malloc(len)) == NULL )
+		return -1;
+
+	for( i = 0, p = req; i < argc; i++ )
+		p = stpcpy(p, argv[i]) + 1;
+
+	nvramd_addr(&sun);
+
+	if( (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 )
+	{
+		free(req);
+		return -1;
+	}
+
+	if( connect(fd, (struct sockaddr *)&sun, sizeof(sun)) ||
+		xwrite(fd, &len, sizeof(len)) || xwrite(fd, req, len) ||
+		xread(fd, hdr, sizeof(hdr)) )
+	{
+		free(req);
+		close(fd);
+		return -1;
+	}
+
+	*stat = (int32_t)hdr[0];
+
+	if( !nvramd_relay(fd, hdr[1], stdout) )
+		nvramd_relay(fd, hdr[2], stderr);
+
+	free(req);
+	close(fd);
+
+	return 0;
+}
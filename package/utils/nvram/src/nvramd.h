@@ -0,0 +1,51 @@
+/*
+ * Resident NVRAM daemon and its client side
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _nvramd_h_
+#define _nvramd_h_
+
+#include "nvram.h"
+
+
+/* Open the NVRAM the daemon should serve. */
+typedef nvram_handle_t * (*nvramd_open_t)(void);
+
+/*
+ * Run the commands in argv against an open handle, writing their output
+ * to out and err. Returns the command status and sets NVRAMD_* flags.
+ */
+typedef int (*nvramd_exec_t)(nvram_handle_t *h, int argc, const char *argv[],
+	FILE *out, FILE *err, int *flags);
+
+/* Serve requests until terminated. */
+int nvramd_run(nvramd_open_t open_nvram, nvramd_exec_t exec);
+
+/* Let a running daemon execute argv, returns -1 if there is none. */
+int nvramd_call(int argc, const char *argv[], int *stat);
+
+
+/* Socket the daemon listens on */
+#define NVRAMD_SOCKET		"/tmp/.nvramd"
+
+/* Flags reported by the exec callback */
+#define NVRAMD_WRITE		0x1	/* variables were set or unset */
+#define NVRAMD_COMMIT		0x2	/* commit was requested */
+#define NVRAMD_USAGE		0x4	/* command line was invalid */
+
+/* Largest request accepted */
+#define NVRAMD_MAX_REQUEST	0x10000
+#define NVRAMD_MAX_ARGS		256
+
+
+#endif /* _nvramd_h_ */